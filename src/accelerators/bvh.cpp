@@ -38,6 +38,23 @@
 #include "stats.h"
 #include "parallel.h"
 #include <algorithm>
+#include <array>
+#include <chrono>
+#include <mutex>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unordered_map>
+#ifdef PBRT_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#define PBRT_BVH_HAVE_SSE
+#endif
 
 namespace pbrt {
 
@@ -45,6 +62,11 @@ STAT_MEMORY_COUNTER("Memory/BVH tree", treeBytes);
 STAT_RATIO("BVH/Primitives per leaf node", totalPrimitives, totalLeafNodes);
 STAT_COUNTER("BVH/Interior nodes", interiorNodes);
 STAT_COUNTER("BVH/Leaf nodes", leafNodes);
+STAT_PERCENT("BVH/Primitives in SIMD triangle blocks", packedPrimitives,
+             totalBVHPrimitives);
+STAT_COUNTER("BVH/Trees loaded from cache", cachedTrees);
+STAT_RATIO("BVH/Rays tested per packet node visit", packetRayNodeTests,
+           packetNodeVisits);
 
 // BVHAccel Local Declarations
 struct BVHPrimitiveInfo {
@@ -103,6 +125,113 @@ struct LinearBVHNode {
     uint8_t pad[1];        // ensure 32 byte total size
 };
 
+// Node of a BVH with _N_ children per node, collapsed from the binary
+// build tree. Child bounds are stored as single-precision SoA so that all
+// _N_ slab tests can be done at once with SIMD instructions.
+template <int N>
+struct WideBVHNode {
+    static_assert(N == 4 || N == 8, "Only 4- and 8-wide BVHs are supported");
+    // bounds[0] holds the minimum corners, bounds[1] the maximum corners
+    float bounds[2][3][N];
+    // Interior child: index of its node; leaf child: offset of its first
+    // primitive. Unused child slots have empty bounds and _child_ = -1.
+    int32_t child[N];
+    uint16_t nPrimitives[N];  // 0 -> interior child
+    uint8_t pad[(64 - (30 * N) % 64) % 64];  // round up to cache lines
+};
+
+// Ray data in the single-precision format used by _WideBVHNode_ tests
+struct WideBVHRay {
+    WideBVHRay(const Ray &ray) {
+        for (int i = 0; i < 3; ++i) {
+            o[i] = ray.o[i];
+            invDir[i] = 1 / (float)ray.d[i];
+            dirIsNeg[i] = invDir[i] < 0;
+        }
+    }
+    float o[3], invDir[3];
+    int dirIsNeg[3];
+};
+
+// Tests _ray_ against all children of _node_ at once, returning a bit mask
+// of the children that are hit and their entry distances in _tNear_. Like
+// Bounds3::IntersectP(), the far distances are conservatively enlarged and
+// NaNs from $0 \cdot \infty$ are ignored.
+template <int N>
+inline int IntersectWideNode(const WideBVHNode<N> &node, const WideBVHRay &ray,
+                             float tMax, float *tNear) {
+    int mask = 0;
+    const float farScale = 1 + 2 * gamma(3);
+    for (int i = 0; i < N; ++i) {
+        float t0 = 0, t1 = tMax;
+        for (int a = 0; a < 3; ++a) {
+            float tn = (node.bounds[ray.dirIsNeg[a]][a][i] - ray.o[a]) *
+                       ray.invDir[a];
+            float tf = (node.bounds[1 - ray.dirIsNeg[a]][a][i] - ray.o[a]) *
+                       ray.invDir[a] * farScale;
+            t0 = tn > t0 ? tn : t0;
+            t1 = tf < t1 ? tf : t1;
+        }
+        tNear[i] = t0;
+        if (t0 <= t1) mask |= 1 << i;
+    }
+    return mask;
+}
+
+#ifdef PBRT_BVH_HAVE_SSE
+template <>
+inline int IntersectWideNode<4>(const WideBVHNode<4> &node,
+                                const WideBVHRay &ray, float tMax,
+                                float *tNear) {
+    __m128 t0 = _mm_setzero_ps(), t1 = _mm_set1_ps(tMax);
+    const __m128 farScale = _mm_set1_ps(1 + 2 * gamma(3));
+    for (int a = 0; a < 3; ++a) {
+        __m128 o = _mm_set1_ps(ray.o[a]), invDir = _mm_set1_ps(ray.invDir[a]);
+        __m128 tn = _mm_mul_ps(
+            _mm_sub_ps(_mm_loadu_ps(node.bounds[ray.dirIsNeg[a]][a]), o),
+            invDir);
+        __m128 tf = _mm_mul_ps(
+            _mm_mul_ps(
+                _mm_sub_ps(_mm_loadu_ps(node.bounds[1 - ray.dirIsNeg[a]][a]),
+                           o),
+                invDir),
+            farScale);
+        // When either operand is NaN, min/max return the second one
+        t0 = _mm_max_ps(tn, t0);
+        t1 = _mm_min_ps(tf, t1);
+    }
+    _mm_storeu_ps(tNear, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+#endif  // PBRT_BVH_HAVE_SSE
+
+#ifdef __AVX__
+template <>
+inline int IntersectWideNode<8>(const WideBVHNode<8> &node,
+                                const WideBVHRay &ray, float tMax,
+                                float *tNear) {
+    __m256 t0 = _mm256_setzero_ps(), t1 = _mm256_set1_ps(tMax);
+    const __m256 farScale = _mm256_set1_ps(1 + 2 * gamma(3));
+    for (int a = 0; a < 3; ++a) {
+        __m256 o = _mm256_set1_ps(ray.o[a]);
+        __m256 invDir = _mm256_set1_ps(ray.invDir[a]);
+        __m256 tn = _mm256_mul_ps(
+            _mm256_sub_ps(_mm256_loadu_ps(node.bounds[ray.dirIsNeg[a]][a]), o),
+            invDir);
+        __m256 tf = _mm256_mul_ps(
+            _mm256_mul_ps(
+                _mm256_sub_ps(
+                    _mm256_loadu_ps(node.bounds[1 - ray.dirIsNeg[a]][a]), o),
+                invDir),
+            farScale);
+        t0 = _mm256_max_ps(tn, t0);
+        t1 = _mm256_min_ps(tf, t1);
+    }
+    _mm256_storeu_ps(tNear, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+#endif  // __AVX__
+
 // BVHAccel Utility Functions
 inline uint32_t LeftShift3(uint32_t x) {
     CHECK_LE(x, (1 << 10));
@@ -179,14 +308,71 @@ static void RadixSort(std::vector<MortonPrimitive> *v) {
     if (nPasses & 1) std::swap(*v, tempVector);
 }
 
+// Subtrees with at least this many primitives are built in parallel
+static PBRT_CONSTEXPR int parallelBuildMinPrimitives = 16 * 1024;
+// Nodes with at least this many primitives are bounded and binned in
+// parallel, _parallelBinChunk_ primitives per task
+static PBRT_CONSTEXPR int parallelBinMinPrimitives = 256 * 1024;
+static PBRT_CONSTEXPR int parallelBinChunk = 32 * 1024;
+
+// Arenas for subtrees that are built in parallel; _MemoryArena_ itself
+// isn't thread-safe, so each concurrently built subtree gets its own.
+struct BVHBuildArenas {
+    // _MemoryArena_ is cache-line aligned, which plain _new_ doesn't
+    // guarantee before C++17, so arenas live in _AllocAligned()_ memory
+    struct ArenaDeleter {
+        void operator()(MemoryArena *arena) const {
+            arena->~MemoryArena();
+            FreeAligned(arena);
+        }
+    };
+
+    MemoryArena &Alloc() {
+        std::lock_guard<std::mutex> lock(mutex);
+        MemoryArena *arena = new (AllocAligned<MemoryArena>(1)) MemoryArena;
+        arenas.push_back(std::unique_ptr<MemoryArena, ArenaDeleter>(arena));
+        return *arena;
+    }
+    size_t TotalAllocated() const {
+        size_t total = 0;
+        for (const auto &arena : arenas) total += arena->TotalAllocated();
+        return total;
+    }
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<MemoryArena, ArenaDeleter>> arenas;
+};
+
+// Returns the SAH cost of the subtree rooted at _node_, assuming unit
+// traversal and intersection costs, relative to a root with surface
+// area _rootArea_.
+static Float computeSAHCost(const BVHBuildNode *node, Float rootArea) {
+    Float area = rootArea > 0 ? node->bounds.SurfaceArea() / rootArea : 0;
+    if (node->nPrimitives > 0) return area * node->nPrimitives;
+    return area + computeSAHCost(node->children[0], rootArea) +
+           computeSAHCost(node->children[1], rootArea);
+}
+
 // BVHAccel Method Definitions
 BVHAccel::BVHAccel(std::vector<std::shared_ptr<Primitive>> p,
-                   int maxPrimsInNode, SplitMethod splitMethod)
+                   int maxPrimsInNode, SplitMethod splitMethod, int width,
+                   const std::string &cacheFile)
     : maxPrimsInNode(std::min(255, maxPrimsInNode)),
       splitMethod(splitMethod),
+      width(width),
       primitives(std::move(p)) {
+    CHECK(width == 2 || width == 4 || width == 8);
     ProfilePhase _(Prof::AccelConstruction);
     if (primitives.empty()) return;
+
+    // Reuse a tree previously built for the same primitives, if possible
+    uint64_t key = 0;
+    std::vector<std::shared_ptr<Primitive>> inputPrims;
+    if (!cacheFile.empty()) {
+        key = cacheKey();
+        if (readCache(cacheFile, key)) return;
+        inputPrims = primitives;
+    }
     // Build BVH from _primitives_
 
     // Initialize _primitiveInfo_ array for primitives
@@ -195,80 +381,377 @@ BVHAccel::BVHAccel(std::vector<std::shared_ptr<Primitive>> p,
         primitiveInfo[i] = {i, primitives[i]->WorldBound()};
 
     // Build BVH tree for primitives using _primitiveInfo_
+    auto buildStart = std::chrono::steady_clock::now();
     MemoryArena arena(1024 * 1024);
+    BVHBuildArenas subtreeArenas;
     int totalNodes = 0;
-    std::vector<std::shared_ptr<Primitive>> orderedPrims;
-    orderedPrims.reserve(primitives.size());
+    std::vector<std::shared_ptr<Primitive>> orderedPrims(primitives.size());
     BVHBuildNode *root;
     if (splitMethod == SplitMethod::HLBVH)
         root = HLBVHBuild(arena, primitiveInfo, &totalNodes, orderedPrims);
-    else
-        root = recursiveBuild(arena, primitiveInfo, 0, primitives.size(),
-                              &totalNodes, orderedPrims);
+    else {
+        std::atomic<int> atomicTotal(0);
+        root = recursiveBuild(arena, subtreeArenas, primitiveInfo, 0,
+                              primitives.size(), &atomicTotal, orderedPrims);
+        totalNodes = atomicTotal;
+    }
     primitives.swap(orderedPrims);
     primitiveInfo.resize(0);
+    sahCost = computeSAHCost(root, root->bounds.SurfaceArea());
+    double buildSeconds = std::chrono::duration<double>(
+                              std::chrono::steady_clock::now() - buildStart)
+                              .count();
     LOG(INFO) << StringPrintf("BVH created with %d nodes for %d "
                               "primitives (%.2f MB), arena allocated %.2f MB",
                               totalNodes, (int)primitives.size(),
                               float(totalNodes * sizeof(LinearBVHNode)) /
                               (1024.f * 1024.f),
-                              float(arena.TotalAllocated()) /
+                              float(arena.TotalAllocated() +
+                                    subtreeArenas.TotalAllocated()) /
                               (1024.f * 1024.f));
+    LOG(INFO) << StringPrintf("BVH build took %.3f s, SAH cost %.3f",
+                              buildSeconds, sahCost);
+
+    // Pack leaves made up of plain triangles into SIMD blocks
+    leafBlocks.assign(primitives.size(), -1);
+    packTriangleLeaves(root);
+    totalBVHPrimitives += primitives.size();
+    treeBytes += triangleBlocks.size() * sizeof(TriangleBlock) +
+                 leafBlocks.size() * sizeof(int);
 
     // Compute representation of depth-first traversal of BVH tree
-    treeBytes += totalNodes * sizeof(LinearBVHNode) + sizeof(*this) +
-                 primitives.size() * sizeof(primitives[0]);
-    nodes = AllocAligned<LinearBVHNode>(totalNodes);
+    bounds = root->bounds;
+    treeBytes += sizeof(*this) + primitives.size() * sizeof(primitives[0]);
     int offset = 0;
-    flattenBVHTree(root, &offset);
-    CHECK_EQ(totalNodes, offset);
+    if (width == 2) {
+        treeBytes += totalNodes * sizeof(LinearBVHNode);
+        nodes = AllocAligned<LinearBVHNode>(totalNodes);
+        flattenBVHTree(root, &offset);
+        CHECK_EQ(totalNodes, offset);
+    } else {
+        // Each wide node absorbs at least one binary interior node, which
+        // bounds how many of them are needed
+        int maxWideNodes = totalNodes / 2 + 1;
+        if (width == 4) {
+            wideNodes = AllocAligned<WideBVHNode<4>>(maxWideNodes);
+            flattenWideBVHTree<4>(root, &offset);
+            treeBytes += offset * sizeof(WideBVHNode<4>);
+        } else {
+            wideNodes = AllocAligned<WideBVHNode<8>>(maxWideNodes);
+            flattenWideBVHTree<8>(root, &offset);
+            treeBytes += offset * sizeof(WideBVHNode<8>);
+        }
+        CHECK_LE(offset, maxWideNodes);
+        LOG(INFO) << StringPrintf("Collapsed BVH into %d %d-wide nodes", offset,
+                                  width);
+    }
+    if (!cacheFile.empty()) writeCache(cacheFile, key, inputPrims, offset);
 }
 
-Bounds3f BVHAccel::WorldBound() const {
-    return nodes ? nodes[0].bounds : Bounds3f();
+// BVH cache files hold a _BVHCacheHeader_ followed by the flattened nodes,
+// the _TriangleBlock_s, _leafBlocks_, and for each primitive of the tree
+// its index in the primitive vector the BVH was created with. They are
+// written in native byte order and only meant to be reused on the machine
+// that wrote them.
+struct BVHCacheHeader {
+    char magic[8];
+    int32_t floatSize, width, maxPrimsInNode, splitMethod;
+    uint64_t key;
+    int64_t nPrimitives, nNodes, nTriangleBlocks;
+    double sahCost;
+};
+static_assert(sizeof(BVHCacheHeader) == 64,
+              "BVH cache header must keep the nodes cache-line aligned");
+static const char bvhCacheMagic[8] = {'P', 'B', 'R', 'T', 'B', 'V', 'H', '1'};
+
+uint64_t BVHAccel::cacheKey() const {
+    // Hash the build parameters and the bounds of every primitive, in order.
+    // The cached _TriangleBlock_s are used in place of the primitives'
+    // geometry, so the vertices of every triangle that may be put in a
+    // block and whether it may be are hashed as well.
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](uint64_t v) {
+        hash = (hash ^ v) * 1099511628211ull;
+        hash ^= hash >> 29;
+    };
+    mix(sizeof(Float));
+    mix(width);
+    mix(maxPrimsInNode);
+    mix((uint64_t)splitMethod);
+    mix(primitives.size());
+    for (const auto &prim : primitives) {
+        Bounds3f b = prim->WorldBound();
+        for (int i = 0; i < 2; ++i)
+            for (int j = 0; j < 3; ++j) mix(FloatToBits(b[i][j]));
+
+        const GeometricPrimitive *gp =
+            dynamic_cast<const GeometricPrimitive *>(prim.get());
+        const Triangle *tri =
+            gp ? dynamic_cast<const Triangle *>(gp->GetShape()) : nullptr;
+        Point3f p[3];
+        if (!tri)
+            mix(0);
+        else if (!tri->GetBlockVertices(p))
+            mix(1);
+        else {
+            mix(2);
+            for (int i = 0; i < 3; ++i)
+                for (int j = 0; j < 3; ++j) mix(FloatToBits(p[i][j]));
+        }
+    }
+    return hash;
 }
 
+bool BVHAccel::readCache(const std::string &filename, uint64_t key) {
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) {
+        LOG(INFO) << "No BVH cache at " << filename << "; building BVH";
+        return false;
+    }
+    BVHCacheHeader header;
+    bool headerRead = fread(&header, sizeof(header), 1, f) == 1;
+    fseek(f, 0, SEEK_END);
+    long fileSize = ftell(f);
+    if (!headerRead ||
+        memcmp(header.magic, bvhCacheMagic, sizeof(bvhCacheMagic)) != 0 ||
+        header.floatSize != sizeof(Float)) {
+        Warning("%s: not a BVH cache file for this build of pbrt. "
+                "Rebuilding BVH.", filename.c_str());
+        fclose(f);
+        return false;
+    }
+    if (header.key != key || header.width != width ||
+        header.maxPrimsInNode != maxPrimsInNode ||
+        header.splitMethod != (int)splitMethod ||
+        header.nPrimitives != (int64_t)primitives.size()) {
+        LOG(INFO) << "BVH cache " << filename << " is out of date; rebuilding";
+        fclose(f);
+        return false;
+    }
+    size_t nodeSize = width == 2 ? sizeof(LinearBVHNode)
+                                 : (width == 4 ? sizeof(WideBVHNode<4>)
+                                               : sizeof(WideBVHNode<8>));
+    size_t nodesOffset = sizeof(BVHCacheHeader);
+    size_t blocksOffset = nodesOffset + header.nNodes * nodeSize;
+    size_t leafBlocksOffset =
+        blocksOffset + header.nTriangleBlocks * sizeof(TriangleBlock);
+    size_t orderOffset = leafBlocksOffset + header.nPrimitives * sizeof(int32_t);
+    size_t expectedSize = orderOffset + header.nPrimitives * sizeof(int32_t);
+    if ((size_t)fileSize != expectedSize) {
+        Warning("%s: BVH cache file is truncated. Rebuilding BVH.",
+                filename.c_str());
+        fclose(f);
+        return false;
+    }
+
+    // Map the file so that the nodes can be used in place
+#ifdef PBRT_HAVE_MMAP
+    fclose(f);
+    int fd = open(filename.c_str(), O_RDONLY);
+    void *ptr = fd == -1 ? MAP_FAILED
+                         : mmap(0, expectedSize, PROT_READ,
+                                MAP_FILE | MAP_PRIVATE, fd, 0);
+    if (fd != -1) close(fd);
+    if (ptr == MAP_FAILED) {
+        Warning("%s: unable to map BVH cache: %s", filename.c_str(),
+                strerror(errno));
+        return false;
+    }
+#else
+    void *ptr = AllocAligned(expectedSize);
+    fseek(f, 0, SEEK_SET);
+    bool contentsRead = fread(ptr, expectedSize, 1, f) == 1;
+    fclose(f);
+    if (!contentsRead) {
+        Warning("%s: unable to read BVH cache.", filename.c_str());
+        FreeAligned(ptr);
+        return false;
+    }
+#endif
+    const uint8_t *data = (const uint8_t *)ptr;
+
+    // Reorder _primitives_ as in the cached tree
+    const int32_t *order = (const int32_t *)(data + orderOffset);
+    std::vector<bool> seen(primitives.size(), false);
+    std::vector<std::shared_ptr<Primitive>> orderedPrims(primitives.size());
+    bool valid = true;
+    for (size_t i = 0; i < primitives.size() && valid; ++i) {
+        valid = order[i] >= 0 && order[i] < (int)primitives.size() &&
+                !seen[order[i]];
+        if (valid) {
+            seen[order[i]] = true;
+            orderedPrims[i] = primitives[order[i]];
+        }
+    }
+    if (!valid) {
+        Warning("%s: corrupt BVH cache. Rebuilding BVH.", filename.c_str());
+#ifdef PBRT_HAVE_MMAP
+        munmap(ptr, expectedSize);
+#else
+        FreeAligned(ptr);
+#endif
+        return false;
+    }
+    primitives.swap(orderedPrims);
+
+    cacheMapping = ptr;
+    cacheMappingSize = expectedSize;
+    if (width == 2)
+        nodes = (LinearBVHNode *)(data + nodesOffset);
+    else
+        wideNodes = (void *)(data + nodesOffset);
+    const TriangleBlock *blocks = (const TriangleBlock *)(data + blocksOffset);
+    triangleBlocks.assign(blocks, blocks + header.nTriangleBlocks);
+    const int32_t *leafBlockData = (const int32_t *)(data + leafBlocksOffset);
+    leafBlocks.assign(leafBlockData, leafBlockData + header.nPrimitives);
+    sahCost = header.sahCost;
+    for (const auto &prim : primitives)
+        bounds = Union(bounds, prim->WorldBound());
+
+    ++cachedTrees;
+    totalBVHPrimitives += primitives.size();
+    treeBytes += sizeof(*this) + primitives.size() * sizeof(primitives[0]) +
+                 triangleBlocks.size() * sizeof(TriangleBlock) +
+                 leafBlocks.size() * sizeof(int) + header.nNodes * nodeSize;
+    LOG(INFO) << StringPrintf("Loaded BVH with %d nodes for %d primitives "
+                              "from cache %s",
+                              (int)header.nNodes, (int)primitives.size(),
+                              filename.c_str());
+    return true;
+}
+
+void BVHAccel::writeCache(
+    const std::string &filename, uint64_t key,
+    const std::vector<std::shared_ptr<Primitive>> &inputPrims,
+    int nNodes) const {
+    // Find each primitive's index in the vector the BVH was created with
+    std::unordered_map<const Primitive *, int32_t> inputIndex;
+    for (size_t i = 0; i < inputPrims.size(); ++i)
+        inputIndex[inputPrims[i].get()] = i;
+    if (inputIndex.size() != inputPrims.size()) {
+        Warning("BVH has duplicate primitives; not writing cache \"%s\"",
+                filename.c_str());
+        return;
+    }
+    std::vector<int32_t> order(primitives.size());
+    for (size_t i = 0; i < primitives.size(); ++i)
+        order[i] = inputIndex[primitives[i].get()];
+
+    BVHCacheHeader header;
+    memcpy(header.magic, bvhCacheMagic, sizeof(bvhCacheMagic));
+    header.floatSize = sizeof(Float);
+    header.width = width;
+    header.maxPrimsInNode = maxPrimsInNode;
+    header.splitMethod = (int)splitMethod;
+    header.key = key;
+    header.nPrimitives = primitives.size();
+    header.nNodes = nNodes;
+    header.nTriangleBlocks = triangleBlocks.size();
+    header.sahCost = sahCost;
+    const void *nodeData = width == 2 ? (const void *)nodes : wideNodes;
+    size_t nodeSize = width == 2 ? sizeof(LinearBVHNode)
+                                 : (width == 4 ? sizeof(WideBVHNode<4>)
+                                               : sizeof(WideBVHNode<8>));
+    std::vector<int32_t> leafBlockData(leafBlocks.begin(), leafBlocks.end());
+
+    // Write to a temporary file and rename it so that a concurrent or
+    // interrupted run never sees a partial cache
+    std::string tmpName = filename + ".tmp";
+    FILE *f = fopen(tmpName.c_str(), "wb");
+    if (!f) {
+        Warning("%s: unable to write BVH cache: %s", tmpName.c_str(),
+                strerror(errno));
+        return;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+              fwrite(nodeData, nodeSize, nNodes, f) == (size_t)nNodes &&
+              fwrite(triangleBlocks.data(), sizeof(TriangleBlock),
+                     triangleBlocks.size(), f) == triangleBlocks.size() &&
+              fwrite(leafBlockData.data(), sizeof(int32_t),
+                     leafBlockData.size(), f) == leafBlockData.size() &&
+              fwrite(order.data(), sizeof(int32_t), order.size(), f) ==
+                  order.size();
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmpName.c_str(), filename.c_str()) != 0) {
+        Warning("%s: unable to write BVH cache: %s", filename.c_str(),
+                strerror(errno));
+        remove(tmpName.c_str());
+        return;
+    }
+    LOG(INFO) << "Wrote BVH cache " << filename;
+}
+
+Bounds3f BVHAccel::WorldBound() const { return bounds; }
+
 struct BucketInfo {
     int count = 0;
     Bounds3f bounds;
 };
 
+// Computes the bounds of the primitives in [start, end) and of their
+// centroids, splitting large ranges across threads.
+static void computeRangeBounds(
+    const std::vector<BVHPrimitiveInfo> &primitiveInfo, int start, int end,
+    Bounds3f *bounds, Bounds3f *centroidBounds) {
+    int nChunks = (end - start + parallelBinChunk - 1) / parallelBinChunk;
+    if (end - start < parallelBinMinPrimitives) nChunks = 1;
+    std::vector<Bounds3f> chunkBounds(nChunks), chunkCentroidBounds(nChunks);
+    auto boundChunk = [&](int64_t c) {
+        int chunkEnd = nChunks == 1 ? end
+                                    : std::min<int>(
+                                          end, start + (c + 1) *
+                                                           parallelBinChunk);
+        for (int i = start + c * parallelBinChunk; i < chunkEnd; ++i) {
+            chunkBounds[c] = Union(chunkBounds[c], primitiveInfo[i].bounds);
+            chunkCentroidBounds[c] =
+                Union(chunkCentroidBounds[c], primitiveInfo[i].centroid);
+        }
+    };
+    if (nChunks == 1)
+        boundChunk(0);
+    else
+        ParallelFor(boundChunk, nChunks);
+    for (int c = 0; c < nChunks; ++c) {
+        *bounds = Union(*bounds, chunkBounds[c]);
+        *centroidBounds = Union(*centroidBounds, chunkCentroidBounds[c]);
+    }
+}
+
 BVHBuildNode *BVHAccel::recursiveBuild(
-    MemoryArena &arena, std::vector<BVHPrimitiveInfo> &primitiveInfo, int start,
-    int end, int *totalNodes,
+    MemoryArena &arena, BVHBuildArenas &subtreeArenas,
+    std::vector<BVHPrimitiveInfo> &primitiveInfo, int start, int end,
+    std::atomic<int> *totalNodes,
     std::vector<std::shared_ptr<Primitive>> &orderedPrims) {
     CHECK_NE(start, end);
     BVHBuildNode *node = arena.Alloc<BVHBuildNode>();
     (*totalNodes)++;
-    // Compute bounds of all primitives in BVH node
-    Bounds3f bounds;
-    for (int i = start; i < end; ++i)
-        bounds = Union(bounds, primitiveInfo[i].bounds);
+    // Compute bounds of all primitives and centroids in BVH node
+    Bounds3f bounds, centroidBounds;
+    computeRangeBounds(primitiveInfo, start, end, &bounds, &centroidBounds);
     int nPrimitives = end - start;
+    // Leaves store their primitives at the same offset as their
+    // _primitiveInfo_ range, so subtrees can be built concurrently.
     if (nPrimitives == 1) {
         // Create leaf _BVHBuildNode_
-        int firstPrimOffset = orderedPrims.size();
+        int firstPrimOffset = start;
         for (int i = start; i < end; ++i) {
             int primNum = primitiveInfo[i].primitiveNumber;
-            orderedPrims.push_back(primitives[primNum]);
+            orderedPrims[i] = primitives[primNum];
         }
         node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
         return node;
     } else {
-        // Compute bound of primitive centroids, choose split dimension _dim_
-        Bounds3f centroidBounds;
-        for (int i = start; i < end; ++i)
-            centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
+        // Choose split dimension _dim_
         int dim = centroidBounds.MaximumExtent();
 
         // Partition primitives into two sets and build children
         int mid = (start + end) / 2;
         if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
             // Create leaf _BVHBuildNode_
-            int firstPrimOffset = orderedPrims.size();
+            int firstPrimOffset = start;
             for (int i = start; i < end; ++i) {
                 int primNum = primitiveInfo[i].primitiveNumber;
-                orderedPrims.push_back(primitives[primNum]);
+                orderedPrims[i] = primitives[primNum];
             }
             node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
             return node;
@@ -320,17 +803,44 @@ BVHBuildNode *BVHAccel::recursiveBuild(
                     PBRT_CONSTEXPR int nBuckets = 12;
                     BucketInfo buckets[nBuckets];
 
-                    // Initialize _BucketInfo_ for SAH partition buckets
-                    for (int i = start; i < end; ++i) {
-                        int b = nBuckets *
-                                centroidBounds.Offset(
-                                    primitiveInfo[i].centroid)[dim];
-                        if (b == nBuckets) b = nBuckets - 1;
-                        CHECK_GE(b, 0);
-                        CHECK_LT(b, nBuckets);
-                        buckets[b].count++;
-                        buckets[b].bounds =
-                            Union(buckets[b].bounds, primitiveInfo[i].bounds);
+                    // Initialize _BucketInfo_ for SAH partition buckets,
+                    // binning large nodes in parallel chunks
+                    auto binPrimitives = [&](int binStart, int binEnd,
+                                             BucketInfo *buckets) {
+                        for (int i = binStart; i < binEnd; ++i) {
+                            int b = nBuckets *
+                                    centroidBounds.Offset(
+                                        primitiveInfo[i].centroid)[dim];
+                            if (b == nBuckets) b = nBuckets - 1;
+                            CHECK_GE(b, 0);
+                            CHECK_LT(b, nBuckets);
+                            buckets[b].count++;
+                            buckets[b].bounds = Union(buckets[b].bounds,
+                                                      primitiveInfo[i].bounds);
+                        }
+                    };
+                    if (nPrimitives < parallelBinMinPrimitives)
+                        binPrimitives(start, end, buckets);
+                    else {
+                        int nChunks = (nPrimitives + parallelBinChunk - 1) /
+                                      parallelBinChunk;
+                        std::vector<BucketInfo> chunkBuckets(nChunks *
+                                                             nBuckets);
+                        ParallelFor([&](int64_t c) {
+                            binPrimitives(
+                                start + c * parallelBinChunk,
+                                std::min<int>(end, start + (c + 1) *
+                                                               parallelBinChunk),
+                                &chunkBuckets[c * nBuckets]);
+                        }, nChunks);
+                        for (int c = 0; c < nChunks; ++c)
+                            for (int b = 0; b < nBuckets; ++b) {
+                                const BucketInfo &cb =
+                                    chunkBuckets[c * nBuckets + b];
+                                buckets[b].count += cb.count;
+                                buckets[b].bounds =
+                                    Union(buckets[b].bounds, cb.bounds);
+                            }
                     }
 
                     // Compute costs for splitting after each bucket
@@ -379,10 +889,10 @@ BVHBuildNode *BVHAccel::recursiveBuild(
                         mid = pmid - &primitiveInfo[0];
                     } else {
                         // Create leaf _BVHBuildNode_
-                        int firstPrimOffset = orderedPrims.size();
+                        int firstPrimOffset = start;
                         for (int i = start; i < end; ++i) {
                             int primNum = primitiveInfo[i].primitiveNumber;
-                            orderedPrims.push_back(primitives[primNum]);
+                            orderedPrims[i] = primitives[primNum];
                         }
                         node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
                         return node;
@@ -391,11 +901,29 @@ BVHBuildNode *BVHAccel::recursiveBuild(
                 break;
             }
             }
-            node->InitInterior(dim,
-                               recursiveBuild(arena, primitiveInfo, start, mid,
-                                              totalNodes, orderedPrims),
-                               recursiveBuild(arena, primitiveInfo, mid, end,
-                                              totalNodes, orderedPrims));
+            if (nPrimitives < parallelBuildMinPrimitives)
+                node->InitInterior(
+                    dim,
+                    recursiveBuild(arena, subtreeArenas, primitiveInfo, start,
+                                   mid, totalNodes, orderedPrims),
+                    recursiveBuild(arena, subtreeArenas, primitiveInfo, mid,
+                                   end, totalNodes, orderedPrims));
+            else {
+                // Build the two subtrees concurrently; the first keeps using
+                // _arena_ since this thread won't allocate from it meanwhile
+                MemoryArena &secondArena = subtreeArenas.Alloc();
+                BVHBuildNode *children[2];
+                ParallelFor([&](int64_t i) {
+                    children[i] =
+                        i == 0 ? recursiveBuild(arena, subtreeArenas,
+                                                primitiveInfo, start, mid,
+                                                totalNodes, orderedPrims)
+                               : recursiveBuild(secondArena, subtreeArenas,
+                                                primitiveInfo, mid, end,
+                                                totalNodes, orderedPrims);
+                }, 2);
+                node->InitInterior(dim, children[0], children[1]);
+            }
         }
     }
     return node;
@@ -657,14 +1185,482 @@ int BVHAccel::flattenBVHTree(BVHBuildNode *node, int *offset) {
     return myOffset;
 }
 
-BVHAccel::~BVHAccel() { FreeAligned(nodes); }
+void BVHAccel::packTriangleLeaves(const BVHBuildNode *node) {
+    if (node->nPrimitives == 0) {
+        packTriangleLeaves(node->children[0]);
+        packTriangleLeaves(node->children[1]);
+        return;
+    }
+
+    // Only leaves where every primitive is a triangle without alpha masks
+    // can be packed
+    int offset = node->firstPrimOffset, n = node->nPrimitives;
+    std::vector<std::array<Point3f, 3>> vertices(n);
+    for (int i = 0; i < n; ++i) {
+        const GeometricPrimitive *gp =
+            dynamic_cast<const GeometricPrimitive *>(
+                primitives[offset + i].get());
+        const Triangle *tri =
+            gp ? dynamic_cast<const Triangle *>(gp->GetShape()) : nullptr;
+        if (!tri || !tri->GetBlockVertices(&vertices[i][0])) return;
+    }
+
+    leafBlocks[offset] = triangleBlocks.size();
+    for (int start = 0; start < n; start += TriangleBlock::Width) {
+        TriangleBlock block;
+        block.nTriangles = std::min(n - start, TriangleBlock::Width);
+        for (int lane = 0; lane < TriangleBlock::Width; ++lane)
+            for (int j = 0; j < 3; ++j)
+                for (int a = 0; a < 3; ++a)
+                    block.p[j][a][lane] = lane < block.nTriangles
+                                              ? vertices[start + lane][j][a]
+                                              : 0;
+        triangleBlocks.push_back(block);
+    }
+    packedPrimitives += n;
+}
+
+bool BVHAccel::intersectLeaf(const Ray &ray, const TriangleBlockRay *blockRay,
+                             int offset, int nPrimitives,
+                             SurfaceInteraction *isect, int *deferredPrim,
+                             Float *deferredTMax) const {
+    bool hit = false;
+    if (blockRay && leafBlocks[offset] >= 0) {
+        // Test the leaf's triangle blocks and only remember the closest
+        // hit; its _SurfaceInteraction_ is computed after traversal.
+        int nBlocks = (nPrimitives + TriangleBlock::Width - 1) /
+                      TriangleBlock::Width;
+        for (int b = 0; b < nBlocks; ++b) {
+            Float tHit;
+            int lane = IntersectTriangleBlock(
+                triangleBlocks[leafBlocks[offset] + b], *blockRay, ray.tMax,
+                &tHit);
+            if (lane >= 0) {
+                *deferredPrim = offset + b * TriangleBlock::Width + lane;
+                *deferredTMax = ray.tMax;
+                ray.tMax = tHit;
+                hit = true;
+            }
+        }
+    } else {
+        for (int i = 0; i < nPrimitives; ++i)
+            if (primitives[offset + i]->Intersect(ray, isect)) {
+                // _isect_ now holds a closer hit than any deferred one
+                *deferredPrim = -1;
+                hit = true;
+            }
+    }
+    return hit;
+}
+
+bool BVHAccel::intersectPLeaf(const Ray &ray, const TriangleBlockRay *blockRay,
+                              int offset, int nPrimitives) const {
+    if (blockRay && leafBlocks[offset] >= 0) {
+        int nBlocks = (nPrimitives + TriangleBlock::Width - 1) /
+                      TriangleBlock::Width;
+        for (int b = 0; b < nBlocks; ++b) {
+            Float tHit;
+            if (IntersectTriangleBlock(triangleBlocks[leafBlocks[offset] + b],
+                                       *blockRay, ray.tMax, &tHit) >= 0)
+                return true;
+        }
+        return false;
+    }
+    for (int i = 0; i < nPrimitives; ++i)
+        if (primitives[offset + i]->IntersectP(ray)) return true;
+    return false;
+}
+
+bool BVHAccel::finishIntersect(const Ray &ray, SurfaceInteraction *isect,
+                               bool hit, int deferredPrim, Float deferredTMax,
+                               Float originalTMax) const {
+    if (deferredPrim == -1) return hit;
+    // Compute the _SurfaceInteraction_ for the closest triangle block hit,
+    // using the same $t$ range as when it was found
+    ray.tMax = deferredTMax;
+    if (primitives[deferredPrim]->Intersect(ray, isect)) return true;
+
+    // The full triangle test disagreed with the block test (e.g. due to
+    // different floating-point contraction); redo the traversal without
+    // the blocks.
+    LOG(WARNING) << "Triangle block hit not confirmed; retracing ray";
+    ray.tMax = originalTMax;
+    if (width == 2) return intersectBinary(ray, isect, false);
+    return width == 4 ? intersectWide<4>(ray, isect, false)
+                      : intersectWide<8>(ray, isect, false);
+}
+
+template <int N>
+int BVHAccel::flattenWideBVHTree(BVHBuildNode *node, int *offset) {
+    WideBVHNode<N> *wide = (WideBVHNode<N> *)wideNodes;
+    int myOffset = (*offset)++;
+
+    // Gather up to _N_ children by repeatedly opening up the interior
+    // child with the largest surface area
+    BVHBuildNode *children[N];
+    int nChildren = 0;
+    if (node->nPrimitives > 0)
+        children[nChildren++] = node;
+    else {
+        children[nChildren++] = node->children[0];
+        children[nChildren++] = node->children[1];
+    }
+    while (nChildren < N) {
+        int best = -1;
+        Float bestArea = 0;
+        for (int i = 0; i < nChildren; ++i) {
+            if (children[i]->nPrimitives > 0) continue;
+            Float area = children[i]->bounds.SurfaceArea();
+            if (best == -1 || area > bestArea) {
+                best = i;
+                bestArea = area;
+            }
+        }
+        if (best == -1) break;
+        BVHBuildNode *open = children[best];
+        children[best] = open->children[0];
+        children[nChildren++] = open->children[1];
+    }
+
+    // Initialize _WideBVHNode_ for the gathered children
+    for (int i = 0; i < N; ++i) {
+        WideBVHNode<N> &w = wide[myOffset];
+        if (i >= nChildren) {
+            for (int a = 0; a < 3; ++a) {
+                w.bounds[0][a][i] = std::numeric_limits<float>::infinity();
+                w.bounds[1][a][i] = -std::numeric_limits<float>::infinity();
+            }
+            w.child[i] = -1;
+            w.nPrimitives[i] = 0;
+            continue;
+        }
+        const Bounds3f &b = children[i]->bounds;
+        for (int a = 0; a < 3; ++a) {
+            // Round outward when _Float_ is wider than the stored bounds
+            float lo = b.pMin[a], hi = b.pMax[a];
+            if (lo > b.pMin[a]) lo = NextFloatDown(lo);
+            if (hi < b.pMax[a]) hi = NextFloatUp(hi);
+            w.bounds[0][a][i] = lo;
+            w.bounds[1][a][i] = hi;
+        }
+        if (children[i]->nPrimitives > 0) {
+            CHECK_LT(children[i]->nPrimitives, 65536);
+            w.child[i] = children[i]->firstPrimOffset;
+            w.nPrimitives[i] = children[i]->nPrimitives;
+        } else {
+            w.nPrimitives[i] = 0;
+            int childOffset = flattenWideBVHTree<N>(children[i], offset);
+            wide[myOffset].child[i] = childOffset;
+        }
+    }
+    return myOffset;
+}
+
+BVHAccel::~BVHAccel() {
+    if (cacheMapping) {
+#ifdef PBRT_HAVE_MMAP
+        munmap(cacheMapping, cacheMappingSize);
+#else
+        FreeAligned(cacheMapping);
+#endif
+        return;
+    }
+    FreeAligned(nodes);
+    FreeAligned(wideNodes);
+}
+
+// Rays in a batch are traversed in packets of this many rays, each
+// tracked by a bit of a 32-bit mask
+static PBRT_CONSTEXPR int bvhPacketSize = 32;
+
+// Per-ray state for packet traversal
+struct BVHPacketRay {
+    Vector3f invDir;
+    int dirIsNeg[3];
+    TriangleBlockRay blockRay;
+    int deferredPrim;
+    Float deferredTMax, originalTMax;
+};
+
+void BVHAccel::Intersect(RayBatch &batch) const {
+    batch.hit.assign(batch.Size(), 0);
+    batch.isects.resize(batch.Size());
+    // Packets are only traversed in the binary layout
+    if (!nodes) {
+        if (wideNodes) Aggregate::Intersect(batch);
+        return;
+    }
+    ProfilePhase p(Prof::AccelIntersect);
+    for (int start = 0; start < batch.Size(); start += bvhPacketSize)
+        intersectPacket(batch, start,
+                        std::min(batch.Size(), start + bvhPacketSize));
+}
+
+void BVHAccel::IntersectP(RayBatch &batch) const {
+    batch.hit.assign(batch.Size(), 0);
+    if (!nodes) {
+        if (wideNodes) Aggregate::IntersectP(batch);
+        return;
+    }
+    ProfilePhase p(Prof::AccelIntersectP);
+    for (int start = 0; start < batch.Size(); start += bvhPacketSize)
+        intersectPPacket(batch, start,
+                         std::min(batch.Size(), start + bvhPacketSize));
+}
+
+void BVHAccel::intersectPacket(RayBatch &batch, int start, int end) const {
+    // Initialize per-ray state for the packet
+    BVHPacketRay packet[bvhPacketSize];
+    int n = end - start;
+    for (int i = 0; i < n; ++i) {
+        const Ray &ray = batch.rays[start + i];
+        BVHPacketRay &pr = packet[i];
+        pr.invDir = Vector3f(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+        for (int a = 0; a < 3; ++a) pr.dirIsNeg[a] = pr.invDir[a] < 0;
+        if (!triangleBlocks.empty()) pr.blockRay = TriangleBlockRay(ray);
+        pr.deferredPrim = -1;
+        pr.deferredTMax = pr.originalTMax = ray.tMax;
+    }
+
+    // Traverse the tree once for the whole packet, carrying the mask of
+    // rays that are still active in each subtree
+    struct {
+        int node;
+        uint32_t mask;
+    } toVisit[64];
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    uint32_t mask = n == 32 ? ~0u : (1u << n) - 1;
+    while (true) {
+        const LinearBVHNode *node = &nodes[currentNodeIndex];
+        // Find the packet's rays that enter _node_
+        uint32_t nodeMask = 0;
+        for (uint32_t m = mask; m; m &= m - 1) {
+            int i = CountTrailingZeros(m);
+            ++packetRayNodeTests;
+            if (node->bounds.IntersectP(batch.rays[start + i], packet[i].invDir,
+                                        packet[i].dirIsNeg))
+                nodeMask |= 1u << i;
+        }
+        ++packetNodeVisits;
+
+        if (nodeMask != 0) {
+            if (node->nPrimitives > 0) {
+                // Intersect the active rays with the leaf's primitives
+                for (uint32_t m = nodeMask; m; m &= m - 1) {
+                    int i = CountTrailingZeros(m);
+                    BVHPacketRay &pr = packet[i];
+                    if (intersectLeaf(
+                            batch.rays[start + i],
+                            triangleBlocks.empty() ? nullptr : &pr.blockRay,
+                            node->primitivesOffset, node->nPrimitives,
+                            &batch.isects[start + i], &pr.deferredPrim,
+                            &pr.deferredTMax))
+                        batch.hit[start + i] = 1;
+                }
+            } else {
+                // Visit the near child first, as seen by the first active ray
+                int first = CountTrailingZeros(nodeMask);
+                if (packet[first].dirIsNeg[node->axis]) {
+                    toVisit[toVisitOffset++] = {currentNodeIndex + 1,
+                                                nodeMask};
+                    currentNodeIndex = node->secondChildOffset;
+                } else {
+                    toVisit[toVisitOffset++] = {node->secondChildOffset,
+                                                nodeMask};
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+                mask = nodeMask;
+                continue;
+            }
+        }
+        if (toVisitOffset == 0) break;
+        --toVisitOffset;
+        currentNodeIndex = toVisit[toVisitOffset].node;
+        mask = toVisit[toVisitOffset].mask;
+    }
+
+    for (int i = 0; i < n; ++i)
+        batch.hit[start + i] = finishIntersect(
+            batch.rays[start + i], &batch.isects[start + i],
+            batch.hit[start + i], packet[i].deferredPrim,
+            packet[i].deferredTMax, packet[i].originalTMax);
+}
+
+void BVHAccel::intersectPPacket(RayBatch &batch, int start, int end) const {
+    BVHPacketRay packet[bvhPacketSize];
+    int n = end - start;
+    for (int i = 0; i < n; ++i) {
+        const Ray &ray = batch.rays[start + i];
+        BVHPacketRay &pr = packet[i];
+        pr.invDir = Vector3f(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+        for (int a = 0; a < 3; ++a) pr.dirIsNeg[a] = pr.invDir[a] < 0;
+        if (!triangleBlocks.empty()) pr.blockRay = TriangleBlockRay(ray);
+    }
+
+    // Traverse as for _intersectPacket()_, dropping rays from the packet as
+    // soon as they are found to be occluded
+    struct {
+        int node;
+        uint32_t mask;
+    } toVisit[64];
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    uint32_t all = n == 32 ? ~0u : (1u << n) - 1;
+    uint32_t mask = all, occluded = 0;
+    while (true) {
+        const LinearBVHNode *node = &nodes[currentNodeIndex];
+        uint32_t nodeMask = 0;
+        for (uint32_t m = mask & ~occluded; m; m &= m - 1) {
+            int i = CountTrailingZeros(m);
+            ++packetRayNodeTests;
+            if (node->bounds.IntersectP(batch.rays[start + i], packet[i].invDir,
+                                        packet[i].dirIsNeg))
+                nodeMask |= 1u << i;
+        }
+        ++packetNodeVisits;
+
+        if (nodeMask != 0) {
+            if (node->nPrimitives > 0) {
+                for (uint32_t m = nodeMask; m; m &= m - 1) {
+                    int i = CountTrailingZeros(m);
+                    if (intersectPLeaf(batch.rays[start + i],
+                                       triangleBlocks.empty()
+                                           ? nullptr
+                                           : &packet[i].blockRay,
+                                       node->primitivesOffset,
+                                       node->nPrimitives))
+                        occluded |= 1u << i;
+                }
+                if (occluded == all) break;
+            } else {
+                int first = CountTrailingZeros(nodeMask);
+                if (packet[first].dirIsNeg[node->axis]) {
+                    toVisit[toVisitOffset++] = {currentNodeIndex + 1,
+                                                nodeMask};
+                    currentNodeIndex = node->secondChildOffset;
+                } else {
+                    toVisit[toVisitOffset++] = {node->secondChildOffset,
+                                                nodeMask};
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+                mask = nodeMask;
+                continue;
+            }
+        }
+        if (toVisitOffset == 0) break;
+        --toVisitOffset;
+        currentNodeIndex = toVisit[toVisitOffset].node;
+        mask = toVisit[toVisitOffset].mask;
+    }
+
+    for (int i = 0; i < n; ++i) batch.hit[start + i] = (occluded >> i) & 1;
+}
+
+// Entry of the traversal stack for wide BVHs; either a node to visit or,
+// when _nPrimitives_ is non-zero, a leaf's primitives.
+struct WideBVHStackEntry {
+    int32_t index, nPrimitives;
+    float tNear;
+};
+
+template <int N>
+bool BVHAccel::intersectWide(const Ray &ray, SurfaceInteraction *isect,
+                             bool usePackedLeaves) const {
+    const WideBVHNode<N> *wide = (const WideBVHNode<N> *)wideNodes;
+    bool hit = false;
+    WideBVHRay wideRay(ray);
+    TriangleBlockRay blockRay(ray);
+    const TriangleBlockRay *leafBlockRay =
+        usePackedLeaves && !triangleBlocks.empty() ? &blockRay : nullptr;
+    int deferredPrim = -1;
+    Float deferredTMax = ray.tMax, originalTMax = ray.tMax;
+    WideBVHStackEntry toVisit[64 * N];
+    int toVisitOffset = 0;
+    toVisit[toVisitOffset++] = {0, 0, 0.f};
+    while (toVisitOffset > 0) {
+        WideBVHStackEntry entry = toVisit[--toVisitOffset];
+        // Skip nodes that are farther away than the closest hit so far
+        if (entry.tNear > ray.tMax) continue;
+        if (entry.nPrimitives > 0) {
+            // Intersect ray with primitives in leaf
+            if (intersectLeaf(ray, leafBlockRay, entry.index,
+                              entry.nPrimitives, isect, &deferredPrim,
+                              &deferredTMax))
+                hit = true;
+            continue;
+        }
+
+        // Check ray against all children and push the ones it hits so
+        // that the nearest is visited first
+        const WideBVHNode<N> &node = wide[entry.index];
+        float tNear[N];
+        int mask = IntersectWideNode<N>(node, wideRay, ray.tMax, tNear);
+        int order[N], nHit = 0;
+        for (int i = 0; i < N; ++i) {
+            if (!(mask & (1 << i))) continue;
+            // Insertion sort by decreasing _tNear_
+            int j = nHit++;
+            while (j > 0 && tNear[order[j - 1]] < tNear[i]) {
+                order[j] = order[j - 1];
+                --j;
+            }
+            order[j] = i;
+        }
+        for (int j = 0; j < nHit; ++j) {
+            int i = order[j];
+            toVisit[toVisitOffset++] = {node.child[i], node.nPrimitives[i],
+                                        tNear[i]};
+        }
+    }
+    return finishIntersect(ray, isect, hit, deferredPrim, deferredTMax,
+                           originalTMax);
+}
+
+template <int N>
+bool BVHAccel::intersectPWide(const Ray &ray) const {
+    const WideBVHNode<N> *wide = (const WideBVHNode<N> *)wideNodes;
+    WideBVHRay wideRay(ray);
+    TriangleBlockRay blockRay(ray);
+    const TriangleBlockRay *leafBlockRay =
+        triangleBlocks.empty() ? nullptr : &blockRay;
+    int toVisit[64 * N];
+    int toVisitOffset = 0;
+    toVisit[toVisitOffset++] = 0;
+    while (toVisitOffset > 0) {
+        const WideBVHNode<N> &node = wide[toVisit[--toVisitOffset]];
+        float tNear[N];
+        int mask = IntersectWideNode<N>(node, wideRay, ray.tMax, tNear);
+        for (int i = 0; i < N; ++i) {
+            if (!(mask & (1 << i))) continue;
+            if (node.nPrimitives[i] > 0) {
+                if (intersectPLeaf(ray, leafBlockRay, node.child[i],
+                                   node.nPrimitives[i]))
+                    return true;
+            } else
+                toVisit[toVisitOffset++] = node.child[i];
+        }
+    }
+    return false;
+}
 
 bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
-    if (!nodes) return false;
     ProfilePhase p(Prof::AccelIntersect);
+    if (wideNodes)
+        return width == 4 ? intersectWide<4>(ray, isect, true)
+                          : intersectWide<8>(ray, isect, true);
+    return intersectBinary(ray, isect, true);
+}
+
+bool BVHAccel::intersectBinary(const Ray &ray, SurfaceInteraction *isect,
+                               bool usePackedLeaves) const {
+    if (!nodes) return false;
     bool hit = false;
     Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
     int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    TriangleBlockRay blockRay(ray);
+    const TriangleBlockRay *leafBlockRay =
+        usePackedLeaves && !triangleBlocks.empty() ? &blockRay : nullptr;
+    int deferredPrim = -1;
+    Float deferredTMax = ray.tMax, originalTMax = ray.tMax;
     // Follow ray through BVH nodes to find primitive intersections
     int toVisitOffset = 0, currentNodeIndex = 0;
     int nodesToVisit[64];
@@ -674,10 +1670,10 @@ bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
         if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
             if (node->nPrimitives > 0) {
                 // Intersect ray with primitives in leaf BVH node
-                for (int i = 0; i < node->nPrimitives; ++i)
-                    if (primitives[node->primitivesOffset + i]->Intersect(
-                            ray, isect))
-                        hit = true;
+                if (intersectLeaf(ray, leafBlockRay, node->primitivesOffset,
+                                  node->nPrimitives, isect, &deferredPrim,
+                                  &deferredTMax))
+                    hit = true;
                 if (toVisitOffset == 0) break;
                 currentNodeIndex = nodesToVisit[--toVisitOffset];
             } else {
@@ -696,14 +1692,22 @@ bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
             currentNodeIndex = nodesToVisit[--toVisitOffset];
         }
     }
-    return hit;
+    return finishIntersect(ray, isect, hit, deferredPrim, deferredTMax,
+                           originalTMax);
 }
 
 bool BVHAccel::IntersectP(const Ray &ray) const {
+    if (wideNodes) {
+        ProfilePhase p(Prof::AccelIntersectP);
+        return width == 4 ? intersectPWide<4>(ray) : intersectPWide<8>(ray);
+    }
     if (!nodes) return false;
     ProfilePhase p(Prof::AccelIntersectP);
     Vector3f invDir(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
     int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    TriangleBlockRay blockRay(ray);
+    const TriangleBlockRay *leafBlockRay =
+        triangleBlocks.empty() ? nullptr : &blockRay;
     int nodesToVisit[64];
     int toVisitOffset = 0, currentNodeIndex = 0;
     while (true) {
@@ -711,12 +1715,9 @@ bool BVHAccel::IntersectP(const Ray &ray) const {
         if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
             // Process BVH node _node_ for traversal
             if (node->nPrimitives > 0) {
-                for (int i = 0; i < node->nPrimitives; ++i) {
-                    if (primitives[node->primitivesOffset + i]->IntersectP(
-                            ray)) {
-                        return true;
-                    }
-                }
+                if (intersectPLeaf(ray, leafBlockRay, node->primitivesOffset,
+                                   node->nPrimitives))
+                    return true;
                 if (toVisitOffset == 0) break;
                 currentNodeIndex = nodesToVisit[--toVisitOffset];
             } else {
@@ -755,8 +1756,24 @@ std::shared_ptr<BVHAccel> CreateBVHAccelerator(
         splitMethod = BVHAccel::SplitMethod::SAH;
     }
 
+    std::string layoutName = ps.FindOneString("layout", "binary");
+    int width;
+    if (layoutName == "binary")
+        width = 2;
+    else if (layoutName == "wide4")
+        width = 4;
+    else if (layoutName == "wide8")
+        width = 8;
+    else {
+        Warning("BVH layout \"%s\" unknown.  Using \"binary\".",
+                layoutName.c_str());
+        width = 2;
+    }
+
     int maxPrimsInNode = ps.FindOneInt("maxnodeprims", 4);
-    return std::make_shared<BVHAccel>(std::move(prims), maxPrimsInNode, splitMethod);
+    std::string cacheFile = ps.FindOneFilename("cachefile", "");
+    return std::make_shared<BVHAccel>(std::move(prims), maxPrimsInNode,
+                                      splitMethod, width, cacheFile);
 }
 
 }  // namespace pbrt
@@ -41,6 +41,7 @@
 // accelerators/bvh.h*
 #include "pbrt.h"
 #include "primitive.h"
+#include "shapes/triangle.h"
 #include <atomic>
 
 namespace pbrt {
@@ -48,8 +49,11 @@ struct BVHBuildNode;
 
 // BVHAccel Forward Declarations
 struct BVHPrimitiveInfo;
+struct BVHBuildArenas;
 struct MortonPrimitive;
 struct LinearBVHNode;
+template <int N>
+struct WideBVHNode;
 
 // BVHAccel Declarations
 class BVHAccel : public Aggregate {
@@ -60,17 +64,22 @@ class BVHAccel : public Aggregate {
     // BVHAccel Public Methods
     BVHAccel(std::vector<std::shared_ptr<Primitive>> p,
              int maxPrimsInNode = 1,
-             SplitMethod splitMethod = SplitMethod::SAH);
+             SplitMethod splitMethod = SplitMethod::SAH, int width = 2,
+             const std::string &cacheFile = "");
     Bounds3f WorldBound() const;
     ~BVHAccel();
     bool Intersect(const Ray &ray, SurfaceInteraction *isect) const;
     bool IntersectP(const Ray &ray) const;
+    void Intersect(RayBatch &batch) const;
+    void IntersectP(RayBatch &batch) const;
+    Float SAHCost() const { return sahCost; }
 
   private:
     // BVHAccel Private Methods
     BVHBuildNode *recursiveBuild(
-        MemoryArena &arena, std::vector<BVHPrimitiveInfo> &primitiveInfo,
-        int start, int end, int *totalNodes,
+        MemoryArena &arena, BVHBuildArenas &subtreeArenas,
+        std::vector<BVHPrimitiveInfo> &primitiveInfo, int start, int end,
+        std::atomic<int> *totalNodes,
         std::vector<std::shared_ptr<Primitive>> &orderedPrims);
     BVHBuildNode *HLBVHBuild(
         MemoryArena &arena, const std::vector<BVHPrimitiveInfo> &primitiveInfo,
@@ -86,12 +95,52 @@ class BVHAccel : public Aggregate {
                                 std::vector<BVHBuildNode *> &treeletRoots,
                                 int start, int end, int *totalNodes) const;
     int flattenBVHTree(BVHBuildNode *node, int *offset);
+    uint64_t cacheKey() const;
+    bool readCache(const std::string &filename, uint64_t key);
+    void writeCache(const std::string &filename, uint64_t key,
+                    const std::vector<std::shared_ptr<Primitive>> &inputPrims,
+                    int nNodes) const;
+    template <int N>
+    int flattenWideBVHTree(BVHBuildNode *node, int *offset);
+    void packTriangleLeaves(const BVHBuildNode *node);
+    bool intersectLeaf(const Ray &ray, const TriangleBlockRay *blockRay,
+                       int offset, int nPrimitives, SurfaceInteraction *isect,
+                       int *deferredPrim, Float *deferredTMax) const;
+    bool intersectPLeaf(const Ray &ray, const TriangleBlockRay *blockRay,
+                        int offset, int nPrimitives) const;
+    bool finishIntersect(const Ray &ray, SurfaceInteraction *isect, bool hit,
+                         int deferredPrim, Float deferredTMax,
+                         Float originalTMax) const;
+    bool intersectBinary(const Ray &ray, SurfaceInteraction *isect,
+                         bool usePackedLeaves) const;
+    template <int N>
+    bool intersectWide(const Ray &ray, SurfaceInteraction *isect,
+                       bool usePackedLeaves) const;
+    template <int N>
+    bool intersectPWide(const Ray &ray) const;
+    void intersectPacket(RayBatch &batch, int start, int end) const;
+    void intersectPPacket(RayBatch &batch, int start, int end) const;
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
     const SplitMethod splitMethod;
+    // Branching factor of the flattened tree: 2 uses _nodes_, while 4 and
+    // 8 collapse the binary tree into _wideNodes_.
+    const int width;
     std::vector<std::shared_ptr<Primitive>> primitives;
     LinearBVHNode *nodes = nullptr;
+    void *wideNodes = nullptr;
+    Bounds3f bounds;
+    Float sahCost = 0;
+    // Leaves made up only of plain triangles are also stored as SoA
+    // _TriangleBlock_s; _leafBlocks_ maps a leaf's first primitive offset
+    // to the index of its first block, or -1 for unpacked leaves.
+    std::vector<TriangleBlock> triangleBlocks;
+    std::vector<int> leafBlocks;
+    // When the tree was loaded from a cache file, the nodes point into this
+    // mapping of the file rather than being allocated separately.
+    void *cacheMapping = nullptr;
+    size_t cacheMappingSize = 0;
 };
 
 std::shared_ptr<BVHAccel> CreateBVHAccelerator(
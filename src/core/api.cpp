@@ -59,6 +59,7 @@
 #include "integrators/path.h"
 #include "integrators/sppm.h"
 #include "integrators/volpath.h"
+#include "integrators/wavefront.h"
 #include "integrators/whitted.h"
 #include "integrators/adaptive.h"
 #include "lights/diffuse.h"
@@ -374,6 +375,7 @@ static std::vector<GraphicsState> pushedGraphicsStates;
 static std::vector<TransformSet> pushedTransforms;
 static std::vector<uint32_t> pushedActiveTransformBits;
 static TransformCache transformCache;
+static WorldEndCallback worldEndCallback;
 int catIndentCount = 0;
 
 // API Forward Declarations
@@ -836,6 +838,7 @@ std::shared_ptr<Sampler> MakeSampler(const std::string &name,
         sampler = CreateStratifiedSampler(paramSet);
     else
         Warning("Sampler \"%s\" unknown.", name.c_str());
+    if (sampler) sampler->name = name;
     paramSet.ReportUnused();
     return std::shared_ptr<Sampler>(sampler);
 }
@@ -901,6 +904,10 @@ void pbrtCleanup() {
     CleanupProfiler();
 }
 
+void pbrtSetWorldEndCallback(WorldEndCallback callback) {
+    worldEndCallback = std::move(callback);
+}
+
 void pbrtIdentity() {
     VERIFY_INITIALIZED("Identity");
     FOR_ACTIVE_TRANSFORMS(curTransform[i] = Transform();)
@@ -1608,7 +1615,14 @@ void pbrtWorldEnd() {
     // Create scene and render
     if (PbrtOptions.cat || PbrtOptions.toPly) {
         printf("%*sWorldEnd\n", catIndentCount, "");
+    } else if (worldEndCallback) {
+        std::unique_ptr<Camera> camera(renderOptions->MakeCamera());
+        if (camera) worldEndCallback(*camera, renderOptions->primitives);
     } else {
+        // Load the image textures of the scene, all in parallel
+        ImageTexture<Float, Float>::LoadTextures();
+        ImageTexture<RGBSpectrum, Spectrum>::LoadTextures();
+
         std::unique_ptr<Integrator> integrator(renderOptions->MakeIntegrator());
         std::unique_ptr<Scene> scene(renderOptions->MakeScene());
 
@@ -1686,6 +1700,9 @@ Integrator *RenderOptions::MakeIntegrator() const {
             CreateDirectLightingIntegrator(IntegratorParams, sampler, camera);
     else if (IntegratorName == "path")
         integrator = CreatePathIntegrator(IntegratorParams, sampler, camera);
+    else if (IntegratorName == "wavefrontpath")
+        integrator =
+            CreateWavefrontPathIntegrator(IntegratorParams, sampler, camera);
     else if (IntegratorName == "volpath")
         integrator = CreateVolPathIntegrator(IntegratorParams, sampler, camera);
     else if (IntegratorName == "volpathadaptive")
@@ -1703,6 +1720,22 @@ Integrator *RenderOptions::MakeIntegrator() const {
         return nullptr;
     }
 
+    // Drive the integrator with adaptive sampling if requested
+    if (IntegratorName != "volpathadaptive")
+        integrator = MakeAdaptive(integrator, IntegratorName, IntegratorParams,
+                                  sampler, camera);
+
+    // Only integrators that render the image tile by tile can be distributed
+    // or render a sample range
+    if ((!PbrtOptions.coordinatorAddress.empty() ||
+         !PbrtOptions.workerAddress.empty() || PbrtOptions.sppRangeEnd > 0) &&
+        !dynamic_cast<SamplerIntegrator *>(integrator)) {
+        Error("Integrator \"%s\" doesn't support distributed rendering or "
+              "sample ranges.", IntegratorName.c_str());
+        delete integrator;
+        return nullptr;
+    }
+
     if (renderOptions->haveScatteringMedia && IntegratorName != "volpath" &&
         IntegratorName != "bdpt" && IntegratorName != "mlt") {
         Warning(
@@ -40,6 +40,7 @@
 
 // core/api.h*
 #include "pbrt.h"
+#include <functional>
 
 namespace pbrt {
 
@@ -91,6 +92,14 @@ void pbrtWorldEnd();
 void pbrtParseFile(std::string filename);
 void pbrtParseString(std::string str);
 
+// If _callback_ is set, _pbrtWorldEnd()_ hands it the camera and the
+// primitives of the scene instead of rendering it; pbrtbench uses this to
+// trace rays through the acceleration structures of real scenes.
+typedef std::function<void(const Camera &camera,
+                           const std::vector<std::shared_ptr<Primitive>> &)>
+    WorldEndCallback;
+void pbrtSetWorldEndCallback(WorldEndCallback callback);
+
 }  // namespace pbrt
 
 #endif  // PBRT_CORE_API_H
@@ -0,0 +1,533 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+
+// core/distributed.cpp*
+#include "distributed.h"
+#include "film.h"
+#include "parallel.h"
+#include "stats.h"
+#ifndef PBRT_IS_WINDOWS
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+namespace pbrt {
+
+STAT_COUNTER("Distributed/Work items merged", nItemsMerged);
+STAT_COUNTER("Distributed/Work items handed out again", nItemsRequeued);
+STAT_COUNTER("Distributed/Work items rendered", nItemsRendered);
+STAT_COUNTER("Distributed/Work items rendered by the coordinator",
+             nItemsRenderedLocally);
+
+#ifndef PBRT_IS_WINDOWS
+
+// Distributed Local Declarations
+// Both ends are pbrt processes built from the same sources, so messages are
+// sent as raw structs; the hello message checks that their layouts match.
+static PBRT_CONSTEXPR uint32_t helloMagic = 0x57545250;  // "PRTW"
+struct Hello {
+    uint32_t magic;
+    uint32_t floatSize;
+    uint32_t spectrumSamples;
+    uint32_t reserved;
+    uint64_t jobId;
+};
+
+enum class Message : int32_t { RequestWork = 1, Result = 2 };
+
+struct ResultHeader {
+    WorkItem item;
+    int32_t pixelBounds[4];
+};
+
+// Sent instead of a _WorkItem_ when the worker should stop
+static PBRT_CONSTEXPR int32_t doneTile = -1;
+
+// Number of seconds a worker keeps trying to reach a coordinator that isn't
+// listening yet, and that the coordinator waits for the rest of a message
+// once its first bytes arrived
+static PBRT_CONSTEXPR int connectSeconds = 30;
+
+// Longest time the coordinator waits for messages before checking whether
+// it has to render the items itself
+static PBRT_CONSTEXPR int pollMilliseconds = 100;
+
+// Distributed Utility Functions
+static bool SendAll(int fd, const void *data, size_t size) {
+    const char *p = (const char *)data;
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool ReceiveAll(int fd, void *data, size_t size) {
+    char *p = (char *)data;
+    while (size > 0) {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool IsUnixSocket(const std::string &address) {
+    return address.find('/') != std::string::npos;
+}
+
+// Returns a socket listening at, or connected to, _address_, or -1
+static int OpenSocket(const std::string &address, bool listening) {
+    if (IsUnixSocket(address)) {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (address.size() >= sizeof(addr.sun_path)) {
+            Error("%s: Unix socket path is too long", address.c_str());
+            return -1;
+        }
+        strcpy(addr.sun_path, address.c_str());
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        bool ok;
+        if (listening) {
+            unlink(address.c_str());
+            ok = bind(fd, (sockaddr *)&addr, sizeof(addr)) == 0 &&
+                 listen(fd, SOMAXCONN) == 0;
+        } else
+            ok = connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0;
+        if (!ok) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        Error("%s: expected a Unix socket path or \"host:port\"",
+              address.c_str());
+        return -1;
+    }
+    std::string host = address.substr(0, colon);
+    std::string port = address.substr(colon + 1);
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (listening) hints.ai_flags = AI_PASSIVE;
+    addrinfo *addrs;
+    if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(),
+                    &hints, &addrs) != 0) {
+        Error("%s: unable to resolve address", address.c_str());
+        return -1;
+    }
+    int fd = -1;
+    for (addrinfo *ai = addrs; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        int one = 1;
+        bool ok;
+        if (listening) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            ok = bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+                 listen(fd, SOMAXCONN) == 0;
+        } else {
+            ok = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+            // Requests are small and latency bound
+            if (ok) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        if (ok) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addrs);
+    return fd;
+}
+
+static Hello MakeHello(uint64_t jobId) {
+    Hello hello;
+    hello.magic = helloMagic;
+    hello.floatSize = sizeof(Float);
+    hello.spectrumSamples = Spectrum::nSamples;
+    hello.reserved = 0;
+    hello.jobId = jobId;
+    return hello;
+}
+
+// Coordinator Method Definitions
+Coordinator::Coordinator(const std::string &address, uint64_t jobId,
+                         Float workerWaitSeconds)
+    : address(address), jobId(jobId), workerWaitSeconds(workerWaitSeconds) {
+    listenFd = OpenSocket(address, true);
+    if (listenFd < 0)
+        Error("%s: unable to listen for workers: %s", address.c_str(),
+              strerror(errno));
+    else
+        LOG(INFO) << "Listening for workers at " << address;
+}
+
+Coordinator::~Coordinator() {
+    // Release the workers; they also treat the end of their connection as
+    // the end of the render
+    WorkItem done = {doneTile, 0, 0, 0};
+    for (Connection &connection : connections) {
+        if (connection.greeted && !connection.busy)
+            SendAll(connection.fd, &done, sizeof(done));
+        close(connection.fd);
+    }
+    if (listenFd >= 0) {
+        close(listenFd);
+        if (IsUnixSocket(address)) unlink(address.c_str());
+    }
+}
+
+void Coordinator::Accept() {
+    int fd = accept(listenFd, nullptr, nullptr);
+    if (fd < 0) return;
+    // Messages are only read once poll() reports that they started to
+    // arrive; the timeout keeps a peer that stops halfway through one from
+    // stalling the others
+    timeval timeout;
+    timeout.tv_sec = connectSeconds;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    Connection connection;
+    connection.fd = fd;
+    connections.push_back(connection);
+}
+
+void Coordinator::Greet(Connection &connection) {
+    Hello hello, expected = MakeHello(jobId);
+    int32_t accepted = ReceiveAll(connection.fd, &hello, sizeof(hello)) &&
+                       memcmp(&hello, &expected, sizeof(hello)) == 0;
+    if (!SendAll(connection.fd, &accepted, sizeof(accepted)) || !accepted) {
+        Warning("Rejected a worker that renders a different scene or was "
+                "built differently.");
+        close(connection.fd);
+        connection.fd = -1;
+        return;
+    }
+    connection.greeted = true;
+    LOG(INFO) << "Accepted worker connection";
+}
+
+bool Coordinator::ReceiveResult(
+    Connection &connection,
+    const std::function<std::unique_ptr<FilmTile>(const WorkItem &)> &newTile,
+    std::unique_ptr<FilmTile> *tile) {
+    ResultHeader header;
+    if (!ReceiveAll(connection.fd, &header, sizeof(header)) ||
+        header.item.tile != connection.item.tile ||
+        header.item.pass != connection.item.pass)
+        return false;
+    *tile = newTile(connection.item);
+    Bounds2i pixelBounds = (*tile)->GetPixelBounds();
+    if (pixelBounds.pMin.x != header.pixelBounds[0] ||
+        pixelBounds.pMin.y != header.pixelBounds[1] ||
+        pixelBounds.pMax.x != header.pixelBounds[2] ||
+        pixelBounds.pMax.y != header.pixelBounds[3])
+        return false;
+
+    std::vector<Float> values((Spectrum::nSamples + 1) * pixelBounds.Area());
+    if (!ReceiveAll(connection.fd, values.data(),
+                    values.size() * sizeof(Float)))
+        return false;
+    const Float *v = values.data();
+    for (Point2i p : pixelBounds) {
+        FilmTilePixel &pixel = (*tile)->GetPixel(p);
+        for (int c = 0; c < Spectrum::nSamples; ++c) pixel.contribSum[c] = *v++;
+        pixel.filterWeightSum = *v++;
+    }
+    return true;
+}
+
+void Coordinator::Drop(Connection &connection, std::deque<WorkItem> *pending) {
+    if (connection.busy) {
+        Warning("Lost a worker connection while it rendered tile %d of pass "
+                "%d. Handing it out again.", connection.item.tile,
+                connection.item.pass);
+        pending->push_front(connection.item);
+        ++nItemsRequeued;
+    }
+    connection.waiting = connection.busy = false;
+    close(connection.fd);
+    connection.fd = -1;
+}
+
+bool Coordinator::Run(
+    const std::vector<WorkItem> &items,
+    const std::function<std::unique_ptr<FilmTile>(const WorkItem &)> &render,
+    const std::function<std::unique_ptr<FilmTile>(const WorkItem &)> &newTile,
+    const std::function<void(const WorkItem &, std::unique_ptr<FilmTile>)>
+        &merge) {
+    if (!Listening()) return false;
+    std::deque<WorkItem> pending(items.begin(), items.end());
+    size_t nMerged = 0;
+    auto lastWorker = std::chrono::steady_clock::now();
+    bool warnedLocal = false;
+    while (nMerged < items.size()) {
+        // Hand out pending items to the connections waiting for work
+        for (Connection &connection : connections) {
+            if (pending.empty()) break;
+            if (connection.fd < 0 || !connection.waiting) continue;
+            connection.item = pending.front();
+            pending.pop_front();
+            connection.waiting = false;
+            connection.busy = true;
+            if (!SendAll(connection.fd, &connection.item, sizeof(WorkItem)))
+                Drop(connection, &pending);
+        }
+        connections.erase(
+            std::remove_if(connections.begin(), connections.end(),
+                           [](const Connection &c) { return c.fd < 0; }),
+            connections.end());
+
+        // Render the pending items here once there have been no workers for
+        // _workerWaitSeconds_, e.g. because none connected or all of them
+        // died; workers that connect later still get the remaining items
+        auto now = std::chrono::steady_clock::now();
+        if (std::any_of(connections.begin(), connections.end(),
+                        [](const Connection &c) { return c.greeted; }))
+            lastWorker = now;
+        bool renderLocally =
+            !pending.empty() &&
+            std::chrono::duration<Float>(now - lastWorker).count() >=
+                workerWaitSeconds;
+
+        // Wait for new workers, work requests and results
+        std::vector<pollfd> fds(1 + connections.size());
+        fds[0].fd = listenFd;
+        for (size_t i = 0; i < connections.size(); ++i)
+            fds[1 + i].fd = connections[i].fd;
+        for (pollfd &fd : fds) fd.events = POLLIN;
+        if (poll(fds.data(), fds.size(),
+                 renderLocally ? 0 : pollMilliseconds) < 0) {
+            if (errno == EINTR) continue;
+            Error("Coordinator: poll() failed: %s", strerror(errno));
+            return false;
+        }
+
+        for (size_t i = 0; i < connections.size(); ++i) {
+            if (!fds[1 + i].revents) continue;
+            Connection &connection = connections[i];
+            if (!connection.greeted) {
+                Greet(connection);
+                continue;
+            }
+            Message message;
+            bool ok = ReceiveAll(connection.fd, &message, sizeof(message));
+            if (ok && message == Message::RequestWork && !connection.busy)
+                connection.waiting = true;
+            else if (ok && message == Message::Result && connection.busy) {
+                std::unique_ptr<FilmTile> tile;
+                ok = ReceiveResult(connection, newTile, &tile);
+                if (ok) {
+                    connection.busy = false;
+                    merge(connection.item, std::move(tile));
+                    ++nMerged;
+                    ++nItemsMerged;
+                }
+            } else
+                ok = false;
+            if (!ok) Drop(connection, &pending);
+        }
+        if (fds[0].revents) Accept();
+
+        if (renderLocally) {
+            if (!warnedLocal)
+                Warning("No workers connected for %.1f seconds. Rendering "
+                        "the remaining tiles locally.",
+                        workerWaitSeconds);
+            warnedLocal = true;
+            // Render as many items as there are threads, then check for
+            // workers again
+            std::vector<WorkItem> localItems;
+            while (!pending.empty() &&
+                   (int)localItems.size() < MaxThreadIndex()) {
+                localItems.push_back(pending.front());
+                pending.pop_front();
+            }
+            std::vector<std::unique_ptr<FilmTile>> tiles(localItems.size());
+            ParallelFor([&](int64_t i) {
+                tiles[i] = render(localItems[i]);
+            }, localItems.size());
+            for (size_t i = 0; i < localItems.size(); ++i) {
+                merge(localItems[i], std::move(tiles[i]));
+                ++nMerged;
+                ++nItemsRenderedLocally;
+            }
+        }
+    }
+    return true;
+}
+
+// Connects to the coordinator and presents the job, retrying while the
+// coordinator isn't listening yet if _retry_ is set
+static int JoinCoordinator(const std::string &address, uint64_t jobId,
+                           bool retry) {
+    auto start = std::chrono::steady_clock::now();
+    for (;;) {
+        int fd = OpenSocket(address, false);
+        if (fd >= 0) {
+            Hello hello = MakeHello(jobId);
+            int32_t accepted = 0;
+            if (SendAll(fd, &hello, sizeof(hello)) &&
+                ReceiveAll(fd, &accepted, sizeof(accepted)) && accepted)
+                return fd;
+            close(fd);
+            Error("%s: the coordinator rejected this worker. Check that both "
+                  "render the same scene with the same pbrt build.",
+                  address.c_str());
+            return -1;
+        }
+        if (!retry || std::chrono::steady_clock::now() - start >
+                          std::chrono::seconds(connectSeconds))
+            return -1;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+}
+
+// Renders items over one connection until the coordinator releases it
+static void WorkerLoop(
+    int fd,
+    const std::function<std::unique_ptr<FilmTile>(const WorkItem &)> &render) {
+    std::vector<Float> values;
+    for (;;) {
+        Message request = Message::RequestWork;
+        WorkItem item;
+        if (!SendAll(fd, &request, sizeof(request)) ||
+            !ReceiveAll(fd, &item, sizeof(item)) || item.tile == doneTile)
+            break;
+        LOG(INFO) << "Rendering tile " << item.tile << " of pass " <<
+            item.pass;
+        std::unique_ptr<FilmTile> tile = render(item);
+        ++nItemsRendered;
+
+        // Send the tile's pixels back
+        Message result = Message::Result;
+        Bounds2i pixelBounds = tile->GetPixelBounds();
+        ResultHeader header;
+        header.item = item;
+        header.pixelBounds[0] = pixelBounds.pMin.x;
+        header.pixelBounds[1] = pixelBounds.pMin.y;
+        header.pixelBounds[2] = pixelBounds.pMax.x;
+        header.pixelBounds[3] = pixelBounds.pMax.y;
+        values.clear();
+        for (Point2i p : pixelBounds) {
+            const FilmTilePixel &pixel = tile->GetPixel(p);
+            for (int c = 0; c < Spectrum::nSamples; ++c)
+                values.push_back(pixel.contribSum[c]);
+            values.push_back(pixel.filterWeightSum);
+        }
+        if (!SendAll(fd, &result, sizeof(result)) ||
+            !SendAll(fd, &header, sizeof(header)) ||
+            !SendAll(fd, values.data(), values.size() * sizeof(Float)))
+            break;
+    }
+    close(fd);
+}
+
+bool RunWorker(
+    const std::string &address, uint64_t jobId,
+    const std::function<std::unique_ptr<FilmTile>(const WorkItem &)> &render) {
+    // Wait for the coordinator with the first connection only, so that
+    // connections opened after the render ended give up at once
+    int fd = JoinCoordinator(address, jobId, true);
+    if (fd < 0) {
+        Error("%s: unable to join the coordinator", address.c_str());
+        return false;
+    }
+    LOG(INFO) << "Joined the coordinator at " << address;
+
+    // Run one connection per thread; plain threads are used rather than
+    // _ParallelFor()_, which doesn't guarantee that all the loops run
+    // concurrently. Each takes a distinct _ThreadIndex_, as integrators
+    // keep per-thread scratch storage indexed by it.
+    std::vector<std::thread> threads;
+    for (int i = 1; i < MaxThreadIndex(); ++i)
+        threads.push_back(std::thread([&, i]() {
+            ThreadIndex = i;
+            int threadFd = JoinCoordinator(address, jobId, false);
+            if (threadFd >= 0) WorkerLoop(threadFd, render);
+            ReportThreadStats();
+        }));
+    WorkerLoop(fd, render);
+    for (std::thread &thread : threads) thread.join();
+    return true;
+}
+
+#else
+
+Coordinator::Coordinator(const std::string &address, uint64_t jobId,
+                         Float workerWaitSeconds)
+    : address(address), jobId(jobId), workerWaitSeconds(workerWaitSeconds) {
+    Error("Distributed rendering is not supported on Windows.");
+}
+
+Coordinator::~Coordinator() {}
+
+bool Coordinator::Run(
+    const std::vector<WorkItem> &items,
+    const std::function<std::unique_ptr<FilmTile>(const WorkItem &)> &render,
+    const std::function<std::unique_ptr<FilmTile>(const WorkItem &)> &newTile,
+    const std::function<void(const WorkItem &, std::unique_ptr<FilmTile>)>
+        &merge) {
+    return false;
+}
+
+bool RunWorker(
+    const std::string &address, uint64_t jobId,
+    const std::function<std::unique_ptr<FilmTile>(const WorkItem &)> &render) {
+    Error("Distributed rendering is not supported on Windows.");
+    return false;
+}
+
+#endif  // !PBRT_IS_WINDOWS
+
+}  // namespace pbrt
@@ -0,0 +1,126 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_CORE_DISTRIBUTED_H
+#define PBRT_CORE_DISTRIBUTED_H
+
+// core/distributed.h*
+#include "pbrt.h"
+#include <deque>
+#include <functional>
+
+namespace pbrt {
+
+// Distributed rendering: a coordinator process hands out _WorkItem_s to
+// worker processes that render the same scene, and merges the _FilmTile_s
+// they stream back. Processes talk over stream sockets, addressed either by
+// a Unix socket path (any address containing a '/') or by "host:port" for
+// TCP. Each worker thread has its own connection, so that a connection is
+// always either waiting for work or rendering one item, and a worker that
+// disconnects only loses the item it was rendering, which is handed out
+// again.
+// A work item asks for the samples [startSample, endSample) of the pixels
+// of an image tile; _pass_ identifies the pass of progressive renders.
+struct WorkItem {
+    int32_t tile;
+    int32_t pass;
+    int64_t startSample, endSample;
+};
+
+class Coordinator {
+  public:
+    // Coordinator Public Methods
+    // Listens at _address_; _jobId_ identifies the render, and workers that
+    // present a different one (e.g. another scene or resolution) are
+    // rejected. When no worker has been connected for _workerWaitSeconds_,
+    // the coordinator renders the remaining items itself.
+    Coordinator(const std::string &address, uint64_t jobId,
+                Float workerWaitSeconds = 10);
+    ~Coordinator();
+    bool Listening() const { return listenFd >= 0; }
+
+    // Hands out _items_ until all of them have been merged. _newTile_
+    // returns the empty _FilmTile_ that receives an item's pixels, which
+    // _merge_ then accumulates. _render_ renders an item locally, for when
+    // there are no workers. Workers that ask for work after the last item
+    // was handed out wait for the next call, or are released by the
+    // destructor.
+    bool Run(const std::vector<WorkItem> &items,
+             const std::function<std::unique_ptr<FilmTile>(const WorkItem &)>
+                 &render,
+             const std::function<std::unique_ptr<FilmTile>(const WorkItem &)>
+                 &newTile,
+             const std::function<void(const WorkItem &,
+                                      std::unique_ptr<FilmTile>)> &merge);
+
+  private:
+    // Coordinator Private Declarations
+    struct Connection {
+        int fd;
+        // Set once the worker's hello was received and accepted
+        bool greeted = false;
+        bool waiting = false;
+        bool busy = false;
+        WorkItem item;
+    };
+    void Accept();
+    void Greet(Connection &connection);
+    bool ReceiveResult(Connection &connection,
+                       const std::function<std::unique_ptr<FilmTile>(
+                           const WorkItem &)> &newTile,
+                       std::unique_ptr<FilmTile> *tile);
+    void Drop(Connection &connection, std::deque<WorkItem> *pending);
+
+    // Coordinator Private Data
+    const std::string address;
+    const uint64_t jobId;
+    const Float workerWaitSeconds;
+    int listenFd = -1;
+    std::vector<Connection> connections;
+};
+
+// Renders the items handed out by the coordinator at _address_ with
+// _MaxThreadIndex()_ concurrent connections, calling _render_ for each one,
+// until the coordinator releases them. Returns false if it couldn't connect
+// or was rejected.
+bool RunWorker(
+    const std::string &address, uint64_t jobId,
+    const std::function<std::unique_ptr<FilmTile>(const WorkItem &)> &render);
+
+}  // namespace pbrt
+
+#endif  // PBRT_CORE_DISTRIBUTED_H
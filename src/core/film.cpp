@@ -36,10 +36,15 @@
 #include "paramset.h"
 #include "imageio.h"
 #include "stats.h"
+#include <chrono>
+#include <inttypes.h>
 
 namespace pbrt {
 
 STAT_MEMORY_COUNTER("Memory/Film pixels", filmPixelMemory);
+STAT_PERCENT("Film/Contended tile merge locks", nContendedMergeLocks,
+             nMergeLocks);
+STAT_COUNTER("Film/Tile merge lock wait time (us)", mergeLockWaitMicros);
 
 // Film Method Definitions
 Film::Film(const Point2i &resolution, const Bounds2f &cropWindow,
@@ -65,6 +70,9 @@ Film::Film(const Point2i &resolution, const Bounds2i &croppedPixelBounds,
     // Allocate film image storage
     pixels = std::unique_ptr<Pixel[]>(new Pixel[croppedPixelBounds.Area()]);
     filmPixelMemory += croppedPixelBounds.Area() * sizeof(Pixel);
+    int nStripes = (croppedPixelBounds.pMax.y - croppedPixelBounds.pMin.y +
+                    mergeStripeHeight - 1) / mergeStripeHeight;
+    stripeMutexes.reset(new std::mutex[std::max(nStripes, 1)]);
 
     // Precompute filter weight table
     int offset = 0;
@@ -125,15 +133,47 @@ void Film::Clear() {
 void Film::MergeFilmTile(std::unique_ptr<FilmTile> tile) {
     ProfilePhase p(Prof::MergeFilmTile);
     VLOG(1) << "Merging film tile " << tile->pixelBounds;
-    std::lock_guard<std::mutex> lock(mutex);
-    for (Point2i pixel : tile->GetPixelBounds()) {
-        // Merge _pixel_ into _Film::pixels_
-        const FilmTilePixel &tilePixel = tile->GetPixel(pixel);
-        Pixel &mergePixel = GetPixel(pixel);
-        Float xyz[3];
-        tilePixel.contribSum.ToXYZ(xyz);
-        for (int i = 0; i < 3; ++i) mergePixel.xyz[i] += xyz[i];
-        mergePixel.filterWeightSum += tilePixel.filterWeightSum;
+    const Bounds2i &tileBounds = tile->GetPixelBounds();
+    if (tileBounds.pMax.x <= tileBounds.pMin.x ||
+        tileBounds.pMax.y <= tileBounds.pMin.y)
+        return;
+
+    // Merge the tile one stripe of rows at a time, holding only that
+    // stripe's lock; stripes are visited in increasing order, so two
+    // tiles can't deadlock waiting on each other.
+    int y0 = tileBounds.pMin.y;
+    while (y0 < tileBounds.pMax.y) {
+        int stripe = (y0 - croppedPixelBounds.pMin.y) / mergeStripeHeight;
+        int y1 = std::min(tileBounds.pMax.y,
+                          croppedPixelBounds.pMin.y +
+                              (stripe + 1) * mergeStripeHeight);
+        std::unique_lock<std::mutex> lock(stripeMutexes[stripe],
+                                          std::try_to_lock);
+        ++nMergeLocks;
+        if (!lock.owns_lock()) {
+            // Another tile is merging into this stripe; account for the
+            // time spent waiting for it
+            ++nContendedMergeLocks;
+            auto start = std::chrono::steady_clock::now();
+            lock.lock();
+            mergeLockWaitMicros +=
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+        }
+        for (int y = y0; y < y1; ++y) {
+            for (int x = tileBounds.pMin.x; x < tileBounds.pMax.x; ++x) {
+                // Merge _pixel_ into _Film::pixels_
+                Point2i pixel(x, y);
+                const FilmTilePixel &tilePixel = tile->GetPixel(pixel);
+                Pixel &mergePixel = GetPixel(pixel);
+                Float xyz[3];
+                tilePixel.contribSum.ToXYZ(xyz);
+                for (int i = 0; i < 3; ++i) mergePixel.xyz[i] += xyz[i];
+                mergePixel.filterWeightSum += tilePixel.filterWeightSum;
+            }
+        }
+        y0 = y1;
     }
 }
 
@@ -173,43 +213,56 @@ void Film::AddSplat(const Point2f &p, Spectrum v) {
     for (int i = 0; i < 3; ++i) pixel.splatXYZ[i].Add(xyz[i]);
 }
 
+// Converts a pixel's accumulators to its final RGB value
+static void AccumulatorsToRGB(const Float xyz[3], Float filterWeightSum,
+                              const Float splatXYZ[3], Float splatScale,
+                              Float scale, Float rgb[3]) {
+    // Convert pixel XYZ color to RGB
+    XYZToRGB(xyz, rgb);
+
+    // Normalize pixel with weight sum
+    if (filterWeightSum != 0) {
+        Float invWt = (Float)1 / filterWeightSum;
+        rgb[0] = std::max((Float)0, rgb[0] * invWt);
+        rgb[1] = std::max((Float)0, rgb[1] * invWt);
+        rgb[2] = std::max((Float)0, rgb[2] * invWt);
+    }
+
+    // Add splat value at pixel
+    Float splatRGB[3];
+    XYZToRGB(splatXYZ, splatRGB);
+    rgb[0] += splatScale * splatRGB[0];
+    rgb[1] += splatScale * splatRGB[1];
+    rgb[2] += splatScale * splatRGB[2];
+
+    // Scale pixel value by _scale_
+    rgb[0] *= scale;
+    rgb[1] *= scale;
+    rgb[2] *= scale;
+}
+
 void Film::WriteImage(Float splatScale) {
     // Convert image to RGB and compute final pixel values
     LOG(INFO) <<
         "Converting image to RGB and computing final weighted pixel values";
     std::unique_ptr<Float[]> rgb(new Float[3 * croppedPixelBounds.Area()]);
     int offset = 0;
+    std::unique_lock<std::mutex> stripeLock;
     for (Point2i p : croppedPixelBounds) {
-        // Convert pixel XYZ color to RGB
-        Pixel &pixel = GetPixel(p);
-        XYZToRGB(pixel.xyz, &rgb[3 * offset]);
-
-        // Normalize pixel with weight sum
-        Float filterWeightSum = pixel.filterWeightSum;
-        if (filterWeightSum != 0) {
-            Float invWt = (Float)1 / filterWeightSum;
-            rgb[3 * offset] = std::max((Float)0, rgb[3 * offset] * invWt);
-            rgb[3 * offset + 1] =
-                std::max((Float)0, rgb[3 * offset + 1] * invWt);
-            rgb[3 * offset + 2] =
-                std::max((Float)0, rgb[3 * offset + 2] * invWt);
-        }
+        // Hold the lock of the stripe being read, so that the image can be
+        // written while other threads are still merging tiles into it
+        int stripe = (p.y - croppedPixelBounds.pMin.y) / mergeStripeHeight;
+        if (stripeLock.mutex() != &stripeMutexes[stripe])
+            stripeLock = std::unique_lock<std::mutex>(stripeMutexes[stripe]);
 
-        // Add splat value at pixel
-        Float splatRGB[3];
+        Pixel &pixel = GetPixel(p);
         Float splatXYZ[3] = {pixel.splatXYZ[0], pixel.splatXYZ[1],
                              pixel.splatXYZ[2]};
-        XYZToRGB(splatXYZ, splatRGB);
-        rgb[3 * offset] += splatScale * splatRGB[0];
-        rgb[3 * offset + 1] += splatScale * splatRGB[1];
-        rgb[3 * offset + 2] += splatScale * splatRGB[2];
-
-        // Scale pixel value by _scale_
-        rgb[3 * offset] *= scale;
-        rgb[3 * offset + 1] *= scale;
-        rgb[3 * offset + 2] *= scale;
+        AccumulatorsToRGB(pixel.xyz, pixel.filterWeightSum, splatXYZ,
+                          splatScale, scale, &rgb[3 * offset]);
         ++offset;
     }
+    if (stripeLock.owns_lock()) stripeLock.unlock();
 
     // Write RGB image
     LOG(INFO) << "Writing image " << filename << " with bounds " <<
@@ -217,6 +270,170 @@ void Film::WriteImage(Float splatScale) {
     pbrt::WriteImage(filename, &rgb[0], croppedPixelBounds, fullResolution);
 }
 
+// Raw film files start with a small header that identifies the film they
+// were written for, followed by the _Pixel_ accumulators in scanline order.
+static const char rawFilmMagic[8] = {'P', 'B', 'R', 'T', 'C', 'K', 'P', '4'};
+
+struct RawFilmHeader {
+    char magic[8];
+    int32_t floatSize;
+    int32_t resolution[2];
+    int32_t bounds[4];
+    int32_t pad;
+    int64_t firstSample, endSample;
+    double scale;
+    uint64_t jobId;
+    int64_t samplesPerPixel;
+    char sampler[32];
+};
+
+bool WriteRawFilm(const std::string &filename, const RawFilm &film) {
+    CHECK_EQ(film.values.size(),
+             (size_t)rawFilmValues * film.pixelBounds.Area());
+    RawFilmHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, rawFilmMagic, sizeof(rawFilmMagic));
+    header.floatSize = sizeof(Float);
+    header.resolution[0] = film.fullResolution.x;
+    header.resolution[1] = film.fullResolution.y;
+    header.bounds[0] = film.pixelBounds.pMin.x;
+    header.bounds[1] = film.pixelBounds.pMin.y;
+    header.bounds[2] = film.pixelBounds.pMax.x;
+    header.bounds[3] = film.pixelBounds.pMax.y;
+    header.firstSample = film.firstSample;
+    header.endSample = film.endSample;
+    header.scale = film.scale;
+    header.jobId = film.jobId;
+    header.samplesPerPixel = film.samplesPerPixel;
+    strncpy(header.sampler, film.sampler.c_str(), sizeof(header.sampler) - 1);
+
+    // Write to a temporary file and then rename it, so that a job that is
+    // killed while writing still leaves the previous file intact.
+    std::string tmpFilename = filename + ".tmp";
+    FILE *f = fopen(tmpFilename.c_str(), "wb");
+    if (!f) {
+        Error("%s: unable to open file for writing", filename.c_str());
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+              fwrite(film.values.data(), sizeof(Float), film.values.size(),
+                     f) == film.values.size();
+    if (fclose(f) != 0) ok = false;
+    if (!ok || rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+        Error("%s: error writing raw film file", filename.c_str());
+        remove(tmpFilename.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool ReadRawFilm(const std::string &filename, RawFilm *film) {
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) return false;
+    RawFilmHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        memcmp(header.magic, rawFilmMagic, sizeof(rawFilmMagic)) != 0 ||
+        header.floatSize != sizeof(Float)) {
+        Warning("%s: not a valid raw film or checkpoint file. Ignoring it.",
+                filename.c_str());
+        fclose(f);
+        return false;
+    }
+    film->fullResolution = Point2i(header.resolution[0], header.resolution[1]);
+    film->pixelBounds =
+        Bounds2i(Point2i(header.bounds[0], header.bounds[1]),
+                 Point2i(header.bounds[2], header.bounds[3]));
+    film->firstSample = header.firstSample;
+    film->endSample = header.endSample;
+    film->scale = header.scale;
+    film->jobId = header.jobId;
+    film->samplesPerPixel = header.samplesPerPixel;
+    header.sampler[sizeof(header.sampler) - 1] = '\0';
+    film->sampler = header.sampler;
+    film->values.resize((size_t)rawFilmValues * film->pixelBounds.Area());
+    bool ok = fread(film->values.data(), sizeof(Float), film->values.size(),
+                    f) == film->values.size();
+    fclose(f);
+    if (!ok)
+        Warning("%s: premature end of raw film file. Ignoring it.",
+                filename.c_str());
+    return ok;
+}
+
+void RawFilmToRGB(const RawFilm &film, Float splatScale, Float *rgb) {
+    const Float *v = film.values.data();
+    for (int i = 0; i < film.pixelBounds.Area(); ++i, v += rawFilmValues)
+        AccumulatorsToRGB(&v[0], v[3], &v[4], splatScale, film.scale,
+                          &rgb[3 * i]);
+}
+
+bool Film::WriteCheckpoint(const std::string &filename, uint64_t jobId,
+                           int64_t samplesPerPixel, const std::string &sampler,
+                           int64_t samplesCompleted, int64_t firstSample) {
+    RawFilm raw;
+    raw.fullResolution = fullResolution;
+    raw.pixelBounds = croppedPixelBounds;
+    raw.firstSample = firstSample;
+    raw.endSample = samplesCompleted;
+    raw.scale = scale;
+    raw.jobId = jobId;
+    raw.samplesPerPixel = samplesPerPixel;
+    raw.sampler = sampler;
+    raw.values.reserve((size_t)rawFilmValues * croppedPixelBounds.Area());
+    for (Point2i p : croppedPixelBounds) {
+        const Pixel &pixel = GetPixel(p);
+        Float values[rawFilmValues] = {
+            pixel.xyz[0],       pixel.xyz[1],       pixel.xyz[2],
+            pixel.filterWeightSum, pixel.splatXYZ[0], pixel.splatXYZ[1],
+            pixel.splatXYZ[2]};
+        raw.values.insert(raw.values.end(), values, values + rawFilmValues);
+    }
+    if (!WriteRawFilm(filename, raw)) return false;
+    LOG(INFO) << "Wrote checkpoint " << filename << " with samples [" <<
+        firstSample << ", " << samplesCompleted << ")";
+    return true;
+}
+
+bool Film::ReadCheckpoint(const std::string &filename, uint64_t jobId,
+                          int64_t samplesPerPixel, const std::string &sampler,
+                          int64_t *samplesCompleted, int64_t *firstSample) {
+    RawFilm raw;
+    if (!ReadRawFilm(filename, &raw)) return false;
+    if (raw.fullResolution != fullResolution ||
+        raw.pixelBounds != croppedPixelBounds) {
+        Warning("%s: checkpoint was written for a different film "
+                "resolution or crop window. Ignoring it.", filename.c_str());
+        return false;
+    }
+    if (raw.samplesPerPixel != samplesPerPixel || raw.sampler != sampler) {
+        // Its samples come from a different sample sequence
+        Warning("%s: checkpoint was written by a render with %" PRId64
+                " samples per pixel and the \"%s\" sampler, not %" PRId64
+                " and \"%s\". Ignoring it.", filename.c_str(),
+                raw.samplesPerPixel, raw.sampler.c_str(), samplesPerPixel,
+                sampler.c_str());
+        return false;
+    }
+    if (raw.jobId != jobId) {
+        Warning("%s: checkpoint was written by a render of a different "
+                "scene or with a different integrator. Ignoring it.",
+                filename.c_str());
+        return false;
+    }
+
+    const Float *v = raw.values.data();
+    for (Point2i p : croppedPixelBounds) {
+        Pixel &pixel = GetPixel(p);
+        for (int i = 0; i < 3; ++i) pixel.xyz[i] = v[i];
+        pixel.filterWeightSum = v[3];
+        for (int i = 0; i < 3; ++i) pixel.splatXYZ[i] = v[4 + i];
+        v += rawFilmValues;
+    }
+    *samplesCompleted = raw.endSample;
+    if (firstSample) *firstSample = raw.firstSample;
+    return true;
+}
+
 Film *CreateFilm(const ParamSet &params, std::unique_ptr<Filter> filter) {
     std::string filename;
     if (PbrtOptions.imageFile != "") {
@@ -54,6 +54,30 @@ struct FilmTilePixel {
     Float filterWeightSum = 0.f;
 };
 
+// RawFilm Declarations
+// The unnormalized accumulators of a film (XYZ sums, filter weight sums and
+// splat XYZ sums, _rawFilmValues_ Floats per pixel in scanline order), as
+// saved by checkpoints and by renders of a sample range (--spp-range), which
+// "imgtool merge" adds up.
+static PBRT_CONSTEXPR int rawFilmValues = 7;
+struct RawFilm {
+    Point2i fullResolution;
+    Bounds2i pixelBounds;
+    // The samples [firstSample, endSample) of each pixel that were rendered
+    int64_t firstSample = 0, endSample = 0;
+    // The fingerprint of the render (see _JobId()_), its samples per pixel
+    // and its sampler, which a resumed render must match
+    uint64_t jobId = 0;
+    int64_t samplesPerPixel = 0;
+    std::string sampler;
+    Float scale = 1;
+    std::vector<Float> values;
+};
+bool WriteRawFilm(const std::string &filename, const RawFilm &film);
+bool ReadRawFilm(const std::string &filename, RawFilm *film);
+// Computes the final RGB values of _film_'s pixels, like _Film::WriteImage()_
+void RawFilmToRGB(const RawFilm &film, Float splatScale, Float *rgb);
+
 // Film Declarations
 class Film {
   public:
@@ -78,6 +102,20 @@ class Film {
     void WriteImage(Float splatScale = 1);
     void Clear();
 
+    // Saves the raw, unnormalized pixel accumulators together with the
+    // range of samples per pixel that have been taken so far, so that an
+    // interrupted render can be resumed with ReadCheckpoint(), or partial
+    // renders merged. The render's fingerprint, samples per pixel and
+    // sampler name are recorded too; ReadCheckpoint() ignores checkpoints of
+    // renders that used different ones.
+    bool WriteCheckpoint(const std::string &filename, uint64_t jobId,
+                         int64_t samplesPerPixel, const std::string &sampler,
+                         int64_t samplesCompleted, int64_t firstSample = 0);
+    bool ReadCheckpoint(const std::string &filename, uint64_t jobId,
+                        int64_t samplesPerPixel, const std::string &sampler,
+                        int64_t *samplesCompleted,
+                        int64_t *firstSample = nullptr);
+
     // Film Public Data
     const Point2i fullResolution;
     const Float diagonal;
@@ -97,7 +135,11 @@ class Film {
     std::unique_ptr<Pixel[]> pixels;
     static PBRT_CONSTEXPR int filterTableWidth = 16;
     Float filterTable[filterTableWidth * filterTableWidth];
-    std::mutex mutex;
+    // Tiles are merged under per-stripe locks covering _mergeStripeHeight_
+    // consecutive rows each, so that tiles in different parts of the image
+    // can be merged concurrently.
+    static PBRT_CONSTEXPR int mergeStripeHeight = 4;
+    std::unique_ptr<std::mutex[]> stripeMutexes;
     const Float scale;
     const Float maxSampleLuminance;
 
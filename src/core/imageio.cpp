@@ -37,6 +37,10 @@
 #include "fileutil.h"
 #include "spectrum.h"
 
+#include <ImfChannelList.h>
+#include <ImfFrameBuffer.h>
+#include <ImfInputFile.h>
+#include <ImfOutputFile.h>
 #include <ImfRgba.h>
 #include <ImfRgbaFile.h>
 
@@ -188,6 +192,84 @@ static void WriteImageEXR(const std::string &name, const Float *pixels,
     delete[] hrgba;
 }
 
+bool WriteImageEXRChannels(const std::string &name,
+                           const std::vector<std::string> &channelNames,
+                           const std::vector<const float *> &channels,
+                           const Bounds2i &outputBounds,
+                           const Point2i &totalResolution) {
+    using namespace Imf;
+    using namespace Imath;
+    CHECK_EQ(channelNames.size(), channels.size());
+    Vector2i resolution = outputBounds.Diagonal();
+    int xOffset = outputBounds.pMin.x, yOffset = outputBounds.pMin.y;
+
+    // OpenEXR uses inclusive pixel bounds.
+    Box2i displayWindow(V2i(0, 0), V2i(totalResolution.x - 1,
+                                       totalResolution.y - 1));
+    Box2i dataWindow(V2i(xOffset, yOffset),
+                     V2i(xOffset + resolution.x - 1,
+                         yOffset + resolution.y - 1));
+
+    try {
+        Header header(displayWindow, dataWindow);
+        FrameBuffer frameBuffer;
+        for (size_t i = 0; i < channels.size(); ++i) {
+            header.channels().insert(channelNames[i], Channel(FLOAT));
+            const float *base =
+                channels[i] - xOffset - yOffset * resolution.x;
+            frameBuffer.insert(channelNames[i],
+                               Slice(FLOAT, (char *)base, sizeof(float),
+                                     sizeof(float) * resolution.x));
+        }
+        OutputFile file(name.c_str(), header);
+        file.setFrameBuffer(frameBuffer);
+        file.writePixels(resolution.y);
+    } catch (const std::exception &exc) {
+        Error("Error writing \"%s\": %s", name.c_str(), exc.what());
+        return false;
+    }
+    return true;
+}
+
+bool ReadImageEXRChannels(const std::string &name,
+                          const std::vector<std::string> &channelNames,
+                          std::vector<std::vector<float>> *channels,
+                          Bounds2i *dataWindow) {
+    using namespace Imf;
+    using namespace Imath;
+    try {
+        InputFile file(name.c_str());
+        Box2i dw = file.header().dataWindow();
+        int width = dw.max.x - dw.min.x + 1;
+        int height = dw.max.y - dw.min.y + 1;
+
+        // OpenEXR uses inclusive pixel bounds; adjust to non-inclusive
+        *dataWindow = {{dw.min.x, dw.min.y}, {dw.max.x + 1, dw.max.y + 1}};
+
+        channels->clear();
+        channels->resize(channelNames.size());
+        FrameBuffer frameBuffer;
+        for (size_t i = 0; i < channelNames.size(); ++i) {
+            if (!file.header().channels().findChannel(channelNames[i]))
+                continue;
+            std::vector<float> &values = (*channels)[i];
+            values.resize(size_t(width) * height);
+            float *base = &values[0] - dw.min.x - dw.min.y * width;
+            frameBuffer.insert(channelNames[i],
+                               Slice(FLOAT, (char *)base, sizeof(float),
+                                     sizeof(float) * width));
+        }
+        file.setFrameBuffer(frameBuffer);
+        file.readPixels(dw.min.y, dw.max.y);
+        LOG(INFO) << StringPrintf("Read EXR channels from %s (%d x %d)",
+                                  name.c_str(), width, height);
+        return true;
+    } catch (const std::exception &e) {
+        Error("Unable to read image file \"%s\": %s", name.c_str(), e.what());
+    }
+    return false;
+}
+
 // TGA Function Definitions
 void WriteImageTGA(const std::string &name, const uint8_t *pixels, int xRes,
                    int yRes, int totalXRes, int totalYRes, int xOffset,
@@ -55,6 +55,22 @@ RGBSpectrum *ReadImageEXR(const std::string &name, int *width,
 void WriteImage(const std::string &name, const Float *rgb,
                 const Bounds2i &outputBounds, const Point2i &totalResolution);
 
+// Writes a float OpenEXR image with arbitrary channels; channels named like
+// "layer.R" are grouped into layers by EXR readers. _channels[i]_ points to
+// the scanline-ordered values of _channelNames[i]_ over _outputBounds_.
+bool WriteImageEXRChannels(const std::string &name,
+                           const std::vector<std::string> &channelNames,
+                           const std::vector<const float *> &channels,
+                           const Bounds2i &outputBounds,
+                           const Point2i &totalResolution);
+
+// Reads float channels of an OpenEXR image by name, in scanline order over
+// the image data window. Channels the file doesn't have are left empty.
+bool ReadImageEXRChannels(const std::string &name,
+                          const std::vector<std::string> &channelNames,
+                          std::vector<std::vector<float>> *channels,
+                          Bounds2i *dataWindow);
+
 }  // namespace pbrt
 
 #endif  // PBRT_CORE_IMAGEIO_H
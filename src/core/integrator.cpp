@@ -41,7 +41,10 @@
 #include "integrator.h"
 #include "progressreporter.h"
 #include "camera.h"
+#include "distributed.h"
 #include "stats.h"
+#include <chrono>
+#include <typeinfo>
 
 namespace pbrt {
 
@@ -50,11 +53,37 @@ STAT_COUNTER("Integrator/Camera rays traced", nCameraRays);
 // Integrator Method Definitions
 Integrator::~Integrator() {}
 
+CameraSampleEstimator::~CameraSampleEstimator() {}
+
+// DeferredShadowRays Method Definitions
+void DeferredShadowRays::Add(const VisibilityTester &vis, const Spectrum &L) {
+    batch.Add(vis.P0().SpawnRayTo(vis.P1()));
+    contributions.push_back(L);
+}
+
+void DeferredShadowRays::Scale(int first, const Spectrum &scale) {
+    for (size_t i = first; i < contributions.size(); ++i)
+        contributions[i] *= scale;
+}
+
+void DeferredShadowRays::Trace(const Scene &scene) {
+    if (batch.Size() > 0) scene.IntersectP(batch);
+}
+
+Spectrum DeferredShadowRays::Resolve(const Scene &scene) {
+    Spectrum L(0.f);
+    Trace(scene);
+    for (int i = 0; i < batch.Size(); ++i) L += Contribution(i);
+    Clear();
+    return L;
+}
+
 // Integrator Utility Functions
 Spectrum UniformSampleAllLights(const Interaction &it, const Scene &scene,
                                 MemoryArena &arena, Sampler &sampler,
                                 const std::vector<int> &nLightSamples,
-                                bool handleMedia) {
+                                bool handleMedia,
+                                DeferredShadowRays *deferred) {
     ProfilePhase p(Prof::DirectLighting);
     Spectrum L(0.f);
     for (size_t j = 0; j < scene.lights.size(); ++j) {
@@ -68,15 +97,17 @@ Spectrum UniformSampleAllLights(const Interaction &it, const Scene &scene,
             Point2f uLight = sampler.Get2D();
             Point2f uScattering = sampler.Get2D();
             L += EstimateDirect(it, uScattering, *light, uLight, scene, sampler,
-                                arena, handleMedia);
+                                arena, handleMedia, false, deferred);
         } else {
             // Estimate direct lighting using sample arrays
             Spectrum Ld(0.f);
+            int firstDeferred = deferred ? deferred->Size() : 0;
             for (int k = 0; k < nSamples; ++k)
                 Ld += EstimateDirect(it, uScatteringArray[k], *light,
                                      uLightArray[k], scene, sampler, arena,
-                                     handleMedia);
+                                     handleMedia, false, deferred);
             L += Ld / nSamples;
+            if (deferred) deferred->Scale(firstDeferred, Spectrum(Float(1) / nSamples));
         }
     }
     return L;
@@ -84,7 +115,8 @@ Spectrum UniformSampleAllLights(const Interaction &it, const Scene &scene,
 
 Spectrum UniformSampleOneLight(const Interaction &it, const Scene &scene,
                                MemoryArena &arena, Sampler &sampler,
-                               bool handleMedia, const Distribution1D *lightDistrib) {
+                               bool handleMedia, const Distribution1D *lightDistrib,
+                               DeferredShadowRays *deferred) {
     ProfilePhase p(Prof::DirectLighting);
     // Randomly choose a single light to sample, _light_
     int nLights = int(scene.lights.size());
@@ -101,14 +133,18 @@ Spectrum UniformSampleOneLight(const Interaction &it, const Scene &scene,
     const std::shared_ptr<Light> &light = scene.lights[lightNum];
     Point2f uLight = sampler.Get2D();
     Point2f uScattering = sampler.Get2D();
-    return EstimateDirect(it, uScattering, *light, uLight,
-                          scene, sampler, arena, handleMedia) / lightPdf;
+    int firstDeferred = deferred ? deferred->Size() : 0;
+    Spectrum Ld = EstimateDirect(it, uScattering, *light, uLight, scene,
+                                 sampler, arena, handleMedia, false, deferred);
+    if (deferred) deferred->Scale(firstDeferred, Spectrum(1 / lightPdf));
+    return Ld / lightPdf;
 }
 
 Spectrum EstimateDirect(const Interaction &it, const Point2f &uScattering,
                         const Light &light, const Point2f &uLight,
                         const Scene &scene, Sampler &sampler,
-                        MemoryArena &arena, bool handleMedia, bool specular) {
+                        MemoryArena &arena, bool handleMedia, bool specular,
+                        DeferredShadowRays *deferred) {
     BxDFType bsdfFlags =
         specular ? BSDF_ALL : BxDFType(BSDF_ALL & ~BSDF_SPECULAR);
     Spectrum Ld(0.f);
@@ -138,11 +174,13 @@ Spectrum EstimateDirect(const Interaction &it, const Point2f &uScattering,
             VLOG(2) << "  medium p: " << p;
         }
         if (!f.IsBlack()) {
-            // Compute effect of visibility for light source sample
+            // Compute effect of visibility for light source sample, unless
+            // the caller traces the shadow ray later
+            bool deferVisibility = deferred && !handleMedia;
             if (handleMedia) {
                 Li *= visibility.Tr(scene, sampler);
                 VLOG(2) << "  after Tr, Li: " << Li;
-            } else {
+            } else if (!deferVisibility) {
               if (!visibility.Unoccluded(scene)) {
                 VLOG(2) << "  shadow ray blocked";
                 Li = Spectrum(0.f);
@@ -152,13 +190,18 @@ Spectrum EstimateDirect(const Interaction &it, const Point2f &uScattering,
 
             // Add light's contribution to reflected radiance
             if (!Li.IsBlack()) {
+                Spectrum contribution;
                 if (IsDeltaLight(light.flags))
-                    Ld += f * Li / lightPdf;
+                    contribution = f * Li / lightPdf;
                 else {
                     Float weight =
                         PowerHeuristic(1, lightPdf, 1, scatteringPdf);
-                    Ld += f * Li * weight / lightPdf;
+                    contribution = f * Li * weight / lightPdf;
                 }
+                if (deferVisibility)
+                    deferred->Add(visibility, contribution);
+                else
+                    Ld += contribution;
             }
         }
     }
@@ -224,6 +267,49 @@ std::unique_ptr<Distribution1D> ComputeLightPowerDistribution(
         new Distribution1D(&lightPower[0], lightPower.size()));
 }
 
+uint64_t JobId(const Scene &scene, const Film &film, const Sampler &sampler,
+               const char *integratorName) {
+    // FNV-1a hash of the values' bytes
+    uint64_t hash = 14695981039346656037ull;
+    auto mixBytes = [&hash](const void *data, size_t size) {
+        const uint8_t *bytes = (const uint8_t *)data;
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ull;
+        }
+    };
+    auto mix = [&mixBytes](int64_t value) {
+        uint8_t bytes[8];
+        for (int i = 0; i < 8; ++i) bytes[i] = (value >> (8 * i)) & 0xff;
+        mixBytes(bytes, sizeof(bytes));
+    };
+    const int64_t values[] = {film.fullResolution.x,
+                              film.fullResolution.y,
+                              film.croppedPixelBounds.pMin.x,
+                              film.croppedPixelBounds.pMin.y,
+                              film.croppedPixelBounds.pMax.x,
+                              film.croppedPixelBounds.pMax.y,
+                              sampler.samplesPerPixel};
+    for (int64_t value : values) mix(value);
+    mixBytes(sampler.name.c_str(), sampler.name.size() + 1);
+    mixBytes(integratorName, strlen(integratorName) + 1);
+
+    const Bounds3f &bounds = scene.WorldBound();
+    for (int i = 0; i < 2; ++i)
+        for (int j = 0; j < 3; ++j) mix(FloatToBits(bounds[i][j]));
+    mix(scene.lights.size());
+    for (const auto &light : scene.lights) {
+        const char *lightName = typeid(*light).name();
+        mixBytes(lightName, strlen(lightName) + 1);
+        mix(light->flags);
+        mix(light->nSamples);
+        Spectrum power = light->Power();
+        for (int c = 0; c < Spectrum::nSamples; ++c)
+            mix(FloatToBits(power[c]));
+    }
+    return hash;
+}
+
 // SamplerIntegrator Method Definitions
 void SamplerIntegrator::Render(const Scene &scene) {
     Preprocess(scene, *sampler);
@@ -235,107 +321,355 @@ void SamplerIntegrator::Render(const Scene &scene) {
     const int tileSize = 16;
     Point2i nTiles((sampleExtent.x + tileSize - 1) / tileSize,
                    (sampleExtent.y + tileSize - 1) / tileSize);
-    ProgressReporter reporter(nTiles.x * nTiles.y, "Rendering");
-    {
-        ParallelFor2D([&](Point2i tile) {
-            // Render section of image corresponding to _tile_
-
-            // Allocate _MemoryArena_ for tile
-            MemoryArena arena;
-
-            // Get sampler instance for tile
-            int seed = tile.y * nTiles.x + tile.x;
-            std::unique_ptr<Sampler> tileSampler = sampler->Clone(seed);
-
-            // Compute sample bounds for tile
-            int x0 = sampleBounds.pMin.x + tile.x * tileSize;
-            int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
-            int y0 = sampleBounds.pMin.y + tile.y * tileSize;
-            int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
-            Bounds2i tileBounds(Point2i(x0, y0), Point2i(x1, y1));
-            LOG(INFO) << "Starting image tile " << tileBounds;
-
-            // Get _FilmTile_ for tile
-            std::unique_ptr<FilmTile> filmTile =
-                camera->film->GetFilmTile(tileBounds);
-
-            // Loop over pixels in tile to render them
-            for (Point2i pixel : tileBounds) {
-                {
-                    ProfilePhase pp(Prof::StartPixel);
-                    tileSampler->StartPixel(pixel);
-                }
 
-                // Do this check after the StartPixel() call; this keeps
-                // the usage of RNG values from (most) Samplers that use
-                // RNGs consistent, which improves reproducability /
-                // debugging.
-                if (!InsideExclusive(pixel, pixelBounds))
-                    continue;
-
-                do {
-                    // Initialize _CameraSample_ for current sample
-                    CameraSample cameraSample =
-                        tileSampler->GetCameraSample(pixel);
-
-                    // Generate camera ray for current sample
-                    RayDifferential ray;
-                    Float rayWeight =
-                        camera->GenerateRayDifferential(cameraSample, &ray);
-                    ray.ScaleDifferentials(
-                        1 / std::sqrt((Float)tileSampler->samplesPerPixel));
-                    ++nCameraRays;
-
-                    // Evaluate radiance along camera ray
-                    Spectrum L(0.f);
-                    if (rayWeight > 0) L = Li(ray, scene, *tileSampler, arena);
-
-                    // Issue warning if unexpected radiance value returned
-                    if (L.HasNaNs()) {
-                        LOG(ERROR) << StringPrintf(
-                            "Not-a-number radiance value returned "
-                            "for pixel (%d, %d), sample %d. Setting to black.",
-                            pixel.x, pixel.y,
-                            (int)tileSampler->CurrentSampleNumber());
-                        L = Spectrum(0.f);
-                    } else if (L.y() < -1e-5) {
-                        LOG(ERROR) << StringPrintf(
-                            "Negative luminance value, %f, returned "
-                            "for pixel (%d, %d), sample %d. Setting to black.",
-                            L.y(), pixel.x, pixel.y,
-                            (int)tileSampler->CurrentSampleNumber());
-                        L = Spectrum(0.f);
-                    } else if (std::isinf(L.y())) {
-                          LOG(ERROR) << StringPrintf(
-                            "Infinite luminance value returned "
-                            "for pixel (%d, %d), sample %d. Setting to black.",
-                            pixel.x, pixel.y,
-                            (int)tileSampler->CurrentSampleNumber());
-                        L = Spectrum(0.f);
-                    }
-                    VLOG(1) << "Camera sample: " << cameraSample << " -> ray: " <<
-                        ray << " -> L = " << L;
-
-                    // Add camera ray's contribution to image
-                    filmTile->AddSample(cameraSample.pFilm, L, rayWeight);
-
-                    // Free _MemoryArena_ memory from computing image sample
-                    // value
-                    arena.Reset();
-                } while (tileSampler->StartNextSample());
-            }
-            LOG(INFO) << "Finished image tile " << tileBounds;
+    // Split the pixel samples into passes for progressive rendering
+    int64_t spp = sampler->samplesPerPixel;
+    int64_t passSpp = PbrtOptions.passSamples > 0
+                          ? std::min<int64_t>(PbrtOptions.passSamples, spp)
+                          : spp;
+
+    // With --spp-range, only the samples [firstSample, endSample) are
+    // rendered. The passes keep the boundaries of a complete render, so
+    // that tiles are seeded the same and the partial renders add up to it.
+    int64_t firstSample = std::min<int64_t>(PbrtOptions.sppRangeStart, spp);
+    int64_t endSample =
+        PbrtOptions.sppRangeEnd > 0
+            ? std::max(firstSample,
+                       std::min<int64_t>(PbrtOptions.sppRangeEnd, spp))
+            : spp;
+    int nPasses = (endSample + passSpp - 1) / passSpp;
+    if (nPasses > 1 && dynamic_cast<const PixelSampler *>(sampler.get()))
+        Warning("The \"%s\" sampler's samples are only stratified within "
+                "each pass of a progressive render. Use the \"halton\" or "
+                "\"sobol\" sampler to keep them stratified across passes.",
+                sampler->name.c_str());
+
+    // Each tile of each pass is rendered with its own seed, so that samplers
+    // that consume random numbers as they go don't repeat the previous
+    // pass's values. Samplers that index their samples by sample number
+    // (e.g. "halton" and "sobol") therefore stay stratified across passes,
+    // but those that generate each pixel's samples together from their RNG
+    // (_PixelSampler_s) are only stratified within each pass.
+    auto tileBounds = [&](int tileIndex) {
+        Point2i tile(tileIndex % nTiles.x, tileIndex / nTiles.x);
+        int x0 = sampleBounds.pMin.x + tile.x * tileSize;
+        int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
+        int y0 = sampleBounds.pMin.y + tile.y * tileSize;
+        int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
+        return Bounds2i(Point2i(x0, y0), Point2i(x1, y1));
+    };
+    auto renderItem = [&](const WorkItem &item) {
+        int seed = item.pass * nTiles.x * nTiles.y + item.tile;
+        return RenderTile(scene, tileBounds(item.tile), seed, item.startSample,
+                          item.endSample);
+    };
+
+    // A distributed worker renders the tiles that the coordinator hands
+    // out; the coordinator writes the image
+    uint64_t jobId =
+        JobId(scene, *camera->film, *sampler, typeid(*this).name());
+    if (!PbrtOptions.workerAddress.empty()) {
+        RunWorker(PbrtOptions.workerAddress, jobId, renderItem);
+        return;
+    }
+    std::unique_ptr<Coordinator> coordinator;
+    if (!PbrtOptions.coordinatorAddress.empty()) {
+        coordinator.reset(
+            new Coordinator(PbrtOptions.coordinatorAddress, jobId));
+        if (!coordinator->Listening()) return;
+        if (!PbrtOptions.quiet)
+            printf("Waiting for workers at \"%s\"\n",
+                   PbrtOptions.coordinatorAddress.c_str());
+    }
 
-            // Merge image tile into _Film_
-            camera->film->MergeFilmTile(std::move(filmTile));
-            reporter.Update();
-        }, nTiles);
-        reporter.Done();
+    // Resume from a previous checkpoint, if there is one
+    int64_t samplesCompleted = firstSample;
+    int64_t checkpointFirstSample, checkpointEndSample;
+    const std::string &checkpointFile = PbrtOptions.checkpointFile;
+    if (!checkpointFile.empty() &&
+        camera->film->ReadCheckpoint(checkpointFile, jobId,
+                                     sampler->samplesPerPixel, sampler->name,
+                                     &checkpointEndSample,
+                                     &checkpointFirstSample)) {
+        if (checkpointFirstSample != firstSample) {
+            Warning("%s: checkpoint starts at sample %" PRId64 " instead of "
+                    "%" PRId64 ". Ignoring it.", checkpointFile.c_str(),
+                    checkpointFirstSample, firstSample);
+            camera->film->Clear();
+        } else {
+            samplesCompleted =
+                Clamp(checkpointEndSample, firstSample, endSample);
+            if (!PbrtOptions.quiet)
+                printf("Resuming from checkpoint \"%s\" at %" PRId64
+                       " samples per pixel\n", checkpointFile.c_str(),
+                       samplesCompleted);
+        }
+    }
+    int firstPass = samplesCompleted / passSpp;
+
+    ProgressReporter reporter(nTiles.x * nTiles.y * (nPasses - firstPass),
+                              "Rendering");
+    auto lastFlush = std::chrono::steady_clock::now();
+    for (int pass = firstPass; pass < nPasses; ++pass) {
+        int64_t passStart = std::max(pass * passSpp, samplesCompleted);
+        int64_t passEnd = std::min(endSample, (pass + 1) * passSpp);
+        if (passStart >= passEnd) continue;
+        if (coordinator) {
+            // Hand out the pass's tiles to the workers
+            std::vector<WorkItem> items;
+            for (int tile = 0; tile < nTiles.x * nTiles.y; ++tile)
+                items.push_back({tile, pass, passStart, passEnd});
+            if (!coordinator->Run(
+                    items, renderItem,
+                    [&](const WorkItem &item) {
+                        return camera->film->GetFilmTile(tileBounds(item.tile));
+                    },
+                    [&](const WorkItem &item, std::unique_ptr<FilmTile> tile) {
+                        camera->film->MergeFilmTile(std::move(tile));
+                        reporter.Update();
+                    }))
+                return;
+        } else {
+            ParallelFor2D([&](Point2i tile) {
+                // Render section of image corresponding to _tile_
+                WorkItem item = {tile.y * nTiles.x + tile.x, pass, passStart,
+                                 passEnd};
+                camera->film->MergeFilmTile(renderItem(item));
+                reporter.Update();
+            }, nTiles);
+        }
+        samplesCompleted = passEnd;
+
+        // Periodically write the partial image and checkpoint
+        auto now = std::chrono::steady_clock::now();
+        if (pass + 1 < nPasses &&
+            std::chrono::duration<Float>(now - lastFlush).count() >=
+                PbrtOptions.flushSeconds) {
+            LOG(INFO) << "Flushing image after " << samplesCompleted <<
+                " samples per pixel";
+            camera->film->WriteImage();
+            if (!checkpointFile.empty())
+                camera->film->WriteCheckpoint(
+                    checkpointFile, jobId, sampler->samplesPerPixel,
+                    sampler->name, samplesCompleted, firstSample);
+            lastFlush = now;
+        }
     }
+    reporter.Done();
     LOG(INFO) << "Rendering finished";
 
     // Save final image after rendering
     camera->film->WriteImage();
+
+    // Save the raw pixel sums of a sample range, to be merged with the other
+    // ranges
+    if (PbrtOptions.sppRangeEnd > 0) {
+        const std::string &filename = camera->film->filename;
+        std::string rawFilename =
+            filename.substr(0, filename.find_last_of('.')) + ".film";
+        if (camera->film->WriteCheckpoint(rawFilename, jobId,
+                                          sampler->samplesPerPixel,
+                                          sampler->name, endSample,
+                                          firstSample) &&
+            !PbrtOptions.quiet)
+            printf("Wrote samples [%" PRId64 ", %" PRId64 ") to \"%s\"\n",
+                   firstSample, endSample, rawFilename.c_str());
+    }
+
+    // The checkpoint is only useful for unfinished renders
+    if (!checkpointFile.empty()) remove(checkpointFile.c_str());
+}
+
+std::unique_ptr<FilmTile> SamplerIntegrator::RenderTile(
+    const Scene &scene, const Bounds2i &tileBounds, int seed,
+    int64_t startSample, int64_t endSample) const {
+    // Allocate _MemoryArena_ for tile
+    MemoryArena arena;
+
+    // Get sampler instance for tile
+    std::unique_ptr<Sampler> tileSampler = sampler->Clone(seed);
+    LOG(INFO) << "Starting image tile " << tileBounds;
+
+    // Get _FilmTile_ for tile
+    std::unique_ptr<FilmTile> filmTile =
+        camera->film->GetFilmTile(tileBounds);
+
+    // Checks a camera sample's radiance and adds it to _filmTile_
+    auto addSample = [&](const Point2i &pixel,
+                         const CameraSample &cameraSample,
+                         const RayDifferential &ray, Spectrum L,
+                         Float rayWeight) {
+        // Issue warning if unexpected radiance value returned
+        if (L.HasNaNs()) {
+            LOG(ERROR) << StringPrintf(
+                "Not-a-number radiance value returned "
+                "for pixel (%d, %d), sample %d. Setting to black.",
+                pixel.x, pixel.y,
+                (int)tileSampler->CurrentSampleNumber());
+            L = Spectrum(0.f);
+        } else if (L.y() < -1e-5) {
+            LOG(ERROR) << StringPrintf(
+                "Negative luminance value, %f, returned "
+                "for pixel (%d, %d), sample %d. Setting to black.",
+                L.y(), pixel.x, pixel.y,
+                (int)tileSampler->CurrentSampleNumber());
+            L = Spectrum(0.f);
+        } else if (std::isinf(L.y())) {
+              LOG(ERROR) << StringPrintf(
+                "Infinite luminance value returned "
+                "for pixel (%d, %d), sample %d. Setting to black.",
+                pixel.x, pixel.y,
+                (int)tileSampler->CurrentSampleNumber());
+            L = Spectrum(0.f);
+        }
+        VLOG(1) << "Camera sample: " << cameraSample << " -> ray: " <<
+            ray << " -> L = " << L;
+
+        // Add camera ray's contribution to image
+        filmTile->AddSample(cameraSample.pFilm, L, rayWeight);
+
+        // Free _MemoryArena_ memory from computing image sample
+        // value
+        arena.Reset();
+    };
+
+    // Camera rays of the current pixel, for integrators that
+    // intersect them as a batch
+    std::vector<CameraSample> cameraSamples;
+    std::vector<RayDifferential> cameraRays;
+    std::vector<Float> rayWeights;
+    RayBatch cameraBatch;
+
+    // Loop over pixels in tile to render them
+    for (Point2i pixel : tileBounds) {
+        {
+            ProfilePhase pp(Prof::StartPixel);
+            tileSampler->StartPixel(pixel);
+            if (startSample > 0) tileSampler->SetSampleNumber(startSample);
+        }
+
+        // Do this check after the StartPixel() call; this keeps
+        // the usage of RNG values from (most) Samplers that use
+        // RNGs consistent, which improves reproducability /
+        // debugging.
+        if (!InsideExclusive(pixel, pixelBounds))
+            continue;
+
+        if (BatchCameraRays()) {
+            // Generate the pixel's camera rays for this pass and
+            // find their closest intersections together
+            int64_t firstSample = tileSampler->CurrentSampleNumber();
+            cameraSamples.clear();
+            cameraRays.clear();
+            rayWeights.clear();
+            cameraBatch.Clear();
+            do {
+                CameraSample cameraSample =
+                    tileSampler->GetCameraSample(pixel);
+                RayDifferential ray;
+                Float rayWeight =
+                    camera->GenerateRayDifferential(cameraSample, &ray);
+                ray.ScaleDifferentials(
+                    1 / std::sqrt((Float)tileSampler->samplesPerPixel));
+                ++nCameraRays;
+                cameraSamples.push_back(cameraSample);
+                cameraRays.push_back(ray);
+                rayWeights.push_back(rayWeight);
+                cameraBatch.Add(ray);
+            } while (tileSampler->StartNextSample() &&
+                     tileSampler->CurrentSampleNumber() < endSample);
+            scene.Intersect(cameraBatch);
+
+            for (size_t k = 0; k < cameraRays.size(); ++k) {
+                // Return to the sample and skip past its camera
+                // sample dimensions before shading the hit
+                tileSampler->SetSampleNumber(firstSample + k);
+                tileSampler->GetCameraSample(pixel);
+                cameraRays[k].tMax = cameraBatch.rays[k].tMax;
+                Spectrum L(0.f);
+                if (rayWeights[k] > 0)
+                    L = LiFromHit(cameraRays[k],
+                                  cameraBatch.hit[k]
+                                      ? &cameraBatch.isects[k]
+                                      : nullptr,
+                                  scene, *tileSampler, arena);
+                addSample(pixel, cameraSamples[k], cameraRays[k], L,
+                          rayWeights[k]);
+            }
+            continue;
+        }
+
+        do {
+            // Initialize _CameraSample_ for current sample
+            CameraSample cameraSample =
+                tileSampler->GetCameraSample(pixel);
+
+            // Generate camera ray for current sample
+            RayDifferential ray;
+            Float rayWeight =
+                camera->GenerateRayDifferential(cameraSample, &ray);
+            ray.ScaleDifferentials(
+                1 / std::sqrt((Float)tileSampler->samplesPerPixel));
+            ++nCameraRays;
+
+            // Evaluate radiance along camera ray
+            Spectrum L(0.f);
+            if (rayWeight > 0) L = Li(ray, scene, *tileSampler, arena);
+            addSample(pixel, cameraSample, ray, L, rayWeight);
+        } while (tileSampler->StartNextSample() &&
+                 tileSampler->CurrentSampleNumber() < endSample);
+    }
+    LOG(INFO) << "Finished image tile " << tileBounds;
+    return filmTile;
+}
+
+void SamplerIntegrator::PrepareSamples(const Scene &scene, Sampler &sampler) {
+    Preprocess(scene, sampler);
+}
+
+Spectrum SamplerIntegrator::EstimateSample(const Point2i &pixel,
+                                           const Scene &scene,
+                                           Sampler &sampler,
+                                           FilmTile *filmTile,
+                                           MemoryArena &arena) const {
+    // Initialize _CameraSample_ for current sample
+    CameraSample cameraSample = sampler.GetCameraSample(pixel);
+
+    // Generate camera ray for current sample
+    RayDifferential ray;
+    Float rayWeight = camera->GenerateRayDifferential(cameraSample, &ray);
+    ray.ScaleDifferentials(1 / std::sqrt((Float)sampler.samplesPerPixel));
+    ++nCameraRays;
+
+    // Evaluate radiance along camera ray
+    Spectrum L(0.f);
+    if (rayWeight > 0) L = Li(ray, scene, sampler, arena);
+
+    // Issue warning if unexpected radiance value returned
+    if (L.HasNaNs() || L.y() < -1e-5 || std::isinf(L.y())) {
+        LOG(ERROR) << StringPrintf(
+            "Invalid radiance value, luminance %f, returned for pixel "
+            "(%d, %d), sample %d. Setting to black.", L.y(), pixel.x,
+            pixel.y, (int)sampler.CurrentSampleNumber());
+        L = Spectrum(0.f);
+    }
+
+    // Add camera ray's contribution to image
+    filmTile->AddSample(cameraSample.pFilm, L, rayWeight);
+
+    // Free _MemoryArena_ memory from computing image sample value
+    arena.Reset();
+    sampler.StartNextSample();
+    return L;
+}
+
+Spectrum SamplerIntegrator::LiFromHit(const RayDifferential &ray,
+                                     SurfaceInteraction *isect,
+                                     const Scene &scene, Sampler &sampler,
+                                     MemoryArena &arena) const {
+    // Integrators that batch camera rays are expected to override this;
+    // fall back to tracing the ray again.
+    return Li(ray, scene, sampler, arena);
 }
 
 Spectrum SamplerIntegrator::SpecularReflect(
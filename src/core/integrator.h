@@ -57,24 +57,78 @@ class Integrator {
     virtual void Render(const Scene &scene) = 0;
 };
 
+// Integrators that estimate the image one camera sample at a time can
+// implement _CameraSampleEstimator_, so that render loops other than their
+// own (e.g. the adaptive one in integrators/adaptive.h) can drive them.
+class CameraSampleEstimator {
+  public:
+    virtual ~CameraSampleEstimator();
+    // Called once, before any sample is estimated.
+    virtual void PrepareSamples(const Scene &scene, Sampler &sampler) = 0;
+    // Estimates the current sample of _sampler_ at _pixel_, adds it to
+    // _filmTile_ (light splats, if any, go to the film directly), then
+    // starts the next sample and resets _arena_. Returns the radiance
+    // estimate of the sample, excluding splats.
+    virtual Spectrum EstimateSample(const Point2i &pixel, const Scene &scene,
+                                    Sampler &sampler, FilmTile *filmTile,
+                                    MemoryArena &arena) const = 0;
+    // The pixels the integrator renders.
+    virtual Bounds2i SampledPixels() const = 0;
+};
+
+// Light sample contributions whose shadow rays are traced together by
+// _Resolve()_, which returns the sum of the unoccluded contributions.
+// Alternatively, _Trace()_ traces them and leaves the individual
+// contributions available through _Contribution()_ until _Clear()_.
+class DeferredShadowRays {
+  public:
+    void Add(const VisibilityTester &vis, const Spectrum &L);
+    int Size() const { return batch.Size(); }
+    // Scales the contributions added since the _first_th one
+    void Scale(int first, const Spectrum &scale);
+    Spectrum Resolve(const Scene &scene);
+    void Trace(const Scene &scene);
+    Spectrum Contribution(int i) const {
+        return batch.hit[i] ? Spectrum(0.f) : contributions[i];
+    }
+    void Clear() {
+        batch.Clear();
+        contributions.clear();
+    }
+
+  private:
+    RayBatch batch;
+    std::vector<Spectrum> contributions;
+};
+
 Spectrum UniformSampleAllLights(const Interaction &it, const Scene &scene,
                                 MemoryArena &arena, Sampler &sampler,
                                 const std::vector<int> &nLightSamples,
-                                bool handleMedia = false);
+                                bool handleMedia = false,
+                                DeferredShadowRays *deferred = nullptr);
 Spectrum UniformSampleOneLight(const Interaction &it, const Scene &scene,
                                MemoryArena &arena, Sampler &sampler,
                                bool handleMedia = false,
-                               const Distribution1D *lightDistrib = nullptr);
+                               const Distribution1D *lightDistrib = nullptr,
+                               DeferredShadowRays *deferred = nullptr);
 Spectrum EstimateDirect(const Interaction &it, const Point2f &uShading,
                         const Light &light, const Point2f &uLight,
                         const Scene &scene, Sampler &sampler,
                         MemoryArena &arena, bool handleMedia = false,
-                        bool specular = false);
+                        bool specular = false,
+                        DeferredShadowRays *deferred = nullptr);
 std::unique_ptr<Distribution1D> ComputeLightPowerDistribution(
     const Scene &scene);
+// Fingerprint of a render, which distributed workers and resumed
+// checkpoints must match: the same scene rendered into the same image with
+// the same integrator and sampler. The scene is only fingerprinted by its
+// bounds and its lights' number, types and power, so e.g. a light moved
+// within the scene goes unnoticed.
+uint64_t JobId(const Scene &scene, const Film &film, const Sampler &sampler,
+               const char *integratorName);
 
 // SamplerIntegrator Declarations
-class SamplerIntegrator : public Integrator {
+class SamplerIntegrator : public Integrator, public CameraSampleEstimator {
   public:
     // SamplerIntegrator Public Methods
     SamplerIntegrator(std::shared_ptr<const Camera> camera,
@@ -86,6 +140,14 @@ class SamplerIntegrator : public Integrator {
     virtual Spectrum Li(const RayDifferential &ray, const Scene &scene,
                         Sampler &sampler, MemoryArena &arena,
                         int depth = 0) const = 0;
+    // Integrators that return true from _BatchCameraRays()_ implement
+    // _LiFromHit()_, which is given the closest intersection of the camera
+    // ray, or _nullptr_ if it escaped. _Render()_ then intersects all the
+    // camera rays of a pixel in one batch.
+    virtual bool BatchCameraRays() const { return false; }
+    virtual Spectrum LiFromHit(const RayDifferential &ray,
+                               SurfaceInteraction *isect, const Scene &scene,
+                               Sampler &sampler, MemoryArena &arena) const;
     Spectrum SpecularReflect(const RayDifferential &ray,
                              const SurfaceInteraction &isect,
                              const Scene &scene, Sampler &sampler,
@@ -94,12 +156,25 @@ class SamplerIntegrator : public Integrator {
                               const SurfaceInteraction &isect,
                               const Scene &scene, Sampler &sampler,
                               MemoryArena &arena, int depth) const;
+    void PrepareSamples(const Scene &scene, Sampler &sampler) override;
+    Spectrum EstimateSample(const Point2i &pixel, const Scene &scene,
+                            Sampler &sampler, FilmTile *filmTile,
+                            MemoryArena &arena) const override;
+    Bounds2i SampledPixels() const override { return pixelBounds; }
 
   protected:
     // SamplerIntegrator Protected Data
     std::shared_ptr<const Camera> camera;
 
   private:
+    // SamplerIntegrator Private Methods
+    // Renders the samples [startSample, endSample) of the pixels of
+    // _tileBounds_ with a sampler cloned with _seed_
+    std::unique_ptr<FilmTile> RenderTile(const Scene &scene,
+                                         const Bounds2i &tileBounds, int seed,
+                                         int64_t startSample,
+                                         int64_t endSample) const;
+
     // SamplerIntegrator Private Data
     std::shared_ptr<Sampler> sampler;
     const Bounds2i pixelBounds;
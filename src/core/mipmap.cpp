@@ -0,0 +1,113 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+// core/mipmap.cpp*
+#include "mipmap.h"
+#if (defined(__SSE2__) || defined(_M_X64)) && !defined(PBRT_FLOAT_AS_DOUBLE)
+#include <immintrin.h>
+#define PBRT_MIPMAP_HAVE_SSE
+#endif
+
+namespace pbrt {
+
+// EWA Filter Definitions
+static Float *ComputeEWAWeightLut() {
+    static Float lut[EWAWeightLUTSize];
+    for (int i = 0; i < EWAWeightLUTSize; ++i) {
+        Float alpha = 2;
+        Float r2 = Float(i) / Float(EWAWeightLUTSize - 1);
+        lut[i] = std::exp(-alpha * r2) - std::exp(-alpha);
+    }
+    return lut;
+}
+
+const Float *EWAWeightLut() {
+    // Thread-safe initialization; MIP maps may be created in parallel
+    static const Float *lut = ComputeEWAWeightLut();
+    return lut;
+}
+
+uint32_t EWARowWeights(Float A, Float B, Float C, int s0, Float sCenter,
+                       Float tt, int n, Float *weights) {
+    DCHECK_LE(n, EWAMaxRowTexels);
+    const Float *lut = EWAWeightLut();
+    // The $t$ term of the quadratic is shared by the whole row
+    Float ctt = C * tt * tt;
+    uint32_t inside = 0;
+#ifdef PBRT_MIPMAP_HAVE_SSE
+    // Evaluate four texels at a time, with the same operation order as
+    // the scalar loop below so that both give identical weights; lanes
+    // past the end of the row are masked off
+    const __m128 a = _mm_set1_ps(A), b = _mm_set1_ps(B);
+    const __m128 ttv = _mm_set1_ps(tt), cttv = _mm_set1_ps(ctt);
+    const __m128 sc = _mm_set1_ps(sCenter), one = _mm_set1_ps(1.f);
+    const __m128 lutScale = _mm_set1_ps(EWAWeightLUTSize);
+    const __m128i maxIndex = _mm_set1_epi32(EWAWeightLUTSize - 1);
+    const __m128i four = _mm_set1_epi32(4);
+    __m128i is = _mm_setr_epi32(s0, s0 + 1, s0 + 2, s0 + 3);
+    for (int i = 0; i < n; i += 4, is = _mm_add_epi32(is, four)) {
+        __m128 ss = _mm_sub_ps(_mm_cvtepi32_ps(is), sc);
+        __m128 r2 = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(_mm_mul_ps(a, ss), ss),
+                       _mm_mul_ps(_mm_mul_ps(b, ss), ttv)),
+            cttv);
+        int mask = _mm_movemask_ps(_mm_cmplt_ps(r2, one));
+        if (n - i < 4) mask &= (1 << (n - i)) - 1;
+        if (mask == 0) continue;
+        // _mm_min_epi32 needs SSE4.1; clamp the indices with a compare
+        __m128i index = _mm_cvttps_epi32(_mm_mul_ps(r2, lutScale));
+        __m128i over = _mm_cmpgt_epi32(index, maxIndex);
+        index = _mm_or_si128(_mm_and_si128(over, maxIndex),
+                             _mm_andnot_si128(over, index));
+        alignas(16) int32_t idx[4];
+        _mm_store_si128((__m128i *)idx, index);
+        for (int j = 0; j < 4; ++j)
+            if (mask & (1 << j)) weights[i + j] = lut[idx[j]];
+        inside |= uint32_t(mask) << i;
+    }
+#else
+    for (int i = 0; i < n; ++i) {
+        Float ss = (s0 + i) - sCenter;
+        // Compute squared radius and filter texel if inside ellipse
+        Float r2 = A * ss * ss + B * ss * tt + ctt;
+        if (r2 < 1) {
+            int index =
+                std::min((int)(r2 * EWAWeightLUTSize), EWAWeightLUTSize - 1);
+            weights[i] = lut[index];
+            inside |= uint32_t(1) << i;
+        }
+    }
+#endif  // PBRT_MIPMAP_HAVE_SSE
+    return inside;
+}
+
+}  // namespace pbrt
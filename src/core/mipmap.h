@@ -44,6 +44,7 @@
 #include "texture.h"
 #include "stats.h"
 #include "parallel.h"
+#include "texcache.h"
 
 namespace pbrt {
 
@@ -58,6 +59,44 @@ struct ResampleWeight {
     Float weight[4];
 };
 
+// EWA Filter Declarations
+static PBRT_CONSTEXPR int EWAWeightLUTSize = 128;
+static PBRT_CONSTEXPR int EWAMaxRowTexels = 32;
+const Float *EWAWeightLut();
+// Computes the EWA filter weights of the _n_ texels $s_0 \ldots s_0+n-1$
+// of the row at offset _tt_ from the filter center; returns a bit mask of
+// the texels inside the ellipse, whose weights are stored in _weights_
+uint32_t EWARowWeights(Float A, Float B, Float C, int s0, Float sCenter,
+                       Float tt, int n, Float *weights);
+
+// Conversions between MIPMap texels and the float channels that tiled MIP
+// map files store
+template <typename T>
+struct TexelChannels;
+template <>
+struct TexelChannels<Float> {
+    static PBRT_CONSTEXPR int n = 1;
+    static void ToFloats(Float v, float *c) { c[0] = v; }
+    static Float FromFloats(const float *c, int nChannels) {
+        if (nChannels == 1) return c[0];
+        RGBSpectrum rgb;
+        for (int i = 0; i < 3; ++i) rgb[i] = c[i];
+        return rgb.y();
+    }
+};
+template <>
+struct TexelChannels<RGBSpectrum> {
+    static PBRT_CONSTEXPR int n = 3;
+    static void ToFloats(const RGBSpectrum &v, float *c) {
+        for (int i = 0; i < 3; ++i) c[i] = v[i];
+    }
+    static RGBSpectrum FromFloats(const float *c, int nChannels) {
+        RGBSpectrum v;
+        for (int i = 0; i < 3; ++i) v[i] = c[nChannels == 1 ? 0 : i];
+        return v;
+    }
+};
+
 // MIPMap Declarations
 template <typename T>
 class MIPMap {
@@ -65,10 +104,17 @@ class MIPMap {
     // MIPMap Public Methods
     MIPMap(const Point2i &resolution, const T *data, bool doTri = false,
            Float maxAniso = 8.f, ImageWrap wrapMode = ImageWrap::Repeat);
+    // Creates a _MIPMap_ whose texels are read from a tiled MIP map file
+    // and multiplied by _scale_
+    MIPMap(std::unique_ptr<TiledMIPFile> tiles, bool doTri = false,
+           Float maxAniso = 8.f, ImageWrap wrapMode = ImageWrap::Repeat,
+           Float scale = 1.f);
     int Width() const { return resolution[0]; }
     int Height() const { return resolution[1]; }
-    int Levels() const { return pyramid.size(); }
-    const T &Texel(int level, int s, int t) const;
+    int Levels() const { return levelResolution.size(); }
+    T Texel(int level, int s, int t) const;
+    // Writes the pyramid to a tiled MIP map file
+    bool WriteTiled(const std::string &filename) const;
     T Lookup(const Point2f &st, Float width = 0.f) const;
     T Lookup(const Point2f &st, Vector2f dstdx, Vector2f dstdy) const;
 
@@ -99,6 +145,16 @@ class MIPMap {
     SampledSpectrum clamp(const SampledSpectrum &v) {
         return v.Clamp(0.f, Infinity);
     }
+    // Returns texel $(s,t)$, which must be inside the level
+    T LevelTexel(int level, int s, int t) const {
+        if (tiles) {
+            float texel[3];
+            tiles->Texel(level, s, t, texel);
+            return tileScale *
+                   TexelChannels<T>::FromFloats(texel, tiles->Channels());
+        }
+        return (*pyramid[level])(s, t);
+    }
     T triangle(int level, const Point2f &st) const;
     T EWA(int level, Point2f st, Vector2f dst0, Vector2f dst1) const;
 
@@ -107,9 +163,11 @@ class MIPMap {
     const Float maxAnisotropy;
     const ImageWrap wrapMode;
     Point2i resolution;
+    std::vector<Point2i> levelResolution;
+    // The levels of the pyramid are either in memory, or in _tiles_
     std::vector<std::unique_ptr<BlockedArray<T>>> pyramid;
-    static PBRT_CONSTEXPR int WeightLUTSize = 128;
-    static Float weightLut[WeightLUTSize];
+    std::unique_ptr<TiledMIPFile> tiles;
+    Float tileScale = 1;
 };
 
 // MIPMap Method Definitions
@@ -186,14 +244,19 @@ MIPMap<T>::MIPMap(const Point2i &res, const T *img, bool doTrilinear,
     pyramid.resize(nLevels);
 
     // Initialize most detailed level of MIPMap
-    pyramid[0].reset(
-        new BlockedArray<T>(resolution[0], resolution[1],
-                            resampledImage ? resampledImage.get() : img));
+    pyramid[0].reset(new BlockedArray<T>(resolution[0], resolution[1]));
+    levelResolution.push_back(resolution);
+    const T *level0 = resampledImage ? resampledImage.get() : img;
+    ParallelFor([&](int t) {
+        for (int s = 0; s < resolution[0]; ++s)
+            (*pyramid[0])(s, t) = level0[t * resolution[0] + s];
+    }, resolution[1], 16);
     for (int i = 1; i < nLevels; ++i) {
         // Initialize $i$th MIPMap level from $i-1$st level
         int sRes = std::max(1, pyramid[i - 1]->uSize() / 2);
         int tRes = std::max(1, pyramid[i - 1]->vSize() / 2);
         pyramid[i].reset(new BlockedArray<T>(sRes, tRes));
+        levelResolution.push_back(Point2i(sRes, tRes));
 
         // Filter four texels from finer level of pyramid
         ParallelFor([&](int t) {
@@ -206,39 +269,52 @@ MIPMap<T>::MIPMap(const Point2i &res, const T *img, bool doTrilinear,
         }, tRes, 16);
     }
 
-    // Initialize EWA filter weights if needed
-    if (weightLut[0] == 0.) {
-        for (int i = 0; i < WeightLUTSize; ++i) {
-            Float alpha = 2;
-            Float r2 = Float(i) / Float(WeightLUTSize - 1);
-            weightLut[i] = std::exp(-alpha * r2) - std::exp(-alpha);
-        }
-    }
     mipMapMemory += (4 * resolution[0] * resolution[1] * sizeof(T)) / 3;
 }
 
 template <typename T>
-const T &MIPMap<T>::Texel(int level, int s, int t) const {
-    CHECK_LT(level, pyramid.size());
-    const BlockedArray<T> &l = *pyramid[level];
+MIPMap<T>::MIPMap(std::unique_ptr<TiledMIPFile> tileFile, bool doTrilinear,
+                  Float maxAnisotropy, ImageWrap wrapMode, Float scale)
+    : doTrilinear(doTrilinear),
+      maxAnisotropy(maxAnisotropy),
+      wrapMode(wrapMode),
+      tiles(std::move(tileFile)),
+      tileScale(scale) {
+    CHECK(tiles->Channels() == 1 || tiles->Channels() == 3);
+    for (int i = 0; i < tiles->Levels(); ++i)
+        levelResolution.push_back(tiles->LevelResolution(i));
+    resolution = levelResolution[0];
+}
+
+template <typename T>
+T MIPMap<T>::Texel(int level, int s, int t) const {
+    CHECK_LT(level, Levels());
+    const Point2i &res = levelResolution[level];
     // Compute texel $(s,t)$ accounting for boundary conditions
     switch (wrapMode) {
     case ImageWrap::Repeat:
-        s = Mod(s, l.uSize());
-        t = Mod(t, l.vSize());
+        s = Mod(s, res.x);
+        t = Mod(t, res.y);
         break;
     case ImageWrap::Clamp:
-        s = Clamp(s, 0, l.uSize() - 1);
-        t = Clamp(t, 0, l.vSize() - 1);
+        s = Clamp(s, 0, res.x - 1);
+        t = Clamp(t, 0, res.y - 1);
         break;
     case ImageWrap::Black: {
-        static const T black = 0.f;
-        if (s < 0 || s >= (int)l.uSize() || t < 0 || t >= (int)l.vSize())
-            return black;
+        if (s < 0 || s >= res.x || t < 0 || t >= res.y) return T(0.f);
         break;
     }
     }
-    return l(s, t);
+    return LevelTexel(level, s, t);
+}
+
+template <typename T>
+bool MIPMap<T>::WriteTiled(const std::string &filename) const {
+    return WriteTiledMIPFile(
+        filename, TexelChannels<T>::n, levelResolution,
+        [&](int level, int s, int t, float *texel) {
+            TexelChannels<T>::ToFloats(Texel(level, s, t), texel);
+        });
 }
 
 template <typename T>
@@ -263,8 +339,8 @@ T MIPMap<T>::Lookup(const Point2f &st, Float width) const {
 template <typename T>
 T MIPMap<T>::triangle(int level, const Point2f &st) const {
     level = Clamp(level, 0, Levels() - 1);
-    Float s = st[0] * pyramid[level]->uSize() - 0.5f;
-    Float t = st[1] * pyramid[level]->vSize() - 0.5f;
+    Float s = st[0] * levelResolution[level].x - 0.5f;
+    Float t = st[1] * levelResolution[level].y - 0.5f;
     int s0 = std::floor(s), t0 = std::floor(t);
     Float ds = s - s0, dt = t - t0;
     return (1 - ds) * (1 - dt) * Texel(level, s0, t0) +
@@ -306,12 +382,13 @@ template <typename T>
 T MIPMap<T>::EWA(int level, Point2f st, Vector2f dst0, Vector2f dst1) const {
     if (level >= Levels()) return Texel(Levels() - 1, 0, 0);
     // Convert EWA coordinates to appropriate scale for level
-    st[0] = st[0] * pyramid[level]->uSize() - 0.5f;
-    st[1] = st[1] * pyramid[level]->vSize() - 0.5f;
-    dst0[0] *= pyramid[level]->uSize();
-    dst0[1] *= pyramid[level]->vSize();
-    dst1[0] *= pyramid[level]->uSize();
-    dst1[1] *= pyramid[level]->vSize();
+    const Point2i &res = levelResolution[level];
+    st[0] = st[0] * res.x - 0.5f;
+    st[1] = st[1] * res.y - 0.5f;
+    dst0[0] *= res.x;
+    dst0[1] *= res.y;
+    dst1[0] *= res.x;
+    dst1[1] *= res.y;
 
     // Compute ellipse coefficients to bound EWA filter region
     Float A = dst0[1] * dst0[1] + dst1[1] * dst1[1] + 1;
@@ -331,30 +408,68 @@ T MIPMap<T>::EWA(int level, Point2f st, Vector2f dst0, Vector2f dst1) const {
     int t0 = std::ceil(st[1] - 2 * invDet * vSqrt);
     int t1 = std::floor(st[1] + 2 * invDet * vSqrt);
 
-    // Scan over ellipse bound and compute quadratic equation
+    // Scan over ellipse bound a row at a time, wrapping each row once
     T sum(0.f);
     Float sumWts = 0;
+    Float weights[EWAMaxRowTexels];
+    Float inv2A = 1 / (2 * A), disc0 = B * B - 4 * A * C;
+    const BlockedArray<T> *levelData = tiles ? nullptr : pyramid[level].get();
     for (int it = t0; it <= t1; ++it) {
         Float tt = it - st[1];
-        for (int is = s0; is <= s1; ++is) {
-            Float ss = is - st[0];
-            // Compute squared radius and filter texel if inside ellipse
-            Float r2 = A * ss * ss + B * ss * tt + C * tt * tt;
-            if (r2 < 1) {
-                int index =
-                    std::min((int)(r2 * WeightLUTSize), WeightLUTSize - 1);
-                Float weight = weightLut[index];
-                sum += Texel(level, is, it) * weight;
-                sumWts += weight;
+        int t = it;
+        bool blackRow = false;
+        switch (wrapMode) {
+        case ImageWrap::Repeat:
+            t = Mod(t, res.y);
+            break;
+        case ImageWrap::Clamp:
+            t = Clamp(t, 0, res.y - 1);
+            break;
+        case ImageWrap::Black:
+            blackRow = t < 0 || t >= res.y;
+            break;
+        }
+        // Find the row's span inside the ellipse, padded by a texel so
+        // that the weight computation below decides which texels count
+        Float disc = disc0 * tt * tt + 4 * A;
+        Float sMid = st[0] - B * tt * inv2A;
+        Float sHalf = std::sqrt(std::max(disc, (Float)0)) * inv2A + 1;
+        int rs0 = std::max(s0, (int)std::ceil(sMid - sHalf));
+        int rs1 = std::min(s1, (int)std::floor(sMid + sHalf));
+        for (int is0 = rs0; is0 <= rs1; is0 += EWAMaxRowTexels) {
+            // Compute filter weights for a batch of texels in the row
+            int n = std::min(rs1 - is0 + 1, EWAMaxRowTexels);
+            uint32_t inside =
+                EWARowWeights(A, B, C, is0, st[0], tt, n, weights);
+            int sStart = wrapMode == ImageWrap::Repeat ? Mod(is0, res.x) : is0;
+            if (blackRow || sStart < 0 || sStart + n > res.x) {
+                // Accumulate texels that need wrapping one at a time
+                for (; inside; inside &= inside - 1) {
+                    int i = CountTrailingZeros(inside);
+                    int s = sStart + i;
+                    if (wrapMode == ImageWrap::Repeat)
+                        s = Mod(s, res.x);
+                    else if (wrapMode == ImageWrap::Clamp)
+                        s = Clamp(s, 0, res.x - 1);
+                    if (!blackRow && s >= 0 && s < res.x)
+                        sum += LevelTexel(level, s, t) * weights[i];
+                    sumWts += weights[i];
+                }
+            } else {
+                // Accumulate texels inside the level directly
+                for (; inside; inside &= inside - 1) {
+                    int i = CountTrailingZeros(inside);
+                    sum += (levelData ? (*levelData)(sStart + i, t)
+                                      : LevelTexel(level, sStart + i, t)) *
+                           weights[i];
+                    sumWts += weights[i];
+                }
             }
         }
     }
     return sum / sumWts;
 }
 
-template <typename T>
-Float MIPMap<T>::weightLut[WeightLUTSize];
-
 }  // namespace pbrt
 
 #endif  // PBRT_CORE_MIPMAP_H
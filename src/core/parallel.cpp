@@ -30,12 +30,11 @@
 
  */
 
-
 // core/parallel.cpp*
 #include "parallel.h"
 #include "memory.h"
 #include "stats.h"
-#include <list>
+#include <deque>
 #include <thread>
 #include <condition_variable>
 
@@ -45,18 +44,32 @@ namespace pbrt {
 static std::vector<std::thread> threads;
 static bool shutdownThreads = false;
 class ParallelForLoop;
-static ParallelForLoop *workList = nullptr;
-static std::mutex workListMutex;
+class WorkQueue;
+
+// Each thread that takes part in parallel loops owns a _WorkQueue_, indexed
+// by _ThreadIndex_; the main thread uses entry 0.
+static std::vector<std::unique_ptr<WorkQueue>> workQueues;
+
+// Number of _WorkItem_s that are currently sitting in any of the queues;
+// idle threads sleep on _workCondition_ until it becomes non-zero.
+static std::atomic<int64_t> pendingItems{0};
+static std::mutex workMutex;
+static std::condition_variable workCondition;
+// Number of threads waiting on _workCondition_; lets the common case of
+// pushing work while every thread is busy skip taking _workMutex_.
+static std::atomic<int> nSleeping{0};
 
 // Bookkeeping variables to help with the implementation of
 // MergeWorkerThreadStats().
-static std::atomic<bool> reportWorkerStats{false};
+static bool reportWorkerStats = false;
+// Incremented each time the main thread asks the workers for their stats,
+// so that each worker reports exactly once per request.
+static int reportGeneration = 0;
 // Number of workers that still need to report their stats.
-static std::atomic<int> reporterCount;
+static int reporterCount;
 // After kicking the workers to report their stats, the main thread waits
 // on this condition variable until they've all done so.
 static std::condition_variable reportDoneCondition;
-static std::mutex reportDoneMutex;
 
 class ParallelForLoop {
   public:
@@ -66,13 +79,15 @@ class ParallelForLoop {
         : func1D(std::move(func1D)),
           maxIndex(maxIndex),
           chunkSize(chunkSize),
-          profilerState(profilerState) {}
+          profilerState(profilerState),
+          remaining(maxIndex) {}
     ParallelForLoop(const std::function<void(Point2i)> &f, const Point2i &count,
                     uint64_t profilerState)
         : func2D(f),
           maxIndex(count.x * count.y),
           chunkSize(1),
-          profilerState(profilerState) {
+          profilerState(profilerState),
+          remaining(maxIndex) {
         nX = count.x;
     }
 
@@ -83,15 +98,53 @@ class ParallelForLoop {
     const int64_t maxIndex;
     const int chunkSize;
     uint64_t profilerState;
-    int64_t nextIndex = 0;
-    int activeWorkers = 0;
-    ParallelForLoop *next = nullptr;
+    // Number of loop iterations that haven't finished running yet
+    std::atomic<int64_t> remaining;
     int nX = -1;
 
     // ParallelForLoop Private Methods
-    bool Finished() const {
-        return nextIndex >= maxIndex && activeWorkers == 0;
+    bool Finished() const { return remaining == 0; }
+};
+
+// A contiguous range of iterations _[start, end)_ of a _ParallelForLoop_.
+struct WorkItem {
+    ParallelForLoop *loop;
+    int64_t start, end;
+};
+
+// Per-thread double-ended queue of _WorkItem_s. The owning thread pushes
+// and pops at the back, so that it works on the most recently split (and
+// thus smallest, most cache-friendly) ranges; other threads steal from the
+// front, where the largest ranges are.
+class WorkQueue {
+  public:
+    void Push(const WorkItem &item) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            items.push_back(item);
+        }
+        ++pendingItems;
+    }
+    bool Pop(WorkItem *item) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (items.empty()) return false;
+        *item = items.back();
+        items.pop_back();
+        --pendingItems;
+        return true;
     }
+    bool Steal(WorkItem *item) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (items.empty()) return false;
+        *item = items.front();
+        items.pop_front();
+        --pendingItems;
+        return true;
+    }
+
+  private:
+    std::mutex mutex;
+    std::deque<WorkItem> items;
 };
 
 void Barrier::Wait() {
@@ -107,7 +160,97 @@ void Barrier::Wait() {
         cv.wait(lock, [this] { return count == 0; });
 }
 
-static std::condition_variable workListCondition;
+static WorkQueue &LocalQueue() {
+    // Threads that weren't launched by ParallelInit() (and so don't have
+    // a queue of their own) share the main thread's queue.
+    int index = ThreadIndex < (int)workQueues.size() ? ThreadIndex : 0;
+    return *workQueues[index];
+}
+
+static void WakeWorkers(bool all) {
+    if (nSleeping == 0) return;
+    // Taking the lock ensures that a thread that has just checked the
+    // wait predicate is already waiting when the notification arrives.
+    { std::lock_guard<std::mutex> lock(workMutex); }
+    if (all)
+        workCondition.notify_all();
+    else
+        workCondition.notify_one();
+}
+
+// Finds a _WorkItem_ to run, first from the calling thread's own queue and
+// then by stealing from the others, starting with the thread after this one
+// so that thieves spread out over the victims.
+static bool FindWork(WorkItem *item) {
+    if (workQueues.empty()) return false;
+    if (pendingItems == 0) return false;
+    if (LocalQueue().Pop(item)) return true;
+    int nQueues = workQueues.size();
+    for (int i = 1; i < nQueues; ++i) {
+        int victim = (ThreadIndex + i) % nQueues;
+        if (workQueues[victim]->Steal(item)) return true;
+    }
+    return false;
+}
+
+static void RunWorkItem(WorkItem item) {
+    ParallelForLoop &loop = *item.loop;
+
+    // Split off the upper half of the range for other threads to steal
+    // until what is left is a single chunk
+    while (item.end - item.start > loop.chunkSize) {
+        int64_t nChunks = (item.end - item.start + loop.chunkSize - 1) /
+                          loop.chunkSize;
+        int64_t mid = item.start + (nChunks / 2) * loop.chunkSize;
+        LocalQueue().Push({item.loop, mid, item.end});
+        WakeWorkers(false);
+        item.end = mid;
+    }
+
+    // Run loop indices in _[item.start, item.end)_
+    uint64_t oldState = ProfilerState;
+    ProfilerState = loop.profilerState;
+    for (int64_t index = item.start; index < item.end; ++index) {
+        if (loop.func1D) {
+            loop.func1D(index);
+        }
+        // Handle other types of loops
+        else {
+            CHECK(loop.func2D);
+            loop.func2D(Point2i(index % loop.nX, index / loop.nX));
+        }
+    }
+    ProfilerState = oldState;
+
+    // Update _loop_ to reflect completion of iterations; the thread that
+    // issued the loop may be asleep waiting for it to finish.
+    if ((loop.remaining -= item.end - item.start) == 0) WakeWorkers(true);
+}
+
+// Enqueues all of _loop_'s iterations on the calling thread's queue, and
+// then helps with any available work until the loop has finished. Because
+// waiting threads keep running other items (possibly from other loops),
+// ParallelFor() may be called from inside a parallel loop body.
+static void RunLoop(ParallelForLoop &loop) {
+    LocalQueue().Push({&loop, 0, loop.maxIndex});
+    WakeWorkers(false);
+
+    while (!loop.Finished()) {
+        WorkItem item;
+        if (FindWork(&item)) {
+            RunWorkItem(item);
+            continue;
+        }
+        // The remaining iterations are running on other threads; sleep
+        // until either they finish or more work shows up.
+        std::unique_lock<std::mutex> lock(workMutex);
+        ++nSleeping;
+        workCondition.wait(lock, [&loop] {
+            return loop.Finished() || pendingItems > 0;
+        });
+        --nSleeping;
+    }
+}
 
 static void workerThreadFunc(int tIndex, std::shared_ptr<Barrier> barrier) {
     LOG(INFO) << "Started execution in worker thread " << tIndex;
@@ -126,56 +269,34 @@ static void workerThreadFunc(int tIndex, std::shared_ptr<Barrier> barrier) {
     // the threads have cleared it.
     barrier.reset();
 
-    std::unique_lock<std::mutex> lock(workListMutex);
-    while (!shutdownThreads) {
-        if (reportWorkerStats) {
+    int reportedGeneration = 0;
+    while (true) {
+        // Run work from our own queue or steal it from other threads
+        WorkItem item;
+        if (FindWork(&item)) {
+            RunWorkItem(item);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(workMutex);
+        if (shutdownThreads) break;
+        if (reportWorkerStats && reportedGeneration != reportGeneration) {
             ReportThreadStats();
+            reportedGeneration = reportGeneration;
             if (--reporterCount == 0)
                 // Once all worker threads have merged their stats, wake up
                 // the main thread.
                 reportDoneCondition.notify_one();
-            // Now sleep again.
-            workListCondition.wait(lock);
-        } else if (!workList) {
-            // Sleep until there are more tasks to run
-            workListCondition.wait(lock);
-        } else {
-            // Get work from _workList_ and run loop iterations
-            ParallelForLoop &loop = *workList;
-
-            // Run a chunk of loop iterations for _loop_
-
-            // Find the set of loop iterations to run next
-            int64_t indexStart = loop.nextIndex;
-            int64_t indexEnd =
-                std::min(indexStart + loop.chunkSize, loop.maxIndex);
-
-            // Update _loop_ to reflect iterations this thread will run
-            loop.nextIndex = indexEnd;
-            if (loop.nextIndex == loop.maxIndex) workList = loop.next;
-            loop.activeWorkers++;
-
-            // Run loop indices in _[indexStart, indexEnd)_
-            lock.unlock();
-            for (int64_t index = indexStart; index < indexEnd; ++index) {
-                uint64_t oldState = ProfilerState;
-                ProfilerState = loop.profilerState;
-                if (loop.func1D) {
-                    loop.func1D(index);
-                }
-                // Handle other types of loops
-                else {
-                    CHECK(loop.func2D);
-                    loop.func2D(Point2i(index % loop.nX, index / loop.nX));
-                }
-                ProfilerState = oldState;
-            }
-            lock.lock();
-
-            // Update _loop_ to reflect completion of iterations
-            loop.activeWorkers--;
-            if (loop.Finished()) workListCondition.notify_all();
+            continue;
         }
+        // Sleep until there are more tasks to run
+        ++nSleeping;
+        workCondition.wait(lock, [&reportedGeneration] {
+            return shutdownThreads || pendingItems > 0 ||
+                   (reportWorkerStats &&
+                    reportedGeneration != reportGeneration);
+        });
+        --nSleeping;
     }
     LOG(INFO) << "Exiting worker thread " << tIndex;
 }
@@ -191,51 +312,10 @@ void ParallelFor(std::function<void(int64_t)> func, int64_t count,
         return;
     }
 
-    // Create and enqueue _ParallelForLoop_ for this loop
+    // Create _ParallelForLoop_ for this loop and run it
     ParallelForLoop loop(std::move(func), count, chunkSize,
                          CurrentProfilerState());
-    workListMutex.lock();
-    loop.next = workList;
-    workList = &loop;
-    workListMutex.unlock();
-
-    // Notify worker threads of work to be done
-    std::unique_lock<std::mutex> lock(workListMutex);
-    workListCondition.notify_all();
-
-    // Help out with parallel loop iterations in the current thread
-    while (!loop.Finished()) {
-        // Run a chunk of loop iterations for _loop_
-
-        // Find the set of loop iterations to run next
-        int64_t indexStart = loop.nextIndex;
-        int64_t indexEnd = std::min(indexStart + loop.chunkSize, loop.maxIndex);
-
-        // Update _loop_ to reflect iterations this thread will run
-        loop.nextIndex = indexEnd;
-        if (loop.nextIndex == loop.maxIndex) workList = loop.next;
-        loop.activeWorkers++;
-
-        // Run loop indices in _[indexStart, indexEnd)_
-        lock.unlock();
-        for (int64_t index = indexStart; index < indexEnd; ++index) {
-            uint64_t oldState = ProfilerState;
-            ProfilerState = loop.profilerState;
-            if (loop.func1D) {
-                loop.func1D(index);
-            }
-            // Handle other types of loops
-            else {
-                CHECK(loop.func2D);
-                loop.func2D(Point2i(index % loop.nX, index / loop.nX));
-            }
-            ProfilerState = oldState;
-        }
-        lock.lock();
-
-        // Update _loop_ to reflect completion of iterations
-        loop.activeWorkers--;
-    }
+    RunLoop(loop);
 }
 
 PBRT_THREAD_LOCAL int ThreadIndex;
@@ -254,48 +334,7 @@ void ParallelFor2D(std::function<void(Point2i)> func, const Point2i &count) {
     }
 
     ParallelForLoop loop(std::move(func), count, CurrentProfilerState());
-    {
-        std::lock_guard<std::mutex> lock(workListMutex);
-        loop.next = workList;
-        workList = &loop;
-    }
-
-    std::unique_lock<std::mutex> lock(workListMutex);
-    workListCondition.notify_all();
-
-    // Help out with parallel loop iterations in the current thread
-    while (!loop.Finished()) {
-        // Run a chunk of loop iterations for _loop_
-
-        // Find the set of loop iterations to run next
-        int64_t indexStart = loop.nextIndex;
-        int64_t indexEnd = std::min(indexStart + loop.chunkSize, loop.maxIndex);
-
-        // Update _loop_ to reflect iterations this thread will run
-        loop.nextIndex = indexEnd;
-        if (loop.nextIndex == loop.maxIndex) workList = loop.next;
-        loop.activeWorkers++;
-
-        // Run loop indices in _[indexStart, indexEnd)_
-        lock.unlock();
-        for (int64_t index = indexStart; index < indexEnd; ++index) {
-            uint64_t oldState = ProfilerState;
-            ProfilerState = loop.profilerState;
-            if (loop.func1D) {
-                loop.func1D(index);
-            }
-            // Handle other types of loops
-            else {
-                CHECK(loop.func2D);
-                loop.func2D(Point2i(index % loop.nX, index / loop.nX));
-            }
-            ProfilerState = oldState;
-        }
-        lock.lock();
-
-        // Update _loop_ to reflect completion of iterations
-        loop.activeWorkers--;
-    }
+    RunLoop(loop);
 }
 
 int NumSystemCores() {
@@ -307,6 +346,11 @@ void ParallelInit() {
     int nThreads = MaxThreadIndex();
     ThreadIndex = 0;
 
+    // Allocate a work queue for each thread, including the main thread
+    workQueues.clear();
+    for (int i = 0; i < nThreads; ++i)
+        workQueues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue));
+
     // Create a barrier so that we can be sure all worker threads get past
     // their call to ProfilerWorkerThreadInit() before we return from this
     // function.  In turn, we can be sure that the profiling system isn't
@@ -325,26 +369,27 @@ void ParallelCleanup() {
     if (threads.empty()) return;
 
     {
-        std::lock_guard<std::mutex> lock(workListMutex);
+        std::lock_guard<std::mutex> lock(workMutex);
         shutdownThreads = true;
-        workListCondition.notify_all();
+        workCondition.notify_all();
     }
 
     for (std::thread &thread : threads) thread.join();
     threads.erase(threads.begin(), threads.end());
+    workQueues.clear();
     shutdownThreads = false;
 }
 
 void MergeWorkerThreadStats() {
-    std::unique_lock<std::mutex> lock(workListMutex);
-    std::unique_lock<std::mutex> doneLock(reportDoneMutex);
+    std::unique_lock<std::mutex> lock(workMutex);
     // Set up state so that the worker threads will know that we would like
     // them to report their thread-specific stats when they wake up.
     reportWorkerStats = true;
+    ++reportGeneration;
     reporterCount = threads.size();
 
     // Wake up the worker threads.
-    workListCondition.notify_all();
+    workCondition.notify_all();
 
     // Wait for all of them to merge their stats.
     reportDoneCondition.wait(lock, []() { return reporterCount == 0; });
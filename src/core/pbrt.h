@@ -182,6 +182,24 @@ struct Options {
     std::string imageFile;
     // x0, x1, y0, y1
     Float cropWindow[2][2];
+    // Progressive rendering: samples per pixel in each pass (0 renders all
+    // of them in one pass), the minimum time between intermediate image
+    // writes, and the checkpoint file used to resume interrupted renders.
+    int passSamples = 0;
+    Float flushSeconds = 60;
+    std::string checkpointFile;
+    // Distributed rendering: the address at which this process hands out
+    // tiles to workers, or of the coordinator whose tiles it renders
+    std::string coordinatorAddress, workerAddress;
+    // The range of samples per pixel [sppRangeStart, sppRangeEnd) to render,
+    // for renders split in runs that are merged afterwards; an end of 0
+    // renders all of them.
+    int64_t sppRangeStart = 0, sppRangeEnd = 0;
+    // Memory budget of the texture cache in MB; if positive, image textures
+    // are stored as tiled files in _textureCacheDir_ (or the system temp
+    // directory) and paged in on demand instead of being kept in memory.
+    int textureCacheMB = 0;
+    std::string textureCacheDir;
 };
 
 extern Options PbrtOptions;
@@ -43,6 +43,19 @@ STAT_MEMORY_COUNTER("Memory/Primitives", primitiveMemory);
 
 // Primitive Method Definitions
 Primitive::~Primitive() {}
+void Aggregate::Intersect(RayBatch &batch) const {
+    batch.hit.resize(batch.Size());
+    batch.isects.resize(batch.Size());
+    for (int i = 0; i < batch.Size(); ++i)
+        batch.hit[i] = Intersect(batch.rays[i], &batch.isects[i]);
+}
+
+void Aggregate::IntersectP(RayBatch &batch) const {
+    batch.hit.resize(batch.Size());
+    for (int i = 0; i < batch.Size(); ++i)
+        batch.hit[i] = IntersectP(batch.rays[i]);
+}
+
 const AreaLight *Aggregate::GetAreaLight() const {
     LOG(FATAL) <<
         "Aggregate::GetAreaLight() method"
@@ -76,6 +76,7 @@ class GeometricPrimitive : public Primitive {
                        const MediumInterface &mediumInterface);
     const AreaLight *GetAreaLight() const;
     const Material *GetMaterial() const;
+    const Shape *GetShape() const { return shape.get(); }
     void ComputeScatteringFunctions(SurfaceInteraction *isect,
                                     MemoryArena &arena, TransportMode mode,
                                     bool allowMultipleLobes) const;
@@ -115,10 +116,31 @@ class TransformedPrimitive : public Primitive {
     const AnimatedTransform PrimitiveToWorld;
 };
 
+// RayBatch Declarations
+// Rays that are intersected together, so that aggregates can share work
+// such as node fetches across coherent rays. As with single rays, each
+// ray's _tMax_ is updated to its closest intersection.
+struct RayBatch {
+    int Size() const { return rays.size(); }
+    void Add(const Ray &ray) { rays.push_back(ray); }
+    void Clear() { rays.clear(); }
+
+    std::vector<Ray> rays;
+    // Results: _hit_ is set for rays that intersect something (for
+    // _Intersect()_) or are occluded (for _IntersectP()_); _isects_ holds
+    // the closest intersection of each ray that hit.
+    std::vector<uint8_t> hit;
+    std::vector<SurfaceInteraction> isects;
+};
+
 // Aggregate Declarations
 class Aggregate : public Primitive {
   public:
     // Aggregate Public Methods
+    using Primitive::Intersect;
+    using Primitive::IntersectP;
+    virtual void Intersect(RayBatch &batch) const;
+    virtual void IntersectP(RayBatch &batch) const;
     const AreaLight *GetAreaLight() const;
     const Material *GetMaterial() const;
     void ComputeScatteringFunctions(SurfaceInteraction *isect,
@@ -72,6 +72,9 @@ class Sampler {
 
     // Sampler Public Data
     const int64_t samplesPerPixel;
+    // The sampler's name in the scene description, if it was created from
+    // one
+    std::string name;
 
   protected:
     // Sampler Protected Data
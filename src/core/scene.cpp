@@ -54,6 +54,29 @@ bool Scene::IntersectP(const Ray &ray) const {
     return aggregate->IntersectP(ray);
 }
 
+void Scene::Intersect(RayBatch &batch) const {
+    nIntersectionTests += batch.Size();
+    if (batchAggregate) {
+        batchAggregate->Intersect(batch);
+        return;
+    }
+    batch.hit.resize(batch.Size());
+    batch.isects.resize(batch.Size());
+    for (int i = 0; i < batch.Size(); ++i)
+        batch.hit[i] = aggregate->Intersect(batch.rays[i], &batch.isects[i]);
+}
+
+void Scene::IntersectP(RayBatch &batch) const {
+    nShadowTests += batch.Size();
+    if (batchAggregate) {
+        batchAggregate->IntersectP(batch);
+        return;
+    }
+    batch.hit.resize(batch.Size());
+    for (int i = 0; i < batch.Size(); ++i)
+        batch.hit[i] = aggregate->IntersectP(batch.rays[i]);
+}
+
 bool Scene::IntersectTr(Ray ray, Sampler &sampler, SurfaceInteraction *isect,
                         Spectrum *Tr) const {
     *Tr = Spectrum(1.f);
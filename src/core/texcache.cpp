@@ -0,0 +1,374 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+// core/texcache.cpp*
+#include "texcache.h"
+#include "parallel.h"
+#include "stats.h"
+#include <atomic>
+#include <string.h>
+#ifdef PBRT_HAVE_MMAP
+#include <sys/mman.h>
+#endif
+#ifndef PBRT_IS_WINDOWS
+#include <unistd.h>
+#endif
+
+namespace pbrt {
+
+STAT_PERCENT("Texture/Texture cache misses", nTileMisses, nTexelLookups);
+STAT_COUNTER("Texture/Texture cache tiles evicted", nTilesEvicted);
+STAT_COUNTER("Texture/Tiled MIP map files written", nTiledFilesWritten);
+STAT_COUNTER("Texture/Tiled MIP map files memory-mapped", nTiledFilesMapped);
+
+static std::atomic<int64_t> peakCacheBytes(0);
+static StatRegisterer peakCacheBytesReporter([](StatsAccumulator &accum) {
+    // Each thread reports its statistics; only the first one takes the peak
+    accum.ReportMemoryCounter("Memory/Texture cache (peak)",
+                              peakCacheBytes.exchange(0));
+});
+
+static const char tiledMIPMagic[8] = {'P', 'B', 'R', 'T', 'T', 'M', 'I', 'P'};
+static PBRT_CONSTEXPR int tiledMIPVersion = 1;
+static PBRT_CONSTEXPR int tiledMIPTileSize = 64;
+
+// Tile keys combine the file's id with the level and index of the tile
+static uint64_t TileKey(uint32_t fileId, int level, int tile) {
+    return ((uint64_t)(fileId & 0xffffff) << 40) | ((uint64_t)level << 32) |
+           (uint32_t)tile;
+}
+
+static uint64_t HashKey(uint64_t key) {
+    // MurmurHash3 finalizer
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ull;
+    key ^= key >> 33;
+    return key;
+}
+
+// TiledMIPFile Method Definitions
+std::unique_ptr<TiledMIPFile> TiledMIPFile::Open(const std::string &filename,
+                                                 TextureCache *cache,
+                                                 bool removeOnClose) {
+    static std::atomic<uint32_t> nextId(0);
+    std::unique_ptr<TiledMIPFile> mip(new TiledMIPFile);
+    mip->filename = filename;
+    mip->removeOnClose = removeOnClose;
+    mip->cache = cache;
+    mip->id = nextId++;
+    mip->file = fopen(filename.c_str(), "rb");
+    if (!mip->file) {
+        Error("%s: %s", filename.c_str(), strerror(errno));
+        return nullptr;
+    }
+
+    char magic[8];
+    int32_t header[4];
+    if (fread(magic, sizeof(magic), 1, mip->file) != 1 ||
+        memcmp(magic, tiledMIPMagic, sizeof(magic)) != 0 ||
+        fread(header, sizeof(header), 1, mip->file) != 1 ||
+        header[0] != tiledMIPVersion) {
+        Error("%s: not a tiled MIP map file", filename.c_str());
+        return nullptr;
+    }
+    mip->channels = header[1];
+    mip->tileSize = header[2];
+    int nLevels = header[3];
+    if ((mip->channels != 1 && mip->channels != 3) || mip->tileSize < 1 ||
+        nLevels < 1 || nLevels > 32) {
+        Error("%s: invalid tiled MIP map header", filename.c_str());
+        return nullptr;
+    }
+    for (int i = 0; i < nLevels; ++i) {
+        int32_t res[2];
+        int64_t offset;
+        if (fread(res, sizeof(res), 1, mip->file) != 1 ||
+            fread(&offset, sizeof(offset), 1, mip->file) != 1 || res[0] < 1 ||
+            res[1] < 1) {
+            Error("%s: invalid tiled MIP map header", filename.c_str());
+            return nullptr;
+        }
+        Level level;
+        level.resolution = Point2i(res[0], res[1]);
+        level.tilesPerRow = (res[0] + mip->tileSize - 1) / mip->tileSize;
+        level.offset = offset;
+        mip->levels.push_back(level);
+    }
+
+    // Make sure that all tiles are inside the file
+    int64_t fileBytes = 0;
+#ifdef PBRT_IS_WINDOWS
+    if (_fseeki64(mip->file, 0, SEEK_END) == 0)
+        fileBytes = _ftelli64(mip->file);
+#else
+    if (fseeko(mip->file, 0, SEEK_END) == 0) fileBytes = ftello(mip->file);
+#endif
+    for (const Level &level : mip->levels) {
+        Point2i res = level.resolution;
+        int64_t nTiles = (int64_t)level.tilesPerRow *
+                         ((res.y + mip->tileSize - 1) / mip->tileSize);
+        if (level.offset < 0 || level.offset % sizeof(float) != 0 ||
+            level.offset + nTiles * (int64_t)mip->TileBytes() > fileBytes) {
+            Error("%s: tiled MIP map file is truncated", filename.c_str());
+            return nullptr;
+        }
+    }
+
+    if (!cache) {
+#ifdef PBRT_HAVE_MMAP
+        void *ptr = mmap(0, fileBytes, PROT_READ, MAP_FILE | MAP_PRIVATE,
+                         fileno(mip->file), 0);
+        if (ptr == MAP_FAILED) {
+            Error("%s: unable to map file: %s", filename.c_str(),
+                  strerror(errno));
+            return nullptr;
+        }
+        mip->mapping = (const float *)ptr;
+#else
+        // Without mmap(), read the whole file instead
+        float *data = new float[fileBytes / sizeof(float) + 1];
+        if (fseek(mip->file, 0, SEEK_SET) != 0 ||
+            fread(data, fileBytes, 1, mip->file) != 1) {
+            delete[] data;
+            Error("%s: error reading tiled MIP map file", filename.c_str());
+            return nullptr;
+        }
+        mip->mapping = data;
+#endif
+        mip->mappingBytes = fileBytes;
+        ++nTiledFilesMapped;
+    }
+#ifndef PBRT_IS_WINDOWS
+    // The open file stays readable after its name is removed
+    if (removeOnClose) {
+        unlink(filename.c_str());
+        mip->removeOnClose = false;
+    }
+#endif
+    return mip;
+}
+
+TiledMIPFile::~TiledMIPFile() {
+    if (cache) cache->Remove(this);
+#ifdef PBRT_HAVE_MMAP
+    if (mapping) munmap((void *)mapping, mappingBytes);
+#else
+    delete[] mapping;
+#endif
+    if (file) fclose(file);
+    if (removeOnClose) remove(filename.c_str());
+}
+
+void TiledMIPFile::CachedTexel(int level, int s, int t, float *texel) const {
+    cache->Texel(this, level, s, t, texel);
+}
+
+bool TiledMIPFile::ReadTile(int level, int tile, float *texels) const {
+    std::lock_guard<std::mutex> lock(fileMutex);
+    int64_t offset = levels[level].offset + tile * (int64_t)TileBytes();
+#ifdef PBRT_IS_WINDOWS
+    int err = _fseeki64(file, offset, SEEK_SET);
+#else
+    int err = fseeko(file, offset, SEEK_SET);
+#endif
+    return err == 0 && fread(texels, TileBytes(), 1, file) == 1;
+}
+
+bool WriteTiledMIPFile(
+    const std::string &filename, int channels,
+    const std::vector<Point2i> &levelResolutions,
+    const std::function<void(int level, int s, int t, float *texel)>
+        &getTexel) {
+    FILE *f = fopen(filename.c_str(), "wb");
+    if (!f) {
+        Error("%s: %s", filename.c_str(), strerror(errno));
+        return false;
+    }
+    int tileSize = tiledMIPTileSize;
+    int32_t header[4] = {tiledMIPVersion, channels, tileSize,
+                         (int32_t)levelResolutions.size()};
+    bool ok = fwrite(tiledMIPMagic, sizeof(tiledMIPMagic), 1, f) == 1 &&
+              fwrite(header, sizeof(header), 1, f) == 1;
+
+    // Lay out the levels one after the other, starting past the header
+    int64_t offset = sizeof(tiledMIPMagic) + sizeof(header) +
+                     levelResolutions.size() * (2 * sizeof(int32_t) +
+                                                sizeof(int64_t));
+    size_t tileFloats = tileSize * tileSize * channels;
+    for (const Point2i &res : levelResolutions) {
+        int32_t r[2] = {res.x, res.y};
+        ok = ok && fwrite(r, sizeof(r), 1, f) == 1 &&
+             fwrite(&offset, sizeof(offset), 1, f) == 1;
+        int nTiles = ((res.x + tileSize - 1) / tileSize) *
+                     ((res.y + tileSize - 1) / tileSize);
+        offset += nTiles * tileFloats * sizeof(float);
+    }
+
+    std::unique_ptr<float[]> tile(new float[tileFloats]);
+    for (size_t level = 0; level < levelResolutions.size() && ok; ++level) {
+        Point2i res = levelResolutions[level];
+        for (int t0 = 0; t0 < res.y && ok; t0 += tileSize)
+            for (int s0 = 0; s0 < res.x && ok; s0 += tileSize) {
+                // Gather the texels of the tile at $(s_0,t_0)$, replicating
+                // the last row and column into the padding
+                float *texel = tile.get();
+                for (int t = t0; t < t0 + tileSize; ++t)
+                    for (int s = s0; s < s0 + tileSize; ++s) {
+                        getTexel(level, std::min(s, res.x - 1),
+                                 std::min(t, res.y - 1), texel);
+                        texel += channels;
+                    }
+                ok = fwrite(tile.get(), sizeof(float), tileFloats, f) ==
+                     tileFloats;
+            }
+    }
+    if (fclose(f) != 0) ok = false;
+    if (!ok) {
+        Error("%s: error writing tiled MIP map file", filename.c_str());
+        remove(filename.c_str());
+        return false;
+    }
+    ++nTiledFilesWritten;
+    return true;
+}
+
+// TextureCache Method Definitions
+TextureCache::TextureCache(int64_t maxBytes)
+    : maxShardBytes(maxBytes / nShards), lastTiles(MaxThreadIndex()) {}
+
+TextureCache::~TextureCache() {}
+
+TextureCache *TextureCache::Global() {
+    if (PbrtOptions.textureCacheMB <= 0) return nullptr;
+    static TextureCache cache(PbrtOptions.textureCacheMB * (int64_t)1048576);
+    return &cache;
+}
+
+void TextureCache::Texel(const TiledMIPFile *file, int level, int s, int t,
+                         float *texel) {
+    ++nTexelLookups;
+    const TiledMIPFile::Level &l = file->levels[level];
+    int tileSize = file->tileSize, channels = file->channels;
+    int tile = (t / tileSize) * l.tilesPerRow + s / tileSize;
+    int offset = channels * ((t % tileSize) * tileSize + s % tileSize);
+    uint64_t key = TileKey(file->id, level, tile);
+    LastTile *lastTile =
+        ThreadIndex < (int)lastTiles.size() ? &lastTiles[ThreadIndex] : nullptr;
+    if (lastTile && lastTile->key == key) {
+        memcpy(texel, lastTile->texels.get() + offset,
+               channels * sizeof(float));
+        return;
+    }
+    // Copies the texel from _texels_ and makes it this thread's last tile
+    auto useTile = [&](std::shared_ptr<const float> texels) {
+        memcpy(texel, texels.get() + offset, channels * sizeof(float));
+        if (lastTile) {
+            lastTile->key = key;
+            lastTile->texels = std::move(texels);
+        }
+    };
+
+    Shard &shard = shards[HashKey(key) % nShards];
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto iter = shard.tiles.find(key);
+        if (iter != shard.tiles.end()) {
+            // Move the tile to the front of the LRU list
+            shard.lru.splice(shard.lru.begin(), shard.lru, iter->second);
+            useTile(iter->second->texels);
+            return;
+        }
+    }
+
+    // Read the tile without holding the shard's lock
+    ++nTileMisses;
+    size_t bytes = file->TileBytes();
+    std::shared_ptr<float> texels(new float[bytes / sizeof(float)],
+                                  std::default_delete<float[]>());
+    if (!file->ReadTile(level, tile, texels.get())) {
+        Error("%s: error reading texture tile; using black instead",
+              file->filename.c_str());
+        memset(texels.get(), 0, bytes);
+    }
+    useTile(texels);
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    // Another thread may have read the same tile in the meantime
+    if (shard.tiles.find(key) != shard.tiles.end()) return;
+    Tile newTile;
+    newTile.key = key;
+    newTile.bytes = bytes;
+    newTile.texels = std::move(texels);
+    shard.lru.push_front(std::move(newTile));
+    shard.tiles[key] = shard.lru.begin();
+    shard.bytes += bytes;
+    // Evict the least recently used tiles; a shard always keeps at least
+    // the one it just read
+    while (shard.bytes > maxShardBytes && shard.lru.size() > 1) {
+        const Tile &last = shard.lru.back();
+        shard.bytes -= last.bytes;
+        shard.tiles.erase(last.key);
+        shard.lru.pop_back();
+        ++nTilesEvicted;
+    }
+    int64_t resident = BytesResident();
+    int64_t peak = peakCacheBytes;
+    while (resident > peak &&
+           !peakCacheBytes.compare_exchange_weak(peak, resident))
+        ;
+}
+
+void TextureCache::Remove(const TiledMIPFile *file) {
+    for (Shard &shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (auto iter = shard.lru.begin(); iter != shard.lru.end();) {
+            if ((iter->key >> 40) == (file->id & 0xffffff)) {
+                shard.bytes -= iter->bytes;
+                shard.tiles.erase(iter->key);
+                iter = shard.lru.erase(iter);
+            } else
+                ++iter;
+        }
+    }
+}
+
+int64_t TextureCache::BytesResident() const {
+    // Shard sizes are read without locking the shards, so this is
+    // approximate while other threads page in tiles
+    int64_t bytes = 0;
+    for (const Shard &shard : shards) bytes += shard.bytes;
+    return bytes;
+}
+
+}  // namespace pbrt
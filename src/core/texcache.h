@@ -0,0 +1,181 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_CORE_TEXCACHE_H
+#define PBRT_CORE_TEXCACHE_H
+
+// core/texcache.h*
+#include "pbrt.h"
+#include "geometry.h"
+#include <atomic>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string.h>
+#include <unordered_map>
+
+namespace pbrt {
+
+// Tiled MIP map files store each level of a MIP pyramid in square tiles of
+// float texels, so that textures can be paged in one tile at a time by a
+// _TextureCache_ instead of being kept in memory in full, or be memory
+// mapped and used as they are. After a header with the resolution and file
+// offset of each level, the tiles of each level follow in scanline order,
+// with the texels of each tile in scanline order as well; tiles at the
+// right and top edges are padded. Texels have one channel, or three for
+// RGB.
+class TextureCache;
+class TiledMIPFile {
+  public:
+    // TiledMIPFile Public Methods
+    // Opens _filename_, whose tiles are then read through _cache_, or are
+    // memory-mapped if _cache_ is _nullptr_. If _removeOnClose_ is set, the
+    // file is deleted once it's no longer used.
+    static std::unique_ptr<TiledMIPFile> Open(const std::string &filename,
+                                              TextureCache *cache,
+                                              bool removeOnClose = false);
+    ~TiledMIPFile();
+    int Channels() const { return channels; }
+    int TileSize() const { return tileSize; }
+    int Levels() const { return levels.size(); }
+    Point2i LevelResolution(int level) const {
+        return levels[level].resolution;
+    }
+    size_t TileBytes() const {
+        return sizeof(float) * tileSize * tileSize * channels;
+    }
+    // Returns the _Channels()_ values of texel $(s,t)$ of _level_ in
+    // _texel_; $s$ and $t$ must be inside the level.
+    void Texel(int level, int s, int t, float *texel) const {
+        if (mapping) {
+            const Level &l = levels[level];
+            int tile = (t / tileSize) * l.tilesPerRow + s / tileSize;
+            const float *texels =
+                mapping + (l.offset + tile * TileBytes()) / sizeof(float);
+            memcpy(texel,
+                   texels + channels * ((t % tileSize) * tileSize +
+                                        s % tileSize),
+                   channels * sizeof(float));
+        } else
+            CachedTexel(level, s, t, texel);
+    }
+    // Reads the texels of a tile, returning false on I/O errors
+    bool ReadTile(int level, int tile, float *texels) const;
+
+  private:
+    // TiledMIPFile Private Methods
+    TiledMIPFile() = default;
+    void CachedTexel(int level, int s, int t, float *texel) const;
+
+    // TiledMIPFile Private Data
+    struct Level {
+        Point2i resolution;
+        int tilesPerRow;
+        int64_t offset;
+    };
+    friend class TextureCache;
+    std::string filename;
+    bool removeOnClose = false;
+    FILE *file = nullptr;
+    mutable std::mutex fileMutex;
+    TextureCache *cache = nullptr;
+    // The whole file, when it's memory-mapped
+    const float *mapping = nullptr;
+    size_t mappingBytes = 0;
+    uint32_t id;
+    int channels, tileSize;
+    std::vector<Level> levels;
+};
+
+// Writes a tiled MIP map file with the given per-level resolutions, calling
+// _getTexel_ for each texel of each level.
+bool WriteTiledMIPFile(
+    const std::string &filename, int channels,
+    const std::vector<Point2i> &levelResolutions,
+    const std::function<void(int level, int s, int t, float *texel)> &getTexel);
+
+// The texture cache keeps the tiles of _TiledMIPFile_s that were used most
+// recently in memory, up to a memory budget, and evicts the least recently
+// used ones to page in others. Tiles are spread over independently locked
+// shards, each with its own LRU list and a share of the budget. Each thread
+// also keeps the tile it read last, so that the texels of a filter
+// footprint, which mostly share a tile, are found without locking a shard.
+class TextureCache {
+  public:
+    // TextureCache Public Methods
+    TextureCache(int64_t maxBytes);
+    ~TextureCache();
+    // The cache shared by all textures, sized by _PbrtOptions.textureCacheMB_;
+    // returns nullptr if textures are kept in memory in full.
+    static TextureCache *Global();
+    void Texel(const TiledMIPFile *file, int level, int s, int t,
+               float *texel);
+    // Drops the tiles of a file that is being closed
+    void Remove(const TiledMIPFile *file);
+    int64_t BytesResident() const;
+
+  private:
+    // TextureCache Private Declarations
+    struct Tile {
+        uint64_t key;
+        size_t bytes;
+        std::shared_ptr<const float> texels;
+    };
+    // A thread's last tile stays alive after its eviction until the thread
+    // reads another one, so the budget may be exceeded by a tile per thread
+    struct LastTile {
+        uint64_t key = ~0ull;
+        std::shared_ptr<const float> texels;
+    };
+    struct Shard {
+        std::mutex mutex;
+        std::list<Tile> lru;
+        std::unordered_map<uint64_t, std::list<Tile>::iterator> tiles;
+        std::atomic<int64_t> bytes{0};
+    };
+    static PBRT_CONSTEXPR int nShards = 16;
+
+    // TextureCache Private Data
+    const int64_t maxShardBytes;
+    Shard shards[nShards];
+    // Indexed by _ThreadIndex_
+    std::vector<LastTile> lastTiles;
+};
+
+}  // namespace pbrt
+
+#endif  // PBRT_CORE_TEXCACHE_H
@@ -1,15 +1,35 @@
 // integrators/adaptive.cpp*
 #include "adaptive.h"
 #include "camera.h"
-#include "filters/box.h"
+#include "imageio.h"
 #include "paramset.h"
 #include "progressreporter.h"
 #include "stats.h"
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+#include <typeinfo>
 
 namespace pbrt {
 
-STAT_COUNTER("Integrator/Camera rays traced", nCameraRays);
 STAT_COUNTER("Integrator/Render time in milliseconds", nElapsedMilliseconds);
+STAT_COUNTER("Integrator/Intermediate image writes", nIntermediateWrites);
+STAT_COUNTER("Integrator/Straggler pixel batches", nStragglerBatches);
+STAT_COUNTER("Integrator/Batches completed by every tile", nCompletedBatches);
+
+// Derives the sampler seed of a batch from the tile (or straggler chunk) and
+// batch indices alone, with the MurmurHash3 finalizer, so that a batch draws
+// the same samples however the render is scheduled or split, and
+// consecutive batches don't get consecutive seeds.
+static int BatchSeed(int index, int batch) {
+    uint64_t h = (uint64_t(uint32_t(batch)) << 32) | uint32_t(index);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return int(h & 0x7fffffff);
+}
 
 Statistics::Statistics(const ParamSet &paramSet, const Film *originalFilm,
                        const Sampler &sampler)
@@ -22,12 +42,58 @@ Statistics::Statistics(const ParamSet &paramSet, const Film *originalFilm,
       maxSamples(sampler.samplesPerPixel),
       minSamples(paramSet.FindOneInt("minsamples", 64)),
       errorThreshold(paramSet.FindOneFloat("errorthreshold", 0.01)),
-      errorHeuristic(paramSet.FindOneString("errorheuristic", "relative")),
+      errorHeuristic([](std::string &&heuristicString) {
+              if (heuristicString == "standard")
+                  return ErrorHeuristic::STANDARD;
+              if (heuristicString != "relative")
+                  Warning("Error heuristic \"%s\" unknown. Using \"relative\".",
+                          heuristicString.c_str());
+              return ErrorHeuristic::RELATIVE;
+          }(paramSet.FindOneString("errorheuristic", "relative"))
+      ),
+      stopCheckInterval(std::max(1, paramSet.FindOneInt("stopcheckinterval", 8))),
+      stragglerSamples(paramSet.FindOneInt("stragglersamples", 4 * minSamples)),
       batchSize(paramSet.FindOneInt("batchsize", 16)),
       targetSeconds(paramSet.FindOneInt("targetseconds", 60)),
+      writeInterval(paramSet.FindOneFloat("writeinterval",
+                                          PbrtOptions.flushSeconds)),
+      tileFraction(paramSet.FindOneInt("startbatch", 0) > 0 ||
+                           paramSet.FindOneInt("endbatch", 0) > 0
+                       ? 1
+                       : Clamp(paramSet.FindOneFloat("tilefraction", 0.25),
+                               0, 1)),
+      tileFairness(Clamp(paramSet.FindOneFloat("tilefairness", 0.1), 0, 1)),
+      startBatch(std::max(0, paramSet.FindOneInt("startbatch", 0))),
+      endBatch(std::max(0, paramSet.FindOneInt("endbatch", 0))),
       originalFilm(originalFilm),
       pixelBounds(originalFilm->croppedPixelBounds),
-      pixels(new Pixel[pixelBounds.Area()]) {}
+      nChannels(paramSet.FindOneString("statschannels", "rgb") == "luminance"
+                    ? 1 : 3),
+      tileOrigin(originalFilm->GetSampleBounds().pMin),
+      stripeMutexes(new std::mutex[std::max(
+          1, (pixelBounds.pMax.y - pixelBounds.pMin.y + stripeHeight - 1) /
+                 stripeHeight)]) {
+    // Allocate the statistics planes, covering every tile that overlaps the
+    // film
+    nTilesX = (pixelBounds.pMax.x - tileOrigin.x + tileSize - 1) / tileSize;
+    int nTilesY = (pixelBounds.pMax.y - tileOrigin.y + tileSize - 1) / tileSize;
+    planeSize = size_t(nTilesX) * nTilesY * tileSize * tileSize;
+    size_t nValues = planeSize * (1 + 2 * nChannels);
+    planes.reset(new float[nValues]);
+    std::fill(planes.get(), planes.get() + nValues, 0.f);
+
+    if (tileFraction == 1 &&
+        paramSet.FindOneFloat("tilefraction", 1) < 1)
+        Warning("\"tilefraction\" is ignored when a batch range is given: "
+                "every tile renders every batch of the range.");
+    if (endBatch > 0 && endBatch <= startBatch)
+        Warning("\"endbatch\" %d is not after \"startbatch\" %d. No batch "
+                "will be rendered.", endBatch, startBatch);
+
+    std::string prior = paramSet.FindOneFilename("priorstats", "");
+    if (!prior.empty() && mode == Mode::ERROR)
+        LoadPrior(prior, paramSet.FindOneInt("priorminsamples", 16));
+}
 
 void Statistics::RenderBegin() {
     startTime = Clock::now();
@@ -35,33 +101,74 @@ void Statistics::RenderBegin() {
 
 void Statistics::RenderEnd() const {
     nElapsedMilliseconds = ElapsedMilliseconds();
+
+    Float meanError = 0, maxError = 0;
+    for (Point2i pixel : pixelBounds) {
+        Float error = Error(LoadPixel(pixel)).MaxComponentValue();
+        if (std::isnan(error)) continue;
+        meanError += error;
+        maxError = std::max(maxError, error);
+    }
+    meanError /= pixelBounds.Area();
+    LOG(INFO) << "Final pixel error: mean " << meanError << ", max " <<
+        maxError;
 }
 
 void Statistics::WriteImages() const {
     CHECK(originalFilm);
-    Film samplesFilm(*originalFilm, StatImagesFilter(), "_samples");
-    Film varianceFilm(*originalFilm, StatImagesFilter(), "_variance");
-    Film errorFilm(*originalFilm, StatImagesFilter(), "_error");
 
+    // Gather the exported values in scanline order, one plane per channel
+    const char *rgbSuffixes[3] = {".R", ".G", ".B"};
+    const char *ySuffix[1] = {".Y"};
+    const char **suffixes = nChannels == 1 ? ySuffix : rgbSuffixes;
+    std::vector<std::string> channelNames = {"samples.Y"};
+    for (const char *layer : {"variance", "error"})
+        for (int c = 0; c < nChannels; ++c)
+            channelNames.push_back(std::string(layer) + suffixes[c]);
+
+    size_t nPixels = pixelBounds.Area();
+    std::vector<float> values(channelNames.size() * nPixels);
+    size_t offset = 0;
     for (Point2i pixel : pixelBounds) {
-        Point2f floatPixel(static_cast<Float>(pixel.x),
-                           static_cast<Float>(pixel.y));
-        const Pixel &statsPixel = GetPixel(pixel);
-        samplesFilm.AddSplat(floatPixel, Sampling(statsPixel));
-        varianceFilm.AddSplat(floatPixel, Variance(statsPixel));
-        errorFilm.AddSplat(floatPixel, Error(statsPixel));
+        Pixel statsPixel;
+        {
+            std::lock_guard<std::mutex> lock(StripeMutex(pixel));
+            statsPixel = LoadPixel(pixel);
+        }
+        RGBSpectrum variance = Variance(statsPixel);
+        RGBSpectrum error = Error(statsPixel);
+        values[offset] = Sampling(statsPixel);
+        for (int c = 0; c < nChannels; ++c) {
+            values[(1 + c) * nPixels + offset] = variance[c];
+            values[(1 + nChannels + c) * nPixels + offset] = error[c];
+        }
+        ++offset;
     }
 
-    samplesFilm.WriteImage();
-    varianceFilm.WriteImage();
-    errorFilm.WriteImage();
+    std::vector<const float *> channels;
+    for (size_t i = 0; i < channelNames.size(); ++i)
+        channels.push_back(&values[i * nPixels]);
+    const std::string &filename = originalFilm->filename;
+    std::string statsFilename =
+        filename.substr(0, filename.find_last_of('.')) + "_stats.exr";
+    LOG(INFO) << "Writing statistics image " << statsFilename;
+    WriteImageEXRChannels(statsFilename, channelNames, channels, pixelBounds,
+                          originalFilm->fullResolution);
+}
+
+Float Statistics::WriteInterval() const {
+    // Only time mode renders several batches, so that intermediate images
+    // are meaningful
+    return mode == Mode::TIME ? std::max(writeInterval, Float(0)) : 0;
 }
 
 bool Statistics::StartNextBatch(int number) {
     switch (mode)
     {
     case Mode::TIME:
-        return ElapsedMilliseconds() < (targetSeconds * 1000) && (number * batchSize) < maxSamples;
+        return ElapsedMilliseconds() < (targetSeconds * 1000) &&
+               (number * batchSize) < maxSamples &&
+               (endBatch == 0 || number < endBatch);
 
     default:
         if (batchOnce) {
@@ -76,103 +183,162 @@ long Statistics::BatchSize() const {
     return batchSize;
 }
 
-void Statistics::SamplingLoop(Point2i pixel, const SamplingFunctor &sampleOnce){
-    auto loop = [&]() {
-        UpdateStats(pixel, sampleOnce());
-    };
+std::vector<int> Statistics::NextTiles(
+    const std::vector<Float> &tileErrors,
+    const std::vector<int> &tileBatches) const {
+    CHECK_EQ(tileErrors.size(), tileBatches.size());
+    int nTiles = tileErrors.size();
+    std::vector<int> tiles;
+    if (mode != Mode::TIME) {
+        for (int i = 0; i < nTiles; ++i) tiles.push_back(i);
+        return tiles;
+    }
 
-    switch (mode)
-    {
-        case Mode::NORMAL:
-        {
-            for (long i = 0; i < maxSamples; ++i)
-                loop();
-            break;
-        }
-        case Mode::ERROR:
-        {
-            long i = 0;
-            for (; i < minSamples; ++i)
-                loop();
+    // Rank the tiles that can still take a batch by decreasing error
+    int maxBatches = 0;
+    for (int i = 0; i < nTiles; ++i) {
+        maxBatches = std::max(maxBatches, tileBatches[i]);
+        if (tileBatches[i] * batchSize < maxSamples) tiles.push_back(i);
+    }
+    std::stable_sort(tiles.begin(), tiles.end(), [&](int a, int b) {
+        return tileErrors[a] > tileErrors[b];
+    });
+
+    // Keep the noisiest tiles, and the ones that haven't been rendered yet
+    // or got less than their fair share of batches
+    int nNoisiest = std::max(1, (int)std::ceil(tileFraction * nTiles));
+    int n = 0;
+    for (size_t i = 0; i < tiles.size(); ++i) {
+        int tile = tiles[i];
+        if ((int)i < nNoisiest || tileBatches[tile] == 0 ||
+            tileBatches[tile] < tileFairness * maxBatches)
+            tiles[n++] = tile;
+    }
+    tiles.resize(n);
+    return tiles;
+}
 
-            while (!StopCriterion(pixel) && i < maxSamples)
-            {
-                ++i;
-                loop();
-            }
-            break;
-        }
-        case Mode::TIME:
-        {
-            for (long i = 0; i < BatchSize() && i < maxSamples; ++i)
-                loop();
-            break;
-        }
+Float Statistics::TileError(const Bounds2i &tileBounds) const {
+    Float sum = 0;
+    int n = 0;
+    for (Point2i pixel : Intersect(tileBounds, pixelBounds)) {
+        Pixel statsPixel = LoadPixel(pixel);
+        if (statsPixel.samples < 2) continue;
+        sum += Error(statsPixel).MaxComponentValue();
+        ++n;
+    }
+    return n > 0 ? sum / n : Infinity;
+}
+
+std::vector<Statistics::PixelBatch> Statistics::NextPixelBatches() const {
+    std::vector<PixelBatch> batches;
+    if (mode != Mode::ERROR)
+        return batches;
+
+    for (Point2i pixel : pixelBounds) {
+        // Skip the pixels that weren't rendered, or are done
+        Pixel statsPixel = LoadPixel(pixel);
+        long samples = statsPixel.samples;
+        if (samples == 0 || samples >= maxSamples || StopCriterion(statsPixel))
+            continue;
+
+        // The error decreases as the inverse square root of the number of
+        // samples; the estimate is noisy, so at most double the samples.
+        RGBSpectrum error = Error(statsPixel);
+        Float minError = std::min(error[0], std::min(error[1], error[2]));
+        Float needed = samples * (minError / errorThreshold) *
+                       (minError / errorThreshold);
+        long extra = (long)std::ceil(std::min(needed, Float(2 * samples))) -
+                     samples;
+        extra = std::min(std::max(extra, batchSize), maxSamples - samples);
+
+        for (long first = samples; first < samples + extra; first += batchSize)
+            batches.push_back({pixel, first,
+                               std::min(batchSize, samples + extra - first)});
     }
+    return batches;
+}
+
+void Statistics::PublishPixel(Point2i pixel, const Pixel &statsPixel) {
+    std::lock_guard<std::mutex> lock(StripeMutex(pixel));
+    StorePixel(pixel, statsPixel);
 }
 
 void Statistics::UpdateStats(Point2i pixel, Spectrum &&L) {
     if (!InsideExclusive(pixel, pixelBounds))
         return;
 
-    Pixel &statsPixel = GetPixel(pixel);
-    long &samples = statsPixel.samples;
-    Spectrum &mean = statsPixel.mean;
-    Spectrum &moment2 = statsPixel.moment2;
+    std::lock_guard<std::mutex> lock(StripeMutex(pixel));
+    Pixel statsPixel = LoadPixel(pixel);
+    UpdatePixel(statsPixel, L);
+    StorePixel(pixel, statsPixel);
+}
+
+void Statistics::MergePixel(Pixel &statsPixel, const Pixel &other) {
+    if (other.samples == 0)
+        return;
 
-    // Welford's online algorithm
-    samples = samples + 1;
-    Spectrum delta1 = L - mean;
-    mean += delta1 / samples;
-    Spectrum delta2 = L - mean;
-    moment2 += delta1 * delta2;
+    // Chan et al.'s parallel variant of Welford's algorithm
+    long samples = statsPixel.samples + other.samples;
+    Float weight = Float(other.samples) / samples;
+    for (int c = 0; c < 3; ++c) {
+        Float delta = other.mean[c] - statsPixel.mean[c];
+        statsPixel.mean[c] += delta * weight;
+        statsPixel.moment2[c] += other.moment2[c] +
+                                 delta * delta * (statsPixel.samples * weight);
+    }
+    statsPixel.samples = samples;
 }
 
 Float Statistics::Sampling(const Pixel &statsPixel) const {
-    return Float(statsPixel.samples - minSamples) / Float(maxSamples);
+    return Float(statsPixel.samples);
 }
 
-Spectrum Statistics::Variance(const Pixel &statsPixel) const {
-    return (statsPixel.samples > 1) ? statsPixel.moment2 / (statsPixel.samples - 1) : Spectrum(0);
+RGBSpectrum Statistics::Variance(const Pixel &statsPixel) const {
+    Float variance[3] = {0, 0, 0};
+    if (statsPixel.samples > 1)
+        for (int c = 0; c < nChannels; ++c)
+            variance[c] = statsPixel.moment2[c] / (statsPixel.samples - 1);
+    if (nChannels == 1)
+        variance[1] = variance[2] = variance[0];
+    return RGBSpectrum::FromRGB(variance);
 }
 
-Spectrum Statistics::Error(const Pixel &statsPixel) const {
-
-    static bool bIsErrorStandard = (errorHeuristic == "standard");
-    static bool bIsErrorRelative = (errorHeuristic == "relative");
-
-    Spectrum mean = statsPixel.mean;
-    Spectrum sigma = Sqrt(statsPixel.moment2 / std::pow(statsPixel.samples, 2));
+RGBSpectrum Statistics::Error(const Pixel &statsPixel) const {
+    Float samples = statsPixel.samples;
+    Float error[3];
+    for (int c = 0; c < nChannels; ++c) {
+        Float mean = statsPixel.mean[c];
+        Float sigma = std::sqrt(statsPixel.moment2[c] / (samples * samples));
 
-//    for (int i = 0; i < Spectrum::nSamples; ++i)
-//        if (mean[i] == 0.0) return Spectrum(0);
-
-    if (bIsErrorRelative)
-    {
-        return sigma;
-    }
-    else if (bIsErrorStandard)
-    {
-        constexpr Float EPSILON = 0.5f;
-        for (int i = 0; i < Spectrum::nSamples; ++i)
-            mean[i] = mean[i] > EPSILON ? mean[i] : EPSILON;
+        switch (errorHeuristic)
+        {
+            case ErrorHeuristic::RELATIVE:
+                error[c] = sigma;
+                break;
 
-        return sigma / mean;
-    }
-    else
-    {
-        LOG(ERROR) << "Undefined error heuristic";
-        return Spectrum(0);
+            case ErrorHeuristic::STANDARD:
+            {
+                constexpr Float EPSILON = 0.5f;
+                error[c] = sigma / std::max(mean, EPSILON);
+                break;
+            }
+        }
     }
+    if (nChannels == 1)
+        error[1] = error[2] = error[0];
+    return RGBSpectrum::FromRGB(error);
 }
 
 bool Statistics::StopCriterion(Point2i pixel) const {
     if (!InsideExclusive(pixel, pixelBounds))
         return true;
-    const Pixel &statsPixel = GetPixel(pixel);
+    return StopCriterion(LoadPixel(pixel));
+}
 
+bool Statistics::StopCriterion(const Pixel &statsPixel) const {
     // Control approximation error
-    Spectrum error = Error(statsPixel);
+    RGBSpectrum error = Error(statsPixel);
     return error[0] < errorThreshold || error[1] < errorThreshold || error[2] < errorThreshold;
 }
 
@@ -192,21 +358,92 @@ long Statistics::UpdateWork() {
     return mode == Mode::TIME ? 0 : 1;
 }
 
-Statistics::Pixel &Statistics::GetPixel(Point2i pixel) {
-    const auto *that = this;
-    return const_cast<Pixel &>(that->GetPixel(pixel));
+void Statistics::LoadPrior(const std::string &filename,
+                           long minPriorSamples) {
+    std::vector<std::vector<float>> channels;
+    Bounds2i dataWindow;
+    if (!ReadImageEXRChannels(filename,
+                              {"samples.Y", "error.Y", "error.R", "error.G",
+                               "error.B"},
+                              &channels, &dataWindow))
+        return;
+    const std::vector<float> &samples = channels[0];
+    bool luminance = !channels[1].empty();
+    bool rgb = !channels[2].empty() && !channels[3].empty() &&
+               !channels[4].empty();
+    if (samples.empty() || (!luminance && !rgb)) {
+        Warning("%s: no samples and error layers found. Ignoring the prior "
+                "statistics.", filename.c_str());
+        return;
+    }
+    if (dataWindow != pixelBounds) {
+        Warning("%s: prior statistics were written for different pixel "
+                "bounds. Ignoring them.", filename.c_str());
+        return;
+    }
+
+    // Predict the samples each pixel needs from its previous error, which
+    // decreases as the inverse square root of the number of samples
+    warmupSamples.assign(planeSize, (float)minSamples);
+    double totalSamples = 0;
+    int offset = 0;
+    for (Point2i pixel : pixelBounds) {
+        Float error = luminance ? channels[1][offset]
+                                : std::min(channels[2][offset],
+                                           std::min(channels[3][offset],
+                                                    channels[4][offset]));
+        Float previous = samples[offset++];
+        long warmup = minSamples;
+        if (previous > 0 && !std::isnan(error)) {
+            Float needed = previous * (error / errorThreshold) *
+                           (error / errorThreshold);
+            warmup = (long)std::ceil(std::min(needed, Float(maxSamples)));
+            warmup = Clamp(warmup, std::min(minPriorSamples, maxSamples),
+                           maxSamples);
+        }
+        warmupSamples[PixelOffset(pixel)] = warmup;
+        totalSamples += warmup;
+    }
+    LOG(INFO) << "Loaded prior statistics " << filename << ": " <<
+        totalSamples / pixelBounds.Area() << " warm-up samples per pixel "
+        "instead of " << minSamples;
+}
+
+long Statistics::WarmupSamples(Point2i pixel) const {
+    return warmupSamples.empty() ? minSamples
+                                 : (long)warmupSamples[PixelOffset(pixel)];
 }
 
-const Statistics::Pixel &Statistics::GetPixel(Point2i pixel) const {
+size_t Statistics::PixelOffset(Point2i pixel) const {
     CHECK(InsideExclusive(pixel, pixelBounds));
-    int width = pixelBounds.pMax.x - pixelBounds.pMin.x;
-    int offset = (pixel.x - pixelBounds.pMin.x)
-               + (pixel.y - pixelBounds.pMin.y) * width;
-    return pixels[offset];
+    Vector2i p = pixel - tileOrigin;
+    int tile = (p.y / tileSize) * nTilesX + p.x / tileSize;
+    return size_t(tile) * tileSize * tileSize +
+           (p.y % tileSize) * tileSize + p.x % tileSize;
+}
+
+Statistics::Pixel Statistics::LoadPixel(Point2i pixel) const {
+    size_t offset = PixelOffset(pixel);
+    Pixel statsPixel;
+    statsPixel.samples = (long)planes[offset];
+    for (int c = 0; c < nChannels; ++c) {
+        statsPixel.mean[c] = planes[(1 + c) * planeSize + offset];
+        statsPixel.moment2[c] = planes[(1 + nChannels + c) * planeSize + offset];
+    }
+    return statsPixel;
+}
+
+void Statistics::StorePixel(Point2i pixel, const Pixel &statsPixel) {
+    size_t offset = PixelOffset(pixel);
+    planes[offset] = (float)statsPixel.samples;
+    for (int c = 0; c < nChannels; ++c) {
+        planes[(1 + c) * planeSize + offset] = statsPixel.mean[c];
+        planes[(1 + nChannels + c) * planeSize + offset] = statsPixel.moment2[c];
+    }
 }
 
-std::unique_ptr<Filter> Statistics::StatImagesFilter() {
-    return std::unique_ptr<Filter>(new BoxFilter({0, 0}));
+std::mutex &Statistics::StripeMutex(Point2i pixel) const {
+    return stripeMutexes[(pixel.y - pixelBounds.pMin.y) / stripeHeight];
 }
 
 VolPathAdaptive::VolPathAdaptive(Statistics stats, int maxDepth,
@@ -217,102 +454,274 @@ VolPathAdaptive::VolPathAdaptive(Statistics stats, int maxDepth,
     : VolPathIntegrator(maxDepth, std::move(camera), sampler, pixelBounds,
                         rrThreshold, lightSampleStrategy),
       stats(std::move(stats)),
-      sampler(std::move(sampler)),
-      pixelBounds(pixelBounds) {}
+      sampler(std::move(sampler)) {}
 
-void VolPathAdaptive::Render(const Scene &scene) {
-    Preprocess(scene, *sampler);
+void Statistics::Render(const Scene &scene, const Camera &camera,
+                        Sampler &sampler, CameraSampleEstimator &estimator) {
+    estimator.PrepareSamples(scene, sampler);
+    const Bounds2i samplePixels = estimator.SampledPixels();
     // Render image tiles in parallel
 
     // Compute number of tiles, _nTiles_, to use for parallel rendering
-    Bounds2i sampleBounds = camera->film->GetSampleBounds();
+    Bounds2i sampleBounds = camera.film->GetSampleBounds();
     Vector2i sampleExtent = sampleBounds.Diagonal();
     const int tileSize = 16;
     Point2i nTiles((sampleExtent.x + tileSize - 1) / tileSize,
                    (sampleExtent.y + tileSize - 1) / tileSize);
 
-    stats.RenderBegin();
-    ProgressReporter reporter(nTiles.x * nTiles.y, stats.WorkTitle());
-    for (int batch = 0; stats.StartNextBatch(batch); ++batch) {
-        ParallelFor2D([&](Point2i tile) {
-            // Render section of image corresponding to _tile_
-
-            // Allocate _MemoryArena_ for tile
-            MemoryArena arena;
-
-            // Get sampler instance for tile
-            int seed = nTiles.x * nTiles.y * batch + nTiles.x * tile.y + tile.x;
-            std::unique_ptr<Sampler> tileSampler = sampler->Clone(seed);
+    // Light splats are normalized by the mean number of samples per pixel,
+    // which varies during adaptive renders
+    std::atomic<int64_t> totalSamples(0);
+    auto meanSamples = [&]() {
+        int64_t samples = totalSamples;
+        return samples > 0 ? Float(samples) / samplePixels.Area() : Float(1);
+    };
 
-            // Compute sample bounds for tile
-            int x0 = sampleBounds.pMin.x + tile.x * tileSize;
-            int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
-            int y0 = sampleBounds.pMin.y + tile.y * tileSize;
-            int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
-            Bounds2i tileBounds(Point2i(x0, y0), Point2i(x1, y1));
-            LOG(INFO) << "Starting image tile " << tileBounds;
+    // A uniformly scheduled time mode render renders the same batches in
+    // every tile, so it can resume from the checkpoint of its completed
+    // batches
+    const int nTileCount = nTiles.x * nTiles.y;
+    const std::string &checkpointFile = PbrtOptions.checkpointFile;
+    const bool uniformBatches = mode == Mode::TIME && tileFraction == 1;
+    const bool checkpointed = uniformBatches && !checkpointFile.empty();
+    const uint64_t jobId =
+        JobId(scene, *camera.film, sampler, typeid(estimator).name());
+    int firstBatch = startBatch;
+    int64_t samplesCompleted = 0;
+    if (checkpointed &&
+        camera.film->ReadCheckpoint(checkpointFile, jobId,
+                                    sampler.samplesPerPixel, sampler.name,
+                                    &samplesCompleted)) {
+        int resumeBatch = samplesCompleted / batchSize;
+        if (resumeBatch > firstBatch) {
+            if (!PbrtOptions.quiet)
+                printf("Resuming from checkpoint \"%s\" at batch %d\n",
+                       checkpointFile.c_str(), resumeBatch);
+            totalSamples = (std::min<int64_t>(samplesCompleted, maxSamples) -
+                            int64_t(firstBatch) * batchSize) *
+                           samplePixels.Area();
+            firstBatch = resumeBatch;
+        } else {
+            Warning("%s: checkpoint precedes batch %d. Ignoring it.",
+                    checkpointFile.c_str(), firstBatch);
+            camera.film->Clear();
+        }
+    } else if (!checkpointed && mode == Mode::TIME &&
+               !checkpointFile.empty())
+        Warning("Adaptive time mode only writes checkpoints with a uniform "
+                "schedule (\"tilefraction\" 1).");
+    auto lastCheckpoint = Clock::now();
+
+    RenderBegin();
+    ProgressReporter reporter(nTiles.x * nTiles.y, WorkTitle());
+
+    // Launch a thread that periodically writes the current image and
+    // statistics images, so that long renders can be monitored
+    std::mutex writerMutex;
+    std::condition_variable writerCondition;
+    bool renderDone = false;
+    std::thread writer;
+    if (WriteInterval() > 0) {
+        auto interval = std::chrono::duration<Float>(WriteInterval());
+        writer = std::thread([&]() {
+            std::unique_lock<std::mutex> lock(writerMutex);
+            while (!writerCondition.wait_for(lock, interval,
+                                             [&]() { return renderDone; })) {
+                lock.unlock();
+                LOG(INFO) << "Writing intermediate images after " <<
+                    ElapsedMilliseconds() << " ms";
+                camera.film->WriteImage(1 / meanSamples());
+                WriteImages();
+                ++nIntermediateWrites;
+                lock.lock();
+            }
+            ReportThreadStats();
+        });
+    }
 
-            // Get _FilmTile_ for tile
-            auto filmTile = camera->film->GetFilmTile(tileBounds);
+    // Track the error and the number of batches of each tile, so that the
+    // statistics can schedule the noisiest tiles first
+    std::vector<Float> tileErrors(nTileCount, Infinity);
+    std::vector<int> tileBatches(nTileCount, firstBatch);
+    while (StartNextBatch(
+        *std::min_element(tileBatches.begin(), tileBatches.end()))) {
+        std::vector<int> tiles = NextTiles(tileErrors, tileBatches);
+        if (tiles.empty()) break;
+
+        // With uniform batches, render the tiles in four passes by the
+        // parity of their coordinates, so that each pixel accumulates its
+        // samples in the same order whatever the number of threads and the
+        // checkpointed batches are bit-reproducible; other schedules render
+        // all the tiles in one pass. Tiles of a pass are _tileSize_ pixels
+        // apart, so their film tiles are only disjoint while the filter
+        // radius is below _tileSize_ / 2 = 8 pixels.
+        std::vector<int> passTiles[4];
+        for (int tileIndex : tiles)
+            passTiles[uniformBatches ? (tileIndex % nTiles.x) % 2 +
+                                           2 * ((tileIndex / nTiles.x) % 2)
+                                     : 0]
+                .push_back(tileIndex);
+        for (const std::vector<int> &pass : passTiles) {
+            if (pass.empty()) continue;
+            ParallelFor([&](int64_t i) {
+                // Render section of image corresponding to _tile_
+                int tileIndex = pass[i];
+                Point2i tile(tileIndex % nTiles.x, tileIndex / nTiles.x);
+                int batch = tileBatches[tileIndex];
+
+                // Allocate _MemoryArena_ for tile
+                MemoryArena arena;
+
+                // Get sampler instance for tile
+                std::unique_ptr<Sampler> tileSampler =
+                    sampler.Clone(BatchSeed(tileIndex, batch));
+
+                // Compute sample bounds for tile
+                int x0 = sampleBounds.pMin.x + tile.x * tileSize;
+                int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
+                int y0 = sampleBounds.pMin.y + tile.y * tileSize;
+                int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
+                Bounds2i tileBounds(Point2i(x0, y0), Point2i(x1, y1));
+                LOG(INFO) << "Starting image tile " << tileBounds;
+
+                // Get _FilmTile_ for tile
+                auto filmTile = camera.film->GetFilmTile(tileBounds);
+
+                // Loop over pixels in tile to render them
+                int64_t tileSamples = 0;
+                for (Point2i pixel : tileBounds) {
+                    {
+                        ProfilePhase pp(Prof::StartPixel);
+                        tileSampler->StartPixel(pixel);
+                        tileSampler->SetSampleNumber(batch * BatchSize());
+                    }
+
+                    // Do this check after the StartPixel() call; this keeps
+                    // the usage of RNG values from (most) Samplers that use
+                    // RNGs consistent, which improves reproducibility /
+                    // debugging.
+                    if (!InsideExclusive(pixel, samplePixels))
+                        continue;
+
+                    SamplingLoop(pixel, [&]() {
+                        ++tileSamples;
+                        return estimator.EstimateSample(
+                            pixel, scene, *tileSampler, filmTile.get(), arena);
+                    });
+                }
+                totalSamples += tileSamples;
+                LOG(INFO) << "Finished image tile " << tileBounds;
+
+                // Merge image tile into _Film_
+                camera.film->MergeFilmTile(std::move(filmTile));
+                reporter.Update(UpdateWork());
+
+                // Each tile appears once in _tiles_, so its entries can be
+                // updated without synchronization
+                tileErrors[tileIndex] = TileError(tileBounds);
+                ++tileBatches[tileIndex];
+            }, pass.size());
+        }
 
-            // Loop over pixels in tile to render them
-            for (Point2i pixel : tileBounds) {
+        // Checkpoint the completed batches between rounds, when the film is
+        // consistent
+        if (checkpointed &&
+            std::chrono::duration<Float>(Clock::now() - lastCheckpoint)
+                    .count() >= PbrtOptions.flushSeconds) {
+            camera.film->WriteCheckpoint(
+                checkpointFile, jobId, sampler.samplesPerPixel, sampler.name,
+                int64_t(tileBatches[0]) * batchSize);
+            lastCheckpoint = Clock::now();
+        }
+    }
+    int completedBatches =
+        *std::min_element(tileBatches.begin(), tileBatches.end());
+    nCompletedBatches = completedBatches;
+    if (mode == Mode::TIME)
+        LOG(INFO) << "Completed batches [" << firstBatch << ", " <<
+            completedBatches << ")";
+    // Unlike _SamplerIntegrator_'s, the final checkpoint is kept: it holds
+    // the raw accumulators of this chunk of batches, to be merged with the
+    // other chunks or resumed later
+    if (checkpointed)
+        camera.film->WriteCheckpoint(checkpointFile, jobId,
+                                     sampler.samplesPerPixel, sampler.name,
+                                     int64_t(completedBatches) * batchSize);
+
+    // In error mode, finish the pixels that didn't converge during the tile
+    // pass in rounds of _PixelBatch_es, so that their remaining samples are
+    // spread over all the threads instead of stalling the last tiles
+    for (int round = 1;; ++round) {
+        std::vector<PixelBatch> batches = NextPixelBatches();
+        if (batches.empty()) break;
+        LOG(INFO) << "Starting straggler round " << round << " with " <<
+            batches.size() << " pixel batches";
+        nStragglerBatches += batches.size();
+
+        // Group a few batches per task to amortize the arena and sampler
+        const int64_t chunkSize = 16;
+        int64_t nChunks = (batches.size() + chunkSize - 1) / chunkSize;
+        ParallelFor([&](int64_t chunk) {
+            MemoryArena arena;
+            std::unique_ptr<Sampler> batchSampler =
+                sampler.Clone(BatchSeed((int)chunk, -round));
+            int64_t end = std::min<int64_t>((chunk + 1) * chunkSize,
+                                            batches.size());
+            for (int64_t i = chunk * chunkSize; i < end; ++i) {
+                const PixelBatch &batch = batches[i];
+                Point2i pixel = batch.pixel;
                 {
                     ProfilePhase pp(Prof::StartPixel);
-                    tileSampler->StartPixel(pixel);
-                    tileSampler->SetSampleNumber(batch * stats.BatchSize());
+                    batchSampler->StartPixel(pixel);
+                    batchSampler->SetSampleNumber(batch.firstSample);
                 }
-
-                // Do this check after the StartPixel() call; this keeps
-                // the usage of RNG values from (most) Samplers that use
-                // RNGs consistent, which improves reproducibility /
-                // debugging.
-                if (!InsideExclusive(pixel, pixelBounds))
-                    continue;
-
-                stats.SamplingLoop(pixel, [&]() {
-                    // Initialize _CameraSample_ for current sample
-                    CameraSample cameraSample =
-                        tileSampler->GetCameraSample(pixel);
-
-                    // Generate camera ray for current sample
-                    RayDifferential ray;
-                    Float rayWeight =
-                        camera->GenerateRayDifferential(cameraSample, &ray);
-                    ray.ScaleDifferentials(
-                        1 / std::sqrt((Float)tileSampler->samplesPerPixel));
-                    ++nCameraRays;
-
-                    // Evaluate radiance along camera ray
-                    Spectrum L(0.f);
-                    if (rayWeight > 0)
-                        L = Li(ray, scene, *tileSampler, arena, 0);
-
-                    // Add camera ray's contribution to image
-                    filmTile->AddSample(cameraSample.pFilm, L, rayWeight);
-
-                    // Free _MemoryArena_ memory from computing image sample
-                    // value
-                    arena.Reset();
-
-                    tileSampler->StartNextSample();
-                    return L;
+                auto filmTile = camera.film->GetFilmTile(
+                    Bounds2i(pixel, pixel + Vector2i(1, 1)));
+                SampleBatch(batch, [&]() {
+                    return estimator.EstimateSample(pixel, scene, *batchSampler,
+                                                    filmTile.get(), arena);
                 });
+                camera.film->MergeFilmTile(std::move(filmTile));
+                totalSamples += batch.nSamples;
             }
-            LOG(INFO) << "Finished image tile " << tileBounds;
-
-            // Merge image tile into _Film_
-            camera->film->MergeFilmTile(std::move(filmTile));
-            reporter.Update(stats.UpdateWork());
-        }, nTiles);
+        }, nChunks);
     }
     reporter.Done();
     LOG(INFO) << "Rendering finished";
-    stats.RenderEnd();
+    RenderEnd();
+
+    if (writer.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(writerMutex);
+            renderDone = true;
+        }
+        writerCondition.notify_one();
+        writer.join();
+    }
 
     // Save final image after rendering
-    camera->film->WriteImage();
-    stats.WriteImages();
+    camera.film->WriteImage(1 / meanSamples());
+    WriteImages();
+}
+
+void VolPathAdaptive::Render(const Scene &scene) {
+    stats.Render(scene, *camera, *sampler, *this);
+}
+
+AdaptiveIntegrator::AdaptiveIntegrator(Statistics stats,
+                                       std::unique_ptr<Integrator> integrator,
+                                       std::shared_ptr<const Camera> camera,
+                                       std::shared_ptr<Sampler> sampler)
+    : stats(std::move(stats)),
+      integrator(std::move(integrator)),
+      estimator(dynamic_cast<CameraSampleEstimator *>(this->integrator.get())),
+      camera(std::move(camera)),
+      sampler(std::move(sampler)) {
+    CHECK(estimator);
+}
+
+void AdaptiveIntegrator::Render(const Scene &scene) {
+    stats.Render(scene, *camera, *sampler, *estimator);
 }
 
 VolPathAdaptive *CreateVolPathAdaptive(const ParamSet &params,
@@ -342,4 +751,22 @@ VolPathAdaptive *CreateVolPathAdaptive(const ParamSet &params,
                                lightStrategy);
 }
 
+Integrator *MakeAdaptive(Integrator *integrator, const std::string &name,
+                         const ParamSet &params,
+                         std::shared_ptr<Sampler> sampler,
+                         std::shared_ptr<const Camera> camera) {
+    std::string mode = params.FindOneString("mode", "normal");
+    if (!integrator || (mode != "error" && mode != "time"))
+        return integrator;
+
+    if (!dynamic_cast<CameraSampleEstimator *>(integrator)) {
+        Warning("\"%s\" integrator doesn't support the \"%s\" mode. "
+                "Ignoring it.", name.c_str(), mode.c_str());
+        return integrator;
+    }
+    return new AdaptiveIntegrator({params, camera->film, *sampler},
+                                  std::unique_ptr<Integrator>(integrator),
+                                  camera, sampler);
+}
+
 }  // namespace pbrt
@@ -11,7 +11,7 @@
 #include "film.h"
 #include "volpath.h"
 #include <chrono>
-#include <functional>
+#include <mutex>
 
 namespace pbrt {
 
@@ -24,75 +24,148 @@ class Statistics {
     // - time: render with a fixed target computation time
     enum class Mode {NORMAL, ERROR, TIME};
 
+    // The error heuristics, resolved once from the .pbrt scene file:
+    // - relative: the standard deviation of the mean
+    // - standard: the standard deviation of the mean divided by the mean
+    enum class ErrorHeuristic {RELATIVE, STANDARD};
+
     // A steady clock gives the most robust estimation of computation time
     using Clock = std::chrono::steady_clock;
 
-    // The _SamplingFunctor_ is given by the integrator to the _Statistics_
-    // instance. It allows the _Statistics_ instance to draw an arbitrary number
-    // of samples at a given pixel. The functor does not take any parameter and
-    // returns a Spectrum value, thus its signature is Spectrum(void).
-    using SamplingFunctor = std::function<Spectrum()>;
-
 public:
     // The object keeps a 2D grid _Pixel_s up to date during the render. A
     // _Pixel_ holds the three base statistics needed to evaluate statistics:
     // - number of samples that were drawn at the pixel
     // - mean of the sample distribution
     // - second moment of the sample distribution
+    // The sample values are tracked either as RGB, or as luminance only, in
+    // which case only the first channel is used.
     struct Pixel {
         long samples = 0;
-        Spectrum mean = 0;
-        Spectrum moment2 = 0;
+        Float mean[3] = {0, 0, 0};
+        Float moment2[3] = {0, 0, 0};
+    };
+
+    // A range of samples to draw at a single pixel, used in error mode to
+    // finish the pixels that didn't converge during the tile pass
+    struct PixelBatch {
+        Point2i pixel;
+        long firstSample;
+        long nSamples;
     };
 
     Statistics(const ParamSet &paramSet, const Film *originalFilm,
                const Sampler &sampler);
 
+    // Runs the whole render loop, and writes the image and the statistics
+    // images. The tiles are scheduled according to the mode, the pixels that
+    // didn't converge during the tile pass are finished in rounds, and
+    // intermediate images are written in time mode.
+    // @param camera The camera whose film is rendered
+    // @param sampler The sampler cloned for each tile
+    // @param estimator The integrator, which estimates each camera sample
+    void Render(const Scene &scene, const Camera &camera, Sampler &sampler,
+                CameraSampleEstimator &estimator);
+
     // Utility functions that are called only once during the render
     void RenderBegin();
     void RenderEnd() const;
+
+    // Writes the samples, variance and error images. It can be called while
+    // other threads are still sampling, e.g. to write intermediate results.
     void WriteImages() const;
 
+    // @return The period, in seconds, at which intermediate images should be
+    //         written while rendering, or 0 if they should not be written
+    Float WriteInterval() const;
+
     // Determines if a new batch should be rendered. By default, only one batch
     // will be rendered regardless of the total rendering time and batch index.
-    // @param number The index of the batch that is about to be rendered
+    // In time mode, batches are rendered until the target time or the end
+    // batch is reached.
+    // @param number The fewest batches that any tile has received so far
     // @return If the next batch should be rendered
     bool StartNextBatch(int number);
 
+    // Chooses the tiles that are rendered in the next batch. In time mode,
+    // the tiles are ranked by their error and only the noisiest ones are
+    // returned, together with any tile that fell below the fairness floor.
+    // Other modes render every tile.
+    // @param tileErrors The last _TileError_ of each tile, or infinity if the
+    //                   tile was not rendered yet
+    // @param tileBatches The number of batches each tile has received
+    // @return The indices of the tiles to render, noisiest first
+    std::vector<int> NextTiles(const std::vector<Float> &tileErrors,
+                               const std::vector<int> &tileBatches) const;
+
+    // @param tileBounds The pixels covered by a tile
+    // @return The mean error of the tile pixels, used to rank the tiles. It
+    //         should only be called by the thread that renders the tile.
+    Float TileError(const Bounds2i &tileBounds) const;
+
     // @return the number of samples a batch contains
     long BatchSize() const;
 
     // This function controls the rendering process using the information that
     // is given by the integrator and the statistics. By default, it just draw
     // the same number of samples throughout the image while updating the
-    // statistics.
+    // statistics. It is a template so that the functor, called once per
+    // sample, can be inlined.
     // @param pixel The pixel being rendered, rounded to the nearest position
-    // @param sampleOnce The functor given by the integrator. Calling it draw
-    //                   generates exactly one random sample. Usually a lambda.
-    void SamplingLoop(Point2i pixel, const SamplingFunctor &sampleOnce);
+    // @param sampleOnce The functor given by the integrator. It does not take
+    //                   any parameter, and calling it generates exactly one
+    //                   random sample, returned as a Spectrum. Usually a
+    //                   lambda.
+    template <typename SamplingFunctor>
+    void SamplingLoop(Point2i pixel, SamplingFunctor &&sampleOnce);
+
+    // In error mode, returns the work needed to finish the pixels that have
+    // not converged yet, split in _PixelBatch_es that can be sampled
+    // concurrently, even for a single pixel. Each pixel gets the number of
+    // samples its current error predicts it needs to converge, but at most
+    // twice its current count. It must not be called while sampling.
+    // @return The batches of the next round, or nothing if the render is over
+    std::vector<PixelBatch> NextPixelBatches() const;
+
+    // Draws the samples of a _PixelBatch_ and merges them into the pixel
+    // statistics. Several batches of the same pixel can be sampled
+    // concurrently.
+    // @param batch The pixel and the range of samples to draw
+    // @param sampleOnce The functor given by the integrator, see
+    //                   _SamplingLoop_
+    template <typename SamplingFunctor>
+    void SampleBatch(const PixelBatch &batch, SamplingFunctor &&sampleOnce);
 
     // Update the statistics grid to account for a newly sampled value.
     // @param pixel The pixel where the samples was drawn
     // @param L The newly obtained _Spectrum_ value
     void UpdateStats(Point2i pixel, Spectrum &&L);
 
+    // Update a single _Pixel_ to account for a newly sampled value, using
+    // Welford's online algorithm.
+    void UpdatePixel(Pixel &statsPixel, const Spectrum &L) const;
+
+    // Combine the statistics of two disjoint sets of samples of a pixel.
+    static void MergePixel(Pixel &statsPixel, const Pixel &other);
+
     // @param statsPixel The three base statistics
-    // @return Either the total number of drawn samples, or the ratio of
-    //         additional samples that were used
+    // @return The total number of drawn samples
     Float Sampling(const Pixel &statsPixel) const;
 
     // @param statsPixel The three base statistics
-    // @return The estimated variance
-    Spectrum Variance(const Pixel &statsPixel) const;
+    // @return The estimated variance, per RGB channel
+    RGBSpectrum Variance(const Pixel &statsPixel) const;
 
     // @param statsPixel The three base statistics
-    // @return The estimation error according to the chosen heuristic
-    Spectrum Error(const Pixel &statsPixel) const;
+    // @return The estimation error according to the chosen heuristic, per
+    //         RGB channel
+    RGBSpectrum Error(const Pixel &statsPixel) const;
 
     // A criterion to determine if a given pixel has converged or not.
     // @return If the pixel should stop being rendered, e.g. if the maximum
     //         number of samples was reached || the error is below the threshold
     bool StopCriterion(Point2i pixel) const;
+    bool StopCriterion(const Pixel &statsPixel) const;
 
     // @return The elapsed time from the beginning of the render, is ms
     long ElapsedMilliseconds() const;
@@ -113,21 +186,55 @@ private:
     const long minSamples;
     // - the error threshold that should be reached by each pixel
     const float errorThreshold;
-    // - the chosen error heuristic (relative, standard, confidence...)
-    const std::string errorHeuristic;
+    // - the chosen error heuristic (relative, standard...)
+    const ErrorHeuristic errorHeuristic;
+    // - the number of samples drawn between two convergence tests
+    const long stopCheckInterval;
+    // - the number of samples a pixel can take during the tile pass, the
+    //   rest being drawn in rounds shared by all the threads
+    const long stragglerSamples;
+    // - optionally, the number of samples drawn at each pixel before its
+    //   first convergence test, predicted from a previous frame's
+    //   statistics. It is stored in the same tiled layout as _planes_.
+    std::vector<float> warmupSamples;
 
     // For time mode:
     // - the number of samples a batch contains
     const long batchSize;
     // - the target time
     const long targetSeconds;
-
-    // Original film used to construct the statistics images
+    // - the period at which intermediate images are written
+    const Float writeInterval;
+    // - the fraction of the tiles, ranked by error, rendered in each batch
+    const Float tileFraction;
+    // - the fairness floor: each tile gets at least this fraction of the
+    //   batches of the most sampled tile
+    const Float tileFairness;
+    // - the range of batches [startBatch, endBatch) to render, so that a
+    //   long render can be split in chunks; _endBatch_ is 0 when unbounded.
+    //   Setting either forces a uniform schedule (_tileFraction_ of 1).
+    const int startBatch;
+    const int endBatch;
+
+    // Original film used to name the statistics images
     const Film *originalFilm;
     // Film size
     const Bounds2i pixelBounds;
-    // Pixel data updated with each sample, and exported after the render
-    std::unique_ptr<Pixel[]> pixels;
+    // The number of channels tracked per pixel: 3 for RGB, 1 for luminance
+    const int nChannels;
+    // Pixel data updated with each sample, and exported after the render. It
+    // is stored as float planes (sample count, then the mean and second
+    // moment of each channel), each laid out in the same 16x16 tiles as the
+    // render, starting at _tileOrigin_, so that a tile's pixels are close.
+    static PBRT_CONSTEXPR int tileSize = 16;
+    const Point2i tileOrigin;
+    int nTilesX;
+    size_t planeSize;
+    std::unique_ptr<float[]> planes;
+    // Pixels are published under per-stripe locks covering _stripeHeight_
+    // consecutive rows each, so that they can be read while rendering.
+    static PBRT_CONSTEXPR int stripeHeight = 4;
+    std::unique_ptr<std::mutex[]> stripeMutexes;
 
     // Starting time of the render
     Clock::time_point startTime;
@@ -135,13 +242,104 @@ private:
     bool batchOnce = true;
 
     // Access functions to the stored pixels grid;
-    Pixel &GetPixel(Point2i pixel);
-    const Pixel &GetPixel(Point2i pixel) const;
-
-    // Just a dummy filter to construct the statistics films
-    static std::unique_ptr<Filter> StatImagesFilter();
+    size_t PixelOffset(Point2i pixel) const;
+    Pixel LoadPixel(Point2i pixel) const;
+    void StorePixel(Point2i pixel, const Pixel &statsPixel);
+    std::mutex &StripeMutex(Point2i pixel) const;
+
+    // Stores the statistics accumulated by _SamplingLoop_ for a pixel
+    void PublishPixel(Point2i pixel, const Pixel &statsPixel);
+
+    // Sets _warmupSamples_ from the statistics image of a previous frame,
+    // written by _WriteImages_. _minPriorSamples_ bounds the budget of pixels
+    // that converged quickly.
+    void LoadPrior(const std::string &filename, long minPriorSamples);
+
+    // @return The number of samples to draw at a pixel before testing for
+    //         convergence in error mode
+    long WarmupSamples(Point2i pixel) const;
 };
 
+template <typename SamplingFunctor>
+inline void Statistics::SamplingLoop(Point2i pixel,
+                                     SamplingFunctor &&sampleOnce) {
+    // Samples are accumulated in a local copy of the pixel, which is
+    // published once the loop is done. Only the calling thread updates this
+    // pixel, so its current value can be read without locking.
+    const bool inside = InsideExclusive(pixel, pixelBounds);
+    Pixel statsPixel = inside ? LoadPixel(pixel) : Pixel();
+
+    switch (mode)
+    {
+        case Mode::NORMAL:
+        {
+            for (long i = 0; i < maxSamples; ++i)
+                UpdatePixel(statsPixel, sampleOnce());
+            break;
+        }
+        case Mode::ERROR:
+        {
+            // Only test for convergence every _stopCheckInterval_ samples.
+            // Pixels that need more than _stragglerSamples_ are finished by
+            // _NextPixelBatches_ rounds, instead of stalling their tile.
+            long tileSamples = std::min(maxSamples, stragglerSamples);
+            long warmup = inside ? std::min(WarmupSamples(pixel), tileSamples)
+                                 : minSamples;
+            long i = 0;
+            for (; i < warmup; ++i)
+                UpdatePixel(statsPixel, sampleOnce());
+
+            while (inside && i < tileSamples && !StopCriterion(statsPixel))
+            {
+                long end = std::min(i + stopCheckInterval, tileSamples);
+                for (; i < end; ++i)
+                    UpdatePixel(statsPixel, sampleOnce());
+            }
+            break;
+        }
+        case Mode::TIME:
+        {
+            for (long i = 0; i < BatchSize() && i < maxSamples; ++i)
+                UpdatePixel(statsPixel, sampleOnce());
+            break;
+        }
+    }
+
+    if (inside)
+        PublishPixel(pixel, statsPixel);
+}
+
+template <typename SamplingFunctor>
+inline void Statistics::SampleBatch(const PixelBatch &batch,
+                                    SamplingFunctor &&sampleOnce) {
+    Pixel statsPixel;
+    for (long i = 0; i < batch.nSamples; ++i)
+        UpdatePixel(statsPixel, sampleOnce());
+
+    std::lock_guard<std::mutex> lock(StripeMutex(batch.pixel));
+    Pixel merged = LoadPixel(batch.pixel);
+    MergePixel(merged, statsPixel);
+    StorePixel(batch.pixel, merged);
+}
+
+inline void Statistics::UpdatePixel(Pixel &statsPixel,
+                                    const Spectrum &L) const {
+    Float value[3];
+    if (nChannels == 1)
+        value[0] = L.y();
+    else
+        L.ToRGB(value);
+
+    // Welford's online algorithm
+    long samples = ++statsPixel.samples;
+    for (int c = 0; c < nChannels; ++c) {
+        Float delta1 = value[c] - statsPixel.mean[c];
+        statsPixel.mean[c] += delta1 / samples;
+        Float delta2 = value[c] - statsPixel.mean[c];
+        statsPixel.moment2[c] += delta1 * delta2;
+    }
+}
+
 // VolPathAdaptive is similar to the original VolPathIntegrator, except for the
 // Render function that is configured to use Statistics.
 class VolPathAdaptive : public VolPathIntegrator {
@@ -160,13 +358,40 @@ private:
     // control the rendering loop
     Statistics stats;
     std::shared_ptr<Sampler> sampler;
-    const Bounds2i pixelBounds;
+};
+
+// AdaptiveIntegrator renders with any integrator that implements
+// _CameraSampleEstimator_ (e.g. "path" or "bdpt"), under the control of
+// _Statistics_. It is used when the error or time modes are requested for
+// those integrators.
+class AdaptiveIntegrator : public Integrator {
+public:
+    AdaptiveIntegrator(Statistics stats, std::unique_ptr<Integrator> integrator,
+                       std::shared_ptr<const Camera> camera,
+                       std::shared_ptr<Sampler> sampler);
+
+    void Render(const Scene &scene) override;
+
+private:
+    Statistics stats;
+    std::unique_ptr<Integrator> integrator;
+    CameraSampleEstimator *estimator;
+    std::shared_ptr<const Camera> camera;
+    std::shared_ptr<Sampler> sampler;
 };
 
 VolPathAdaptive *CreateVolPathAdaptive(const ParamSet &params,
                                        std::shared_ptr<Sampler> sampler,
                                        std::shared_ptr<const Camera> camera);
 
+// Wraps _integrator_ in an _AdaptiveIntegrator_ if _params_ request the error
+// or time modes; returns it unchanged otherwise, or if it doesn't support
+// them.
+Integrator *MakeAdaptive(Integrator *integrator, const std::string &name,
+                         const ParamSet &params,
+                         std::shared_ptr<Sampler> sampler,
+                         std::shared_ptr<const Camera> camera);
+
 }  // namespace pbrt
 
 #endif  // PBRT_INTEGRATORS_ADAPTIVE_H
\ No newline at end of file
@@ -38,6 +38,7 @@
 #include "camera.h"
 #include "film.h"
 #include "scene.h"
+#include "parallel.h"
 
 namespace pbrt {
 
@@ -54,51 +55,70 @@ AOIntegrator::AOIntegrator(bool cosSample, int ns,
     sampler->Request2DArray(nSamples);
 }
 
-Spectrum AOIntegrator::Li(const RayDifferential &r, const Scene &scene,
+void AOIntegrator::Preprocess(const Scene &scene, Sampler &sampler) {
+    shadowRays.resize(MaxThreadIndex());
+}
+
+Spectrum AOIntegrator::Li(const RayDifferential &ray, const Scene &scene,
                           Sampler &sampler, MemoryArena &arena,
                           int depth) const {
+    // Intersect _ray_ with scene and store intersection in _isect_
+    SurfaceInteraction isect;
+    bool hit = scene.Intersect(ray, &isect);
+    return LiFromHit(ray, hit ? &isect : nullptr, scene, sampler, arena);
+}
+
+Spectrum AOIntegrator::LiFromHit(const RayDifferential &r,
+                                 SurfaceInteraction *isect,
+                                 const Scene &scene, Sampler &sampler,
+                                 MemoryArena &arena) const {
     ProfilePhase p(Prof::SamplerIntegratorLi);
     Spectrum L(0.f);
     RayDifferential ray(r);
 
-    // Intersect _ray_ with scene and store intersection in _isect_
-    SurfaceInteraction isect;
- retry:
-    if (scene.Intersect(ray, &isect)) {
-        isect.ComputeScatteringFunctions(ray, arena, true);
-        if (!isect.bsdf) {
-            VLOG(2) << "Skipping intersection due to null bsdf";
-            ray = isect.SpawnRay(ray.d);
-            goto retry;
+    // Skip past surfaces without a BSDF
+    while (isect) {
+        isect->ComputeScatteringFunctions(ray, arena, true);
+        if (isect->bsdf) break;
+        VLOG(2) << "Skipping intersection due to null bsdf";
+        ray = isect->SpawnRay(ray.d);
+        if (!scene.Intersect(ray, isect)) isect = nullptr;
+    }
+    if (!isect) return L;
+
+    // Compute coordinate frame based on true geometry, not shading
+    // geometry.
+    Normal3f n = Faceforward(isect->n, -ray.d);
+    Vector3f s = Normalize(isect->dpdu);
+    Vector3f t = Cross(isect->n, s);
+
+    // Generate all of the ambient occlusion rays and trace them as a batch
+    const Point2f *u = sampler.Get2DArray(nSamples);
+    RayBatch &batch = shadowRays[ThreadIndex];
+    batch.Clear();
+    Float *weights = arena.Alloc<Float>(nSamples);
+    for (int i = 0; i < nSamples; ++i) {
+        Vector3f wi;
+        Float pdf;
+        if (cosSample) {
+            wi = CosineSampleHemisphere(u[i]);
+            pdf = CosineHemispherePdf(std::abs(wi.z));
+        } else {
+            wi = UniformSampleHemisphere(u[i]);
+            pdf = UniformHemispherePdf();
         }
 
-        // Compute coordinate frame based on true geometry, not shading
-        // geometry.
-        Normal3f n = Faceforward(isect.n, -ray.d);
-        Vector3f s = Normalize(isect.dpdu);
-        Vector3f t = Cross(isect.n, s);
-
-        const Point2f *u = sampler.Get2DArray(nSamples);
-        for (int i = 0; i < nSamples; ++i) {
-            Vector3f wi;
-            Float pdf;
-            if (cosSample) {
-                wi = CosineSampleHemisphere(u[i]);
-                pdf = CosineHemispherePdf(std::abs(wi.z));
-            } else {
-                wi = UniformSampleHemisphere(u[i]);
-                pdf = UniformHemispherePdf();
-            }
-
-            // Transform wi from local frame to world space.
-            wi = Vector3f(s.x * wi.x + t.x * wi.y + n.x * wi.z,
-                          s.y * wi.x + t.y * wi.y + n.y * wi.z,
-                          s.z * wi.x + t.z * wi.y + n.z * wi.z);
-
-            if (!scene.IntersectP(isect.SpawnRay(wi)))
-                L += Dot(wi, n) / (pdf * nSamples);
-        }
+        // Transform wi from local frame to world space.
+        wi = Vector3f(s.x * wi.x + t.x * wi.y + n.x * wi.z,
+                      s.y * wi.x + t.y * wi.y + n.y * wi.z,
+                      s.z * wi.x + t.z * wi.y + n.z * wi.z);
+
+        batch.Add(isect->SpawnRay(wi));
+        weights[i] = Dot(wi, n) / (pdf * nSamples);
     }
+    scene.IntersectP(batch);
+    for (int i = 0; i < nSamples; ++i)
+        if (!batch.hit[i]) L += weights[i];
     return L;
 }
 
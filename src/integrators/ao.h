@@ -54,9 +54,18 @@ class AOIntegrator : public SamplerIntegrator {
                  const Bounds2i &pixelBounds);
     Spectrum Li(const RayDifferential &ray, const Scene &scene,
                 Sampler &sampler, MemoryArena &arena, int depth) const;
+    bool BatchCameraRays() const { return true; }
+    Spectrum LiFromHit(const RayDifferential &ray, SurfaceInteraction *isect,
+                       const Scene &scene, Sampler &sampler,
+                       MemoryArena &arena) const;
+    void Preprocess(const Scene &scene, Sampler &sampler);
+
  private:
     bool cosSample;
     int nSamples;
+    // Ambient occlusion rays of the shading point each thread is working
+    // on, indexed by _ThreadIndex_ so their storage is reused
+    mutable std::vector<RayBatch> shadowRays;
 };
 
 AOIntegrator *CreateAOIntegrator(const ParamSet &params,
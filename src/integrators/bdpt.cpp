@@ -299,17 +299,93 @@ inline int BufferIndex(int s, int t) {
     return s + above * (5 + above) / 2;
 }
 
-void BDPTIntegrator::Render(const Scene &scene) {
-    std::unique_ptr<LightDistribution> lightDistribution =
+void BDPTIntegrator::PrepareSamples(const Scene &scene, Sampler &sampler) {
+    lightDistribution =
         CreateLightSampleDistribution(lightSampleStrategy, scene);
 
     // Compute a reverse mapping from light pointers to offsets into the
     // scene lights vector (and, equivalently, offsets into
     // lightDistr). Added after book text was finalized; this is critical
     // to reasonable performance with 100s+ of light sources.
-    std::unordered_map<const Light *, size_t> lightToIndex;
+    lightToIndex.clear();
     for (size_t i = 0; i < scene.lights.size(); ++i)
         lightToIndex[scene.lights[i].get()] = i;
+}
+
+Spectrum BDPTIntegrator::EstimateSample(const Point2i &pixel,
+                                        const Scene &scene, Sampler &sampler,
+                                        FilmTile *filmTile,
+                                        MemoryArena &arena) const {
+    Spectrum L(0.f);
+    if (scene.lights.size() > 0)
+        L = SampleBDPT(pixel, scene, sampler, filmTile, arena, nullptr);
+    sampler.StartNextSample();
+    return L;
+}
+
+Spectrum BDPTIntegrator::SampleBDPT(
+    const Point2i &pPixel, const Scene &scene, Sampler &sampler,
+    FilmTile *filmTile, MemoryArena &arena,
+    std::vector<std::unique_ptr<Film>> *weightFilms) const {
+    // Generate a single sample using BDPT
+    Film *film = camera->film;
+    Point2f pFilm = (Point2f)pPixel + sampler.Get2D();
+
+    // Trace the camera subpath
+    Vertex *cameraVertices = arena.Alloc<Vertex>(maxDepth + 2);
+    Vertex *lightVertices = arena.Alloc<Vertex>(maxDepth + 1);
+    int nCamera = GenerateCameraSubpath(scene, sampler, arena, maxDepth + 2,
+                                        *camera, pFilm, cameraVertices);
+    // Get a distribution for sampling the light at the start of the light
+    // subpath. Because the light path follows multiple bounces, basing the
+    // sampling distribution on any of the vertices of the camera path is
+    // unlikely to be a good strategy. We use the PowerLightDistribution by
+    // default here, which doesn't use the point passed to it.
+    const Distribution1D *lightDistr =
+        lightDistribution->Lookup(cameraVertices[0].p());
+    // Now trace the light subpath
+    int nLight = GenerateLightSubpath(scene, sampler, arena, maxDepth + 1,
+                                      cameraVertices[0].time(), *lightDistr,
+                                      lightToIndex, lightVertices);
+
+    // Execute all BDPT connection strategies
+    Spectrum L(0.f);
+    for (int t = 1; t <= nCamera; ++t) {
+        for (int s = 0; s <= nLight; ++s) {
+            int depth = t + s - 2;
+            if ((s == 1 && t == 1) || depth < 0 || depth > maxDepth)
+                continue;
+            // Execute the $(s, t)$ connection strategy and update _L_
+            Point2f pFilmNew = pFilm;
+            Float misWeight = 0.f;
+            Spectrum Lpath = ConnectBDPT(scene, lightVertices, cameraVertices,
+                                         s, t, *lightDistr, lightToIndex,
+                                         *camera, sampler, &pFilmNew,
+                                         &misWeight);
+            VLOG(2) << "Connect bdpt s: " << s <<", t: " << t <<
+                ", Lpath: " << Lpath << ", misWeight: " << misWeight;
+            if (weightFilms) {
+                Spectrum value;
+                if (visualizeStrategies)
+                    value = misWeight == 0 ? 0 : Lpath / misWeight;
+                if (visualizeWeights) value = Lpath;
+                (*weightFilms)[BufferIndex(s, t)]->AddSplat(pFilmNew, value);
+            }
+            if (t != 1)
+                L += Lpath;
+            else
+                film->AddSplat(pFilmNew, Lpath);
+        }
+    }
+    VLOG(2) << "Add film sample pFilm: " << pFilm << ", L: " << L <<
+        ", (y: " << L.y() << ")";
+    filmTile->AddSample(pFilm, L);
+    arena.Reset();
+    return L;
+}
+
+void BDPTIntegrator::Render(const Scene &scene) {
+    PrepareSamples(scene, *sampler);
 
     // Partition the image into tiles
     Film *film = camera->film;
@@ -362,67 +438,10 @@ void BDPTIntegrator::Render(const Scene &scene) {
                 if (!InsideExclusive(pPixel, pixelBounds))
                     continue;
                 do {
-                    // Generate a single sample using BDPT
-                    Point2f pFilm = (Point2f)pPixel + tileSampler->Get2D();
-
-                    // Trace the camera subpath
-                    Vertex *cameraVertices = arena.Alloc<Vertex>(maxDepth + 2);
-                    Vertex *lightVertices = arena.Alloc<Vertex>(maxDepth + 1);
-                    int nCamera = GenerateCameraSubpath(
-                        scene, *tileSampler, arena, maxDepth + 2, *camera,
-                        pFilm, cameraVertices);
-                    // Get a distribution for sampling the light at the
-                    // start of the light subpath. Because the light path
-                    // follows multiple bounces, basing the sampling
-                    // distribution on any of the vertices of the camera
-                    // path is unlikely to be a good strategy. We use the
-                    // PowerLightDistribution by default here, which
-                    // doesn't use the point passed to it.
-                    const Distribution1D *lightDistr =
-                        lightDistribution->Lookup(cameraVertices[0].p());
-                    // Now trace the light subpath
-                    int nLight = GenerateLightSubpath(
-                        scene, *tileSampler, arena, maxDepth + 1,
-                        cameraVertices[0].time(), *lightDistr, lightToIndex,
-                        lightVertices);
-
-                    // Execute all BDPT connection strategies
-                    Spectrum L(0.f);
-                    for (int t = 1; t <= nCamera; ++t) {
-                        for (int s = 0; s <= nLight; ++s) {
-                            int depth = t + s - 2;
-                            if ((s == 1 && t == 1) || depth < 0 ||
-                                depth > maxDepth)
-                                continue;
-                            // Execute the $(s, t)$ connection strategy and
-                            // update _L_
-                            Point2f pFilmNew = pFilm;
-                            Float misWeight = 0.f;
-                            Spectrum Lpath = ConnectBDPT(
-                                scene, lightVertices, cameraVertices, s, t,
-                                *lightDistr, lightToIndex, *camera, *tileSampler,
-                                &pFilmNew, &misWeight);
-                            VLOG(2) << "Connect bdpt s: " << s <<", t: " << t <<
-                                ", Lpath: " << Lpath << ", misWeight: " << misWeight;
-                            if (visualizeStrategies || visualizeWeights) {
-                                Spectrum value;
-                                if (visualizeStrategies)
-                                    value =
-                                        misWeight == 0 ? 0 : Lpath / misWeight;
-                                if (visualizeWeights) value = Lpath;
-                                weightFilms[BufferIndex(s, t)]->AddSplat(
-                                    pFilmNew, value);
-                            }
-                            if (t != 1)
-                                L += Lpath;
-                            else
-                                film->AddSplat(pFilmNew, Lpath);
-                        }
-                    }
-                    VLOG(2) << "Add film sample pFilm: " << pFilm << ", L: " << L <<
-                        ", (y: " << L.y() << ")";
-                    filmTile->AddSample(pFilm, L);
-                    arena.Reset();
+                    SampleBDPT(pPixel, scene, *tileSampler, filmTile.get(),
+                               arena,
+                               (visualizeStrategies || visualizeWeights)
+                                   ? &weightFilms : nullptr);
                 } while (tileSampler->StartNextSample());
             }
             film->MergeFilmTile(std::move(filmTile));
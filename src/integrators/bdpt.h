@@ -44,6 +44,7 @@
 #include "integrator.h"
 #include "interaction.h"
 #include "light.h"
+#include "lightdistrib.h"
 #include "pbrt.h"
 #include "reflection.h"
 #include "sampling.h"
@@ -125,7 +126,7 @@ inline Float InfiniteLightDensity(
 }
 
 // BDPT Declarations
-class BDPTIntegrator : public Integrator {
+class BDPTIntegrator : public Integrator, public CameraSampleEstimator {
   public:
     // BDPTIntegrator Public Methods
     BDPTIntegrator(std::shared_ptr<Sampler> sampler,
@@ -141,8 +142,19 @@ class BDPTIntegrator : public Integrator {
           pixelBounds(pixelBounds),
           lightSampleStrategy(lightSampleStrategy) {}
     void Render(const Scene &scene);
+    void PrepareSamples(const Scene &scene, Sampler &sampler) override;
+    Spectrum EstimateSample(const Point2i &pixel, const Scene &scene,
+                            Sampler &sampler, FilmTile *filmTile,
+                            MemoryArena &arena) const override;
+    Bounds2i SampledPixels() const override { return pixelBounds; }
 
   private:
+    // BDPTIntegrator Private Methods
+    Spectrum SampleBDPT(const Point2i &pPixel, const Scene &scene,
+                        Sampler &sampler, FilmTile *filmTile,
+                        MemoryArena &arena,
+                        std::vector<std::unique_ptr<Film>> *weightFilms) const;
+
     // BDPTIntegrator Private Data
     std::shared_ptr<Sampler> sampler;
     std::shared_ptr<const Camera> camera;
@@ -151,6 +163,8 @@ class BDPTIntegrator : public Integrator {
     const bool visualizeWeights;
     const Bounds2i pixelBounds;
     const std::string lightSampleStrategy;
+    std::unique_ptr<LightDistribution> lightDistribution;
+    std::unordered_map<const Light *, size_t> lightToIndex;
 };
 
 struct Vertex {
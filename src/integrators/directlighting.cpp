@@ -38,12 +38,14 @@
 #include "camera.h"
 #include "film.h"
 #include "stats.h"
+#include "parallel.h"
 
 namespace pbrt {
 
 // DirectLightingIntegrator Method Definitions
 void DirectLightingIntegrator::Preprocess(const Scene &scene,
                                           Sampler &sampler) {
+    shadowRays.resize(MaxThreadIndex());
     if (strategy == LightStrategy::UniformSampleAll) {
         // Compute number of samples to use for each light
         for (const auto &light : scene.lights)
@@ -62,34 +64,59 @@ void DirectLightingIntegrator::Preprocess(const Scene &scene,
 Spectrum DirectLightingIntegrator::Li(const RayDifferential &ray,
                                       const Scene &scene, Sampler &sampler,
                                       MemoryArena &arena, int depth) const {
+    // Find closest ray intersection
+    SurfaceInteraction isect;
+    bool hit = scene.Intersect(ray, &isect);
+    return ShadeHit(ray, hit ? &isect : nullptr, scene, sampler, arena, depth);
+}
+
+Spectrum DirectLightingIntegrator::LiFromHit(const RayDifferential &ray,
+                                             SurfaceInteraction *isect,
+                                             const Scene &scene,
+                                             Sampler &sampler,
+                                             MemoryArena &arena) const {
+    return ShadeHit(ray, isect, scene, sampler, arena, 0);
+}
+
+Spectrum DirectLightingIntegrator::ShadeHit(const RayDifferential &ray,
+                                            SurfaceInteraction *isect,
+                                            const Scene &scene,
+                                            Sampler &sampler,
+                                            MemoryArena &arena,
+                                            int depth) const {
     ProfilePhase p(Prof::SamplerIntegratorLi);
     Spectrum L(0.f);
-    // Find closest ray intersection or return background radiance
-    SurfaceInteraction isect;
-    if (!scene.Intersect(ray, &isect)) {
+    // Return background radiance if the ray escaped
+    if (!isect) {
         for (const auto &light : scene.lights) L += light->Le(ray);
         return L;
     }
 
     // Compute scattering functions for surface interaction
-    isect.ComputeScatteringFunctions(ray, arena);
-    if (!isect.bsdf)
-        return Li(isect.SpawnRay(ray.d), scene, sampler, arena, depth);
-    Vector3f wo = isect.wo;
+    isect->ComputeScatteringFunctions(ray, arena);
+    if (!isect->bsdf)
+        return Li(isect->SpawnRay(ray.d), scene, sampler, arena, depth);
+    Vector3f wo = isect->wo;
     // Compute emitted light if ray hit an area light source
-    L += isect.Le(wo);
+    L += isect->Le(wo);
     if (scene.lights.size() > 0) {
         // Compute direct lighting for _DirectLightingIntegrator_ integrator
-        if (strategy == LightStrategy::UniformSampleAll)
-            L += UniformSampleAllLights(isect, scene, arena, sampler,
-                                        nLightSamples);
-        else
-            L += UniformSampleOneLight(isect, scene, arena, sampler);
+        if (strategy == LightStrategy::UniformSampleAll) {
+            // Trace the shadow rays for all of the light samples together;
+            // they are resolved before any recursive call to _Li()_ that
+            // could reuse this thread's batch
+            DeferredShadowRays &deferred = shadowRays[ThreadIndex];
+            deferred.Clear();
+            L += UniformSampleAllLights(*isect, scene, arena, sampler,
+                                        nLightSamples, false, &deferred);
+            L += deferred.Resolve(scene);
+        } else
+            L += UniformSampleOneLight(*isect, scene, arena, sampler);
     }
     if (depth + 1 < maxDepth) {
         // Trace rays for specular reflection and refraction
-        L += SpecularReflect(ray, isect, scene, sampler, arena, depth);
-        L += SpecularTransmit(ray, isect, scene, sampler, arena, depth);
+        L += SpecularReflect(ray, *isect, scene, sampler, arena, depth);
+        L += SpecularTransmit(ray, *isect, scene, sampler, arena, depth);
     }
     return L;
 }
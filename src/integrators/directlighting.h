@@ -61,13 +61,25 @@ class DirectLightingIntegrator : public SamplerIntegrator {
           maxDepth(maxDepth) {}
     Spectrum Li(const RayDifferential &ray, const Scene &scene,
                 Sampler &sampler, MemoryArena &arena, int depth) const;
+    bool BatchCameraRays() const { return true; }
+    Spectrum LiFromHit(const RayDifferential &ray, SurfaceInteraction *isect,
+                       const Scene &scene, Sampler &sampler,
+                       MemoryArena &arena) const;
     void Preprocess(const Scene &scene, Sampler &sampler);
 
   private:
+    // DirectLightingIntegrator Private Methods
+    Spectrum ShadeHit(const RayDifferential &ray, SurfaceInteraction *isect,
+                      const Scene &scene, Sampler &sampler, MemoryArena &arena,
+                      int depth) const;
+
     // DirectLightingIntegrator Private Data
     const LightStrategy strategy;
     const int maxDepth;
     std::vector<int> nLightSamples;
+    // Shadow rays of the shading point each thread is working on, indexed
+    // by _ThreadIndex_ so their storage is reused
+    mutable std::vector<DeferredShadowRays> shadowRays;
 };
 
 DirectLightingIntegrator *CreateDirectLightingIntegrator(
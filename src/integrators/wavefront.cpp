@@ -0,0 +1,356 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+
+// integrators/wavefront.cpp*
+#include "integrators/wavefront.h"
+#include "camera.h"
+#include "film.h"
+#include "interaction.h"
+#include "paramset.h"
+#include "parallel.h"
+#include "progressreporter.h"
+#include "sampler.h"
+#include "scene.h"
+#include "stats.h"
+#include <algorithm>
+#include <chrono>
+
+namespace pbrt {
+
+STAT_COUNTER("Integrator/Wavefront paths", nWavefrontPaths);
+STAT_COUNTER("Integrator/Wavefront path segments", nPathSegments);
+STAT_INT_DISTRIBUTION("Integrator/Wavefront path length", wavefrontPathLength);
+
+// WavefrontPath Declarations
+struct WavefrontPath {
+    RayDifferential ray;
+    Spectrum L, beta;
+    Float etaScale, rayWeight;
+    Point2f pFilm;
+    Point2i pixel;
+    int bounces;
+    bool specularBounce;
+};
+
+// Sample values consumed by each bounce of a path, in the order that
+// _PathIntegrator_ requests them
+static PBRT_CONSTEXPR int n1DPerBounce = 2;  // light choice, roulette
+static PBRT_CONSTEXPR int n2DPerBounce = 3;  // light, MIS BSDF, BSDF
+
+// WavefrontPathIntegrator Method Definitions
+WavefrontPathIntegrator::WavefrontPathIntegrator(
+    int maxDepth, std::shared_ptr<const Camera> camera,
+    std::shared_ptr<Sampler> sampler, const Bounds2i &pixelBounds,
+    Float rrThreshold, const std::string &lightSampleStrategy,
+    int maxWavePaths)
+    : camera(camera),
+      sampler(sampler),
+      pixelBounds(pixelBounds),
+      maxDepth(maxDepth),
+      rrThreshold(rrThreshold),
+      lightSampleStrategy(lightSampleStrategy),
+      maxWavePaths(std::max(1, maxWavePaths)) {}
+
+void WavefrontPathIntegrator::Render(const Scene &scene) {
+    lightDistribution =
+        CreateLightSampleDistribution(lightSampleStrategy, scene);
+
+    // Compute number of tiles, _nTiles_, to use for parallel rendering
+    Bounds2i sampleBounds = camera->film->GetSampleBounds();
+    Vector2i sampleExtent = sampleBounds.Diagonal();
+    const int tileSize = 16;
+    Point2i nTiles((sampleExtent.x + tileSize - 1) / tileSize,
+                   (sampleExtent.y + tileSize - 1) / tileSize);
+
+    ProgressReporter reporter(nTiles.x * nTiles.y, "Rendering");
+    auto start = std::chrono::steady_clock::now();
+    std::atomic<int64_t> segments(0);
+    ParallelFor2D([&](Point2i tile) {
+        // Get sampler instance and _FilmTile_ for tile
+        int seed = tile.y * nTiles.x + tile.x;
+        std::unique_ptr<Sampler> tileSampler = sampler->Clone(seed);
+        int x0 = sampleBounds.pMin.x + tile.x * tileSize;
+        int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
+        int y0 = sampleBounds.pMin.y + tile.y * tileSize;
+        int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
+        Bounds2i tileBounds(Point2i(x0, y0), Point2i(x1, y1));
+        std::unique_ptr<FilmTile> filmTile =
+            camera->film->GetFilmTile(tileBounds);
+
+        segments += RenderTile(scene, tileBounds, *tileSampler,
+                               filmTile.get());
+
+        camera->film->MergeFilmTile(std::move(filmTile));
+        reporter.Update();
+    }, nTiles);
+    reporter.Done();
+    Float seconds = std::chrono::duration<Float>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+    LOG(INFO) << StringPrintf("Wavefront rendering finished: %.2f M path "
+                              "segments/s", segments / seconds * 1e-6);
+
+    camera->film->WriteImage();
+}
+
+int64_t WavefrontPathIntegrator::RenderTile(const Scene &scene,
+                                            const Bounds2i &tileBounds,
+                                            Sampler &sampler,
+                                            FilmTile *filmTile) const {
+    MemoryArena arena;
+    std::vector<WavefrontPath> paths;
+    std::vector<Float> u1D;
+    std::vector<Point2f> u2D;
+    std::vector<int> active, hits, shadowOwners;
+    RayBatch batch;
+    DeferredShadowRays shadowRays;
+    int64_t segments = 0;
+
+    // Split the tile's samples into waves of at most _maxWavePaths_ paths
+    int64_t spp = sampler.samplesPerPixel;
+    int64_t waveSpp =
+        std::max<int64_t>(1, maxWavePaths / std::max(1, tileBounds.Area()));
+    for (int64_t waveStart = 0; waveStart < spp; waveStart += waveSpp) {
+        int64_t waveEnd = std::min(spp, waveStart + waveSpp);
+
+        // Generate camera rays and sample values for the wave's paths
+        paths.clear();
+        u1D.clear();
+        u2D.clear();
+        for (Point2i pixel : tileBounds) {
+            {
+                ProfilePhase pp(Prof::StartPixel);
+                sampler.StartPixel(pixel);
+                if (waveStart > 0) sampler.SetSampleNumber(waveStart);
+            }
+            if (!InsideExclusive(pixel, pixelBounds)) continue;
+            for (int64_t s = waveStart; s < waveEnd; ++s) {
+                CameraSample cameraSample = sampler.GetCameraSample(pixel);
+                WavefrontPath path;
+                path.rayWeight =
+                    camera->GenerateRayDifferential(cameraSample, &path.ray);
+                path.ray.ScaleDifferentials(1 / std::sqrt((Float)spp));
+                path.L = Spectrum(0.f);
+                path.beta = Spectrum(1.f);
+                path.etaScale = 1;
+                path.pFilm = cameraSample.pFilm;
+                path.pixel = pixel;
+                path.bounces = 0;
+                path.specularBounce = false;
+                paths.push_back(path);
+                for (int b = 0; b < maxDepth; ++b) {
+                    u1D.push_back(sampler.Get1D());
+                    u2D.push_back(sampler.Get2D());
+                    u2D.push_back(sampler.Get2D());
+                    u2D.push_back(sampler.Get2D());
+                    u1D.push_back(sampler.Get1D());
+                }
+                sampler.StartNextSample();
+            }
+        }
+        nWavefrontPaths += paths.size();
+        active.clear();
+        for (size_t i = 0; i < paths.size(); ++i)
+            if (paths[i].rayWeight > 0) active.push_back(i);
+
+        while (!active.empty()) {
+            // Intersect the active paths' rays
+            batch.Clear();
+            for (int i : active) batch.Add(paths[i].ray);
+            scene.Intersect(batch);
+            nPathSegments += active.size();
+            segments += active.size();
+
+            // Terminate escaped paths and find the ones to shade
+            hits.clear();
+            for (size_t k = 0; k < active.size(); ++k) {
+                WavefrontPath &path = paths[active[k]];
+                path.ray.tMax = batch.rays[k].tMax;
+                if (batch.hit[k])
+                    hits.push_back(k);
+                else {
+                    if (path.bounces == 0 || path.specularBounce)
+                        for (const auto &light : scene.infiniteLights)
+                            path.L += path.beta * light->Le(path.ray);
+                    ReportValue(wavefrontPathLength, path.bounces);
+                    path.bounces = -1;
+                }
+            }
+
+            // Shade intersections grouped by material
+            std::stable_sort(hits.begin(), hits.end(), [&](int a, int b) {
+                return batch.isects[a].primitive->GetMaterial() <
+                       batch.isects[b].primitive->GetMaterial();
+            });
+            shadowOwners.clear();
+            for (int k : hits) {
+                int index = active[k];
+                WavefrontPath &path = paths[index];
+                SurfaceInteraction &isect = batch.isects[k];
+
+                // Possibly add emitted light at path vertex
+                if (path.bounces == 0 || path.specularBounce)
+                    path.L += path.beta * isect.Le(-path.ray.d);
+                if (path.bounces >= maxDepth) {
+                    ReportValue(wavefrontPathLength, path.bounces);
+                    path.bounces = -1;
+                    continue;
+                }
+
+                // Compute scattering functions and skip over medium
+                // boundaries
+                isect.ComputeScatteringFunctions(path.ray, arena, true);
+                if (!isect.bsdf) {
+                    path.ray = isect.SpawnRay(path.ray.d);
+                    continue;
+                }
+                const Float *u1 = &u1D[(index * maxDepth + path.bounces) *
+                                       n1DPerBounce];
+                const Point2f *u2 = &u2D[(index * maxDepth + path.bounces) *
+                                         n2DPerBounce];
+
+                // Sample a light, deferring its shadow ray
+                if (!scene.lights.empty() &&
+                    isect.bsdf->NumComponents(
+                        BxDFType(BSDF_ALL & ~BSDF_SPECULAR)) > 0) {
+                    ProfilePhase p(Prof::DirectLighting);
+                    const Distribution1D *distrib =
+                        lightDistribution->Lookup(isect.p);
+                    Float lightPdf;
+                    int lightNum = distrib->SampleDiscrete(u1[0], &lightPdf);
+                    if (lightPdf > 0) {
+                        int first = shadowRays.Size();
+                        Spectrum scale = path.beta / lightPdf;
+                        Spectrum Ld = EstimateDirect(
+                            isect, u2[1], *scene.lights[lightNum], u2[0], scene,
+                            sampler, arena, false, false, &shadowRays);
+                        path.L += scale * Ld;
+                        shadowRays.Scale(first, scale);
+                        shadowOwners.resize(shadowRays.Size(), index);
+                    }
+                }
+
+                // Sample BSDF to get new path direction
+                Vector3f wo = -path.ray.d, wi;
+                Float pdf;
+                BxDFType flags;
+                Spectrum f = isect.bsdf->Sample_f(wo, &wi, u2[2], &pdf,
+                                                  BSDF_ALL, &flags);
+                if (f.IsBlack() || pdf == 0.f) {
+                    ReportValue(wavefrontPathLength, path.bounces);
+                    path.bounces = -1;
+                    continue;
+                }
+                path.beta *= f * AbsDot(wi, isect.shading.n) / pdf;
+                path.specularBounce = (flags & BSDF_SPECULAR) != 0;
+                if ((flags & BSDF_SPECULAR) && (flags & BSDF_TRANSMISSION)) {
+                    Float eta = isect.bsdf->eta;
+                    path.etaScale *= (Dot(wo, isect.n) > 0) ? (eta * eta)
+                                                            : 1 / (eta * eta);
+                }
+                path.ray = isect.SpawnRay(wi);
+
+                // Possibly terminate the path with Russian roulette
+                Spectrum rrBeta = path.beta * path.etaScale;
+                if (rrBeta.MaxComponentValue() < rrThreshold &&
+                    path.bounces > 3) {
+                    Float q =
+                        std::max((Float).05, 1 - rrBeta.MaxComponentValue());
+                    if (u1[1] < q) {
+                        ReportValue(wavefrontPathLength, path.bounces);
+                        path.bounces = -1;
+                        continue;
+                    }
+                    path.beta /= 1 - q;
+                }
+                ++path.bounces;
+            }
+
+            // Trace the shadow rays of all the light samples
+            shadowRays.Trace(scene);
+            for (size_t j = 0; j < shadowOwners.size(); ++j)
+                paths[shadowOwners[j]].L += shadowRays.Contribution(j);
+            shadowRays.Clear();
+            arena.Reset();
+
+            // Keep the paths that are still active
+            active.erase(std::remove_if(active.begin(), active.end(),
+                                        [&](int i) {
+                                            return paths[i].bounces < 0;
+                                        }),
+                         active.end());
+        }
+
+        // Add the wave's samples to the film tile
+        for (WavefrontPath &path : paths) {
+            Spectrum L = path.L;
+            if (L.HasNaNs() || L.y() < -1e-5 || std::isinf(L.y())) {
+                LOG(ERROR) << StringPrintf(
+                    "Invalid radiance value returned for pixel (%d, %d). "
+                    "Setting to black.", path.pixel.x, path.pixel.y);
+                L = Spectrum(0.f);
+            }
+            filmTile->AddSample(path.pFilm, L, path.rayWeight);
+        }
+    }
+    return segments;
+}
+
+WavefrontPathIntegrator *CreateWavefrontPathIntegrator(
+    const ParamSet &params, std::shared_ptr<Sampler> sampler,
+    std::shared_ptr<const Camera> camera) {
+    int maxDepth = params.FindOneInt("maxdepth", 5);
+    int np;
+    const int *pb = params.FindInt("pixelbounds", &np);
+    Bounds2i pixelBounds = camera->film->GetSampleBounds();
+    if (pb) {
+        if (np != 4)
+            Error("Expected four values for \"pixelbounds\" parameter. Got %d.",
+                  np);
+        else {
+            pixelBounds = Intersect(pixelBounds,
+                                    Bounds2i{{pb[0], pb[2]}, {pb[1], pb[3]}});
+            if (pixelBounds.Area() == 0)
+                Error("Degenerate \"pixelbounds\" specified.");
+        }
+    }
+    Float rrThreshold = params.FindOneFloat("rrthreshold", 1.);
+    std::string lightStrategy =
+        params.FindOneString("lightsamplestrategy", "spatial");
+    int maxWavePaths = params.FindOneInt("wavesize", 16384);
+    return new WavefrontPathIntegrator(maxDepth, camera, sampler, pixelBounds,
+                                       rrThreshold, lightStrategy,
+                                       maxWavePaths);
+}
+
+}  // namespace pbrt
@@ -46,13 +46,36 @@ static void usage(const char *msg = nullptr) {
 
     fprintf(stderr, R"(usage: pbrt [<options>] <filename.pbrt...>
 Rendering options:
+  --checkpoint <file>  Periodically save the render state to the given file,
+                       and resume from it if it already exists.
+  --coordinator <addr> Hand out image tiles to the workers that connect to
+                       the given address and write the image they render.
+                       The address is a Unix socket path, or host:port.
   --cropwindow <x0,x1,y0,y1> Specify an image crop window.
+  --flushinterval <s>  Minimum number of seconds between intermediate image
+                       and checkpoint writes in progressive mode. Default: 60.
   --help               Print this help text.
   --nthreads <num>     Use specified number of threads for rendering.
   --outfile <filename> Write the final image to the given filename.
+  --passspp <num>      Render progressively, taking the given number of
+                       samples per pixel in each pass over the image. Only
+                       global samplers like "halton" and "sobol" stay
+                       stratified across passes.
   --quick              Automatically reduce a number of quality settings to
                        render more quickly.
   --quiet              Suppress all text output other than error messages.
+  --spp-range <a-b>    Only take the samples a to b (inclusive) of each pixel,
+                       and also write the raw pixel sums next to the image,
+                       with a .film extension, so that the partial renders
+                       of a scene can be combined with "imgtool merge".
+  --texcache <MB>      Keep at most the given amount of image texture data in
+                       memory, paging in tiles of the textures as needed.
+  --texcachedir <dir>  Directory for the tiled copies of image textures that
+                       --texcache pages in from. Default: system temp
+                       directory (e.g. $TMPDIR or /tmp).
+  --worker <addr>      Render the image tiles handed out by the coordinator
+                       at the given address, for the same scene, instead of
+                       writing an image.
 
 Logging options:
   --logdir <dir>       Specify directory that log files should be written to.
@@ -72,6 +95,16 @@ Reformatting options:
     exit(msg ? 1 : 0);
 }
 
+static void parseSppRange(const char *range, Options *options) {
+    long long first, last;
+    char end;
+    if (sscanf(range, "%lld-%lld%c", &first, &last, &end) != 2 || first < 0 ||
+        last < first)
+        usage("--spp-range expects a range of sample indices like \"0-255\"");
+    options->sppRangeStart = first;
+    options->sppRangeEnd = last + 1;
+}
+
 // main program
 int main(int argc, char *argv[]) {
     google::InitGoogleLogging(argv[0]);
@@ -100,6 +133,60 @@ int main(int argc, char *argv[]) {
             options.cropWindow[1][1] = atof(argv[++i]);
         } else if (!strncmp(argv[i], "--outfile=", 10)) {
             options.imageFile = &argv[i][10];
+        } else if (!strcmp(argv[i], "--passspp") || !strcmp(argv[i], "-passspp")) {
+            if (i + 1 == argc)
+                usage("missing value after --passspp argument");
+            options.passSamples = atoi(argv[++i]);
+        } else if (!strncmp(argv[i], "--passspp=", 10)) {
+            options.passSamples = atoi(&argv[i][10]);
+        } else if (!strcmp(argv[i], "--flushinterval") ||
+                   !strcmp(argv[i], "-flushinterval")) {
+            if (i + 1 == argc)
+                usage("missing value after --flushinterval argument");
+            options.flushSeconds = atof(argv[++i]);
+        } else if (!strncmp(argv[i], "--flushinterval=", 16)) {
+            options.flushSeconds = atof(&argv[i][16]);
+        } else if (!strcmp(argv[i], "--checkpoint") ||
+                   !strcmp(argv[i], "-checkpoint")) {
+            if (i + 1 == argc)
+                usage("missing value after --checkpoint argument");
+            options.checkpointFile = argv[++i];
+        } else if (!strncmp(argv[i], "--checkpoint=", 13)) {
+            options.checkpointFile = &argv[i][13];
+        } else if (!strcmp(argv[i], "--texcache") ||
+                   !strcmp(argv[i], "-texcache")) {
+            if (i + 1 == argc)
+                usage("missing value after --texcache argument");
+            options.textureCacheMB = atoi(argv[++i]);
+        } else if (!strncmp(argv[i], "--texcache=", 11)) {
+            options.textureCacheMB = atoi(&argv[i][11]);
+        } else if (!strcmp(argv[i], "--texcachedir") ||
+                   !strcmp(argv[i], "-texcachedir")) {
+            if (i + 1 == argc)
+                usage("missing value after --texcachedir argument");
+            options.textureCacheDir = argv[++i];
+        } else if (!strncmp(argv[i], "--texcachedir=", 14)) {
+            options.textureCacheDir = &argv[i][14];
+        } else if (!strcmp(argv[i], "--spp-range") ||
+                   !strcmp(argv[i], "-spp-range")) {
+            if (i + 1 == argc)
+                usage("missing value after --spp-range argument");
+            parseSppRange(argv[++i], &options);
+        } else if (!strncmp(argv[i], "--spp-range=", 12)) {
+            parseSppRange(&argv[i][12], &options);
+        } else if (!strcmp(argv[i], "--coordinator") ||
+                   !strcmp(argv[i], "-coordinator")) {
+            if (i + 1 == argc)
+                usage("missing value after --coordinator argument");
+            options.coordinatorAddress = argv[++i];
+        } else if (!strncmp(argv[i], "--coordinator=", 14)) {
+            options.coordinatorAddress = &argv[i][14];
+        } else if (!strcmp(argv[i], "--worker") || !strcmp(argv[i], "-worker")) {
+            if (i + 1 == argc)
+                usage("missing value after --worker argument");
+            options.workerAddress = argv[++i];
+        } else if (!strncmp(argv[i], "--worker=", 9)) {
+            options.workerAddress = &argv[i][9];
         } else if (!strcmp(argv[i], "--logdir") || !strcmp(argv[i], "-logdir")) {
             if (i + 1 == argc)
                 usage("missing value after --logdir argument");
@@ -138,6 +225,9 @@ int main(int argc, char *argv[]) {
             filenames.push_back(argv[i]);
     }
 
+    if (!options.coordinatorAddress.empty() && !options.workerAddress.empty())
+        usage("--coordinator and --worker are mutually exclusive");
+
     // Print welcome banner
     if (!options.quiet && !options.cat && !options.toPly) {
         if (sizeof(void *) == 4)
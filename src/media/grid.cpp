@@ -37,12 +37,102 @@
 #include "sampler.h"
 #include "stats.h"
 #include "interaction.h"
+#include "parallel.h"
 
 namespace pbrt {
 
-STAT_RATIO("Media/Grid steps per Tr() call", nTrSteps, nTrCalls);
+STAT_RATIO("Media/Grid density lookups per Sample() call", nSampleLookups,
+           nSampleCalls);
+STAT_RATIO("Media/Grid density lookups per Tr() call", nTrLookups, nTrCalls);
+STAT_RATIO("Media/Majorant grid segments per ray", nMajorantSegments,
+           nMajorantRays);
 
 // GridDensityMedium Method Definitions
+void GridDensityMedium::InitMajorants() {
+    // Use majorant cells about four density samples wide
+    auto cells = [](int n) { return Clamp((n + 3) / 4, 1, 128); };
+    majorantRes = Point3i(cells(nx), cells(ny), cells(nz));
+    int nCells = majorantRes.x * majorantRes.y * majorantRes.z;
+    majorants.reset(new Float[nCells]);
+    densityBytes += nCells * sizeof(Float);
+
+    // Bound each cell by the samples that trilinear interpolation may
+    // reach from inside it, with a sample of slack for round-off
+    auto sampleRange = [](int cell, int nCells, int n, int *lo, int *hi) {
+        *lo = std::max(0, int((int64_t)cell * n / nCells) - 1);
+        *hi = std::min(n - 1,
+                       int(((int64_t)(cell + 1) * n + nCells - 1) / nCells));
+    };
+    ParallelFor([&](int z) {
+        int z0, z1;
+        sampleRange(z, majorantRes.z, nz, &z0, &z1);
+        for (int y = 0; y < majorantRes.y; ++y) {
+            int y0, y1;
+            sampleRange(y, majorantRes.y, ny, &y0, &y1);
+            for (int x = 0; x < majorantRes.x; ++x) {
+                int x0, x1;
+                sampleRange(x, majorantRes.x, nx, &x0, &x1);
+                Float maxDensity = 0;
+                for (int iz = z0; iz <= z1; ++iz)
+                    for (int iy = y0; iy <= y1; ++iy)
+                        for (int ix = x0; ix <= x1; ++ix)
+                            maxDensity = std::max(
+                                maxDensity, density[(iz * ny + iy) * nx + ix]);
+                majorants[(z * majorantRes.y + y) * majorantRes.x + x] =
+                    maxDensity;
+            }
+        }
+    }, majorantRes.z);
+}
+
+template <typename F>
+void GridDensityMedium::TraverseMajorants(const Ray &ray, Float tMin,
+                                          Float tMax, F callback) const {
+    ++nMajorantRays;
+    // Set up 3D DDA for ray through the majorant grid
+    Point3f pStart = ray(tMin);
+    Float nextCrossingT[3], deltaT[3];
+    int step[3], out[3];
+    Point3i cell;
+    for (int axis = 0; axis < 3; ++axis) {
+        Float pCell = pStart[axis] * majorantRes[axis];
+        Float dCell = ray.d[axis] * majorantRes[axis];
+        cell[axis] = Clamp(int(pCell), 0, majorantRes[axis] - 1);
+        if (dCell == 0) {
+            nextCrossingT[axis] = Infinity;
+            deltaT[axis] = 0;
+            step[axis] = 0;
+            out[axis] = -1;
+        } else if (dCell > 0) {
+            nextCrossingT[axis] = tMin + (cell[axis] + 1 - pCell) / dCell;
+            deltaT[axis] = 1 / dCell;
+            step[axis] = 1;
+            out[axis] = majorantRes[axis];
+        } else {
+            nextCrossingT[axis] = tMin + (cell[axis] - pCell) / dCell;
+            deltaT[axis] = -1 / dCell;
+            step[axis] = -1;
+            out[axis] = -1;
+        }
+    }
+
+    // Walk ray through cells, passing each segment and its majorant to
+    // _callback_ until it returns _false_
+    Float t0 = tMin;
+    while (true) {
+        ++nMajorantSegments;
+        int stepAxis = nextCrossingT[0] < nextCrossingT[1]
+                           ? (nextCrossingT[0] < nextCrossingT[2] ? 0 : 2)
+                           : (nextCrossingT[1] < nextCrossingT[2] ? 1 : 2);
+        Float t1 = std::min(tMax, nextCrossingT[stepAxis]);
+        if (!callback(t0, t1, Majorant(cell)) || t1 >= tMax) return;
+        cell[stepAxis] += step[stepAxis];
+        if (cell[stepAxis] == out[stepAxis]) return;
+        t0 = t1;
+        nextCrossingT[stepAxis] += deltaT[stepAxis];
+    }
+}
+
 Float GridDensityMedium::Density(const Point3f &p) const {
     // Compute voxel coordinates and offsets for _p_
     Point3f pSamples(p.x * nx - .5f, p.y * ny - .5f, p.z * nz - .5f);
@@ -63,6 +153,7 @@ Spectrum GridDensityMedium::Sample(const Ray &rWorld, Sampler &sampler,
                                    MemoryArena &arena,
                                    MediumInteraction *mi) const {
     ProfilePhase _(Prof::MediumSample);
+    ++nSampleCalls;
     Ray ray = WorldToMedium(
         Ray(rWorld.o, Normalize(rWorld.d), rWorld.tMax * rWorld.d.Length()));
     // Compute $[\tmin, \tmax]$ interval of _ray_'s overlap with medium bounds
@@ -70,20 +161,29 @@ Spectrum GridDensityMedium::Sample(const Ray &rWorld, Sampler &sampler,
     Float tMin, tMax;
     if (!b.IntersectP(ray, &tMin, &tMax)) return Spectrum(1.f);
 
-    // Run delta-tracking iterations to sample a medium interaction
-    Float t = tMin;
-    while (true) {
-        t -= std::log(1 - sampler.Get1D()) * invMaxDensity / sigma_t;
-        if (t >= tMax) break;
-        if (Density(ray(t)) * invMaxDensity > sampler.Get1D()) {
-            // Populate _mi_ with medium interaction information and return
-            PhaseFunction *phase = ARENA_ALLOC(arena, HenyeyGreenstein)(g);
-            *mi = MediumInteraction(rWorld(t), -rWorld.d, rWorld.time, this,
-                                    phase);
-            return sigma_s / sigma_t;
+    // Run delta-tracking iterations to sample a medium interaction,
+    // using the local density bound of each majorant grid cell
+    Spectrum result(1.f);
+    TraverseMajorants(ray, tMin, tMax, [&](Float t0, Float t1,
+                                           Float maxDensity) {
+        if (maxDensity == 0) return true;
+        Float invMaxDensity = 1 / maxDensity;
+        Float t = t0;
+        while (true) {
+            t -= std::log(1 - sampler.Get1D()) * invMaxDensity / sigma_t;
+            if (t >= t1) return true;
+            ++nSampleLookups;
+            if (Density(ray(t)) * invMaxDensity > sampler.Get1D()) {
+                // Populate _mi_ with medium interaction information
+                PhaseFunction *phase = ARENA_ALLOC(arena, HenyeyGreenstein)(g);
+                *mi = MediumInteraction(rWorld(t), -rWorld.d, rWorld.time,
+                                        this, phase);
+                result = sigma_s / sigma_t;
+                return false;
+            }
         }
-    }
-    return Spectrum(1.f);
+    });
+    return result;
 }
 
 Spectrum GridDensityMedium::Tr(const Ray &rWorld, Sampler &sampler) const {
@@ -97,23 +197,33 @@ Spectrum GridDensityMedium::Tr(const Ray &rWorld, Sampler &sampler) const {
     Float tMin, tMax;
     if (!b.IntersectP(ray, &tMin, &tMax)) return Spectrum(1.f);
 
-    // Perform ratio tracking to estimate the transmittance value
-    Float Tr = 1, t = tMin;
-    while (true) {
-        ++nTrSteps;
-        t -= std::log(1 - sampler.Get1D()) * invMaxDensity / sigma_t;
-        if (t >= tMax) break;
-        Float density = Density(ray(t));
-        Tr *= 1 - std::max((Float)0, density * invMaxDensity);
-        // Added after book publication: when transmittance gets low,
-        // start applying Russian roulette to terminate sampling.
-        const Float rrThreshold = .1;
-        if (Tr < rrThreshold) {
-            Float q = std::max((Float).05, 1 - Tr);
-            if (sampler.Get1D() < q) return 0;
-            Tr /= 1 - q;
+    // Perform ratio tracking to estimate the transmittance value, using
+    // the local density bound of each majorant grid cell
+    Float Tr = 1;
+    TraverseMajorants(ray, tMin, tMax, [&](Float t0, Float t1,
+                                           Float maxDensity) {
+        if (maxDensity == 0) return true;
+        Float invMaxDensity = 1 / maxDensity;
+        Float t = t0;
+        while (true) {
+            t -= std::log(1 - sampler.Get1D()) * invMaxDensity / sigma_t;
+            if (t >= t1) return true;
+            ++nTrLookups;
+            Float density = Density(ray(t));
+            Tr *= 1 - std::max((Float)0, density * invMaxDensity);
+            // Added after book publication: when transmittance gets low,
+            // start applying Russian roulette to terminate sampling.
+            const Float rrThreshold = .1;
+            if (Tr < rrThreshold) {
+                Float q = std::max((Float).05, 1 - Tr);
+                if (sampler.Get1D() < q) {
+                    Tr = 0;
+                    return false;
+                }
+                Tr /= 1 - q;
+            }
         }
-    }
+    });
     return Spectrum(Tr);
 }
 
@@ -70,10 +70,7 @@ class GridDensityMedium : public Medium {
             Error(
                 "GridDensityMedium requires a spectrally uniform attenuation "
                 "coefficient!");
-        Float maxDensity = 0;
-        for (int i = 0; i < nx * ny * nz; ++i)
-            maxDensity = std::max(maxDensity, density[i]);
-        invMaxDensity = 1 / maxDensity;
+        InitMajorants();
     }
 
     Float Density(const Point3f &p) const;
@@ -87,6 +84,15 @@ class GridDensityMedium : public Medium {
     Spectrum Tr(const Ray &ray, Sampler &sampler) const;
 
   private:
+    // GridDensityMedium Private Methods
+    void InitMajorants();
+    Float Majorant(const Point3i &p) const {
+        return majorants[(p.z * majorantRes.y + p.y) * majorantRes.x + p.x];
+    }
+    template <typename F>
+    void TraverseMajorants(const Ray &ray, Float tMin, Float tMax,
+                           F callback) const;
+
     // GridDensityMedium Private Data
     const Spectrum sigma_a, sigma_s;
     const Float g;
@@ -94,7 +100,10 @@ class GridDensityMedium : public Medium {
     const Transform WorldToMedium;
     std::unique_ptr<Float[]> density;
     Float sigma_t;
-    Float invMaxDensity;
+    // Coarse grid of upper bounds on the density, so that delta and ratio
+    // tracking can take steps sized for the local density
+    Point3i majorantRes;
+    std::unique_ptr<Float[]> majorants;
 };
 
 }  // namespace pbrt
@@ -35,13 +35,32 @@
 #include "shapes/triangle.h"
 #include "textures/constant.h"
 #include "paramset.h"
+#include "parallel.h"
 #include "ext/rply.h"
 
+#include <chrono>
 #include <iostream>
+#include <sstream>
+#ifdef PBRT_HAVE_MMAP
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifndef PBRT_IS_WINDOWS
+#include <sys/resource.h>
+#endif
 
 namespace pbrt {
 using namespace std;
 
+STAT_COUNTER("Scene/PLY files loaded", nPLYFiles);
+STAT_COUNTER("Scene/PLY files memory-mapped", nMappedPLYFiles);
+STAT_COUNTER("Scene/PLY loading time (ms)", plyLoadMilliseconds);
+STAT_MEMORY_COUNTER("Memory/Peak resident set size after PLY loading",
+                    plyPeakRSS);
+
 struct CallbackContext {
     Point3f *p;
     Normal3f *n;
@@ -154,11 +173,412 @@ int rply_face_callback(p_ply_argument argument) {
     return 1;
 }
 
+#ifdef PBRT_HAVE_MMAP
+// Binary little-endian PLY files are read straight from a memory mapping
+// into the _TriangleMesh_ arrays, without rply's per-value callbacks and
+// the intermediate buffers that _CreateTriangleMesh()_ would copy again.
+namespace {
+
+enum class PLYType { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32,
+                     Float64, Invalid };
+
+PLYType ParsePLYType(const std::string &name) {
+    if (name == "char" || name == "int8") return PLYType::Int8;
+    if (name == "uchar" || name == "uint8") return PLYType::UInt8;
+    if (name == "short" || name == "int16") return PLYType::Int16;
+    if (name == "ushort" || name == "uint16") return PLYType::UInt16;
+    if (name == "int" || name == "int32") return PLYType::Int32;
+    if (name == "uint" || name == "uint32") return PLYType::UInt32;
+    if (name == "float" || name == "float32") return PLYType::Float32;
+    if (name == "double" || name == "float64") return PLYType::Float64;
+    return PLYType::Invalid;
+}
+
+int PLYTypeSize(PLYType type) {
+    switch (type) {
+    case PLYType::Int8: case PLYType::UInt8: return 1;
+    case PLYType::Int16: case PLYType::UInt16: return 2;
+    case PLYType::Int32: case PLYType::UInt32: case PLYType::Float32: return 4;
+    case PLYType::Float64: return 8;
+    default: return 0;
+    }
+}
+
+// Reads a value of the given type; the data is little-endian, like the host
+template <typename T>
+inline T ReadPLYValue(const uint8_t *data, PLYType type) {
+    switch (type) {
+#define PLY_READ_CASE(Enum, Type) \
+    case PLYType::Enum: {         \
+        Type value;               \
+        memcpy(&value, data, sizeof(Type)); \
+        return (T)value;          \
+    }
+    PLY_READ_CASE(Int8, int8_t)
+    PLY_READ_CASE(UInt8, uint8_t)
+    PLY_READ_CASE(Int16, int16_t)
+    PLY_READ_CASE(UInt16, uint16_t)
+    PLY_READ_CASE(Int32, int32_t)
+    PLY_READ_CASE(UInt32, uint32_t)
+    PLY_READ_CASE(Float32, float)
+    PLY_READ_CASE(Float64, double)
+#undef PLY_READ_CASE
+    default: return T(0);
+    }
+}
+
+struct PLYProperty {
+    std::string name;
+    PLYType type = PLYType::Invalid;
+    // For list properties, the type of the element count
+    PLYType countType = PLYType::Invalid;
+    bool isList = false;
+    int offset = 0;
+};
+
+struct PLYElement {
+    std::string name;
+    int64_t count = 0;
+    std::vector<PLYProperty> properties;
+    // Size of a record, or 0 if it has list properties
+    int size = 0;
+
+    const PLYProperty *Find(const char *propertyName) const {
+        for (const PLYProperty &prop : properties)
+            if (prop.name == propertyName && !prop.isList) return &prop;
+        return nullptr;
+    }
+};
+
+// Keeps a file mapped while it is read
+class PLYMapping {
+  public:
+    PLYMapping(const std::string &filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd == -1) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *ptr = mmap(0, st.st_size, PROT_READ, MAP_FILE | MAP_PRIVATE,
+                             fd, 0);
+            if (ptr != MAP_FAILED) {
+                data = (const uint8_t *)ptr;
+                size = st.st_size;
+                // Records are read once, front to back
+                madvise(ptr, size, MADV_SEQUENTIAL);
+            }
+        }
+        close(fd);
+    }
+    ~PLYMapping() {
+        if (data) munmap((void *)data, size);
+    }
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+};
+
+// Parses the header of a binary little-endian PLY file, returning false
+// for any other kind of file.
+bool ParsePLYHeader(const PLYMapping &file, std::vector<PLYElement> *elements,
+                    size_t *dataOffset) {
+    static const char endHeader[] = "end_header";
+    const char *text = (const char *)file.data;
+    size_t headerMax = std::min<size_t>(file.size, 1 << 16);
+    if (headerMax < 4 || strncmp(text, "ply", 3) != 0) return false;
+    std::string header(text, headerMax);
+    size_t end = header.find(endHeader);
+    if (end == std::string::npos) return false;
+    size_t newline = header.find('\n', end);
+    if (newline == std::string::npos) return false;
+    *dataOffset = newline + 1;
+
+    std::istringstream lines(header.substr(0, end));
+    std::string line;
+    bool binaryLittleEndian = false;
+    while (std::getline(lines, line)) {
+        std::istringstream words(line);
+        std::string keyword;
+        words >> keyword;
+        if (keyword == "format") {
+            std::string format;
+            words >> format;
+            binaryLittleEndian = format == "binary_little_endian";
+        } else if (keyword == "element") {
+            PLYElement element;
+            words >> element.name >> element.count;
+            if (!words || element.count < 0) return false;
+            elements->push_back(element);
+        } else if (keyword == "property") {
+            if (elements->empty()) return false;
+            PLYProperty prop;
+            std::string type;
+            words >> type;
+            if (type == "list") {
+                std::string countType;
+                words >> countType >> type;
+                prop.isList = true;
+                prop.countType = ParsePLYType(countType);
+                if (prop.countType == PLYType::Invalid ||
+                    prop.countType == PLYType::Float32 ||
+                    prop.countType == PLYType::Float64)
+                    return false;
+            }
+            prop.type = ParsePLYType(type);
+            words >> prop.name;
+            if (prop.type == PLYType::Invalid || !words) return false;
+            elements->back().properties.push_back(prop);
+        }
+    }
+    if (!binaryLittleEndian) return false;
+
+    // Lay out the records of elements without lists
+    for (PLYElement &element : *elements) {
+        int offset = 0;
+        bool hasList = false;
+        for (PLYProperty &prop : element.properties) {
+            prop.offset = offset;
+            hasList |= prop.isList;
+            offset += PLYTypeSize(prop.type);
+        }
+        element.size = hasList ? 0 : offset;
+    }
+    return true;
+}
+
+const char *const uvNames[][2] = {{"u", "v"},
+                                  {"s", "t"},
+                                  {"texture_u", "texture_v"},
+                                  {"texture_s", "texture_t"}};
+
+// Returns false if the file isn't a binary little-endian PLY file that the
+// mapped path handles, in which case rply reads it; otherwise, _*mesh_ is
+// the loaded mesh, or null if the file is invalid.
+bool LoadMappedPLY(const std::string &filename, const Transform &ObjectToWorld,
+                   const std::shared_ptr<Texture<Float>> &alphaTex,
+                   const std::shared_ptr<Texture<Float>> &shadowAlphaTex,
+                   std::shared_ptr<TriangleMesh> *mesh) {
+    uint16_t endianness = 1;
+    if (*(const uint8_t *)&endianness != 1) return false;
+    PLYMapping file(filename);
+    if (!file.data) return false;
+    std::vector<PLYElement> elements;
+    size_t offset;
+    if (!ParsePLYHeader(file, &elements, &offset)) return false;
+
+    // Find the vertex and face records, skipping any other element
+    const PLYElement *vertices = nullptr, *faces = nullptr;
+    size_t vertexOffset = 0, faceOffset = 0;
+    for (const PLYElement &element : elements) {
+        if (element.name == "vertex") {
+            if (element.size == 0) return false;
+            vertices = &element;
+            vertexOffset = offset;
+        } else if (element.name == "face") {
+            faces = &element;
+            faceOffset = offset;
+            // Face records are scanned below; later elements are ignored
+            break;
+        } else if (element.size == 0)
+            return false;
+        offset += element.count * element.size;
+    }
+    if (!vertices || !faces || vertices->count == 0 || faces->count == 0) {
+        Error("%s: PLY file is invalid! No face/vertex elements found!",
+              filename.c_str());
+        return true;
+    }
+    const PLYProperty *x = vertices->Find("x"), *y = vertices->Find("y"),
+                      *z = vertices->Find("z");
+    if (!x || !y || !z) {
+        Error("%s: Vertex coordinate property not found!", filename.c_str());
+        return true;
+    }
+    if (vertexOffset + vertices->count * vertices->size > file.size) {
+        Error("%s: unexpected end of PLY file", filename.c_str());
+        return true;
+    }
+    const PLYProperty *nx = vertices->Find("nx"), *ny = vertices->Find("ny"),
+                      *nz = vertices->Find("nz");
+    bool hasNormals = nx && ny && nz;
+    const PLYProperty *u = nullptr, *v = nullptr;
+    for (const auto &names : uvNames) {
+        u = vertices->Find(names[0]);
+        v = vertices->Find(names[1]);
+        if (u && v) break;
+    }
+    bool hasUV = u && v;
+
+    // Transform the vertices to world space in parallel, writing them
+    // directly to the mesh arrays
+    int nVertices = vertices->count;
+    std::unique_ptr<Point3f[]> p(new Point3f[nVertices]);
+    std::unique_ptr<Normal3f[]> n(hasNormals ? new Normal3f[nVertices]
+                                             : nullptr);
+    std::unique_ptr<Point2f[]> uv(hasUV ? new Point2f[nVertices] : nullptr);
+    const uint8_t *vertexData = file.data + vertexOffset;
+    const int vertexSize = vertices->size;
+    const int64_t chunkSize = 16384;
+    ParallelFor([&](int64_t chunk) {
+        int end = std::min<int64_t>(nVertices, (chunk + 1) * chunkSize);
+        for (int i = chunk * chunkSize; i < end; ++i) {
+            const uint8_t *record = vertexData + (size_t)i * vertexSize;
+            p[i] = ObjectToWorld(
+                Point3f(ReadPLYValue<Float>(record + x->offset, x->type),
+                        ReadPLYValue<Float>(record + y->offset, y->type),
+                        ReadPLYValue<Float>(record + z->offset, z->type)));
+            if (hasNormals)
+                n[i] = ObjectToWorld(
+                    Normal3f(ReadPLYValue<Float>(record + nx->offset, nx->type),
+                             ReadPLYValue<Float>(record + ny->offset, ny->type),
+                             ReadPLYValue<Float>(record + nz->offset,
+                                                 nz->type)));
+            if (hasUV)
+                uv[i] =
+                    Point2f(ReadPLYValue<Float>(record + u->offset, u->type),
+                            ReadPLYValue<Float>(record + v->offset, v->type));
+        }
+    }, (nVertices + chunkSize - 1) / chunkSize);
+
+    // Scan the variable-size face records, splitting quads in two triangles
+    std::vector<int> indices;
+    std::vector<int> faceIndices;
+    indices.reserve(3 * faces->count);
+    bool hasFaceIndices = faces->Find("face_indices") != nullptr;
+    if (hasFaceIndices) faceIndices.reserve(faces->count);
+    const uint8_t *data = file.data + faceOffset;
+    const uint8_t *dataEnd = file.data + file.size;
+    int nIgnoredFaces = 0;
+    for (int64_t f = 0; f < faces->count; ++f) {
+        int face[4], length = 0, faceIndex = 0;
+        for (const PLYProperty &prop : faces->properties) {
+            int count = 1;
+            if (prop.isList) {
+                int countSize = PLYTypeSize(prop.countType);
+                if (data + countSize > dataEnd) {
+                    data = dataEnd + 1;
+                    break;
+                }
+                count = ReadPLYValue<int>(data, prop.countType);
+                data += countSize;
+            }
+            int valueSize = PLYTypeSize(prop.type);
+            if (count < 0 || data + (size_t)count * valueSize > dataEnd) {
+                data = dataEnd + 1;
+                break;
+            }
+            if (prop.isList && (prop.name == "vertex_indices" ||
+                                prop.name == "vertex_index")) {
+                length = count;
+                for (int i = 0; i < std::min(count, 4); ++i)
+                    face[i] = ReadPLYValue<int>(data + i * valueSize,
+                                                prop.type);
+            } else if (!prop.isList && prop.name == "face_indices")
+                faceIndex = ReadPLYValue<int>(data, prop.type);
+            data += (size_t)count * valueSize;
+        }
+        if (data > dataEnd) {
+            Error("%s: unexpected end of PLY file", filename.c_str());
+            return true;
+        }
+        if (length != 3 && length != 4) {
+            ++nIgnoredFaces;
+            continue;
+        }
+        for (int i = 0; i < length; ++i)
+            if (face[i] < 0 || face[i] >= nVertices) {
+                Error("plymesh: Vertex reference %i is out of bounds! "
+                      "Valid range is [0..%i)", face[i], nVertices);
+                return true;
+            }
+        indices.insert(indices.end(), {face[0], face[1], face[2]});
+        if (hasFaceIndices) faceIndices.push_back(faceIndex);
+        if (length == 4) {
+            indices.insert(indices.end(), {face[3], face[0], face[2]});
+            if (hasFaceIndices) faceIndices.push_back(faceIndex);
+        }
+    }
+    if (nIgnoredFaces > 0)
+        Warning("plymesh: Ignoring %d faces that aren't triangles or quads",
+                nIgnoredFaces);
+
+    int nTriangles = indices.size() / 3;
+    mesh->reset(new TriangleMesh(nTriangles, std::move(indices), nVertices,
+                                 std::move(p), nullptr, std::move(n),
+                                 std::move(uv), alphaTex, shadowAlphaTex,
+                                 std::move(faceIndices)));
+    ++nMappedPLYFiles;
+    return true;
+}
+
+}  // anonymous namespace
+#endif  // PBRT_HAVE_MMAP
+
+// Accounts for the time spent loading a PLY file, and the peak memory use
+// after loading it
+static void ReportPLYLoad(const std::string &filename,
+                          std::chrono::steady_clock::time_point start) {
+    int64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+    ++nPLYFiles;
+    plyLoadMilliseconds += ms;
+#ifndef PBRT_IS_WINDOWS
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+        // macOS reports bytes
+        int64_t peakRSS = usage.ru_maxrss;
+#else
+        // Linux and the BSDs report kilobytes
+        int64_t peakRSS = int64_t(usage.ru_maxrss) * 1024;
+#endif
+        plyPeakRSS = std::max<int64_t>(plyPeakRSS, peakRSS);
+    }
+#endif
+    LOG(INFO) << "Loaded PLY file " << filename << " in " << ms << " ms";
+}
+
 std::vector<std::shared_ptr<Shape>> CreatePLYMesh(
     const Transform *o2w, const Transform *w2o, bool reverseOrientation,
     const ParamSet &params,
     std::map<std::string, std::shared_ptr<Texture<Float>>> *floatTextures) {
     const std::string filename = params.FindOneFilename("filename", "");
+
+    // Look up an alpha texture, if applicable
+    std::shared_ptr<Texture<Float>> alphaTex;
+    std::string alphaTexName = params.FindTexture("alpha");
+    if (alphaTexName != "") {
+        if (floatTextures->find(alphaTexName) != floatTextures->end())
+            alphaTex = (*floatTextures)[alphaTexName];
+        else
+            Error("Couldn't find float texture \"%s\" for \"alpha\" parameter",
+                  alphaTexName.c_str());
+    } else if (params.FindOneFloat("alpha", 1.f) == 0.f) {
+        alphaTex.reset(new ConstantTexture<Float>(0.f));
+    }
+
+    std::shared_ptr<Texture<Float>> shadowAlphaTex;
+    std::string shadowAlphaTexName = params.FindTexture("shadowalpha");
+    if (shadowAlphaTexName != "") {
+        if (floatTextures->find(shadowAlphaTexName) != floatTextures->end())
+            shadowAlphaTex = (*floatTextures)[shadowAlphaTexName];
+        else
+            Error(
+                "Couldn't find float texture \"%s\" for \"shadowalpha\" "
+                "parameter",
+                shadowAlphaTexName.c_str());
+    } else if (params.FindOneFloat("shadowalpha", 1.f) == 0.f)
+        shadowAlphaTex.reset(new ConstantTexture<Float>(0.f));
+
+    auto start = std::chrono::steady_clock::now();
+#ifdef PBRT_HAVE_MMAP
+    std::shared_ptr<TriangleMesh> mesh;
+    if (LoadMappedPLY(filename, *o2w, alphaTex, shadowAlphaTex, &mesh)) {
+        if (!mesh) return std::vector<std::shared_ptr<Shape>>();
+        ReportPLYLoad(filename, start);
+        return CreateTriangleMesh(o2w, w2o, reverseOrientation, mesh);
+    }
+#endif
+
     p_ply ply = ply_open(filename.c_str(), rply_message_callback, 0, nullptr);
     if (!ply) {
         Error("Couldn't open PLY file \"%s\"", filename.c_str());
@@ -256,32 +676,7 @@ std::vector<std::shared_ptr<Shape>> CreatePLYMesh(
 
     if (context.error) return std::vector<std::shared_ptr<Shape>>();
 
-    // Look up an alpha texture, if applicable
-    std::shared_ptr<Texture<Float>> alphaTex;
-    std::string alphaTexName = params.FindTexture("alpha");
-    if (alphaTexName != "") {
-        if (floatTextures->find(alphaTexName) != floatTextures->end())
-            alphaTex = (*floatTextures)[alphaTexName];
-        else
-            Error("Couldn't find float texture \"%s\" for \"alpha\" parameter",
-                  alphaTexName.c_str());
-    } else if (params.FindOneFloat("alpha", 1.f) == 0.f) {
-        alphaTex.reset(new ConstantTexture<Float>(0.f));
-    }
-
-    std::shared_ptr<Texture<Float>> shadowAlphaTex;
-    std::string shadowAlphaTexName = params.FindTexture("shadowalpha");
-    if (shadowAlphaTexName != "") {
-        if (floatTextures->find(shadowAlphaTexName) != floatTextures->end())
-            shadowAlphaTex = (*floatTextures)[shadowAlphaTexName];
-        else
-            Error(
-                "Couldn't find float texture \"%s\" for \"shadowalpha\" "
-                "parameter",
-                shadowAlphaTexName.c_str());
-    } else if (params.FindOneFloat("shadowalpha", 1.f) == 0.f)
-        shadowAlphaTex.reset(new ConstantTexture<Float>(0.f));
-
+    ReportPLYLoad(filename, start);
     return CreateTriangleMesh(o2w, w2o, reverseOrientation,
                               context.indexCtr / 3, context.indices,
                               vertexCount, context.p, nullptr, context.n,
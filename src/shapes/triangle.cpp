@@ -39,6 +39,10 @@
 #include "efloat.h"
 #include "ext/rply.h"
 #include <array>
+#if (defined(__SSE2__) || defined(_M_X64)) && !defined(PBRT_FLOAT_AS_DOUBLE)
+#include <immintrin.h>
+#define PBRT_TRIANGLE_HAVE_SSE
+#endif
 
 namespace pbrt {
 
@@ -66,8 +70,8 @@ TriangleMesh::TriangleMesh(
     nTris += nTriangles;
     triMeshBytes += sizeof(*this) + this->vertexIndices.size() * sizeof(int) +
                     nVertices * (sizeof(*P) + (N ? sizeof(*N) : 0) +
-                                 (S ? sizeof(*S) : 0) + (UV ? sizeof(*UV) : 0) +
-                                 (fIndices ? sizeof(*fIndices) : 0));
+                                 (S ? sizeof(*S) : 0) + (UV ? sizeof(*UV) : 0)) +
+                    (fIndices ? nTriangles * sizeof(*fIndices) : 0);
 
     // Transform mesh vertices to world space
     p.reset(new Point3f[nVertices]);
@@ -91,6 +95,34 @@ TriangleMesh::TriangleMesh(
         faceIndices = std::vector<int>(fIndices, fIndices + nTriangles);
 }
 
+TriangleMesh::TriangleMesh(
+    int nTriangles, std::vector<int> vertexIndices, int nVertices,
+    std::unique_ptr<Point3f[]> P, std::unique_ptr<Vector3f[]> S,
+    std::unique_ptr<Normal3f[]> N, std::unique_ptr<Point2f[]> UV,
+    const std::shared_ptr<Texture<Float>> &alphaMask,
+    const std::shared_ptr<Texture<Float>> &shadowAlphaMask,
+    std::vector<int> fIndices)
+    : nTriangles(nTriangles),
+      nVertices(nVertices),
+      vertexIndices(std::move(vertexIndices)),
+      p(std::move(P)),
+      n(std::move(N)),
+      s(std::move(S)),
+      uv(std::move(UV)),
+      alphaMask(alphaMask),
+      shadowAlphaMask(shadowAlphaMask),
+      faceIndices(std::move(fIndices)) {
+    CHECK_EQ(this->vertexIndices.size(), 3 * (size_t)nTriangles);
+    CHECK(faceIndices.empty() || faceIndices.size() == (size_t)nTriangles);
+    ++nMeshes;
+    nTris += nTriangles;
+    triMeshBytes += sizeof(*this) + this->vertexIndices.size() * sizeof(int) +
+                    nVertices * (sizeof(Point3f) + (n ? sizeof(Normal3f) : 0) +
+                                 (s ? sizeof(Vector3f) : 0) +
+                                 (uv ? sizeof(Point2f) : 0)) +
+                    faceIndices.size() * sizeof(int);
+}
+
 std::vector<std::shared_ptr<Shape>> CreateTriangleMesh(
     const Transform *ObjectToWorld, const Transform *WorldToObject,
     bool reverseOrientation, int nTriangles, const int *vertexIndices,
@@ -101,6 +133,14 @@ std::vector<std::shared_ptr<Shape>> CreateTriangleMesh(
     std::shared_ptr<TriangleMesh> mesh = std::make_shared<TriangleMesh>(
         *ObjectToWorld, nTriangles, vertexIndices, nVertices, p, s, n, uv,
         alphaMask, shadowAlphaMask, faceIndices);
+    return CreateTriangleMesh(ObjectToWorld, WorldToObject, reverseOrientation,
+                              mesh);
+}
+
+std::vector<std::shared_ptr<Shape>> CreateTriangleMesh(
+    const Transform *ObjectToWorld, const Transform *WorldToObject,
+    bool reverseOrientation, const std::shared_ptr<TriangleMesh> &mesh) {
+    int nTriangles = mesh->nTriangles;
     std::vector<std::shared_ptr<Shape>> tris;
     tris.reserve(nTriangles);
     for (int i = 0; i < nTriangles; ++i)
@@ -572,6 +612,277 @@ bool Triangle::IntersectP(const Ray &ray, bool testAlphaTexture) const {
     return true;
 }
 
+bool Triangle::GetBlockVertices(Point3f p[3]) const {
+    if (mesh->alphaMask || mesh->shadowAlphaMask) return false;
+    p[0] = mesh->p[v[0]];
+    p[1] = mesh->p[v[1]];
+    p[2] = mesh->p[v[2]];
+    // Triangle::Intersect() rejects hits on degenerate triangles after the
+    // watertight test, which the block test doesn't replicate
+    return Cross(p[2] - p[0], p[1] - p[0]).LengthSquared() > 0;
+}
+
+TriangleBlockRay::TriangleBlockRay(const Ray &ray) : o(ray.o) {
+    // Permute components of ray direction
+    kz = MaxDimension(Abs(ray.d));
+    kx = kz + 1;
+    if (kx == 3) kx = 0;
+    ky = kx + 1;
+    if (ky == 3) ky = 0;
+    Vector3f d = Permute(ray.d, kx, ky, kz);
+
+    // Compute shear transformation for triangle vertex positions
+    Sx = -d.x / d.z;
+    Sy = -d.y / d.z;
+    Sz = 1.f / d.z;
+}
+
+// Picks the closest of the lanes in _hitMask_, counts the hits, and
+// returns the barycentrics of the closest hit in _b_, if requested
+static int ClosestBlockHit(int hitMask, const Float *t, const Float *e0,
+                           const Float *e1, const Float *e2,
+                           const Float *invDet, Float *tHit, Float *b) {
+    int closest = -1;
+    for (int i = 0; i < TriangleBlock::Width; ++i) {
+        if (!(hitMask & (1 << i))) continue;
+        ++nHits;
+        if (closest == -1 || t[i] < *tHit) {
+            closest = i;
+            *tHit = t[i];
+        }
+    }
+    if (closest >= 0 && b) {
+        b[0] = e0[closest] * invDet[closest];
+        b[1] = e1[closest] * invDet[closest];
+        b[2] = e2[closest] * invDet[closest];
+    }
+    return closest;
+}
+
+#ifdef PBRT_TRIANGLE_HAVE_SSE
+int IntersectTriangleBlock(const TriangleBlock &block,
+                           const TriangleBlockRay &ray, Float tMax,
+                           Float *tHit, Float *b) {
+    static_assert(TriangleBlock::Width == 4,
+                  "SSE triangle blocks must be four triangles wide");
+    ProfilePhase p(Prof::TriIntersect);
+    nTests += block.nTriangles;
+    const int laneMask = (1 << block.nTriangles) - 1;
+
+    // The steps below follow Triangle::Intersect() exactly, with the same
+    // order of operations, so that the hit distances match the ones it
+    // computes.
+
+    // Transform triangle vertices to ray coordinate space
+    const __m128 ox = _mm_set1_ps(ray.o[ray.kx]);
+    const __m128 oy = _mm_set1_ps(ray.o[ray.ky]);
+    const __m128 oz = _mm_set1_ps(ray.o[ray.kz]);
+    const __m128 Sx = _mm_set1_ps(ray.Sx), Sy = _mm_set1_ps(ray.Sy);
+    __m128 xt[3], yt[3], zt[3];
+    for (int j = 0; j < 3; ++j) {
+        // Translate, permute and shear vertex positions
+        xt[j] = _mm_sub_ps(_mm_loadu_ps(block.p[j][ray.kx]), ox);
+        yt[j] = _mm_sub_ps(_mm_loadu_ps(block.p[j][ray.ky]), oy);
+        zt[j] = _mm_sub_ps(_mm_loadu_ps(block.p[j][ray.kz]), oz);
+        xt[j] = _mm_add_ps(xt[j], _mm_mul_ps(Sx, zt[j]));
+        yt[j] = _mm_add_ps(yt[j], _mm_mul_ps(Sy, zt[j]));
+    }
+
+    // Compute edge function coefficients _e0_, _e1_, and _e2_
+    __m128 e[3];
+    for (int k = 0; k < 3; ++k) {
+        int a = (k + 1) % 3, c = (k + 2) % 3;
+        e[k] = _mm_sub_ps(_mm_mul_ps(xt[a], yt[c]), _mm_mul_ps(yt[a], xt[c]));
+    }
+
+    // Fall back to double precision test at triangle edges
+    const __m128 zero = _mm_setzero_ps();
+    int zeroEdges = _mm_movemask_ps(_mm_or_ps(
+                        _mm_or_ps(_mm_cmpeq_ps(e[0], zero),
+                                  _mm_cmpeq_ps(e[1], zero)),
+                        _mm_cmpeq_ps(e[2], zero))) &
+                    laneMask;
+    if (zeroEdges) {
+        alignas(16) float xs[3][4], ys[3][4], es[3][4];
+        for (int j = 0; j < 3; ++j) {
+            _mm_store_ps(xs[j], xt[j]);
+            _mm_store_ps(ys[j], yt[j]);
+            _mm_store_ps(es[j], e[j]);
+        }
+        for (int i = 0; i < 4; ++i) {
+            if (!(zeroEdges & (1 << i))) continue;
+            for (int k = 0; k < 3; ++k) {
+                int a = (k + 1) % 3, c = (k + 2) % 3;
+                double xcya = (double)xs[c][i] * (double)ys[a][i];
+                double ycxa = (double)ys[c][i] * (double)xs[a][i];
+                es[k][i] = (float)(ycxa - xcya);
+            }
+        }
+        for (int k = 0; k < 3; ++k) e[k] = _mm_load_ps(es[k]);
+    }
+
+    // Perform triangle edge and determinant tests
+    __m128 anyNegative = _mm_or_ps(
+        _mm_or_ps(_mm_cmplt_ps(e[0], zero), _mm_cmplt_ps(e[1], zero)),
+        _mm_cmplt_ps(e[2], zero));
+    __m128 anyPositive = _mm_or_ps(
+        _mm_or_ps(_mm_cmpgt_ps(e[0], zero), _mm_cmpgt_ps(e[1], zero)),
+        _mm_cmpgt_ps(e[2], zero));
+    __m128 det = _mm_add_ps(_mm_add_ps(e[0], e[1]), e[2]);
+    __m128 miss = _mm_or_ps(_mm_and_ps(anyNegative, anyPositive),
+                            _mm_cmpeq_ps(det, zero));
+
+    // Compute scaled hit distance to triangle and test against ray $t$
+    // range
+    const __m128 Sz = _mm_set1_ps(ray.Sz);
+    __m128 z[3];
+    for (int j = 0; j < 3; ++j) z[j] = _mm_mul_ps(zt[j], Sz);
+    __m128 tScaled = _mm_add_ps(
+        _mm_add_ps(_mm_mul_ps(e[0], z[0]), _mm_mul_ps(e[1], z[1])),
+        _mm_mul_ps(e[2], z[2]));
+    __m128 tMaxDet = _mm_mul_ps(_mm_set1_ps(tMax), det);
+    miss = _mm_or_ps(
+        miss, _mm_and_ps(_mm_cmplt_ps(det, zero),
+                         _mm_or_ps(_mm_cmpge_ps(tScaled, zero),
+                                   _mm_cmplt_ps(tScaled, tMaxDet))));
+    miss = _mm_or_ps(
+        miss, _mm_and_ps(_mm_cmpgt_ps(det, zero),
+                         _mm_or_ps(_mm_cmple_ps(tScaled, zero),
+                                   _mm_cmpgt_ps(tScaled, tMaxDet))));
+
+    // Compute $t$ value and ensure that it is conservatively greater than
+    // zero
+    const __m128 signBit = _mm_set1_ps(-0.f);
+    auto absLanes = [&](__m128 v) { return _mm_andnot_ps(signBit, v); };
+    auto maxAbs = [&](const __m128 v[3]) {
+        return _mm_max_ps(absLanes(v[0]),
+                          _mm_max_ps(absLanes(v[1]), absLanes(v[2])));
+    };
+    __m128 invDet = _mm_div_ps(_mm_set1_ps(1.f), det);
+    __m128 t = _mm_mul_ps(tScaled, invDet);
+    __m128 maxZt = maxAbs(z);
+    __m128 deltaZ = _mm_mul_ps(_mm_set1_ps(gamma(3)), maxZt);
+    __m128 maxXt = maxAbs(xt), maxYt = maxAbs(yt);
+    __m128 deltaX = _mm_mul_ps(_mm_set1_ps(gamma(5)), _mm_add_ps(maxXt, maxZt));
+    __m128 deltaY = _mm_mul_ps(_mm_set1_ps(gamma(5)), _mm_add_ps(maxYt, maxZt));
+    __m128 deltaE = _mm_mul_ps(
+        _mm_set1_ps(2.f),
+        _mm_add_ps(
+            _mm_add_ps(
+                _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(gamma(2)), maxXt), maxYt),
+                _mm_mul_ps(deltaY, maxXt)),
+            _mm_mul_ps(deltaX, maxYt)));
+    __m128 maxE = maxAbs(e);
+    __m128 deltaT = _mm_mul_ps(
+        _mm_mul_ps(
+            _mm_set1_ps(3.f),
+            _mm_add_ps(
+                _mm_add_ps(
+                    _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(gamma(3)), maxE), maxZt),
+                    _mm_mul_ps(deltaE, maxZt)),
+                _mm_mul_ps(deltaZ, maxE))),
+        absLanes(invDet));
+    miss = _mm_or_ps(miss, _mm_cmple_ps(t, deltaT));
+    int hitMask = ~_mm_movemask_ps(miss) & laneMask;
+    if (!hitMask) return -1;
+
+    alignas(16) Float ts[4], es[3][4], invDets[4];
+    _mm_store_ps(ts, t);
+    for (int k = 0; k < 3; ++k) _mm_store_ps(es[k], e[k]);
+    _mm_store_ps(invDets, invDet);
+    return ClosestBlockHit(hitMask, ts, es[0], es[1], es[2], invDets, tHit,
+                           b);
+}
+
+#else
+int IntersectTriangleBlock(const TriangleBlock &block,
+                           const TriangleBlockRay &ray, Float tMax,
+                           Float *tHit, Float *b) {
+    ProfilePhase p(Prof::TriIntersect);
+    PBRT_CONSTEXPR int W = TriangleBlock::Width;
+    nTests += block.nTriangles;
+
+    // The steps below follow Triangle::Intersect() exactly, one lane loop
+    // at a time, so that the hit distances match the ones it computes.
+
+    // Transform triangle vertices to ray coordinate space
+    Float xt[3][W], yt[3][W], zt[3][W];
+    for (int j = 0; j < 3; ++j) {
+        for (int i = 0; i < W; ++i) {
+            // Translate, permute and shear vertex positions
+            xt[j][i] = block.p[j][ray.kx][i] - ray.o[ray.kx];
+            yt[j][i] = block.p[j][ray.ky][i] - ray.o[ray.ky];
+            zt[j][i] = block.p[j][ray.kz][i] - ray.o[ray.kz];
+            xt[j][i] += ray.Sx * zt[j][i];
+            yt[j][i] += ray.Sy * zt[j][i];
+        }
+    }
+
+    // Compute edge function coefficients _e0_, _e1_, and _e2_
+    Float e[3][W];
+    for (int i = 0; i < W; ++i) {
+        e[0][i] = xt[1][i] * yt[2][i] - yt[1][i] * xt[2][i];
+        e[1][i] = xt[2][i] * yt[0][i] - yt[2][i] * xt[0][i];
+        e[2][i] = xt[0][i] * yt[1][i] - yt[0][i] * xt[1][i];
+    }
+
+    // Fall back to double precision test at triangle edges
+    if (sizeof(Float) == sizeof(float)) {
+        for (int i = 0; i < block.nTriangles; ++i) {
+            if (e[0][i] != 0.0f && e[1][i] != 0.0f && e[2][i] != 0.0f)
+                continue;
+            for (int k = 0; k < 3; ++k) {
+                int a = (k + 1) % 3, c = (k + 2) % 3;
+                double xcya = (double)xt[c][i] * (double)yt[a][i];
+                double ycxa = (double)yt[c][i] * (double)xt[a][i];
+                e[k][i] = (float)(ycxa - xcya);
+            }
+        }
+    }
+
+    // Perform edge, determinant and $t$ range tests for all lanes
+    int hitMask = 0;
+    Float t[W], invDet[W];
+    for (int i = 0; i < W; ++i) {
+        Float e0 = e[0][i], e1 = e[1][i], e2 = e[2][i];
+        bool hit = i < block.nTriangles;
+        hit &= !((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0));
+        Float det = e0 + e1 + e2;
+        hit &= det != 0;
+
+        // Compute scaled hit distance to triangle and test against ray $t$
+        // range
+        Float z0 = zt[0][i] * ray.Sz, z1 = zt[1][i] * ray.Sz,
+              z2 = zt[2][i] * ray.Sz;
+        Float tScaled = e0 * z0 + e1 * z1 + e2 * z2;
+        hit &= !(det < 0 && (tScaled >= 0 || tScaled < tMax * det));
+        hit &= !(det > 0 && (tScaled <= 0 || tScaled > tMax * det));
+
+        // Compute $t$ value and ensure that it is conservatively greater
+        // than zero
+        invDet[i] = 1 / det;
+        t[i] = tScaled * invDet[i];
+        Float maxZt = MaxComponent(Abs(Vector3f(z0, z1, z2)));
+        Float deltaZ = gamma(3) * maxZt;
+        Float maxXt =
+            MaxComponent(Abs(Vector3f(xt[0][i], xt[1][i], xt[2][i])));
+        Float maxYt =
+            MaxComponent(Abs(Vector3f(yt[0][i], yt[1][i], yt[2][i])));
+        Float deltaX = gamma(5) * (maxXt + maxZt);
+        Float deltaY = gamma(5) * (maxYt + maxZt);
+        Float deltaE =
+            2 * (gamma(2) * maxXt * maxYt + deltaY * maxXt + deltaX * maxYt);
+        Float maxE = MaxComponent(Abs(Vector3f(e0, e1, e2)));
+        Float deltaT =
+            3 * (gamma(3) * maxE * maxZt + deltaE * maxZt + deltaZ * maxE) *
+            std::abs(invDet[i]);
+        hit &= t[i] > deltaT;
+        if (hit) hitMask |= 1 << i;
+    }
+    return ClosestBlockHit(hitMask, t, e[0], e[1], e[2], invDet, tHit, b);
+}
+#endif  // PBRT_TRIANGLE_HAVE_SSE
+
 Float Triangle::Area() const {
     // Get triangle vertices in _p0_, _p1_, and _p2_
     const Point3f &p0 = mesh->p[v[0]];
@@ -56,6 +56,14 @@ struct TriangleMesh {
                  const std::shared_ptr<Texture<Float>> &alphaMask,
                  const std::shared_ptr<Texture<Float>> &shadowAlphaMask,
                  const int *faceIndices);
+    // Takes ownership of vertex data that is already in world space, so
+    // that loaders can fill the mesh arrays in place
+    TriangleMesh(int nTriangles, std::vector<int> vertexIndices, int nVertices,
+                 std::unique_ptr<Point3f[]> P, std::unique_ptr<Vector3f[]> S,
+                 std::unique_ptr<Normal3f[]> N, std::unique_ptr<Point2f[]> uv,
+                 const std::shared_ptr<Texture<Float>> &alphaMask,
+                 const std::shared_ptr<Texture<Float>> &shadowAlphaMask,
+                 std::vector<int> faceIndices);
 
     // TriangleMesh Data
     const int nTriangles, nVertices;
@@ -93,6 +101,11 @@ class Triangle : public Shape {
     // reference point p.
     Float SolidAngle(const Point3f &p, int nSamples = 0) const;
 
+    // Returns the triangle's world space vertices for use in a
+    // _TriangleBlock_, or false if the triangle has alpha masks or is
+    // degenerate and so must go through Intersect() instead.
+    bool GetBlockVertices(Point3f p[3]) const;
+
   private:
     // Triangle Private Methods
     void GetUVs(Point2f uv[3]) const {
@@ -113,6 +126,33 @@ class Triangle : public Shape {
     int faceIndex;
 };
 
+// Up to _Width_ triangles stored in SoA form, so that the watertight
+// ray--triangle test can be done for all of them at once, with SSE where
+// available. Only the hit distance and barycentrics are computed; the
+// _SurfaceInteraction_ for the closest hit is left to Triangle::Intersect().
+struct TriangleBlock {
+    static PBRT_CONSTEXPR int Width = 4;
+    // Vertex positions, indexed by vertex, axis and lane
+    Float p[3][3][Width];
+    int nTriangles = 0;
+};
+
+// Ray permutation and shear shared by all triangle tests for a ray
+struct TriangleBlockRay {
+    TriangleBlockRay() = default;
+    TriangleBlockRay(const Ray &ray);
+    Point3f o;
+    int kx, ky, kz;
+    Float Sx, Sy, Sz;
+};
+
+// Returns the lane of the closest triangle hit before _tMax_ and its
+// distance in _*tHit_, or -1 if none of the triangles are hit. The hit's
+// barycentric coordinates are returned in _b[0..2]_ if _b_ isn't null.
+int IntersectTriangleBlock(const TriangleBlock &block,
+                           const TriangleBlockRay &ray, Float tMax,
+                           Float *tHit, Float *b = nullptr);
+
 std::vector<std::shared_ptr<Shape>> CreateTriangleMesh(
     const Transform *o2w, const Transform *w2o, bool reverseOrientation,
     int nTriangles, const int *vertexIndices, int nVertices, const Point3f *p,
@@ -120,6 +160,9 @@ std::vector<std::shared_ptr<Shape>> CreateTriangleMesh(
     const std::shared_ptr<Texture<Float>> &alphaTexture,
     const std::shared_ptr<Texture<Float>> &shadowAlphaTexture,
     const int *faceIndices = nullptr);
+std::vector<std::shared_ptr<Shape>> CreateTriangleMesh(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    const std::shared_ptr<TriangleMesh> &mesh);
 std::vector<std::shared_ptr<Shape>> CreateTriangleMeshShape(
     const Transform *o2w, const Transform *w2o, bool reverseOrientation,
     const ParamSet &params,
@@ -1,5 +1,6 @@
 
 #include "tests/gtest/gtest.h"
+#include <functional>
 #include "pbrt.h"
 
 #include "accelerators/bvh.h"
@@ -10,13 +11,16 @@
 #include "filters/box.h"
 #include "geometry.h"
 #include "imageio.h"
+#include "integrators/adaptive.h"
 #include "integrators/bdpt.h"
 #include "integrators/directlighting.h"
 #include "integrators/mlt.h"
 #include "integrators/path.h"
 #include "integrators/volpath.h"
+#include "integrators/wavefront.h"
 #include "lights/diffuse.h"
 #include "lights/point.h"
+#include "paramset.h"
 #include "materials/matte.h"
 #include "materials/mirror.h"
 #include "materials/uber.h"
@@ -29,11 +33,10 @@
 #include "shapes/sphere.h"
 #include "spectrum.h"
 #include "textures/constant.h"
+#include "tests/testutil.h"
 
 using namespace pbrt;
 
-static std::string inTestDir(const std::string &path) { return path; }
-
 struct TestScene {
     std::shared_ptr<Scene> scene;
     std::string description;
@@ -313,6 +316,27 @@ std::vector<TestIntegrator> GetIntegrators() {
                                    scene});
         }
 
+        // Wavefront path tracing integrator
+        for (auto sampler : GetSamplers(Bounds2i(Point2i(0, 0), resolution))) {
+            std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
+            Film *film =
+                new Film(resolution, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                         std::move(filter), 1., inTestDir("test.exr"), 1.);
+            std::shared_ptr<Camera> camera =
+                std::make_shared<PerspectiveCamera>(
+                    identity, Bounds2f(Point2f(-1, -1), Point2f(1, 1)), 0., 1.,
+                    0., 10., 45, film, nullptr);
+
+            Integrator *integrator =
+                new WavefrontPathIntegrator(8, camera, sampler.first,
+                                            film->croppedPixelBounds);
+            integrators.push_back({integrator, film,
+                                   "WavefrontPath, depth 8, Perspective, " +
+                                       sampler.second + ", " +
+                                       scene.description,
+                                   scene});
+        }
+
         // Volume path tracing integrators
         for (auto sampler : GetSamplers(Bounds2i(Point2i(0, 0), resolution))) {
             std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
@@ -438,3 +462,140 @@ TEST_P(RenderTest, RadianceMatches) {
 
 INSTANTIATE_TEST_CASE_P(AnalyticTestScenes, RenderTest,
                         testing::ValuesIn(GetIntegrators()));
+
+// Renders _scene_ at _resolution_ with the integrator that _makeIntegrator_
+// creates for the given camera and sampler and checks the image's average.
+static void RenderAndCheckAverage(
+    const TestScene &scene, const Point2i &resolution,
+    std::shared_ptr<Sampler> sampler,
+    const std::function<Integrator *(std::shared_ptr<Camera>,
+                                     std::shared_ptr<Sampler>, Film *)>
+        &makeIntegrator) {
+    AnimatedTransform identity(new Transform, 0, new Transform, 1);
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
+    Film *film = new Film(resolution, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                          std::move(filter), 1., inTestDir("test.exr"), 1.);
+    std::shared_ptr<Camera> camera = std::make_shared<PerspectiveCamera>(
+        identity, Bounds2f(Point2f(-1, -1), Point2f(1, 1)), 0., 1., 0., 10.,
+        45, film, nullptr);
+    std::unique_ptr<Integrator> integrator(
+        makeIntegrator(camera, std::move(sampler), film));
+    integrator->Render(*scene.scene);
+    CheckSceneAverage(inTestDir("test.exr"), scene.expected);
+    integrator.reset();
+    EXPECT_EQ(0, remove(inTestDir("test.exr").c_str()));
+}
+
+// Renders the first test scene with both the regular and the wavefront path
+// tracer at a higher resolution.
+TEST(AnalyticScenes, WavefrontPath) {
+    Options options;
+    options.quiet = true;
+    pbrtInit(options);
+
+    Point2i resolution(64, 64);
+    std::vector<TestScene> scenes = GetScenes();
+    for (bool wavefront : {false, true}) {
+        std::shared_ptr<Sampler> sampler = std::make_shared<SobolSampler>(
+            64, Bounds2i(Point2i(0, 0), resolution));
+        RenderAndCheckAverage(
+            scenes[0], resolution, sampler,
+            [&](std::shared_ptr<Camera> camera,
+                std::shared_ptr<Sampler> sampler, Film *film) -> Integrator * {
+                if (wavefront)
+                    return new WavefrontPathIntegrator(
+                        8, camera, sampler, film->croppedPixelBounds);
+                return new PathIntegrator(8, camera, sampler,
+                                          film->croppedPixelBounds);
+            });
+    }
+
+    pbrtCleanup();
+}
+
+// Renders the first test scene with the volumetric path tracer and with its
+// adaptive variant, which only adds statistics in normal mode.
+TEST(AnalyticScenes, VolPathAdaptive) {
+    Options options;
+    options.quiet = true;
+    pbrtInit(options);
+
+    Point2i resolution(64, 64);
+    std::vector<TestScene> scenes = GetScenes();
+    for (bool adaptive : {false, true}) {
+        RenderAndCheckAverage(
+            scenes[0], resolution, std::make_shared<RandomSampler>(64),
+            [&](std::shared_ptr<Camera> camera,
+                std::shared_ptr<Sampler> sampler, Film *film) -> Integrator * {
+                if (adaptive)
+                    return new VolPathAdaptive(
+                        Statistics(ParamSet(), film, *sampler), 8, camera,
+                        sampler, film->croppedPixelBounds);
+                return new VolPathIntegrator(8, camera, sampler,
+                                             film->croppedPixelBounds);
+            });
+        if (adaptive)
+            EXPECT_EQ(0, remove(inTestDir("test_stats.exr").c_str()));
+    }
+
+    pbrtCleanup();
+}
+
+TEST(AnalyticScenes, AdaptiveIntegrators) {
+    Options options;
+    options.quiet = true;
+    pbrtInit(options);
+
+    // Render with path tracing and BDPT driven by the adaptive statistics,
+    // in both error and time modes
+    Point2i resolution(16, 16);
+    AnimatedTransform identity(new Transform, 0, new Transform, 1);
+    for (const TestScene &scene : GetScenes()) {
+        for (const char *mode : {"error", "time"}) {
+            for (int bdpt = 0; bdpt < 2; ++bdpt) {
+                std::unique_ptr<Filter> filter(
+                    new BoxFilter(Vector2f(0.5, 0.5)));
+                Film *film = new Film(
+                    resolution, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                    std::move(filter), 1., inTestDir("test.exr"), 1.);
+                std::shared_ptr<Camera> camera =
+                    std::make_shared<PerspectiveCamera>(
+                        identity, Bounds2f(Point2f(-1, -1), Point2f(1, 1)), 0.,
+                        1., 0., 10., 45, film, nullptr);
+                std::shared_ptr<Sampler> sampler =
+                    std::make_shared<RandomSampler>(256);
+
+                ParamSet params;
+                std::unique_ptr<std::string[]> modeValue(new std::string[1]);
+                modeValue[0] = mode;
+                params.AddString("mode", std::move(modeValue), 1);
+                std::unique_ptr<Float[]> threshold(new Float[1]);
+                threshold[0] = 0.002;
+                params.AddFloat("errorthreshold", std::move(threshold), 1);
+                std::unique_ptr<int[]> seconds(new int[1]);
+                seconds[0] = 60;
+                params.AddInt("targetseconds", std::move(seconds), 1);
+
+                Integrator *base;
+                if (bdpt)
+                    base = new BDPTIntegrator(sampler, camera, 6, false, false,
+                                              film->croppedPixelBounds);
+                else
+                    base = new PathIntegrator(8, camera, sampler,
+                                              film->croppedPixelBounds);
+                std::unique_ptr<Integrator> integrator(
+                    MakeAdaptive(base, bdpt ? "bdpt" : "path", params,
+                                 sampler, camera));
+                EXPECT_NE(base, integrator.get());
+
+                integrator->Render(*scene.scene);
+                CheckSceneAverage(inTestDir("test.exr"), scene.expected);
+                integrator.reset();
+                EXPECT_EQ(0, remove(inTestDir("test.exr").c_str()));
+                EXPECT_EQ(0, remove(inTestDir("test_stats.exr").c_str()));
+            }
+        }
+    }
+
+    pbrtCleanup();
+}
@@ -0,0 +1,194 @@
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "rng.h"
+#include "primitive.h"
+#include "sampling.h"
+#include "parallel.h"
+#include "accelerators/bvh.h"
+#include "shapes/triangle.h"
+#include "tests/testutil.h"
+
+using namespace pbrt;
+
+TEST(BVH, WideMatchesBinary) {
+    ParallelInit();
+    RNG rng;
+    std::vector<std::shared_ptr<Primitive>> prims = TriangleSoup(20000, rng);
+    std::vector<Ray> rays = RandomRays(100000, rng);
+
+    const char *names[] = {"binary", "wide4", "wide8"};
+    const int widths[] = {2, 4, 8};
+    std::vector<Float> tHit[3];
+    std::vector<bool> occluded[3];
+    for (int w = 0; w < 3; ++w) {
+        BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SAH, widths[w]);
+        for (Ray ray : rays) {
+            SurfaceInteraction isect;
+            tHit[w].push_back(bvh.Intersect(ray, &isect) ? ray.tMax
+                                                         : Infinity);
+        }
+        for (const Ray &ray : rays) occluded[w].push_back(bvh.IntersectP(ray));
+    }
+
+    for (int w = 1; w < 3; ++w) {
+        for (size_t i = 0; i < rays.size(); ++i) {
+            EXPECT_EQ(tHit[0][i], tHit[w][i]) << names[w] << ", ray " << i;
+            EXPECT_EQ(occluded[0][i], occluded[w][i])
+                << names[w] << ", ray " << i;
+        }
+    }
+    ParallelCleanup();
+}
+
+// Builds SAH BVHs for a few scenes with one thread and with all of them;
+// the parallel build must produce the same tree.
+TEST(BVH, ParallelBuild) {
+    struct {
+        const char *name;
+        int nTriangles, nClusters;
+    } scenes[] = {{"uniform", 200000, 0}, {"clustered", 200000, 16}};
+    int oldThreads = PbrtOptions.nThreads;
+
+    for (const auto &scene : scenes) {
+        RNG rng;
+        std::vector<std::shared_ptr<Primitive>> prims =
+            TriangleSoup(scene.nTriangles, rng, scene.nClusters);
+        std::vector<Ray> rays = RandomRays(10000, rng);
+
+        Float cost[2];
+        std::vector<Float> tHit[2];
+        for (int pass = 0; pass < 2; ++pass) {
+            PbrtOptions.nThreads = pass == 0 ? 1 : oldThreads;
+            ParallelInit();
+            BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SAH);
+            cost[pass] = bvh.SAHCost();
+            for (Ray ray : rays) {
+                SurfaceInteraction isect;
+                tHit[pass].push_back(bvh.Intersect(ray, &isect) ? ray.tMax
+                                                                : Infinity);
+            }
+            ParallelCleanup();
+        }
+
+        EXPECT_EQ(cost[0], cost[1]) << scene.name;
+        EXPECT_TRUE(tHit[0] == tHit[1]) << scene.name;
+    }
+    PbrtOptions.nThreads = oldThreads;
+}
+
+TEST(BVH, Cache) {
+    ParallelInit();
+    RNG rng;
+    std::vector<std::shared_ptr<Primitive>> prims = TriangleSoup(5000, rng);
+    std::vector<Ray> rays = RandomRays(10000, rng);
+    const std::string cacheFile = inTestDir("bvh_cache_test.bvh");
+    remove(cacheFile.c_str());
+
+    for (int width : {2, 8}) {
+        // The first BVH writes the cache, the second one loads it
+        std::vector<Float> tHit[2];
+        Float cost[2];
+        for (int pass = 0; pass < 2; ++pass) {
+            BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SAH, width,
+                         cacheFile);
+            cost[pass] = bvh.SAHCost();
+            for (Ray ray : rays) {
+                SurfaceInteraction isect;
+                tHit[pass].push_back(bvh.Intersect(ray, &isect) ? ray.tMax
+                                                                : Infinity);
+            }
+        }
+        EXPECT_EQ(cost[0], cost[1]);
+        EXPECT_TRUE(tHit[0] == tHit[1]) << "width " << width;
+    }
+
+    // A different set of primitives must not reuse the cached tree
+    std::vector<std::shared_ptr<Primitive>> otherPrims =
+        TriangleSoup(5000, rng);
+    BVHAccel cached(otherPrims, 4, BVHAccel::SplitMethod::SAH, 8, cacheFile);
+    BVHAccel rebuilt(otherPrims, 4, BVHAccel::SplitMethod::SAH, 8);
+    for (Ray ray : rays) {
+        Ray r2 = ray;
+        SurfaceInteraction isect;
+        EXPECT_EQ(cached.Intersect(ray, &isect), rebuilt.Intersect(r2, &isect));
+        EXPECT_EQ(ray.tMax, r2.tMax);
+    }
+
+    // Moving a vertex without changing the triangle's bounds must not reuse
+    // the cached vertices either
+    static Transform identity;
+    auto makeTriangle = [](Point3f p2) {
+        Point3f p[3] = {Point3f(0, 0, 0), Point3f(1, 0, 0), p2};
+        int indices[3] = {0, 1, 2};
+        std::vector<std::shared_ptr<Primitive>> prims;
+        for (const auto &tri :
+             CreateTriangleMesh(&identity, &identity, false, 1, indices, 3, p,
+                                nullptr, nullptr, nullptr, nullptr, nullptr))
+            prims.push_back(std::make_shared<GeometricPrimitive>(
+                tri, nullptr, nullptr, MediumInterface()));
+        return prims;
+    };
+    remove(cacheFile.c_str());
+    Ray ray(Point3f(.6f, .6f, -1), Vector3f(0, 0, 1));
+    SurfaceInteraction isect;
+    BVHAccel original(makeTriangle(Point3f(0, 1, 0)), 4,
+                      BVHAccel::SplitMethod::SAH, 8, cacheFile);
+    EXPECT_FALSE(original.IntersectP(ray));
+    BVHAccel moved(makeTriangle(Point3f(.5f, 1, 0)), 4,
+                   BVHAccel::SplitMethod::SAH, 8, cacheFile);
+    EXPECT_TRUE(moved.IntersectP(ray));
+    EXPECT_TRUE(moved.Intersect(ray, &isect));
+
+    remove(cacheFile.c_str());
+    ParallelCleanup();
+}
+
+TEST(BVH, RayBatchMatchesSingleRays) {
+    ParallelInit();
+    RNG rng;
+    std::vector<std::shared_ptr<Primitive>> prims = TriangleSoup(20000, rng);
+    BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SAH);
+
+    // Coherent rays from a common origin through a small grid of
+    // directions, as for a tile of camera rays, followed by random rays
+    std::vector<Ray> rays;
+    for (int y = 0; y < 256; ++y)
+        for (int x = 0; x < 256; ++x)
+            rays.push_back(Ray(Point3f(0, 0, -3),
+                               Normalize(Vector3f((x - 128) / 256.f,
+                                                  (y - 128) / 256.f, 1))));
+    std::vector<Ray> random = RandomRays(20000, rng);
+    rays.insert(rays.end(), random.begin(), random.end());
+
+    for (bool shadow : {false, true}) {
+        std::vector<Float> tHit;
+        std::vector<bool> hit;
+        for (Ray ray : rays) {
+            SurfaceInteraction isect;
+            hit.push_back(shadow ? bvh.IntersectP(ray)
+                                 : bvh.Intersect(ray, &isect));
+            tHit.push_back(ray.tMax);
+        }
+
+        // Trace the same rays in batches of one 16x16 tile each
+        RayBatch batch;
+        for (size_t first = 0; first < rays.size(); first += 256) {
+            batch.Clear();
+            for (size_t i = first; i < std::min(rays.size(), first + 256); ++i)
+                batch.Add(rays[i]);
+            if (shadow)
+                bvh.IntersectP(batch);
+            else
+                bvh.Intersect(batch);
+            for (int i = 0; i < batch.Size(); ++i) {
+                EXPECT_EQ(hit[first + i], (bool)batch.hit[i]) << first + i;
+                if (!shadow) {
+                    EXPECT_EQ(tHit[first + i], batch.rays[i].tMax) << first + i;
+                    if (batch.hit[i])
+                        EXPECT_TRUE(batch.isects[i].primitive != nullptr);
+                }
+            }
+        }
+    }
+    ParallelCleanup();
+}
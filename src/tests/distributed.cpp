@@ -0,0 +1,138 @@
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "distributed.h"
+#include "film.h"
+#include "parallel.h"
+#include "filters/box.h"
+#include "tests/testutil.h"
+#ifndef PBRT_IS_WINDOWS
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+#include <atomic>
+
+using namespace pbrt;
+
+#ifndef PBRT_IS_WINDOWS
+
+// Runs _func_ in a forked worker process and returns its pid; the process
+// exits with _func_'s return value
+static pid_t Spawn(const std::function<int()> &func) {
+    pid_t pid = fork();
+    if (pid == 0) _exit(func());
+    return pid;
+}
+
+static int ExitStatus(pid_t pid) {
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) return -1;
+    return WEXITSTATUS(status);
+}
+
+TEST(Distributed, CoordinatorMergesWorkerTiles) {
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
+    Point2i resolution(32, 32);
+    Film film(resolution, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+              std::move(filter), 1., inTestDir("test.exr"), 1.);
+    auto tileBounds = [](int tile) {
+        Point2i pMin(16 * (tile % 2), 16 * (tile / 2));
+        return Bounds2i(pMin, pMin + Vector2i(16, 16));
+    };
+    // Each item writes a value that identifies it at every pixel center
+    auto itemValue = [](const WorkItem &item) {
+        return Float(1 + item.tile + 10 * item.pass + 100 * item.startSample);
+    };
+    auto render = [&](const WorkItem &item) {
+        std::unique_ptr<FilmTile> tile = film.GetFilmTile(tileBounds(item.tile));
+        for (Point2i p : tileBounds(item.tile))
+            tile->AddSample(Point2f(p.x + 0.5f, p.y + 0.5f),
+                            Spectrum(itemValue(item)));
+        return tile;
+    };
+
+    const std::string address = inTestDir("test_distributed.sock");
+    const uint64_t jobId = 42;
+    const Float workerWaitSeconds = 3;
+    std::unique_ptr<Coordinator> coordinator(
+        new Coordinator(address, jobId, workerWaitSeconds));
+    ASSERT_TRUE(coordinator->Listening());
+
+    // The workers are separate processes, started before this process
+    // starts any threads: one renders another job, one dies on its first
+    // item, and one waits for the second pass
+    pid_t otherJob = Spawn([&]() {
+        return RunWorker(address, jobId + 1, render) ? 0 : 1;
+    });
+    pid_t dying = Spawn([&]() {
+        return RunWorker(address, jobId, [](const WorkItem &) {
+            _exit(3);
+            return std::unique_ptr<FilmTile>();
+        }) ? 0 : 1;
+    });
+    int startPipe[2];
+    ASSERT_EQ(0, pipe(startPipe));
+    pid_t worker = Spawn([&]() {
+        char c;
+        if (read(startPipe[0], &c, 1) != 1) return 2;
+        return RunWorker(address, jobId, render) ? 0 : 1;
+    });
+    close(startPipe[0]);
+
+    // A client that connects and never says anything must not hold up the
+    // others
+    int silent = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, address.c_str());
+    ASSERT_EQ(0, connect(silent, (sockaddr *)&addr, sizeof(addr)));
+
+    ParallelInit();
+    std::atomic<int> nMerged(0), nWrong(0), nLocal(0);
+    for (int pass = 0; pass < 2; ++pass) {
+        if (pass == 1) {
+            char c = 1;
+            ASSERT_EQ(1, write(startPipe[1], &c, 1));
+        }
+        std::vector<WorkItem> items;
+        for (int tile = 0; tile < 4; ++tile)
+            items.push_back({tile, pass, 8 * pass, 8 * (pass + 1)});
+        EXPECT_TRUE(coordinator->Run(
+            items,
+            [&](const WorkItem &item) {
+                ++nLocal;
+                return render(item);
+            },
+            [&](const WorkItem &item) {
+                return film.GetFilmTile(tileBounds(item.tile));
+            },
+            [&](const WorkItem &item, std::unique_ptr<FilmTile> tile) {
+                for (Point2i p : tileBounds(item.tile)) {
+                    const FilmTilePixel &pixel = tile->GetPixel(p);
+                    if (pixel.contribSum[0] != itemValue(item) ||
+                        pixel.filterWeightSum != 1)
+                        ++nWrong;
+                }
+                ++nMerged;
+            }));
+        // The first pass's items were all handed to the dying worker and
+        // then rendered here once no worker was left; the second pass's
+        // went to the remaining worker
+        EXPECT_EQ(4, nLocal) << "pass " << pass;
+    }
+    ParallelCleanup();
+    close(silent);
+    close(startPipe[1]);
+
+    // Destroying the coordinator releases the worker
+    coordinator.reset();
+    EXPECT_EQ(0, ExitStatus(worker));
+    EXPECT_EQ(3, ExitStatus(dying));
+    EXPECT_EQ(1, ExitStatus(otherJob));
+    EXPECT_EQ(8, nMerged);
+    EXPECT_EQ(0, nWrong);
+}
+
+#endif  // !PBRT_IS_WINDOWS
@@ -0,0 +1,65 @@
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "film.h"
+#include "filters/box.h"
+#include "tests/testutil.h"
+
+using namespace pbrt;
+
+TEST(Film, RawFilmRoundTrip) {
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
+    Point2i resolution(8, 4);
+    Film film(resolution, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+              std::move(filter), 1., inTestDir("test.exr"), 2.);
+    std::unique_ptr<FilmTile> tile = film.GetFilmTile(film.GetSampleBounds());
+    for (Point2i p : film.croppedPixelBounds) {
+        Float rgb[3] = {Float(p.x), Float(p.y), 1};
+        tile->AddSample(Point2f(p.x + 0.5f, p.y + 0.5f),
+                        Spectrum::FromRGB(rgb), 0.5);
+    }
+    film.MergeFilmTile(std::move(tile));
+    const std::string filmFile = inTestDir("test.film");
+    ASSERT_TRUE(film.WriteCheckpoint(filmFile, 42, 64, "halton", 32, 16));
+
+    RawFilm raw;
+    ASSERT_TRUE(ReadRawFilm(filmFile, &raw));
+    EXPECT_EQ(resolution, raw.fullResolution);
+    EXPECT_EQ(film.croppedPixelBounds, raw.pixelBounds);
+    EXPECT_EQ(16, raw.firstSample);
+    EXPECT_EQ(32, raw.endSample);
+    EXPECT_EQ(2, raw.scale);
+    EXPECT_EQ(42, raw.jobId);
+    EXPECT_EQ(64, raw.samplesPerPixel);
+    EXPECT_EQ("halton", raw.sampler);
+
+    // The pixel values are resolved like Film::WriteImage() does: weighted
+    // by the sample weight, normalized by the filter weight and scaled
+    std::vector<Float> rgb(3 * raw.pixelBounds.Area());
+    RawFilmToRGB(raw, 1, rgb.data());
+    int offset = 0;
+    for (Point2i p : raw.pixelBounds) {
+        EXPECT_NEAR(p.x, rgb[3 * offset], 1e-3 * (1 + p.x));
+        EXPECT_NEAR(p.y, rgb[3 * offset + 1], 1e-3 * (1 + p.y));
+        EXPECT_NEAR(1, rgb[3 * offset + 2], 1e-3);
+        ++offset;
+    }
+
+    // A checkpoint resumes with its sample range
+    Film other(resolution, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+               std::unique_ptr<Filter>(new BoxFilter(Vector2f(0.5, 0.5))), 1.,
+               inTestDir("test.exr"), 2.);
+    int64_t samplesCompleted, firstSample;
+    EXPECT_TRUE(other.ReadCheckpoint(filmFile, 42, 64, "halton",
+                                     &samplesCompleted, &firstSample));
+    EXPECT_EQ(32, samplesCompleted);
+    EXPECT_EQ(16, firstSample);
+
+    // ... but not if the scene, the samples per pixel or the sampler changed
+    EXPECT_FALSE(other.ReadCheckpoint(filmFile, 43, 64, "halton",
+                                      &samplesCompleted, &firstSample));
+    EXPECT_FALSE(other.ReadCheckpoint(filmFile, 42, 128, "halton",
+                                      &samplesCompleted, &firstSample));
+    EXPECT_FALSE(other.ReadCheckpoint(filmFile, 42, 64, "sobol",
+                                      &samplesCompleted, &firstSample));
+    EXPECT_EQ(0, remove(filmFile.c_str()));
+}
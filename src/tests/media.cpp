@@ -0,0 +1,77 @@
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "rng.h"
+#include "interaction.h"
+#include "memory.h"
+#include "media/grid.h"
+#include "samplers/random.h"
+
+using namespace pbrt;
+
+// Optical depth along _ray_ from numerically integrating the density
+static Float OpticalDepth(const GridDensityMedium &medium, const Ray &ray,
+                          Float sigma_t) {
+    const int nSteps = 20000;
+    Float tau = 0;
+    for (int i = 0; i < nSteps; ++i) {
+        Point3f p = ray(ray.tMax * (i + .5f) / nSteps);
+        if (Inside(p, Bounds3f(Point3f(0, 0, 0), Point3f(1, 1, 1))))
+            tau += medium.Density(p);
+    }
+    return sigma_t * tau * ray.tMax / nSteps;
+}
+
+TEST(GridDensityMedium, MajorantTracking) {
+    // A sparse volume: faint haze in one corner and a few dense voxels,
+    // so that both empty and very dense majorant cells are crossed
+    const int n = 48;
+    std::vector<Float> density(n * n * n, 0.f);
+    RNG rng;
+    for (int z = 0; z < n; ++z)
+        for (int y = 0; y < n; ++y)
+            for (int x = 0; x < n; ++x)
+                if (x < 16 && y < 16) density[(z * n + y) * n + x] = .05f;
+    for (int z = 18; z < 30; ++z)
+        for (int y = 18; y < 30; ++y)
+            for (int x = 18; x < 30; ++x)
+                if (rng.UniformFloat() < .3f)
+                    density[(z * n + y) * n + x] = 4 * rng.UniformFloat();
+    Float sigma_t = 3;
+    GridDensityMedium medium(Spectrum(1.f), Spectrum(sigma_t - 1), 0, n, n, n,
+                             Transform(), density.data());
+
+    RandomSampler sampler(1 << 30);
+    sampler.StartPixel(Point2i(0, 0));
+    MemoryArena arena;
+    for (int r = 0; r < 20; ++r) {
+        // Rays through the medium's bounds, some of them axis-aligned
+        Point3f o(-.5f, .2f + .6f * rng.UniformFloat(),
+                  .2f + .6f * rng.UniformFloat());
+        Point3f target(1.5f, .35f + .3f * rng.UniformFloat(),
+                       .35f + .3f * rng.UniformFloat());
+        if (r % 5 == 0) target = Point3f(1.5f, o.y, o.z);
+        Vector3f d = target - o;
+        Ray ray(o, Normalize(d), d.Length());
+        Float expected = std::exp(-OpticalDepth(medium, ray, sigma_t));
+
+        // Estimate transmittance with ratio tracking, and as the
+        // probability of delta tracking passing through the medium
+        const int nSamples = 20000;
+        Float trSum = 0;
+        int nEscaped = 0;
+        for (int i = 0; i < nSamples; ++i) {
+            trSum += medium.Tr(ray, sampler)[0];
+            MediumInteraction mi;
+            Spectrum beta = medium.Sample(ray, sampler, arena, &mi);
+            if (mi.IsValid())
+                EXPECT_FLOAT_EQ(beta[0], (sigma_t - 1) / sigma_t);
+            else
+                ++nEscaped;
+            arena.Reset();
+        }
+        Float tolerance = .01f;
+        EXPECT_NEAR(expected, trSum / nSamples, tolerance) << "ray " << r;
+        EXPECT_NEAR(expected, Float(nEscaped) / nSamples, tolerance)
+            << "ray " << r;
+    }
+}
@@ -0,0 +1,119 @@
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "mipmap.h"
+#include "rng.h"
+
+using namespace pbrt;
+
+// Per-texel EWA filter, as MIPMap::Lookup() computed it before texel rows
+// were filtered in batches
+static RGBSpectrum ReferenceEWA(const MIPMap<RGBSpectrum> &mip, int level,
+                               Point2f st, Vector2f dst0, Vector2f dst1) {
+    if (level >= mip.Levels()) return mip.Texel(mip.Levels() - 1, 0, 0);
+    Point2i res(std::max(1, mip.Width() >> level),
+                std::max(1, mip.Height() >> level));
+    st[0] = st[0] * res.x - 0.5f;
+    st[1] = st[1] * res.y - 0.5f;
+    dst0[0] *= res.x;
+    dst0[1] *= res.y;
+    dst1[0] *= res.x;
+    dst1[1] *= res.y;
+    Float A = dst0[1] * dst0[1] + dst1[1] * dst1[1] + 1;
+    Float B = -2 * (dst0[0] * dst0[1] + dst1[0] * dst1[1]);
+    Float C = dst0[0] * dst0[0] + dst1[0] * dst1[0] + 1;
+    Float invF = 1 / (A * C - B * B * 0.25f);
+    A *= invF;
+    B *= invF;
+    C *= invF;
+    Float det = -B * B + 4 * A * C;
+    Float invDet = 1 / det;
+    Float uSqrt = std::sqrt(det * C), vSqrt = std::sqrt(A * det);
+    int s0 = std::ceil(st[0] - 2 * invDet * uSqrt);
+    int s1 = std::floor(st[0] + 2 * invDet * uSqrt);
+    int t0 = std::ceil(st[1] - 2 * invDet * vSqrt);
+    int t1 = std::floor(st[1] + 2 * invDet * vSqrt);
+
+    const Float *weightLut = EWAWeightLut();
+    RGBSpectrum sum(0.f);
+    Float sumWts = 0;
+    for (int it = t0; it <= t1; ++it) {
+        Float tt = it - st[1];
+        for (int is = s0; is <= s1; ++is) {
+            Float ss = is - st[0];
+            Float r2 = A * ss * ss + B * ss * tt + C * tt * tt;
+            if (r2 < 1) {
+                int index = std::min((int)(r2 * EWAWeightLUTSize),
+                                     EWAWeightLUTSize - 1);
+                Float weight = weightLut[index];
+                sum += mip.Texel(level, is, it) * weight;
+                sumWts += weight;
+            }
+        }
+    }
+    return sum / sumWts;
+}
+
+static RGBSpectrum ReferenceLookup(const MIPMap<RGBSpectrum> &mip,
+                                   const Point2f &st, Vector2f dst0,
+                                   Vector2f dst1, Float maxAnisotropy) {
+    if (dst0.LengthSquared() < dst1.LengthSquared()) std::swap(dst0, dst1);
+    Float majorLength = dst0.Length();
+    Float minorLength = dst1.Length();
+    if (minorLength * maxAnisotropy < majorLength && minorLength > 0) {
+        Float scale = majorLength / (minorLength * maxAnisotropy);
+        dst1 *= scale;
+        minorLength *= scale;
+    }
+    if (minorLength == 0) return mip.Lookup(st, dst0, dst1);
+    Float lod = std::max((Float)0, mip.Levels() - (Float)1 + Log2(minorLength));
+    int ilod = std::floor(lod);
+    return Lerp(lod - ilod, ReferenceEWA(mip, ilod, st, dst0, dst1),
+                ReferenceEWA(mip, ilod + 1, st, dst0, dst1));
+}
+
+// EWA lookups with footprints ranging from a few texels to long
+// anisotropic ellipses, compared to the per-texel filter
+TEST(MIPMap, EWAMatchesPerTexelFilter) {
+    Point2i res(256, 256);
+    std::vector<RGBSpectrum> image(res.x * res.y);
+    RNG rng;
+    for (RGBSpectrum &texel : image) {
+        Float rgb[3] = {rng.UniformFloat(), rng.UniformFloat(),
+                        rng.UniformFloat()};
+        texel = RGBSpectrum::FromRGB(rgb);
+    }
+
+    struct Lookup {
+        Point2f st;
+        Vector2f dst0, dst1;
+    };
+    std::vector<Lookup> lookups;
+    for (int i = 0; i < 50000; ++i) {
+        // Footprints between a texel and a sixteenth of the texture,
+        // with anisotropy up to the limit; lookups may wrap
+        Float width = std::pow(2.f, -9.f + 5 * rng.UniformFloat());
+        Float theta = 2 * Pi * rng.UniformFloat();
+        Float aniso = 1 + 15 * rng.UniformFloat();
+        Vector2f major(std::cos(theta), std::sin(theta));
+        Vector2f minor(-major.y, major.x);
+        lookups.push_back({Point2f(1.2f * rng.UniformFloat() - .1f,
+                                   1.2f * rng.UniformFloat() - .1f),
+                           major * width * aniso, minor * width});
+    }
+
+    const char *wrapNames[] = {"repeat", "black", "clamp"};
+    for (ImageWrap wrap :
+         {ImageWrap::Repeat, ImageWrap::Black, ImageWrap::Clamp}) {
+        MIPMap<RGBSpectrum> mip(res, image.data(), false, 8.f, wrap);
+        for (size_t i = 0; i < lookups.size(); ++i) {
+            const Lookup &l = lookups[i];
+            RGBSpectrum expected =
+                ReferenceLookup(mip, l.st, l.dst0, l.dst1, 8.f);
+            RGBSpectrum result = mip.Lookup(l.st, l.dst0, l.dst1);
+            for (int c = 0; c < 3; ++c)
+                EXPECT_NEAR(expected[c], result[c],
+                            1e-5f * std::max((Float)1, expected[c]))
+                    << wrapNames[int(wrap)] << " lookup " << i;
+        }
+    }
+}
@@ -37,3 +37,50 @@ TEST(Parallel, DoNothing) {
 
     ParallelCleanup();
 }
+
+TEST(Parallel, Nested) {
+    ParallelInit();
+
+    std::atomic<int> counter{0};
+    ParallelFor([&](int64_t) {
+        ParallelFor([&](int64_t) { ++counter; }, 100, 7);
+    }, 50, 1);
+    EXPECT_EQ(50 * 100, counter);
+
+    counter = 0;
+    ParallelFor2D([&](Point2i p) {
+        ParallelFor2D([&](Point2i p) { ++counter; }, Point2i(4, 3));
+    }, Point2i(9, 8));
+    EXPECT_EQ(9 * 8 * 4 * 3, counter);
+
+    ParallelCleanup();
+}
+
+// Short, uneven loop iterations, which have to be rebalanced between the
+// threads, give the same result with any number of threads.
+TEST(Parallel, UnevenWork) {
+    int oldThreads = PbrtOptions.nThreads;
+    const int64_t count = 1 << 14;
+    uint64_t expected = 0;
+
+    for (int nThreads : {1, 2, 4, 7}) {
+        PbrtOptions.nThreads = nThreads;
+        ParallelInit();
+
+        std::atomic<uint64_t> checksum{0};
+        ParallelFor([&](int64_t i) {
+            uint64_t v = i;
+            for (int j = 0; j < 20 + (i % 7) * 10; ++j)
+                v = v * 6364136223846793005ull + 1442695040888963407ull;
+            checksum += v;
+        }, count, 16);
+        if (nThreads == 1)
+            expected = checksum;
+        else
+            EXPECT_EQ(expected, checksum) << nThreads << " threads";
+
+        ParallelCleanup();
+    }
+
+    PbrtOptions.nThreads = oldThreads;
+}
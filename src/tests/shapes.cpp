@@ -6,13 +6,16 @@
 #include "rng.h"
 #include "shape.h"
 #include "lowdiscrepancy.h"
+#include "paramset.h"
 #include "sampling.h"
 #include "shapes/cone.h"
 #include "shapes/cylinder.h"
 #include "shapes/disk.h"
 #include "shapes/paraboloid.h"
+#include "shapes/plymesh.h"
 #include "shapes/sphere.h"
 #include "shapes/triangle.h"
+#include "tests/testutil.h"
 
 using namespace pbrt;
 
@@ -557,3 +560,208 @@ TEST(Triangle, BadCases) {
     SurfaceInteraction isect;
     EXPECT_FALSE(mesh[0]->Intersect(ray, &thit, &isect));
 }
+
+TEST(Triangle, BlockMatchesIntersect) {
+    // Random triangles at a range of scales, slivers, nearly collinear
+    // triangles, and triangles with coincident vertices, which must never
+    // be put in blocks
+    RNG rng(5251);
+    std::vector<Point3f> p;
+    std::vector<bool> degenerate;
+    auto randomPoint = [&](Float scale) {
+        return Point3f(pUnif(rng, scale), pUnif(rng, scale),
+                       pUnif(rng, scale));
+    };
+    for (int i = 0; i < 400; ++i) {
+        Float scale = pExp(rng, 3);
+        Point3f p0 = randomPoint(scale), p1 = randomPoint(scale);
+        Point3f p2 = randomPoint(scale);
+        switch (i % 4) {
+        case 1:
+            // Sliver: third vertex just off the edge $p_0 p_1$
+            p2 = Lerp(rng.UniformFloat(), p0, p1) +
+                 Vector3f(1e-4f * scale, 0, 0);
+            break;
+        case 2:
+            // Coincident vertices
+            p2 = p1;
+            break;
+        case 3:
+            // Nearly collinear vertices
+            p2 = p0 + (p1 - p0) * 2 + Vector3f(0, 0, 1e-5f * scale);
+            break;
+        }
+        p.push_back(p0);
+        p.push_back(p1);
+        p.push_back(p2);
+    }
+    int nTriangles = p.size() / 3;
+    std::vector<int> indices(p.size());
+    for (size_t i = 0; i < indices.size(); ++i) indices[i] = i;
+    Transform identity;
+    std::vector<std::shared_ptr<Shape>> tris = CreateTriangleMesh(
+        &identity, &identity, false, nTriangles, indices.data(), p.size(),
+        p.data(), nullptr, nullptr, nullptr, nullptr, nullptr);
+
+    // Pack the triangles that may go in blocks four at a time
+    std::vector<const Triangle *> packed;
+    for (int i = 0; i < nTriangles; ++i) {
+        const Triangle *tri = (const Triangle *)tris[i].get();
+        Point3f v[3];
+        bool packable = tri->GetBlockVertices(v);
+        if (i % 4 == 2) {
+            EXPECT_FALSE(packable) << "triangle " << i;
+        } else if (packable)
+            packed.push_back(tri);
+    }
+    auto makeBlock = [](const Triangle *const *tri, int n) {
+        TriangleBlock block;
+        block.nTriangles = n;
+        for (int lane = 0; lane < TriangleBlock::Width; ++lane) {
+            Point3f v[3] = {Point3f(0, 0, 0), Point3f(0, 0, 0),
+                            Point3f(0, 0, 0)};
+            if (lane < n) tri[lane]->GetBlockVertices(v);
+            for (int j = 0; j < 3; ++j)
+                for (int a = 0; a < 3; ++a) block.p[j][a][lane] = v[j][a];
+        }
+        return block;
+    };
+
+    int nHits = 0;
+    for (size_t start = 0; start + TriangleBlock::Width <= packed.size();
+         start += TriangleBlock::Width) {
+        const Triangle *const *tri = &packed[start];
+        TriangleBlock block = makeBlock(tri, TriangleBlock::Width);
+        for (int r = 0; r < 200; ++r) {
+            // Rays toward points in, on the edges of and around the
+            // triangles
+            int target = rng.UniformUInt32(TriangleBlock::Width);
+            Point3f v[3];
+            tri[target]->GetBlockVertices(v);
+            Point3f pTarget;
+            if (r % 3 == 0)
+                pTarget = Lerp(rng.UniformFloat(), v[0], v[1]);
+            else {
+                Point2f b = UniformSampleTriangle(
+                    Point2f(rng.UniformFloat(), rng.UniformFloat()));
+                pTarget = b[0] * v[0] + b[1] * v[1] + (1 - b[0] - b[1]) * v[2];
+                if (r % 3 == 2)
+                    pTarget += Vector3f(randomPoint(.1f * Distance(v[0], v[1])));
+            }
+            Point3f o = randomPoint(pExp(rng, 3));
+            Ray ray(o, pTarget - o,
+                    rng.UniformFloat() < .2f ? rng.UniformFloat() : Infinity);
+            TriangleBlockRay blockRay(ray);
+
+            // Each triangle on its own
+            int closest = -1;
+            Float tClosest = 0;
+            for (int lane = 0; lane < TriangleBlock::Width; ++lane) {
+                Float tHit, b[3];
+                SurfaceInteraction isect;
+                bool hit = tri[lane]->Intersect(ray, &tHit, &isect, false);
+                EXPECT_EQ(hit, tri[lane]->IntersectP(ray, false));
+                TriangleBlock single = makeBlock(&tri[lane], 1);
+                Float tBlock;
+                int blockLane =
+                    IntersectTriangleBlock(single, blockRay, ray.tMax, &tBlock,
+                                           b);
+                ASSERT_EQ(hit ? 0 : -1, blockLane) << "ray " << r;
+                if (!hit) continue;
+                ++nHits;
+                EXPECT_EQ(tHit, tBlock);
+                // The barycentrics give the same hit point
+                Point3f w[3];
+                tri[lane]->GetBlockVertices(w);
+                EXPECT_EQ(isect.p, b[0] * w[0] + b[1] * w[1] + b[2] * w[2]);
+                if (closest == -1 || tHit < tClosest) {
+                    closest = lane;
+                    tClosest = tHit;
+                }
+            }
+
+            // ... and the whole block at once
+            Float tBlock;
+            EXPECT_EQ(closest,
+                      IntersectTriangleBlock(block, blockRay, ray.tMax,
+                                             &tBlock));
+            if (closest >= 0) EXPECT_EQ(tClosest, tBlock);
+        }
+    }
+    // Make sure the rays actually exercised the hit paths
+    EXPECT_GT(nHits, 1000);
+}
+
+TEST(Triangle, PLYBinaryMatchesASCII) {
+    // The same quad and triangle, stored as ASCII (read with rply) and as
+    // binary little-endian PLY (memory-mapped when supported)
+    const char *header =
+        "element vertex 5\n"
+        "property float x\nproperty float y\nproperty float z\n"
+        "property uchar flags\n"
+        "element face 2\n"
+        "property list uchar int vertex_indices\n"
+        "end_header\n";
+    float p[5][3] = {{0, 0, 0}, {1, 0, 0}, {1, 1, 0}, {0, 1, 0}, {0, 2, 1}};
+    int32_t quad[4] = {0, 1, 2, 3}, tri[3] = {3, 2, 4};
+
+    std::string asciiName = inTestDir("test_ascii.ply"),
+                binaryName = inTestDir("test_binary.ply");
+    FILE *f = fopen(asciiName.c_str(), "w");
+    ASSERT_TRUE(f != nullptr);
+    fprintf(f, "ply\nformat ascii 1.0\n%s", header);
+    for (int i = 0; i < 5; ++i)
+        fprintf(f, "%g %g %g 7\n", p[i][0], p[i][1], p[i][2]);
+    fprintf(f, "4 0 1 2 3\n3 3 2 4\n");
+    fclose(f);
+
+    f = fopen(binaryName.c_str(), "wb");
+    ASSERT_TRUE(f != nullptr);
+    fprintf(f, "ply\nformat binary_little_endian 1.0\n%s", header);
+    uint8_t flags = 7, four = 4, three = 3;
+    for (int i = 0; i < 5; ++i) {
+        fwrite(p[i], sizeof(float), 3, f);
+        fwrite(&flags, 1, 1, f);
+    }
+    fwrite(&four, 1, 1, f);
+    fwrite(quad, sizeof(int32_t), 4, f);
+    fwrite(&three, 1, 1, f);
+    fwrite(tri, sizeof(int32_t), 3, f);
+    fclose(f);
+
+    Transform o2w = Translate(Vector3f(1, 2, 3)), w2o = Inverse(o2w);
+    auto load = [&](const std::string &filename) {
+        ParamSet params;
+        std::unique_ptr<std::string[]> name(new std::string[1]);
+        name[0] = filename;
+        params.AddString("filename", std::move(name), 1);
+        std::map<std::string, std::shared_ptr<Texture<Float>>> textures;
+        return CreatePLYMesh(&o2w, &w2o, false, params, &textures);
+    };
+    std::vector<std::shared_ptr<Shape>> ascii = load(asciiName);
+    std::vector<std::shared_ptr<Shape>> binary = load(binaryName);
+    remove(asciiName.c_str());
+
+    ASSERT_EQ(3, ascii.size());
+    ASSERT_EQ(3, binary.size());
+    for (int i = 0; i < 3; ++i) {
+        EXPECT_EQ(ascii[i]->WorldBound(), binary[i]->WorldBound());
+        EXPECT_EQ(ascii[i]->Area(), binary[i]->Area());
+    }
+
+    // A file that ends before the second face's vertex count fails to load
+    f = fopen(binaryName.c_str(), "r+b");
+    ASSERT_TRUE(f != nullptr);
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fclose(f);
+    std::vector<char> truncated(size - 1 - 3 * sizeof(int32_t));
+    f = fopen(binaryName.c_str(), "rb");
+    ASSERT_EQ(1, fread(truncated.data(), truncated.size(), 1, f));
+    fclose(f);
+    f = fopen(binaryName.c_str(), "wb");
+    fwrite(truncated.data(), truncated.size(), 1, f);
+    fclose(f);
+    EXPECT_EQ(0, load(binaryName).size());
+    remove(binaryName.c_str());
+}
@@ -0,0 +1,88 @@
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_TESTS_TESTUTIL_H
+#define PBRT_TESTS_TESTUTIL_H
+
+// tests/testutil.h*
+// Helpers shared by the unit tests and by pbrtbench, which measures the
+// same code paths.
+#include "pbrt.h"
+#include "primitive.h"
+#include "rng.h"
+#include "sampling.h"
+#include "shapes/triangle.h"
+#include <stdlib.h>
+
+namespace pbrt {
+
+// Returns where the tests write the scratch file _path_: in $TMPDIR or the
+// system's temporary directory rather than the working directory.
+inline std::string inTestDir(const std::string &path) {
+    const char *dir = getenv("TMPDIR");
+#ifdef PBRT_IS_WINDOWS
+    if (!dir) dir = getenv("TEMP");
+    if (!dir) return path;
+#else
+    if (!dir) dir = "/tmp";
+#endif
+    return std::string(dir) + "/" + path;
+}
+
+// Random soup of small triangles inside the [-1,1]^3 cube. If _nClusters_
+// is non-zero, the triangles are packed around that many random points
+// instead of being spread uniformly.
+inline std::vector<std::shared_ptr<Primitive>> TriangleSoup(
+    int nTriangles, RNG &rng, int nClusters = 0) {
+    static Transform identity;
+    std::vector<Point3f> clusters;
+    for (int i = 0; i < nClusters; ++i)
+        clusters.push_back(Point3f(Lerp(rng.UniformFloat(), -1, 1),
+                                   Lerp(rng.UniformFloat(), -1, 1),
+                                   Lerp(rng.UniformFloat(), -1, 1)));
+    std::vector<Point3f> p;
+    std::vector<int> indices;
+    for (int i = 0; i < nTriangles; ++i) {
+        Point3f center(Lerp(rng.UniformFloat(), -1, 1),
+                       Lerp(rng.UniformFloat(), -1, 1),
+                       Lerp(rng.UniformFloat(), -1, 1));
+        if (nClusters > 0)
+            center = clusters[rng.UniformUInt32(nClusters)] +
+                     .05f * (center - Point3f(0, 0, 0));
+        for (int j = 0; j < 3; ++j) {
+            Vector3f offset(rng.UniformFloat() - .5f, rng.UniformFloat() - .5f,
+                            rng.UniformFloat() - .5f);
+            indices.push_back(p.size());
+            p.push_back(center + .1f * offset);
+        }
+    }
+    std::vector<std::shared_ptr<Shape>> tris = CreateTriangleMesh(
+        &identity, &identity, false, nTriangles, &indices[0], p.size(), &p[0],
+        nullptr, nullptr, nullptr, nullptr, nullptr);
+
+    std::vector<std::shared_ptr<Primitive>> prims;
+    for (const auto &tri : tris)
+        prims.push_back(std::make_shared<GeometricPrimitive>(
+            tri, nullptr, nullptr, MediumInterface()));
+    return prims;
+}
+
+// Rays from random points around the triangle soup in random directions
+inline std::vector<Ray> RandomRays(int nRays, RNG &rng) {
+    std::vector<Ray> rays;
+    for (int i = 0; i < nRays; ++i) {
+        Point3f o(Lerp(rng.UniformFloat(), -1.5, 1.5),
+                  Lerp(rng.UniformFloat(), -1.5, 1.5),
+                  Lerp(rng.UniformFloat(), -1.5, 1.5));
+        Vector3f d = UniformSampleSphere(
+            Point2f(rng.UniformFloat(), rng.UniformFloat()));
+        rays.push_back(Ray(o, d));
+    }
+    return rays;
+}
+
+}  // namespace pbrt
+
+#endif  // PBRT_TESTS_TESTUTIL_H
@@ -0,0 +1,77 @@
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "mipmap.h"
+#include "rng.h"
+#include "texcache.h"
+#include "tests/testutil.h"
+
+using namespace pbrt;
+
+TEST(TextureCache, TiledMIPMapMatchesInMemory) {
+    // A non-power-of-two image, so that the pyramid is resampled and has
+    // levels with partially-filled tiles
+    Point2i res(150, 70);
+    std::vector<RGBSpectrum> image(res.x * res.y);
+    RNG rng;
+    for (RGBSpectrum &texel : image) {
+        Float rgb[3] = {rng.UniformFloat(), rng.UniformFloat(),
+                        rng.UniformFloat()};
+        texel = RGBSpectrum::FromRGB(rgb);
+    }
+    MIPMap<RGBSpectrum> mipmap(res, image.data());
+    ASSERT_TRUE(mipmap.WriteTiled(inTestDir("test.tmip")));
+
+    // Leave room for two tiles in each shard, so that tiles are evicted
+    // and paged in again
+    int64_t tileBytes = 64 * 64 * 3 * sizeof(float);
+    int64_t budget = 2 * 16 * tileBytes;
+    TextureCache cache(budget);
+    std::unique_ptr<TiledMIPFile> tiles =
+        TiledMIPFile::Open(inTestDir("test.tmip"), &cache, true);
+    ASSERT_TRUE(tiles != nullptr);
+    EXPECT_EQ(tiles->TileBytes(), tileBytes);
+    MIPMap<RGBSpectrum> tiled(std::move(tiles));
+
+    ASSERT_EQ(mipmap.Levels(), tiled.Levels());
+    EXPECT_EQ(mipmap.Width(), tiled.Width());
+    EXPECT_EQ(mipmap.Height(), tiled.Height());
+    for (int level = 0; level < mipmap.Levels(); ++level)
+        for (int t = -3; t < (mipmap.Height() >> level) + 3; ++t)
+            for (int s = -3; s < (mipmap.Width() >> level) + 3; ++s)
+                EXPECT_EQ(mipmap.Texel(level, s, t), tiled.Texel(level, s, t));
+    EXPECT_LE(cache.BytesResident(), budget);
+
+    for (int i = 0; i < 1000; ++i) {
+        Point2f st(rng.UniformFloat(), rng.UniformFloat());
+        Vector2f dst0(.1f * rng.UniformFloat(), .01f * rng.UniformFloat());
+        Vector2f dst1(.01f * rng.UniformFloat(), .05f * rng.UniformFloat());
+        EXPECT_EQ(mipmap.Lookup(st, dst0, dst1), tiled.Lookup(st, dst0, dst1));
+    }
+}
+
+TEST(TextureCache, MappedTiledMIPMap) {
+    Point2i res(64, 32);
+    std::vector<RGBSpectrum> image(res.x * res.y);
+    RNG rng;
+    for (RGBSpectrum &texel : image) {
+        Float rgb[3] = {rng.UniformFloat(), rng.UniformFloat(),
+                        rng.UniformFloat()};
+        texel = RGBSpectrum::FromRGB(rgb);
+    }
+    MIPMap<RGBSpectrum> mipmap(res, image.data());
+    ASSERT_TRUE(mipmap.WriteTiled(inTestDir("test.tmip")));
+
+    // Without a cache, the file is memory-mapped; RGB files can also be
+    // read as scaled luminance by Float MIP maps
+    std::unique_ptr<TiledMIPFile> tiles =
+        TiledMIPFile::Open(inTestDir("test.tmip"), nullptr, true);
+    ASSERT_TRUE(tiles != nullptr);
+    MIPMap<Float> luminance(std::move(tiles), false, 8.f, ImageWrap::Clamp,
+                            2.f);
+    ASSERT_EQ(mipmap.Levels(), luminance.Levels());
+    for (int level = 0; level < mipmap.Levels(); ++level)
+        for (int t = 0; t < (res.y >> level); ++t)
+            for (int s = 0; s < (res.x >> level); ++s)
+                EXPECT_EQ(2.f * mipmap.Texel(level, s, t).y(),
+                          luminance.Texel(level, s, t));
+}
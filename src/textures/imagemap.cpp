@@ -34,10 +34,48 @@
 // textures/imagemap.cpp*
 #include "textures/imagemap.h"
 #include "imageio.h"
+#include "fileutil.h"
 #include "stats.h"
+#include "stringprint.h"
+#include "texcache.h"
+#include <atomic>
+#ifdef PBRT_IS_WINDOWS
+#include <process.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
 
 namespace pbrt {
 
+// Returns a unique name for the tiled copy of the texture _filename_, in
+// the texture cache directory or else the system's temporary directory
+static std::string TiledTextureFilename(const std::string &filename) {
+    static std::atomic<int> nFiles(0);
+    std::string dir = PbrtOptions.textureCacheDir;
+    if (dir.empty()) {
+#ifdef PBRT_IS_WINDOWS
+        char tmp[MAX_PATH + 1];
+        DWORD length = GetTempPathA(sizeof(tmp), tmp);
+        if (length > 0 && length < sizeof(tmp)) {
+            // Drop the trailing backslash
+            dir = std::string(tmp, length - 1);
+        } else
+            dir = DirectoryContaining(filename);
+#else
+        const char *tmp = getenv("TMPDIR");
+        dir = tmp ? tmp : "/tmp";
+#endif
+    }
+#ifdef PBRT_IS_WINDOWS
+    int pid = _getpid();
+#else
+    int pid = getpid();
+#endif
+    int index = nFiles++;
+    return StringPrintf("%s/pbrt-%d-%d.tmip", dir.c_str(), pid, index);
+}
+
 // ImageTexture Method Definitions
 template <typename Tmemory, typename Treturn>
 ImageTexture<Tmemory, Treturn>::ImageTexture(
@@ -45,21 +83,66 @@ ImageTexture<Tmemory, Treturn>::ImageTexture(
     bool doTrilinear, Float maxAniso, ImageWrap wrapMode, Float scale,
     bool gamma)
     : mapping(std::move(mapping)) {
-    mipmap =
-        GetTexture(filename, doTrilinear, maxAniso, wrapMode, scale, gamma);
+    mipmap = GetTexture(
+        TexInfo(filename, doTrilinear, maxAniso, wrapMode, scale, gamma));
 }
 
 template <typename Tmemory, typename Treturn>
-MIPMap<Tmemory> *ImageTexture<Tmemory, Treturn>::GetTexture(
-    const std::string &filename, bool doTrilinear, Float maxAniso,
-    ImageWrap wrap, Float scale, bool gamma) {
-    // Return _MIPMap_ from texture cache if present
-    TexInfo texInfo(filename, doTrilinear, maxAniso, wrap, scale, gamma);
-    if (textures.find(texInfo) != textures.end())
-        return textures[texInfo].get();
-
-    // Create _MIPMap_ for _filename_
+const std::unique_ptr<MIPMap<Tmemory>> *
+ImageTexture<Tmemory, Treturn>::GetTexture(const TexInfo &texInfo) {
+    // Return the texture cache's entry for _texInfo_, adding the ones that
+    // aren't there yet to the textures that _LoadTextures()_ loads
+    auto iter = textures.find(texInfo);
+    if (iter == textures.end()) {
+        iter = textures.insert(std::make_pair(texInfo, nullptr)).first;
+        pendingTextures.push_back(iter);
+    }
+    return &iter->second;
+}
+
+template <typename Tmemory, typename Treturn>
+void ImageTexture<Tmemory, Treturn>::LoadTextures() {
+    // Each texture also builds its _MIPMap_ with parallel loops, which
+    // other threads help with once they run out of textures to load. A
+    // thread waiting on those loops may start loading another texture of
+    // the same _ParallelFor_, so textures are loaded in groups to bound how
+    // many decoded images are in memory at once: one per thread, or one at
+    // a time when the texture cache has to keep memory use under its limit.
+    int64_t nPending = pendingTextures.size();
+    int64_t groupSize = TextureCache::Global() ? 1 : MaxThreadIndex();
+    for (int64_t start = 0; start < nPending; start += groupSize) {
+        int64_t end = std::min(nPending, start + groupSize);
+        ParallelFor([&](int64_t i) {
+            pendingTextures[start + i]->second.reset(
+                LoadTexture(pendingTextures[start + i]->first));
+        }, end - start);
+    }
+    pendingTextures.clear();
+}
+
+template <typename Tmemory, typename Treturn>
+MIPMap<Tmemory> *ImageTexture<Tmemory, Treturn>::LoadTexture(
+    const TexInfo &texInfo) {
+    // Create _MIPMap_ for _texInfo.filename_
     ProfilePhase _(Prof::TextureLoading);
+    const std::string &filename = texInfo.filename;
+    bool doTrilinear = texInfo.doTrilinear, gamma = texInfo.gamma;
+    Float maxAniso = texInfo.maxAniso, scale = texInfo.scale;
+    ImageWrap wrap = texInfo.wrapMode;
+    if (HasExtension(filename, ".tmip")) {
+        // Use the pre-filtered levels of a tiled MIP map file as they are,
+        // paging them in through the texture cache or mapping the file
+        std::unique_ptr<TiledMIPFile> tiles =
+            TiledMIPFile::Open(filename, TextureCache::Global());
+        if (tiles) {
+            if (gamma)
+                Warning("%s: ignoring \"gamma\" for tiled MIP map file; "
+                        "\"imgtool makemip\" linearizes texels instead",
+                        filename.c_str());
+            return new MIPMap<Tmemory>(std::move(tiles), doTrilinear,
+                                       maxAniso, wrap, scale);
+        }
+    }
     Point2i resolution;
     std::unique_ptr<RGBSpectrum[]> texels = ReadImage(filename, &resolution);
     if (!texels) {
@@ -71,36 +154,55 @@ MIPMap<Tmemory> *ImageTexture<Tmemory, Treturn>::GetTexture(
         texels.reset(rgb);
     }
 
-    // Flip image in y; texture coordinate space has (0,0) at the lower
-    // left corner.
-    for (int y = 0; y < resolution.y / 2; ++y)
-        for (int x = 0; x < resolution.x; ++x) {
-            int o1 = y * resolution.x + x;
-            int o2 = (resolution.y - 1 - y) * resolution.x + x;
-            std::swap(texels[o1], texels[o2]);
-        }
-
     MIPMap<Tmemory> *mipmap = nullptr;
     if (texels) {
-        // Convert texels to type _Tmemory_ and create _MIPMap_
+        // Convert texels to type _Tmemory_ and create _MIPMap_, flipping
+        // the image in y; texture coordinate space has (0,0) at the lower
+        // left corner.
         std::unique_ptr<Tmemory[]> convertedTexels(
             new Tmemory[resolution.x * resolution.y]);
-        for (int i = 0; i < resolution.x * resolution.y; ++i)
-            convertIn(texels[i], &convertedTexels[i], scale, gamma);
+        ParallelFor([&](int64_t y) {
+            const RGBSpectrum *row = &texels[y * resolution.x];
+            Tmemory *flippedRow =
+                &convertedTexels[(resolution.y - 1 - y) * resolution.x];
+            for (int x = 0; x < resolution.x; ++x)
+                convertIn(row[x], &flippedRow[x], scale, gamma);
+        }, resolution.y, 16);
+        texels.reset();
         mipmap = new MIPMap<Tmemory>(resolution, convertedTexels.get(),
                                      doTrilinear, maxAniso, wrap);
+        if (TextureCache *cache = TextureCache::Global()) {
+            // Move the pyramid to a tiled file that the texture cache
+            // pages in from
+            std::string tiledFilename = TiledTextureFilename(filename);
+            std::unique_ptr<TiledMIPFile> tiles;
+            if (mipmap->WriteTiled(tiledFilename))
+                tiles = TiledMIPFile::Open(tiledFilename, cache, true);
+            if (tiles) {
+                // Only the cache's tiles stay resident
+                mipMapMemory -=
+                    (4 * mipmap->Width() * mipmap->Height() * sizeof(Tmemory)) /
+                    3;
+                delete mipmap;
+                mipmap = new MIPMap<Tmemory>(std::move(tiles), doTrilinear,
+                                             maxAniso, wrap);
+            } else
+                Warning("%s: keeping texture in memory", filename.c_str());
+        }
     } else {
         // Create one-valued _MIPMap_
         Tmemory oneVal = scale;
         mipmap = new MIPMap<Tmemory>(Point2i(1, 1), &oneVal);
     }
-    textures[texInfo].reset(mipmap);
     return mipmap;
 }
 
 template <typename Tmemory, typename Treturn>
-std::map<TexInfo, std::unique_ptr<MIPMap<Tmemory>>>
+typename ImageTexture<Tmemory, Treturn>::TextureMap
     ImageTexture<Tmemory, Treturn>::textures;
+template <typename Tmemory, typename Treturn>
+std::vector<typename ImageTexture<Tmemory, Treturn>::TextureMap::iterator>
+    ImageTexture<Tmemory, Treturn>::pendingTextures;
 ImageTexture<Float, Float> *CreateImageFloatTexture(const Transform &tex2world,
                                                     const TextureParams &tp) {
     // Initialize 2D texture mapping _map_ from _tp_
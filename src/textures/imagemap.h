@@ -82,22 +82,30 @@ class ImageTexture : public Texture<Treturn> {
                  const std::string &filename, bool doTri, Float maxAniso,
                  ImageWrap wm, Float scale, bool gamma);
     static void ClearCache() {
+        pendingTextures.clear();
         textures.erase(textures.begin(), textures.end());
     }
+    // Loads the textures created since the last call, in parallel; textures
+    // can't be evaluated before they're loaded.
+    static void LoadTextures();
     Treturn Evaluate(const SurfaceInteraction &si) const {
         Vector2f dstdx, dstdy;
         Point2f st = mapping->Map(si, &dstdx, &dstdy);
-        Tmemory mem = mipmap->Lookup(st, dstdx, dstdy);
+        DCHECK(*mipmap) << "ImageTexture evaluated before LoadTextures()";
+        Tmemory mem = (*mipmap)->Lookup(st, dstdx, dstdy);
         Treturn ret;
         convertOut(mem, &ret);
         return ret;
     }
 
   private:
+    // ImageTexture Private Declarations
+    typedef std::map<TexInfo, std::unique_ptr<MIPMap<Tmemory>>> TextureMap;
+
     // ImageTexture Private Methods
-    static MIPMap<Tmemory> *GetTexture(const std::string &filename,
-                                       bool doTrilinear, Float maxAniso,
-                                       ImageWrap wm, Float scale, bool gamma);
+    static const std::unique_ptr<MIPMap<Tmemory>> *GetTexture(
+        const TexInfo &texInfo);
+    static MIPMap<Tmemory> *LoadTexture(const TexInfo &texInfo);
     static void convertIn(const RGBSpectrum &from, RGBSpectrum *to, Float scale,
                           bool gamma) {
         for (int i = 0; i < RGBSpectrum::nSamples; ++i)
@@ -116,8 +124,10 @@ class ImageTexture : public Texture<Treturn> {
 
     // ImageTexture Private Data
     std::unique_ptr<TextureMapping2D> mapping;
-    MIPMap<Tmemory> *mipmap;
-    static std::map<TexInfo, std::unique_ptr<MIPMap<Tmemory>>> textures;
+    // The entry of _textures_ that holds the _MIPMap_ once it's loaded
+    const std::unique_ptr<MIPMap<Tmemory>> *mipmap;
+    static TextureMap textures;
+    static std::vector<typename TextureMap::iterator> pendingTextures;
 };
 
 extern template class ImageTexture<Float, Float>;
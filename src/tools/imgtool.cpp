@@ -10,7 +10,9 @@
 #include <stdlib.h>
 #include <algorithm>
 #include "fileutil.h"
+#include "film.h"
 #include "imageio.h"
+#include "mipmap.h"
 #include "pbrt.h"
 #include "spectrum.h"
 #include "parallel.h"
@@ -31,7 +33,7 @@ static void usage(const char *msg = nullptr, ...) {
     }
     fprintf(stderr, R"(usage: imgtool <command> [options] <filenames...>
 
-commands: assemble, cat, convert, diff, info, makesky
+commands: assemble, cat, convert, diff, info, makemip, makesky, merge
 
 assemble option:
     --outfile          Output image filename.
@@ -70,6 +72,21 @@ diff options:
     --outfile <name>   Filename to use for saving an image that encodes the
                        absolute value of per-pixel differences.
 
+makemip options:
+    --gamma            Convert texels from sRGB to linear. Default: on for
+                       PNG and TGA images, as for pbrt's image textures.
+    --nogamma          Don't convert texels from sRGB to linear.
+    --wrap <mode>      Wrap mode used to resample images whose resolution
+                       isn't a power of two: "repeat", "black" or "clamp".
+                       Default: "repeat"
+    The output is a tiled MIP map file (.tmip) that pbrt's image textures
+    use without decoding or filtering it.
+
+merge option:
+    --outfile          Output image filename. With a .film extension, the
+                       merged raw pixel sums are written instead, so that
+                       they can be merged further.
+
 makesky options:
     --albedo <a>       Albedo of ground-plane (range 0-1). Default: 0.5
     --elevation <e>    Elevation of the sun in degrees (range 0-90). Default: 10
@@ -84,6 +101,66 @@ makesky options:
     exit(1);
 }
 
+int makemip(int argc, char *argv[]) {
+    int gamma = -1;
+    ImageWrap wrapMode = ImageWrap::Repeat;
+    int i;
+    for (i = 0; i < argc; ++i) {
+        if (argv[i][0] != '-') break;
+        if (!strcmp(argv[i], "--gamma") || !strcmp(argv[i], "-gamma"))
+            gamma = 1;
+        else if (!strcmp(argv[i], "--nogamma") || !strcmp(argv[i], "-nogamma"))
+            gamma = 0;
+        else if (!strcmp(argv[i], "--wrap") || !strcmp(argv[i], "-wrap")) {
+            if (i + 1 == argc) usage("missing value after %s flag", argv[i]);
+            std::string wrap = argv[++i];
+            if (wrap == "repeat")
+                wrapMode = ImageWrap::Repeat;
+            else if (wrap == "black")
+                wrapMode = ImageWrap::Black;
+            else if (wrap == "clamp")
+                wrapMode = ImageWrap::Clamp;
+            else
+                usage("unknown wrap mode \"%s\"", wrap.c_str());
+        } else
+            usage("unknown \"makemip\" option");
+    }
+    if (i + 1 >= argc) usage("missing filenames for \"makemip\"");
+    const char *inFilename = argv[i], *outFilename = argv[i + 1];
+    if (!HasExtension(outFilename, ".tmip"))
+        usage("output filename for \"makemip\" must end in .tmip");
+
+    Point2i res;
+    std::unique_ptr<RGBSpectrum[]> image(ReadImage(inFilename, &res));
+    if (!image) {
+        fprintf(stderr, "%s: unable to read image\n", inFilename);
+        return 1;
+    }
+    if (gamma == -1)
+        gamma = HasExtension(inFilename, ".tga") ||
+                HasExtension(inFilename, ".png");
+
+    // Flip the image in y and linearize it, as _ImageTexture_ does
+    std::vector<RGBSpectrum> texels(res.x * res.y);
+    for (int y = 0; y < res.y; ++y)
+        for (int x = 0; x < res.x; ++x) {
+            RGBSpectrum &texel = texels[(res.y - 1 - y) * res.x + x];
+            texel = image[y * res.x + x];
+            if (gamma)
+                for (int c = 0; c < RGBSpectrum::nSamples; ++c)
+                    texel[c] = InverseGammaCorrect(texel[c]);
+        }
+    image.reset();
+
+    ParallelInit();
+    MIPMap<RGBSpectrum> mipmap(res, texels.data(), false, 8.f, wrapMode);
+    ParallelCleanup();
+    if (!mipmap.WriteTiled(outFilename)) return 1;
+    printf("%s: %d x %d, %d levels\n", outFilename, mipmap.Width(),
+           mipmap.Height(), mipmap.Levels());
+    return 0;
+}
+
 int makesky(int argc, char *argv[]) {
     const char *outfile = "sky.exr";
     float albedo = 0.5;
@@ -284,6 +361,111 @@ int assemble(int argc, char *argv[]) {
     return 0;
 }
 
+int merge(int argc, char *argv[]) {
+    if (argc == 0) usage("no filenames provided to \"merge\"?");
+    const char *outfile = nullptr;
+    std::vector<const char *> infiles;
+    for (int i = 0; i < argc; ++i) {
+        if (!strcmp(argv[i], "--outfile") || !strcmp(argv[i], "-outfile")) {
+            if (i + 1 == argc)
+                usage("missing filename for %s parameter", argv[i]);
+            outfile = argv[++i];
+        } else if (!strncmp(argv[i], "--outfile=", 10)) {
+            outfile = &argv[i][10];
+        } else
+            infiles.push_back(argv[i]);
+    }
+    if (!outfile) usage("--outfile not provided for \"merge\"");
+    if (infiles.empty()) usage("no filenames provided to \"merge\"?");
+
+    // Add up the pixel sums of the partial renders in the order of their
+    // samples, which is the order in which a single render accumulates
+    // them, so that rounding matches. The files are read twice rather than
+    // kept in memory together.
+    struct Part {
+        int64_t firstSample, endSample;
+        const char *file;
+    };
+    std::vector<Part> order;
+    for (const char *file : infiles) {
+        RawFilm film;
+        if (!ReadRawFilm(file, &film)) {
+            fprintf(stderr, "%s: unable to read raw film file.\n", file);
+            return 1;
+        }
+        order.push_back({film.firstSample, film.endSample, file});
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [](const Part &a, const Part &b) {
+                         return a.firstSample < b.firstSample;
+                     });
+
+    // The sample ranges must neither overlap, which would count samples
+    // twice, nor leave gaps, which the merged range couldn't describe
+    for (size_t i = 1; i < order.size(); ++i) {
+        const Part &prev = order[i - 1], &part = order[i];
+        if (part.firstSample < prev.endSample) {
+            fprintf(stderr, "%s: sample range [%lld, %lld) overlaps the "
+                    "range [%lld, %lld) of \"%s\".\n", part.file,
+                    (long long)part.firstSample, (long long)part.endSample,
+                    (long long)prev.firstSample, (long long)prev.endSample,
+                    prev.file);
+            return 1;
+        } else if (part.firstSample > prev.endSample) {
+            fprintf(stderr, "%s: samples [%lld, %lld) are missing between "
+                    "\"%s\" and \"%s\".\n", outfile,
+                    (long long)prev.endSample, (long long)part.firstSample,
+                    prev.file, part.file);
+            return 1;
+        }
+    }
+
+    RawFilm merged;
+    for (size_t i = 0; i < order.size(); ++i) {
+        const char *file = order[i].file;
+        RawFilm film;
+        if (!ReadRawFilm(file, &film)) {
+            fprintf(stderr, "%s: unable to read raw film file.\n", file);
+            return 1;
+        }
+        if (i == 0)
+            merged = std::move(film);
+        else {
+            if (film.fullResolution != merged.fullResolution ||
+                film.pixelBounds != merged.pixelBounds ||
+                film.scale != merged.scale ||
+                film.samplesPerPixel != merged.samplesPerPixel ||
+                film.sampler != merged.sampler) {
+                fprintf(stderr,
+                        "%s: resolution, crop window, scale, samples per "
+                        "pixel or sampler doesn't match the ones of "
+                        "\"%s\".\n",
+                        file, order[0].file);
+                return 1;
+            }
+            if (film.jobId != merged.jobId) {
+                fprintf(stderr,
+                        "%s: was rendered from a different scene or with a "
+                        "different integrator than \"%s\".\n",
+                        file, order[0].file);
+                return 1;
+            }
+            for (size_t i = 0; i < merged.values.size(); ++i)
+                merged.values[i] += film.values[i];
+        }
+    }
+
+    merged.firstSample = order.front().firstSample;
+    merged.endSample = order.back().endSample;
+
+    if (HasExtension(outfile, ".film"))
+        return WriteRawFilm(outfile, merged) ? 0 : 1;
+    std::unique_ptr<Float[]> rgb(new Float[3 * merged.pixelBounds.Area()]);
+    RawFilmToRGB(merged, 1, rgb.get());
+    WriteImage(outfile, rgb.get(), merged.pixelBounds, merged.fullResolution);
+    return 0;
+}
+
 int cat(int argc, char *argv[]) {
     if (argc == 0) usage("no filenames provided to \"cat\"?");
     bool sort = false;
@@ -777,8 +959,12 @@ int main(int argc, char *argv[]) {
         return diff(argc - 2, argv + 2);
     else if (!strcmp(argv[1], "info"))
         return info(argc - 2, argv + 2);
+    else if (!strcmp(argv[1], "makemip"))
+        return makemip(argc - 2, argv + 2);
     else if (!strcmp(argv[1], "makesky"))
         return makesky(argc - 2, argv + 2);
+    else if (!strcmp(argv[1], "merge"))
+        return merge(argc - 2, argv + 2);
     else
         usage("unknown command \"%s\"", argv[1]);
 
@@ -0,0 +1,458 @@
+//
+// pbrtbench.cpp
+//
+// Microbenchmarks that report the throughput of pbrt's performance-critical
+// code paths. The unit tests check that these paths give the right results;
+// this tool only measures how fast they are.
+//
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <vector>
+#include "pbrt.h"
+#include "api.h"
+#include "camera.h"
+#include "parallel.h"
+#include "primitive.h"
+#include "rng.h"
+#include "sampling.h"
+#include "scene.h"
+#include "film.h"
+#include "mipmap.h"
+#include "accelerators/bvh.h"
+#include "cameras/perspective.h"
+#include "filters/box.h"
+#include "integrators/adaptive.h"
+#include "integrators/path.h"
+#include "integrators/volpath.h"
+#include "integrators/wavefront.h"
+#include "lights/point.h"
+#include "materials/matte.h"
+#include "paramset.h"
+#include "samplers/random.h"
+#include "samplers/sobol.h"
+#include "shapes/sphere.h"
+#include "shapes/triangle.h"
+#include "textures/constant.h"
+#include "tests/testutil.h"
+#include <glog/logging.h>
+
+using namespace pbrt;
+
+// Returns the wall clock time _func_ takes, in seconds
+static double Time(const std::function<void()> &func) {
+    auto start = std::chrono::steady_clock::now();
+    func();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+        .count();
+}
+
+// The inside of a diffuse unit sphere lit by a point light at its center,
+// the first of the analytic unit test scenes
+static std::unique_ptr<Scene> SphereScene() {
+    static Transform id;
+    std::shared_ptr<Shape> sphere = std::make_shared<Sphere>(
+        &id, &id, true /* reverse orientation */, 1, -1, 1, 360);
+    std::shared_ptr<Texture<Spectrum>> Kd =
+        std::make_shared<ConstantTexture<Spectrum>>(Spectrum(0.5));
+    std::shared_ptr<Texture<Float>> sigma =
+        std::make_shared<ConstantTexture<Float>>(0.);
+    std::shared_ptr<Material> material =
+        std::make_shared<MatteMaterial>(Kd, sigma, nullptr);
+    std::vector<std::shared_ptr<Primitive>> prims;
+    prims.push_back(std::make_shared<GeometricPrimitive>(
+        sphere, material, nullptr, MediumInterface()));
+    std::vector<std::shared_ptr<Light>> lights;
+    lights.push_back(
+        std::make_shared<PointLight>(Transform(), nullptr, Spectrum(Pi)));
+    return std::unique_ptr<Scene>(
+        new Scene(std::make_shared<BVHAccel>(prims), lights));
+}
+
+// Renders _scene_ at _resolution_ with the integrator that _makeIntegrator_
+// creates for the given camera and sampler and returns the time it took.
+// The image is written to _filename_ and removed afterwards.
+static double TimeRender(
+    const Scene &scene, const Point2i &resolution,
+    std::shared_ptr<Sampler> sampler, const std::string &filename,
+    const std::function<Integrator *(std::shared_ptr<Camera>,
+                                     std::shared_ptr<Sampler>, Film *)>
+        &makeIntegrator) {
+    AnimatedTransform identity(new Transform, 0, new Transform, 1);
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
+    Film *film = new Film(resolution, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                          std::move(filter), 1., filename, 1.);
+    std::shared_ptr<Camera> camera = std::make_shared<PerspectiveCamera>(
+        identity, Bounds2f(Point2f(-1, -1), Point2f(1, 1)), 0., 1., 0., 10.,
+        45, film, nullptr);
+    std::unique_ptr<Integrator> integrator(
+        makeIntegrator(camera, std::move(sampler), film));
+    double seconds = Time([&]() { integrator->Render(scene); });
+    integrator.reset();
+    remove(filename.c_str());
+    return seconds;
+}
+
+// Runs a fixed amount of short, uneven loop iterations with an increasing
+// number of threads and reports the speedup over one thread.
+static void BenchParallel() {
+    int oldThreads = PbrtOptions.nThreads;
+    const int64_t count = 1 << 16;
+    double baseSeconds = 0;
+
+    for (int nThreads = 1; nThreads <= 2 * NumSystemCores(); nThreads *= 2) {
+        PbrtOptions.nThreads = nThreads;
+        ParallelInit();
+
+        std::atomic<uint64_t> checksum{0};
+        double seconds = Time([&]() {
+            ParallelFor([&](int64_t i) {
+                // Iteration cost varies so that work has to be rebalanced
+                uint64_t v = i;
+                for (int j = 0; j < 200 + (i % 7) * 100; ++j)
+                    v = v * 6364136223846793005ull + 1442695040888963407ull;
+                checksum += v & 1;
+            }, count, 16);
+        });
+        if (nThreads == 1) baseSeconds = seconds;
+        printf("ParallelFor: %2d threads %8.4fs speedup %5.2fx\n", nThreads,
+               seconds, baseSeconds / seconds);
+
+        ParallelCleanup();
+    }
+
+    PbrtOptions.nThreads = oldThreads;
+}
+
+// Directory that holds the example scenes the _bvh_ benchmark traces
+static std::string scenesDir = "scenes";
+
+// Traces _rays_ through binary and wide BVHs of _prims_.
+static void TraceBVHs(const char *sceneName,
+                      const std::vector<std::shared_ptr<Primitive>> &prims,
+                      const std::vector<Ray> &rays) {
+    const char *names[] = {"binary", "wide4", "wide8"};
+    const int widths[] = {2, 4, 8};
+    for (int w = 0; w < 3; ++w) {
+        BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SAH, widths[w]);
+        double closestSeconds = Time([&]() {
+            for (Ray ray : rays) {
+                SurfaceInteraction isect;
+                bvh.Intersect(ray, &isect);
+            }
+        });
+        double shadowSeconds = Time([&]() {
+            for (const Ray &ray : rays) bvh.IntersectP(ray);
+        });
+        printf("BVH %-20s %-6s: %.2f Mrays/s closest hit, %.2f Mrays/s "
+               "shadow\n",
+               sceneName, names[w], rays.size() / closestSeconds * 1e-6,
+               rays.size() / shadowSeconds * 1e-6);
+    }
+}
+
+// Traces random rays through binary and wide BVHs of a triangle soup, and
+// camera rays through those of the example scenes.
+static void BenchBVH() {
+    pbrtInit(PbrtOptions);
+    RNG rng;
+    TraceBVHs("soup", TriangleSoup(20000, rng), RandomRays(100000, rng));
+
+    const char *sceneFiles[] = {"killeroo-simple.pbrt", "marbles.pbrt",
+                                "spaceship/scene.pbrt"};
+    for (const char *sceneFile : sceneFiles) {
+        std::string filename = scenesDir + "/" + sceneFile;
+        if (!std::ifstream(filename)) {
+            printf("BVH %-20s: skipped, %s not found\n", sceneFile,
+                   filename.c_str());
+            continue;
+        }
+        // Camera rays through random points of the image
+        pbrtSetWorldEndCallback(
+            [&](const Camera &camera,
+                const std::vector<std::shared_ptr<Primitive>> &prims) {
+                Bounds2i sampleBounds = camera.film->GetSampleBounds();
+                std::vector<Ray> rays;
+                while (rays.size() < 100000) {
+                    CameraSample sample;
+                    sample.pFilm = Point2f(
+                        Lerp(rng.UniformFloat(), sampleBounds.pMin.x,
+                             sampleBounds.pMax.x),
+                        Lerp(rng.UniformFloat(), sampleBounds.pMin.y,
+                             sampleBounds.pMax.y));
+                    sample.pLens =
+                        Point2f(rng.UniformFloat(), rng.UniformFloat());
+                    sample.time = rng.UniformFloat();
+                    Ray ray;
+                    if (camera.GenerateRay(sample, &ray) > 0)
+                        rays.push_back(ray);
+                }
+                TraceBVHs(sceneFile, prims, rays);
+            });
+        pbrtParseFile(filename);
+    }
+    pbrtSetWorldEndCallback(nullptr);
+    pbrtCleanup();
+}
+
+// Builds SAH BVHs for a few scenes with one thread and with all of them,
+// reporting build time and SAH cost.
+static void BenchBVHBuild() {
+    struct {
+        const char *name;
+        int nTriangles, nClusters;
+    } scenes[] = {{"uniform", 200000, 0}, {"clustered", 200000, 16}};
+    int oldThreads = PbrtOptions.nThreads;
+
+    for (const auto &scene : scenes) {
+        RNG rng;
+        std::vector<std::shared_ptr<Primitive>> prims =
+            TriangleSoup(scene.nTriangles, rng, scene.nClusters);
+
+        Float cost = 0;
+        double seconds[2];
+        for (int pass = 0; pass < 2; ++pass) {
+            PbrtOptions.nThreads = pass == 0 ? 1 : oldThreads;
+            ParallelInit();
+            seconds[pass] = Time([&]() {
+                BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SAH);
+                cost = bvh.SAHCost();
+            });
+            ParallelCleanup();
+        }
+        printf("BVH build %-9s: %d tris, serial %.3fs, parallel %.3fs "
+               "(%.2fx), SAH cost %.3f\n",
+               scene.name, scene.nTriangles, seconds[0], seconds[1],
+               seconds[0] / seconds[1], cost);
+    }
+    PbrtOptions.nThreads = oldThreads;
+}
+
+// Traces a tile's worth of coherent camera-like rays and random rays one at
+// a time and in _RayBatch_es of 256 rays.
+static void BenchRayBatch() {
+    ParallelInit();
+    RNG rng;
+    std::vector<std::shared_ptr<Primitive>> prims = TriangleSoup(20000, rng);
+    BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SAH);
+
+    std::vector<Ray> rays;
+    for (int y = 0; y < 256; ++y)
+        for (int x = 0; x < 256; ++x)
+            rays.push_back(Ray(Point3f(0, 0, -3),
+                               Normalize(Vector3f((x - 128) / 256.f,
+                                                  (y - 128) / 256.f, 1))));
+    std::vector<Ray> random = RandomRays(20000, rng);
+    rays.insert(rays.end(), random.begin(), random.end());
+
+    for (bool shadow : {false, true}) {
+        double singleSeconds = Time([&]() {
+            for (Ray ray : rays) {
+                SurfaceInteraction isect;
+                if (shadow)
+                    bvh.IntersectP(ray);
+                else
+                    bvh.Intersect(ray, &isect);
+            }
+        });
+        double batchSeconds = Time([&]() {
+            RayBatch batch;
+            for (size_t first = 0; first < rays.size(); first += 256) {
+                batch.Clear();
+                for (size_t i = first; i < std::min(rays.size(), first + 256);
+                     ++i)
+                    batch.Add(rays[i]);
+                if (shadow)
+                    bvh.IntersectP(batch);
+                else
+                    bvh.Intersect(batch);
+            }
+        });
+        printf("BVH %s rays: single %.2f Mrays/s, batched %.2f Mrays/s\n",
+               shadow ? "shadow" : "closest-hit",
+               rays.size() / singleSeconds * 1e-6,
+               rays.size() / batchSeconds * 1e-6);
+    }
+    ParallelCleanup();
+}
+
+// Renders the sphere scene with the regular and the wavefront path tracers
+static void BenchWavefront() {
+    ParallelInit();
+    std::unique_ptr<Scene> scene = SphereScene();
+    Point2i resolution(64, 64);
+    const int spp = 64;
+    double seconds[2];
+    for (int wavefront = 0; wavefront < 2; ++wavefront) {
+        std::shared_ptr<Sampler> sampler = std::make_shared<SobolSampler>(
+            spp, Bounds2i(Point2i(0, 0), resolution));
+        seconds[wavefront] = TimeRender(
+            *scene, resolution, sampler, "pbrtbench.exr",
+            [&](std::shared_ptr<Camera> camera,
+                std::shared_ptr<Sampler> sampler, Film *film) -> Integrator * {
+                if (wavefront)
+                    return new WavefrontPathIntegrator(
+                        8, camera, sampler, film->croppedPixelBounds);
+                return new PathIntegrator(8, camera, sampler,
+                                          film->croppedPixelBounds);
+            });
+    }
+    int64_t nSamples = int64_t(resolution.x) * resolution.y * spp;
+    printf("Sphere scene: path %.2f Msamples/s, wavefront path %.2f "
+           "Msamples/s\n",
+           nSamples / seconds[0] * 1e-6, nSamples / seconds[1] * 1e-6);
+    ParallelCleanup();
+}
+
+// Renders the sphere scene with the volumetric path tracer and with its
+// adaptive variant in normal mode, to measure the cost of the statistics
+static void BenchAdaptive() {
+    ParallelInit();
+    std::unique_ptr<Scene> scene = SphereScene();
+    Point2i resolution(64, 64);
+    const int spp = 64;
+    double seconds[2];
+    for (int adaptive = 0; adaptive < 2; ++adaptive) {
+        seconds[adaptive] = TimeRender(
+            *scene, resolution, std::make_shared<RandomSampler>(spp),
+            "pbrtbench.exr",
+            [&](std::shared_ptr<Camera> camera,
+                std::shared_ptr<Sampler> sampler, Film *film) -> Integrator * {
+                if (adaptive)
+                    return new VolPathAdaptive(
+                        Statistics(ParamSet(), film, *sampler), 8, camera,
+                        sampler, film->croppedPixelBounds);
+                return new VolPathIntegrator(8, camera, sampler,
+                                             film->croppedPixelBounds);
+            });
+    }
+    remove("pbrtbench_stats.exr");
+    int64_t nSamples = int64_t(resolution.x) * resolution.y * spp;
+    printf("Sphere scene: volpath %.2f Msamples/s, volpathadaptive %.2f "
+           "Msamples/s (%.1f ns overhead per sample)\n",
+           nSamples / seconds[0] * 1e-6, nSamples / seconds[1] * 1e-6,
+           (seconds[1] - seconds[0]) / nSamples * 1e9);
+    ParallelCleanup();
+}
+
+// EWA lookups in a random texture with footprints ranging from a few texels
+// to long anisotropic ellipses, for each wrap mode
+static void BenchEWA() {
+    Point2i res(256, 256);
+    std::vector<RGBSpectrum> image(res.x * res.y);
+    RNG rng;
+    for (RGBSpectrum &texel : image) {
+        Float rgb[3] = {rng.UniformFloat(), rng.UniformFloat(),
+                        rng.UniformFloat()};
+        texel = RGBSpectrum::FromRGB(rgb);
+    }
+
+    struct Lookup {
+        Point2f st;
+        Vector2f dst0, dst1;
+    };
+    std::vector<Lookup> lookups;
+    for (int i = 0; i < 200000; ++i) {
+        Float width = std::pow(2.f, -9.f + 5 * rng.UniformFloat());
+        Float theta = 2 * Pi * rng.UniformFloat();
+        Float aniso = 1 + 15 * rng.UniformFloat();
+        Vector2f major(std::cos(theta), std::sin(theta));
+        Vector2f minor(-major.y, major.x);
+        lookups.push_back({Point2f(1.2f * rng.UniformFloat() - .1f,
+                                   1.2f * rng.UniformFloat() - .1f),
+                           major * width * aniso, minor * width});
+    }
+
+    const char *wrapNames[] = {"repeat", "black", "clamp"};
+    for (ImageWrap wrap :
+         {ImageWrap::Repeat, ImageWrap::Black, ImageWrap::Clamp}) {
+        MIPMap<RGBSpectrum> mip(res, image.data(), false, 8.f, wrap);
+        RGBSpectrum sum(0.f);
+        double seconds = Time([&]() {
+            for (const Lookup &l : lookups)
+                sum += mip.Lookup(l.st, l.dst0, l.dst1);
+        });
+        printf("EWA %-6s: %.2f Mlookups/s (average %f)\n",
+               wrapNames[int(wrap)], lookups.size() / seconds * 1e-6,
+               sum.y() / lookups.size());
+    }
+}
+
+struct Benchmark {
+    const char *name, *description;
+    void (*run)();
+};
+
+static const Benchmark benchmarks[] = {
+    {"parallel", "ParallelFor speedup with 1, 2, 4, ... threads",
+     BenchParallel},
+    {"bvh", "Binary and wide BVH ray tracing throughput", BenchBVH},
+    {"bvhbuild", "Serial and parallel SAH BVH build time", BenchBVHBuild},
+    {"raybatch", "Single ray and ray batch BVH throughput", BenchRayBatch},
+    {"wavefront", "Path and wavefront path tracer throughput",
+     BenchWavefront},
+    {"adaptive", "Overhead of the adaptive sampling statistics",
+     BenchAdaptive},
+    {"ewa", "EWA texture filtering throughput", BenchEWA},
+};
+
+static void usage(const char *msg = nullptr, ...) {
+    if (msg) {
+        va_list args;
+        va_start(args, msg);
+        fprintf(stderr, "pbrtbench: ");
+        vfprintf(stderr, msg, args);
+        fprintf(stderr, "\n");
+    }
+    fprintf(stderr, R"(usage: pbrtbench [--nthreads <num>] [--scenes <dir>] [benchmarks...]
+
+Runs the given benchmarks, or all of them if none is given.
+
+options:
+    --nthreads <num>   Use specified number of threads for the benchmarks
+                       that don't choose their own. Default: one per core
+    --scenes <dir>     Directory holding the example scenes that the bvh
+                       benchmark traces. Default: scenes
+
+benchmarks:
+)");
+    for (const Benchmark &b : benchmarks)
+        fprintf(stderr, "    %-18s %s\n", b.name, b.description);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    google::InitGoogleLogging(argv[0]);
+    FLAGS_stderrthreshold = 1; // Warning and above.
+    PbrtOptions.quiet = true;
+
+    std::vector<const Benchmark *> selected;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--nthreads") || !strcmp(argv[i], "-nthreads")) {
+            if (i + 1 == argc) usage("missing value after --nthreads argument");
+            PbrtOptions.nThreads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--scenes") || !strcmp(argv[i], "-scenes")) {
+            if (i + 1 == argc) usage("missing value after --scenes argument");
+            scenesDir = argv[++i];
+        } else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h"))
+            usage();
+        else {
+            const Benchmark *found = nullptr;
+            for (const Benchmark &b : benchmarks)
+                if (!strcmp(argv[i], b.name)) found = &b;
+            if (!found) usage("unknown benchmark \"%s\"", argv[i]);
+            selected.push_back(found);
+        }
+    }
+    if (selected.empty())
+        for (const Benchmark &b : benchmarks) selected.push_back(&b);
+
+    for (const Benchmark *b : selected) b->run();
+    return 0;
+}